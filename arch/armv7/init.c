@@ -93,7 +93,7 @@ void armv7_init( armv7_bootargs_t *bootargs )
 	earlycon_printf("bootargs: initrd [0x%x-0x%x]\n", armv7_initrd_start_pa,
 							armv7_initrd_end_pa);
 
-	memcpy(physmm_bitmap, bootargs->ba_pm_bitmap, 32768 * sizeof(uint32_t));
+	physmm_load_bitmap(bootargs->ba_pm_bitmap);
 	armv7_exception_init();
 	earlycon_printf("physmm: initializing...\n");
 
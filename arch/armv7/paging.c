@@ -7,6 +7,8 @@
  *
  * Changelog:
  * 11-03-2015 - Created
+ * 17-10-2026 - Dirty page tracking
+ * 17-10-2026 - Page table sharing stubs
  */
 #include "arch/armv7/bootargs.h"
 #include "arch/armv7/mmu.h"
@@ -678,3 +680,43 @@ uintptr_t	paging_get_physical_address_other(page_dir_t *dir,const void * virt_ad
 	return pa;
 }
 
+/**
+ * Check whether a page was written to since the last call
+ *
+ * The short descriptor format has no dirty flag, every mapped page is
+ * reported as dirty.
+ * @param virt_addr The page to check
+ * @return Whether the page is mapped
+ */
+int		paging_clear_dirty(void * virt_addr)
+{
+	return paging_get_physical_address( virt_addr ) != 0;
+}
+
+/**
+ * Check whether a page in another address space was written to
+ * @see paging_clear_dirty
+ */
+int		paging_is_dirty_other(page_dir_t *dir, const void * virt_addr)
+{
+	return paging_get_physical_address_other( dir, virt_addr ) != 0;
+}
+
+/**
+ * Give the active address space its own copy of a shared page table
+ *
+ * Page tables are not shared between address spaces on this architecture.
+ * @return Whether the table was shared
+ */
+int		paging_unshare_table(__attribute__((unused)) void * virt_addr)
+{
+	return 0;
+}
+
+/**
+ * Drop the page tables that an address space shares with others
+ * @see paging_unshare_table
+ */
+void		paging_release_shared_tables(__attribute__((unused)) page_dir_t *dir)
+{
+}
@@ -7,6 +7,7 @@
  *
  * Changelog:
  * 07-12-2020 - Created
+ * 17-10-2026 - Refuse to push signal frames onto read only stacks
  */
 #include <assert.h>
 #include <string.h>
@@ -29,7 +30,7 @@ int process_push_user_data(const void *data, size_t size)
 	i386_task_context_t *tctx = (i386_task_context_t *)
 			scheduler_current_task->arch_state;
 	uintptr_t new_esp = (uintptr_t) tctx->user_regs.esp - size;
-	if (!procvmm_check((void *) new_esp, size))
+	if (!procvmm_check_write((void *) new_esp, size))
 		return 0;
 	memcpy((void *) new_esp, data, size);
 	tctx->user_regs.esp = (uint32_t) new_esp;
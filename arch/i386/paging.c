@@ -7,6 +7,11 @@
  *
  * Changelog:
  * 30-03-2014 - Created
+ * 17-10-2026 - Copy-on-write fork
+ * 17-10-2026 - Dirty page tracking
+ * 17-10-2026 - Look up regions once per region when copying page tables
+ * 17-10-2026 - Share page tables copy-on-write on fork
+ * 17-10-2026 - Leave shared pages unmapped in the child when they can not be referenced
  */
 
 #include "arch/i386/paging.h"
@@ -57,6 +62,181 @@ void *i386_alloc_page() {
 		return (void *) (0xC0000000 + physmm_alloc_frame());
 }
 
+/**
+ * Check whether a user page table was shared on fork, shared tables are
+ * mapped read only in every directory that uses them
+ */
+static inline int i386_table_is_shared(i386_page_dir_t *dir, uintptr_t pd_idx)
+{
+	uint32_t pd_entry = dir->directory[pd_idx];
+
+	if (pd_idx == 0 || pd_idx >= 0x300)
+		return 0;
+
+	return (pd_entry & (I386_PAGE_FLAG_PRESENT | I386_PAGE_FLAG_RW)) == I386_PAGE_FLAG_PRESENT;
+}
+
+/**
+ * Copy a user page table of the active directory, sharing its frames
+ * copy-on-write
+ * @param pd_idx        The directory index of the table
+ * @param new_table_ptr Where the copy is mapped
+ */
+static void i386_copy_table(uintptr_t pd_idx, i386_page_table_t *new_table_ptr)
+{
+	i386_page_dir_t *active_dir = (i386_page_dir_t *) paging_active_dir->content;
+	i386_page_table_t *table_ptr = I386_PTADDR(pd_idx);
+	physaddr_t frame_phys, new_frame_phys;
+	uintptr_t frame_counter, page_addr;
+	uint32_t pd_entry = active_dir->directory[pd_idx];
+	process_mmap_t *region = NULL;
+
+	/* The table might be shared read only, allow writing to it while
+	 * its frames are made copy-on-write */
+	active_dir->directory[pd_idx] = pd_entry | I386_PAGE_FLAG_RW;
+	i386_native_flush_tlb_single((uintptr_t) table_ptr);
+
+	for (frame_counter = 0; frame_counter < 1024; frame_counter++) {
+		if (table_ptr->pages[frame_counter] & I386_PAGE_FLAG_PRESENT){
+			page_addr = (pd_idx << 22) | (frame_counter << 12);
+			/* Pages are visited in order, the region usually stays the same */
+			if (!region || page_addr < (uintptr_t) region->start ||
+			    page_addr - (uintptr_t) region->start >= region->size)
+				region = procvmm_get_memory_region((void *) page_addr);
+			frame_phys = (physaddr_t)(table_ptr->pages[frame_counter] & ~0xFFF);
+			if (region && (region->flags & (PROCESS_MMAP_FLAG_SHM | PROCESS_MMAP_FLAG_DEVICE))) {
+				/* Frames are not owned by the mapping */
+				new_table_ptr->pages[frame_counter] = table_ptr->pages[frame_counter];
+			} else if (region && (region->flags & PROCESS_MMAP_FLAG_PUBLIC)) {
+				/* Without a reference the frame can not be
+				 * shared, the child faults it back in */
+				if (physmm_ref_frame(frame_phys))
+					new_table_ptr->pages[frame_counter] = 0;
+				else
+					new_table_ptr->pages[frame_counter] = table_ptr->pages[frame_counter];
+			} else if (region && !physmm_ref_frame(frame_phys)) {
+				/* Share the frame, copy on write */
+				table_ptr->pages[frame_counter] &= ~I386_PAGE_FLAG_RW;
+				new_table_ptr->pages[frame_counter] = table_ptr->pages[frame_counter];
+			} else {
+				new_frame_phys = physmm_alloc_frame();
+				if (new_frame_phys == PHYSMM_NO_FRAME) {
+					paging_handle_out_of_memory();
+					new_frame_phys = physmm_alloc_frame();
+				}
+				i386_phys_copy_frame(frame_phys, new_frame_phys);//TODO: Get rid of cursed phys copy routine
+				new_table_ptr->pages[frame_counter] = (table_ptr->pages[frame_counter] & 0xFFF) | new_frame_phys;
+			}
+		} else
+			new_table_ptr->pages[frame_counter] = 0;
+	}
+
+	active_dir->directory[pd_idx] = pd_entry;
+	i386_native_flush_tlb_single((uintptr_t) table_ptr);
+}
+
+/**
+ * Drop the frame references held by a page table that is no longer used
+ * @param pd_idx    The directory index the table was used at
+ * @param table_ptr Where the table is mapped
+ */
+static void i386_release_table(uintptr_t pd_idx, i386_page_table_t *table_ptr)
+{
+	uintptr_t frame_counter, page_addr;
+	process_mmap_t *region = NULL;
+
+	for (frame_counter = 0; frame_counter < 1024; frame_counter++) {
+		if (!(table_ptr->pages[frame_counter] & I386_PAGE_FLAG_PRESENT))
+			continue;
+		page_addr = (pd_idx << 22) | (frame_counter << 12);
+		if (!region || page_addr < (uintptr_t) region->start ||
+		    page_addr - (uintptr_t) region->start >= region->size)
+			region = procvmm_get_memory_region((void *) page_addr);
+		if (region && (region->flags & (PROCESS_MMAP_FLAG_SHM | PROCESS_MMAP_FLAG_DEVICE)))
+			continue;
+		physmm_free_frame(table_ptr->pages[frame_counter] & 0xFFFFF000);
+	}
+}
+
+/**
+ * Give the active address space its own copy of a page table that it
+ * shares with other address spaces
+ * @param virt_addr An address in the range of the table
+ * @return Whether the table was shared
+ */
+int paging_unshare_table(void * virt_addr)
+{
+	i386_page_dir_t *dir = (i386_page_dir_t *) paging_active_dir->content;
+	uintptr_t pd_idx = I386_ADDR_TO_PD_IDX(virt_addr);
+	i386_page_table_t *new_table_ptr;
+	physaddr_t table_phys, new_table_phys, window_phys;
+	uint32_t pd_entry;
+
+	if (!i386_table_is_shared(dir, pd_idx))
+		return 0;
+
+	pd_entry = dir->directory[pd_idx];
+	table_phys = pd_entry & 0xFFFFF000;
+
+	/* The last address space using the table can just take it over */
+	if (physmm_frame_refs(table_phys) > 1) {
+		new_table_ptr = (i386_page_table_t *) heapmm_alloc_page();
+		window_phys = paging_get_physical_address(new_table_ptr);
+		new_table_phys = physmm_alloc_frame();
+		if (new_table_phys == PHYSMM_NO_FRAME) {
+			paging_handle_out_of_memory();
+			new_table_phys = physmm_alloc_frame();
+		}
+		paging_map(new_table_ptr, new_table_phys, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
+
+		i386_copy_table(pd_idx, new_table_ptr);
+		pd_entry = (pd_entry & 0xFFF) | new_table_phys;
+
+		/* The others might have let go of the table while we waited
+		 * for memory, then nobody uses its frames anymore */
+		if (physmm_frame_refs(table_phys) == 1) {
+			paging_map(new_table_ptr, table_phys, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
+			i386_release_table(pd_idx, new_table_ptr);
+		}
+		physmm_free_frame(table_phys);
+
+		paging_map(new_table_ptr, window_phys, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
+		heapmm_free(new_table_ptr, PHYSMM_PAGE_SIZE);
+	}
+
+	dir->directory[pd_idx] = pd_entry | I386_PAGE_FLAG_RW;
+	i386_native_write_cr3(paging_get_physical_address(paging_active_dir->content));
+	return 1;
+}
+
+/**
+ * Drop the page tables that an address space shares with others, the pages
+ * in them are left to the other address spaces. Used before tearing down
+ * all user mappings.
+ * @param dir The page directory of the address space
+ */
+void paging_release_shared_tables(page_dir_t *dir)
+{
+	i386_page_dir_t *pdir = (i386_page_dir_t *) dir->content;
+	uintptr_t pd_idx;
+	physaddr_t table_phys;
+	int flush_tlb = 0;
+
+	for (pd_idx = 1; pd_idx < 0x300; pd_idx++) {
+		if (!i386_table_is_shared(pdir, pd_idx))
+			continue;
+		table_phys = pdir->directory[pd_idx] & 0xFFFFF000;
+		if (physmm_frame_refs(table_phys) == 1)
+			continue;
+		physmm_free_frame(table_phys);
+		pdir->directory[pd_idx] = 0;
+		flush_tlb = 1;
+	}
+
+	if (flush_tlb && dir == paging_active_dir)
+		i386_native_write_cr3(paging_get_physical_address(paging_active_dir->content));
+}
+
 page_dir_t *paging_create_dir()
 {
 	i386_page_dir_t *active_dir;
@@ -66,11 +246,10 @@ page_dir_t *paging_create_dir()
 	page_dir_t *dir_w = (paging_active_dir == NULL) ? (&i386_page_dir_initial) :
 			 ((page_dir_t *) heapmm_alloc(sizeof(page_dir_t)));
 	i386_page_table_t *new_table_ptr;
-	i386_page_table_t *table_ptr;
-	physaddr_t table_phys, new_table_phys, frame_phys, new_frame_phys;
-	uintptr_t copy_counter, frame_counter;
-
-	process_mmap_t *region;
+	physaddr_t table_phys, new_table_phys;
+	uintptr_t copy_counter;
+	uint32_t pd_entry;
+	int flush_tlb = 0;
 
 	memset(dir, 0, sizeof(i386_page_dir_t));
 
@@ -83,45 +262,35 @@ page_dir_t *paging_create_dir()
 			dir->directory[copy_counter] = active_dir->directory[copy_counter];
 
 		for (copy_counter = 1; copy_counter < 0x300; copy_counter++) {
-			if (active_dir->directory[copy_counter] & I386_PAGE_FLAG_PRESENT) {
-				//earlycon_printf("Copying table : %i ,%x, %x, %x,%x", copy_counter,active_dir,active_dir->directory[copy_counter],dir_w,paging_active_dir);
-
-				/* Table is present, copy it */
+			pd_entry = active_dir->directory[copy_counter];
+			if (!(pd_entry & I386_PAGE_FLAG_PRESENT)) {
+				dir->directory[copy_counter] = 0;
+			} else if (!physmm_ref_frame(pd_entry & 0xFFFFF000)) {
+				/* Share the table read only, the first write to
+				 * it from either side makes a copy */
+				pd_entry &= ~I386_PAGE_FLAG_RW;
+				active_dir->directory[copy_counter] = pd_entry;
+				dir->directory[copy_counter] = pd_entry;
+				flush_tlb = 1;
+			} else {
+				/* Table could not be shared, copy it now */
 				new_table_phys = physmm_alloc_frame();
 				if (new_table_phys == PHYSMM_NO_FRAME) {
 					paging_handle_out_of_memory();
 					new_table_phys = physmm_alloc_frame();
 				}
 				paging_map(new_table_ptr, new_table_phys, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
-				table_ptr = I386_PTADDR(copy_counter);
-
-				for (frame_counter = 0; frame_counter < 1024; frame_counter++) {
-					if (table_ptr->pages[frame_counter] & I386_PAGE_FLAG_PRESENT){
-						region = procvmm_get_memory_region((void *)((copy_counter << 22) | (frame_counter << 12)));
-						if (region && (region->flags & PROCESS_MMAP_FLAG_PUBLIC)) {
-							new_table_ptr->pages[frame_counter] = table_ptr->pages[frame_counter];
-						} else {
-							new_frame_phys = physmm_alloc_frame();
-							if (new_frame_phys == PHYSMM_NO_FRAME) {
-								paging_handle_out_of_memory();
-								new_frame_phys = physmm_alloc_frame();
-							}
-							frame_phys = (physaddr_t)(table_ptr->pages[frame_counter] & ~0xFFF);
-							i386_phys_copy_frame(frame_phys, new_frame_phys);//TODO: Get rid of cursed phys copy routine
-							new_table_ptr->pages[frame_counter] = (table_ptr->pages[frame_counter] & 0xFFF) | new_frame_phys;
-						}
-					} else
-						new_table_ptr->pages[frame_counter] = 0;
-				}
-
-				dir->directory[copy_counter] = (active_dir->directory[copy_counter] & 0xFFF) | new_table_phys;
-			} else {
-				dir->directory[copy_counter] = 0;
+				i386_copy_table(copy_counter, new_table_ptr);
+				dir->directory[copy_counter] = (pd_entry & 0xFFF) | I386_PAGE_FLAG_RW | new_table_phys;
+				flush_tlb = 1;
 			}
-
 		}
 		paging_map(new_table_ptr, table_phys, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
 		heapmm_free(new_table_ptr, PHYSMM_PAGE_SIZE);
+
+		/* Parent pages were made read only, flush stale TLB entries */
+		if (flush_tlb)
+			i386_native_write_cr3(paging_get_physical_address(paging_active_dir->content));
 	}
 	dir->directory[0x3FF] = ((uint32_t) paging_get_physical_address(dir)) | I386_PAGE_FLAG_RW | I386_PAGE_FLAG_NOCACHE | I386_PAGE_FLAG_PRESENT;
 	llist_add_end(&i386_page_directory_list, (llist_t *) list_node);
@@ -177,6 +346,9 @@ void paging_map(void * virt_addr, physaddr_t phys_addr, page_flags_t flags)
 	uintptr_t pd_idx = I386_ADDR_TO_PD_IDX(virt_addr);
 	i386_page_dir_t *page_dir = (i386_page_dir_t *) paging_active_dir->content;
 
+	/* Shared page tables can not be changed */
+	paging_unshare_table(virt_addr);
+
 	if (page_dir->directory[pd_idx] == 0) {
 		/* Page table does not yet exist */
 		table_addr = physmm_alloc_frame();
@@ -228,6 +400,7 @@ void paging_map(void * virt_addr, physaddr_t phys_addr, page_flags_t flags)
 void paging_unmap(void * virt_addr)
 {
 	uint32_t *pt_entry = I386_ADDR_TO_PTEPTR(virt_addr);
+	paging_unshare_table(virt_addr);
 	*pt_entry &= ~I386_PAGE_FLAG_PRESENT;
 	i386_native_flush_tlb_single((uintptr_t)virt_addr);
 }
@@ -235,6 +408,7 @@ void paging_unmap(void * virt_addr)
 void paging_tag(void * virt_addr, page_tag_t tag)
 {
 	uint32_t *pt_entry = I386_ADDR_TO_PTEPTR(virt_addr);
+	paging_unshare_table(virt_addr);
 	*pt_entry &= ~0xE00;
 	*pt_entry |= ( ((uint32_t)tag) << 9) & 0xE00;
 }
@@ -249,7 +423,9 @@ void i386_paging_enable()
 {
 	uint32_t cr0;
 	asm volatile("mov %%cr0, %0": "=b"(cr0));
-	cr0 |= 0x80000000;
+	/* Enable paging and make supervisor writes honour read only pages,
+	 * so that kernel writes to user memory break copy-on-write sharing */
+	cr0 |= 0x80010000;
 	asm volatile("mov %0, %%cr0":: "b"(cr0));
 }
 
@@ -316,6 +492,62 @@ uintptr_t paging_get_physical_address_other(page_dir_t *dir,const void * virt_ad
 		return 0;
 }
 
+/**
+ * Check whether a page was written to since the last call and clear its
+ * dirty flag
+ * @param virt_addr The page to check
+ * @return Whether the page is mapped and dirty
+ */
+int paging_clear_dirty(void * virt_addr)
+{
+	i386_page_dir_t *page_dir = (i386_page_dir_t *) paging_active_dir->content;
+	uintptr_t pd_idx = I386_ADDR_TO_PD_IDX(virt_addr);
+	uint32_t *pt_entry = I386_ADDR_TO_PTEPTR(virt_addr);
+	uint32_t mask = I386_PAGE_FLAG_PRESENT | I386_PAGE_FLAG_DIRTY;
+
+	if (!(page_dir->directory[pd_idx] & I386_PAGE_FLAG_PRESENT))
+		return 0;
+
+	if ((*pt_entry & mask) != mask)
+		return 0;
+
+	paging_unshare_table(virt_addr);
+	*pt_entry &= ~I386_PAGE_FLAG_DIRTY;
+	i386_native_flush_tlb_single((uintptr_t)virt_addr);
+	return 1;
+}
+
+/**
+ * Check whether a page in another address space was written to
+ * @param dir       The page directory of the address space
+ * @param virt_addr The page to check
+ * @return Whether the page is mapped and dirty
+ */
+int paging_is_dirty_other(page_dir_t *dir, const void * virt_addr)
+{
+	i386_page_dir_t *page_dir = (i386_page_dir_t *) dir->content;
+	uintptr_t pd_idx = I386_ADDR_TO_PD_IDX(virt_addr);
+	uintptr_t pt_idx = I386_ADDR_TO_PT_IDX(virt_addr);
+	uint32_t pd_entry = page_dir->directory[pd_idx];
+	uint32_t mask = I386_PAGE_FLAG_PRESENT | I386_PAGE_FLAG_DIRTY;
+	physaddr_t pt_o;
+	i386_page_table_t *pt;
+	uint32_t pt_v;
+
+	if (!(pd_entry & I386_PAGE_FLAG_PRESENT))
+		return 0;
+
+	pt = heapmm_alloc_page();
+	pt_o = paging_get_physical_address( pt );
+	paging_map( pt, pd_entry & 0xFFFFF000, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
+	pt_v = pt->pages[pt_idx];
+
+	paging_map( pt, pt_o, I386_PAGE_FLAG_RW | I386_PAGE_FLAG_PRESENT);
+	heapmm_free( pt, 4096);
+
+	return (pt_v & mask) == mask;
+}
+
 uintptr_t paging_get_physical_address(const void * virt_addr) {
 	i386_page_dir_t *page_dir;
 	uint32_t pd_entry;
@@ -10,6 +10,11 @@
  * Changelog:
  * \li 02-07-2014 - Created
  * \li 20-01-2015 - Commented
+ * \li 17-10-2026 - Multi-sector transfers
+ * \li 17-10-2026 - Interrupt driven request queue
+ * \li 17-10-2026 - Bus-master DMA writes, PIO fallback and benchmark
+ * \li 17-10-2026 - Perform queued requests from a task
+ * \li 17-10-2026 - Hold the bus while benchmarking
  */
 
 #include "config.h"
@@ -23,8 +28,11 @@
 #include "kernel/scheduler.h"
 #include "kernel/paging.h"
 #include "kernel/heapmm.h"
+#include "kernel/physmm.h"
 #include "kernel/device.h"
+#include "kernel/syscall.h"
 #include "fs/mbr.h"
+#include <sys/ioctl.h>
 
 #define ATA_READ_TIMEOUT  ( 10000000UL )
 #define ATA_WRITE_TIMEOUT ( 10000000UL )
@@ -35,10 +43,11 @@ int ata_global_inited = 0;
 
 ata_device_t **ata_buses;
 
-volatile ata_prd_t *ata_prd_list;
-
 extern blk_ops_t ata_block_driver_ops;
 
+static int ata_dma_initialize(ata_device_t *device);
+static void ata_req_main(ata_device_t *device);
+
 void ata_do_wait(ata_device_t *device)
 {
 	ata_read_port(device, ATA_STATUS_PORT);
@@ -180,7 +189,7 @@ void ata_load_partition_table(ata_device_t *device, int drive)
 
 void ata_initialize(ata_device_t *device)
 {
-	int drive, _t, dmacap = 0;
+	int drive, _t;
 	blk_dev_t *drv;
 
 	if (!ata_global_inited)
@@ -192,6 +201,11 @@ void ata_initialize(ata_device_t *device)
 	device->bus_number = ata_bus_number_counter++;
 	semaphore_init(&device->lock);
 	semaphore_init(&device->int_wait);
+	semaphore_init(&device->req_wake);
+	device->blk = NULL;
+	device->req_task = NULL;
+	device->prd_list = NULL;
+	device->dma_enabled = 0;
 
 	ata_buses[device->bus_number] = device;
 
@@ -242,8 +256,6 @@ void ata_initialize(ata_device_t *device)
 			semaphore_up(&device->lock);
 			ata_load_partition_table(device, drive);
 			semaphore_down(&device->lock);
-			if (device->drives[drive].capabilities & ATA_IDENT_CAP_FLAG_DMA)
-				dmacap |= 1;
 		} else {
 			//Possibly detected an ATAPI device
 			//TODO: Handle ATAPI devices
@@ -251,15 +263,8 @@ void ata_initialize(ata_device_t *device)
 			continue;//Ignoring this one
 		}
 	}
-	if (dmacap) {
-		ata_prd_list = heapmm_alloc_alligned(ATA_PRD_LIST_SIZE * sizeof(ata_prd_t), 8);
-		if (ata_prd_list) {
-			ata_write_port_long(device, ATA_BUSMASTER_PRDT_PTR_PORT, paging_get_physical_address( (void *) ata_prd_list));
-			printf(CON_DEBUG, "allocated DMA prd list at %x", ata_prd_list);
-		} else {
-			device->drives[drive].capabilities &= ~ATA_IDENT_CAP_FLAG_DMA;
-		}
-	}
+	if (device->bmio_base)
+		device->dma_enabled = ata_dma_initialize(device);
 	ata_set_interrupts(device, 1);
 	semaphore_up(&device->lock);
 
@@ -271,7 +276,15 @@ void ata_initialize(ata_device_t *device)
 	drv->block_size = 512;
 	drv->cache_size = 16;
 	drv->ops = &ata_block_driver_ops;
+	device->blk = drv;
 	device_block_register(drv);
+
+	/* Without the request task requests are performed synchronously */
+	_t = scheduler_spawn(ata_req_main, device, &device->req_task);
+	if (_t) {
+		printf(CON_ERROR, "bus %i failed to start the request task: %i", device->bus_number, _t);
+		device->req_task = NULL;
+	}
 }
 
 void ata_setup_lba_transfer(ata_device_t *device, int drive, ata_lba_t lba, uint16_t count)
@@ -321,12 +334,216 @@ void ata_setup_lba_transfer(ata_device_t *device, int drive, ata_lba_t lba, uint
 	}
 }
 
-int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, uint16_t count)
+/**
+ * @brief Set up bus-master DMA for a bus
+ *
+ * The PRD table gets a frame of its own, which keeps it physically
+ * contiguous and clear of the 64K boundaries the controller cannot cross.
+ * @param device The ATA device to operate on
+ * @return 1 if DMA can be used, 0 if not
+ */
+static int ata_dma_initialize(ata_device_t *device)
 {
-	size_t byte_count = count * 512;
-	int status,dstatus,ws;
-	int dma = (device->drives[drive].capabilities & ATA_IDENT_CAP_FLAG_DMA) && ata_interrupt_enabled;
-	semaphore_down(&device->lock);
+	physaddr_t frame;
+	uint8_t bstatus;
+	int drive;
+
+	frame = physmm_alloc_frame();
+	if (frame == PHYSMM_NO_FRAME)
+		return 0;
+
+	device->prd_map = paging_map_phys_range(frame, PHYSMM_PAGE_SIZE,
+	                                        PAGING_PAGE_FLAG_RW);
+	if (!device->prd_map) {
+		physmm_free_frame(frame);
+		return 0;
+	}
+
+	device->prd_phys = frame;
+	device->prd_list = device->prd_map->virt;
+
+	ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x00 );
+	ata_write_port_long(device, ATA_BUSMASTER_PRDT_PTR_PORT, frame);
+
+	/* Report the drives that can do DMA to the controller, this also
+	 * acknowledges any pending interrupt or error */
+	bstatus = ata_read_port(device, ATA_BUSMASTER_STATUS_PORT);
+	for (drive = 0; drive < 2; drive++)
+		if (device->drives[drive].capabilities & ATA_IDENT_CAP_FLAG_DMA)
+			bstatus |= drive ? ATA_BM_STATUS_FLAG_S_DMA : ATA_BM_STATUS_FLAG_M_DMA;
+	ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, bstatus);
+
+	if (bstatus & ATA_BM_STATUS_FLAG_SIMPLEX) {
+		//TODO: Serialize DMA between the channels of simplex controllers
+		printf(CON_WARN, "bus %i is simplex only", device->bus_number);
+	}
+
+	printf(CON_DEBUG, "bus %i PRD table at %x", device->bus_number, frame);
+	return 1;
+}
+
+/**
+ * @brief Check whether a drive can currently use DMA
+ * @param device The ATA device to check
+ * @param drive The drive to check
+ * @return Nonzero if DMA can be used
+ */
+static int ata_dma_usable(ata_device_t *device, int drive)
+{
+	return device->dma_enabled && device->prd_list &&
+	       (device->drives[drive].capabilities & ATA_IDENT_CAP_FLAG_DMA) &&
+	       ata_interrupt_enabled;
+}
+
+/**
+ * @brief Stop using DMA for a drive after a failed transfer
+ * @param device The ATA device to operate on
+ * @param drive The drive that failed
+ */
+static void ata_dma_failed(ata_device_t *device, int drive)
+{
+	printf(CON_WARN, "device %i:%i DMA failed, falling back to PIO", device->bus_number, drive);
+	device->drives[drive].capabilities &= ~ATA_IDENT_CAP_FLAG_DMA;
+}
+
+/**
+ * @brief Fill the PRD list for a transfer
+ * @param device The ATA device whose PRD list to fill
+ * @param buffers The buffers for each sector
+ * @param count The number of sectors
+ * @return 1 if successful, 0 if the buffers do not fit in the PRD list
+ */
+static int ata_build_prd(ata_device_t *device, uint8_t * const *buffers, uint16_t count)
+{
+	volatile ata_prd_t *prd_list = device->prd_list;
+	int n, prd = -1;
+	uintptr_t addr, end;
+	physaddr_t phys, phys_end = 0;
+	size_t chunk;
+
+	for (n = 0; n < count; n++) {
+		addr = (uintptr_t) buffers[n];
+		end  = addr + 512;
+		while (addr < end) {
+			/* Split the buffer at page boundaries */
+			chunk = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+			if (chunk > end - addr)
+				chunk = end - addr;
+			phys = paging_get_physical_address((void *) addr);
+
+			/* Merge with the previous entry if physically
+			 * contiguous and within the same 64K region */
+			if (prd >= 0 && phys == phys_end &&
+			    ((prd_list[prd].buffer_phys ^ (phys + chunk - 1)) & ~0xFFFFu) == 0 &&
+			    prd_list[prd].byte_count + chunk < 0x10000) {
+				prd_list[prd].byte_count += chunk;
+			} else {
+				if (++prd == ATA_PRD_LIST_SIZE)
+					return 0;
+				prd_list[prd].buffer_phys = phys;
+				prd_list[prd].byte_count = chunk;
+				prd_list[prd].end_of_list = 0;
+			}
+
+			phys_end = phys + chunk;
+			addr += chunk;
+		}
+	}
+
+	prd_list[prd].end_of_list = ATA_PRD_END_OF_LIST;
+	return 1;
+}
+
+/**
+ * @brief Wait for a PIO data block to become available
+ * @param device The ATA device to wait on
+ * @param drive The drive being accessed
+ * @param first Nonzero if this is the first block of a read command
+ * @return 1 if the data can be transferred, 0 on error
+ */
+static int ata_pio_read_wait(ata_device_t *device, int drive, int first)
+{
+	if (!ata_interrupt_enabled) {
+		if (ata_poll_wait_resched(device) != 1) {
+			printf(CON_ERROR,"device %i:%i PIO read error", device->bus_number, drive);
+			return 0;
+		}
+		return 1;
+	}
+
+	if (semaphore_ndown( &device->int_wait, ATA_READ_TIMEOUT, SCHED_WAITF_TIMEOUT )) {
+		device->int_status = ata_read_port(device, ATA_STATUS_PORT);
+		if (first)
+			printf(CON_WARN, "device %i:%i PIO read int timeout", device->bus_number, drive);
+		if ( device->int_status & ATA_STATUS_FLAG_BSY ) {
+			printf(CON_ERROR,"device %i:%i PIO read timeout", device->bus_number, drive);
+			return 0;
+		}
+	}
+	if (device->int_status & (ATA_STATUS_FLAG_DF | ATA_STATUS_FLAG_ERR)){
+		printf(CON_ERROR,"device %i:%i PIO read error", device->bus_number, drive);
+		return 0;
+	}
+	if (!(device->int_status & ATA_STATUS_FLAG_DRQ)){
+		printf(CON_ERROR,"device %i:%i PIO read no DRQ!", device->bus_number, drive);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Wait for a bus-master DMA transfer to complete
+ * @param device The ATA device to wait on
+ * @param drive The drive being accessed
+ * @param timeout The timeout in microseconds
+ * @return 1 if successful, 0 on error
+ */
+static int ata_dma_wait(ata_device_t *device, int drive, ktime_t timeout)
+{
+	int status,dstatus;
+
+	do {
+		dstatus = ata_read_port(device, ATA_STATUS_PORT );
+		if ( ~dstatus & ATA_STATUS_FLAG_BSY )
+			break;
+		if ( semaphore_ndown( &device->int_wait, timeout, SCHED_WAITF_TIMEOUT ) ) {
+			printf(CON_ERROR,"device %i:%i DMA timeout", device->bus_number, drive);
+			ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x00 );
+			return 0;
+		}
+		dstatus = ata_read_port(device, ATA_STATUS_PORT );
+		status = ata_read_port(device, ATA_BUSMASTER_STATUS_PORT );
+	} while ( status & ATA_BM_STATUS_FLAG_DMAGO && dstatus & ATA_STATUS_FLAG_BSY );
+
+	ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x00 );
+	status = ata_read_port(device, ATA_BUSMASTER_STATUS_PORT );
+	if ( status & ATA_BM_STATUS_FLAG_ERR ) {
+		ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, ATA_BM_STATUS_FLAG_ERR);
+		printf(CON_ERROR,"device %i:%i DMA error", device->bus_number, drive);
+		return 0;
+	}
+	if ( dstatus & (ATA_STATUS_FLAG_DF | ATA_STATUS_FLAG_ERR) ) {
+		printf(CON_ERROR,"device %i:%i DMA command error", device->bus_number, drive);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Read consecutive sectors into separate buffers
+ * @param device The ATA device to read from
+ * @param drive The drive to read from
+ * @param lba The first sector to read
+ * @param buffers The buffers for each sector, 512 bytes each
+ * @param count The number of sectors to read, at most ATA_MAX_MULTI
+ * @param dma Nonzero to use bus-master DMA if the buffers allow it
+ * @return 1 if successful, 0 on error
+ *
+ * The caller must hold the device lock.
+ */
+static int ata_do_readv(ata_device_t *device, int drive, ata_lba_t lba, uint8_t * const *buffers, uint16_t count, int dma)
+{
+	int n, status;
 
 	if ( dma ) {
 
@@ -336,14 +553,17 @@ int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, ui
 			ata_poll_wait( device );
 
 		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x00 );
-		ata_prd_list[0].buffer_phys = paging_get_physical_address( (void *) buffer);
-		ata_prd_list[0].byte_count = byte_count;
-		ata_prd_list[0].end_of_list = ATA_PRD_END_OF_LIST;
-//		debugcon_printf("bufferphys: %x\t bytecount: %i",ata_prd_list[0].buffer_phys,
-//			ata_prd_list[0].byte_count);
-		ata_write_port_long(device, ATA_BUSMASTER_PRDT_PTR_PORT, paging_get_physical_address( (void *) ata_prd_list));
-		ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, 0x06 );
-		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x08 );
+
+		/* Fall back to PIO if the buffers are too fragmented */
+		dma = ata_build_prd( device, buffers, count );
+
+	}
+
+	if ( dma ) {
+
+		ata_write_port_long(device, ATA_BUSMASTER_PRDT_PTR_PORT, device->prd_phys);
+		ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, ATA_BM_STATUS_FLAG_IREQ | ATA_BM_STATUS_FLAG_ERR );
+		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, ATA_BM_CMD_FLAG_READ );
 
 		if ( ata_interrupt_enabled )
 			ata_poll_wait_resched( device );
@@ -362,7 +582,7 @@ int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, ui
 	device->int_wait = 0;
 
 #ifdef CONFIG_ATA_DEBUG
-	printf(CON_TRACE, "read  %i:%i[%x]->M[%x] * %i blocks, DMA:%i lock:%i", device->bus_number, drive, (uint32_t)lba, buffer,(uint32_t) count, dma, *device->lock);
+	printf(CON_TRACE, "read  %i:%i[%x]->M[%x] * %i blocks, DMA:%i lock:%i", device->bus_number, drive, (uint32_t)lba, buffers[0],(uint32_t) count, dma, *device->lock);
 #endif
 
 	if (dma) {
@@ -373,37 +593,10 @@ int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, ui
 			ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_READ_DMA);
 		ata_do_wait( device );
 		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, ATA_BM_CMD_FLAG_DMA_ENABLE | ATA_BM_CMD_FLAG_READ);
-		do {
-		//TODO: Implement a work queue
-			dstatus = ata_read_port(device, ATA_STATUS_PORT );
-			if ( ~dstatus & ATA_STATUS_FLAG_BSY )
-				break;
-			ws = semaphore_ndown( &device->int_wait, ATA_READ_TIMEOUT, SCHED_WAITF_TIMEOUT );
-			if ( ws ) {
-				printf(CON_ERROR,"device %i:%i DMA read timeout", device->bus_number, drive);
-				status = ata_read_port(device, ATA_BUSMASTER_STATUS_PORT );
-//				debugcon_printf("mstatus : 0x%x", status);
-				dstatus = ata_read_port(device, ATA_STATUS_PORT );
-//				debugcon_printf("dstatus : 0x%x", dstatus);
-				semaphore_up(&device->lock);
-				return 0;
-			}
-			dstatus = ata_read_port(device, ATA_STATUS_PORT );
-//			debugcon_printf("dstatus : 0x%x", dstatus);
-			status = ata_read_port(device, ATA_BUSMASTER_STATUS_PORT );
-//			debugcon_printf("bstatus : 0x%x", status);
-		} while ( status & ATA_BM_STATUS_FLAG_DMAGO && dstatus & ATA_STATUS_FLAG_BSY );
-		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x00 );
-			status = ata_read_port(device, ATA_BUSMASTER_STATUS_PORT );
-		if ( status & ATA_BM_STATUS_FLAG_ERR) {
-			ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, ATA_BM_STATUS_FLAG_ERR);
-			printf(CON_ERROR,"device %i:%i DMA read error", device->bus_number, drive);
-			semaphore_up(&device->lock);
-			return 0;
-		}
-		//scheduler_wait_micros(system_time_micros + 10);
-		semaphore_up(&device->lock);
-		return 1;
+		/* The caller sleeps until the transfer completes, requests */
+		/* are not queued to overlap with other work */
+		status = ata_dma_wait( device, drive, ATA_READ_TIMEOUT );
+		return status;
 	} else {
 		device->int_wait = 0;
 		if (device->drives[drive].lba_mode == ATA_MODE_LBA48)
@@ -413,45 +606,31 @@ int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, ui
 
 		ata_do_wait( device );
 
-		if (ata_interrupt_enabled) {
-
-			if (semaphore_ndown( &device->int_wait, ATA_READ_TIMEOUT, SCHED_WAITF_TIMEOUT )) {
-				device->int_status = ata_read_port(device, ATA_STATUS_PORT);
-				printf(CON_WARN, "device %i:%i PIO read int timeout", device->bus_number, drive);
-				if ( device->int_status & ATA_STATUS_FLAG_BSY ) {
-					printf(CON_ERROR,"device %i:%i PIO read timeout", device->bus_number, drive);
-					semaphore_up(&device->lock);
-					return 0;
-				}
-			}
-			if (device->int_status & (ATA_STATUS_FLAG_DF | ATA_STATUS_FLAG_ERR)){
-				printf(CON_ERROR,"device %i:%i PIO read error", device->bus_number, drive);
-				semaphore_up(&device->lock);
+		/* The drive raises DRQ for every sector of the command */
+		for (n = 0; n < count; n++) {
+			if (!ata_pio_read_wait(device, drive, n == 0))
 				return 0;
-			}
-			if (!(device->int_status & ATA_STATUS_FLAG_DRQ)){
-				printf(CON_ERROR,"device %i:%i PIO read no DRQ!", device->bus_number, drive);
-				semaphore_up(&device->lock);
-				return 0;
-			}
-		} else {
-			if (ata_poll_wait_resched(device) != 1) {
-				printf(CON_ERROR,"device %i:%i PIO read error %i", device->bus_number, drive, lba);
-				semaphore_up(&device->lock);
-				return 0;
-			}
+			ata_read_data(device, ATA_DATA_PORT, buffers[n], 512);
 		}
-		ata_read_data(device, ATA_DATA_PORT, buffer, byte_count);
-		semaphore_up(&device->lock);
 		return 1;
 	}
 }
 
-int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, uint16_t count)
+/**
+ * @brief Write consecutive sectors from separate buffers
+ * @param device The ATA device to write to
+ * @param drive The drive to write to
+ * @param lba The first sector to write
+ * @param buffers The buffers for each sector, 512 bytes each
+ * @param count The number of sectors to write, at most ATA_MAX_MULTI
+ * @param dma Nonzero to use bus-master DMA if the buffers allow it
+ * @return 1 if successful, 0 on error
+ *
+ * The caller must hold the device lock.
+ */
+static int ata_do_writev(ata_device_t *device, int drive, ata_lba_t lba, uint8_t * const *buffers, uint16_t count, int dma)
 {
-	size_t byte_count = count * 512;
-	int dma = 0;//(device->drives[drive].capabilities & ATA_IDENT_CAP_FLAG_DMA) && ata_interrupt_enabled;
-	semaphore_down(&device->lock);
+	int n;
 
 	if ( dma ) {
 
@@ -462,10 +641,16 @@ int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, u
 
 		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, 0x00 );
 
-		if ( ata_interrupt_enabled )
-			ata_poll_wait_resched( device );
-		else
-			ata_poll_wait( device );
+		/* Fall back to PIO if the buffers are too fragmented */
+		dma = ata_build_prd( device, buffers, count );
+
+	}
+
+	if ( dma ) {
+
+		/* Clearing the read flag makes the controller read memory */
+		ata_write_port_long(device, ATA_BUSMASTER_PRDT_PTR_PORT, device->prd_phys);
+		ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, ATA_BM_STATUS_FLAG_IREQ | ATA_BM_STATUS_FLAG_ERR );
 
 	}
 
@@ -478,7 +663,7 @@ int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, u
 
 	device->int_wait = 0;
 #ifdef CONFIG_ATA_DEBUG
-	printf(CON_TRACE,"write %i:%i[%x]<-M[%x] * %i blocks, DMA:%i", device->bus_number, drive, (uint32_t)lba, buffer,(uint32_t) count, dma);
+	printf(CON_TRACE,"write %i:%i[%x]<-M[%x] * %i blocks, DMA:%i", device->bus_number, drive, (uint32_t)lba, buffers[0],(uint32_t) count, dma);
 #endif
 	if (dma) {
 		if (device->drives[drive].lba_mode == ATA_MODE_LBA48)
@@ -486,27 +671,11 @@ int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, u
 		else
 			ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_WRITE_DMA);
 		ata_do_wait(device);
-		//TODO: Implement a work queue
-		ata_prd_list[0].buffer_phys = paging_get_physical_address(buffer);
-		ata_prd_list[0].byte_count = byte_count;
-		ata_prd_list[0].end_of_list = ATA_PRD_END_OF_LIST;
 		ata_write_port(device, ATA_BUSMASTER_COMMAND_PORT, ATA_BM_CMD_FLAG_DMA_ENABLE);
-		ata_do_wait(device);
-		if ( semaphore_ndown( &device->int_wait, ATA_WRITE_TIMEOUT, SCHED_WAITF_TIMEOUT ) ) {
-			printf(CON_ERROR, "device %i:%i DMA write timeout", device->bus_number, drive);
-			semaphore_up(&device->lock);
-			return 0;
-		}
-		if (ata_read_port(device, ATA_BUSMASTER_STATUS_PORT) & ATA_BM_STATUS_FLAG_ERR) {
-			ata_write_port(device, ATA_BUSMASTER_STATUS_PORT, ATA_BM_STATUS_FLAG_ERR);
-			ata_do_wait(device);
-			printf(CON_ERROR, "device %i:%i DMA write error", device->bus_number, drive);
-			semaphore_up(&device->lock);
+		/* The caller sleeps until the transfer completes, requests */
+		/* are not queued to overlap with other work */
+		if ( !ata_dma_wait( device, drive, ATA_WRITE_TIMEOUT ) )
 			return 0;
-		}
-		//scheduler_wait_micros(system_time_micros + 10);
-		semaphore_up(&device->lock);
-		return 1;
 	} else {
 		if (device->drives[drive].lba_mode == ATA_MODE_LBA48)
 			ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_WRITE_PIO_EXT);
@@ -519,103 +688,428 @@ int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, u
 				device->int_status = ata_read_port(device, ATA_STATUS_PORT);
 				if ( device->int_status & ATA_STATUS_FLAG_BSY ) {
 					printf(CON_ERROR, "device %i:%i PIO write timeout", device->bus_number, drive);
-					semaphore_up(&device->lock);
 					return 0;
 				}
 			}
 			if (device->int_status & (ATA_STATUS_FLAG_DF | ATA_STATUS_FLAG_ERR)){
 				printf(CON_ERROR,"device %i:%i PIO write error", device->bus_number, drive);
-				semaphore_up(&device->lock);
 				return 0;
 			}
 			if (!(device->int_status & ATA_STATUS_FLAG_DRQ)){
-				printf(CON_ERROR,"device %i:%i DMA write no DRQ", device->bus_number, drive);
-				semaphore_up(&device->lock);
+				printf(CON_ERROR,"device %i:%i PIO write no DRQ", device->bus_number, drive);
 				return 0;
 			}
 		} else {
 			if (ata_poll_wait_resched(device) != 1) {
 				printf(CON_ERROR,"device %i:%i write error %i", device->bus_number, drive, lba);
-				semaphore_up(&device->lock);
 				return 0;
 			}
 		}
 
-		ata_write_data(device, ATA_DATA_PORT, buffer, byte_count);
-		if (device->drives[drive].lba_mode == ATA_MODE_LBA48)
-			ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_CACHE_FLUSH_EXT);
-		else
-			ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_CACHE_FLUSH);
+		for (n = 0; n < count; n++) {
+			/* The drive raises DRQ again when it is ready for the
+			 * next sector, poll for it as the sector interrupts
+			 * are not waited on. */
+			if (n && ata_poll_wait_resched(device) != 1) {
+				printf(CON_ERROR,"device %i:%i write error %i", device->bus_number, drive, lba + n);
+				return 0;
+			}
+			ata_write_data(device, ATA_DATA_PORT, buffers[n], 512);
+		}
+	}
 
-		if ( ata_interrupt_enabled )
-			ata_poll_wait_resched( device );
-		else
-			ata_poll_wait( device );
-		semaphore_up(&device->lock);
-		return 1;
+	if (device->drives[drive].lba_mode == ATA_MODE_LBA48)
+		ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_CACHE_FLUSH_EXT);
+	else
+		ata_write_port(device, ATA_COMMAND_PORT, ATA_CMD_CACHE_FLUSH);
+
+	if ( ata_interrupt_enabled )
+		ata_poll_wait_resched( device );
+	else
+		ata_poll_wait( device );
+	return 1;
+}
+
+/**
+ * @brief Read consecutive sectors into separate buffers
+ *
+ * Uses DMA when possible, a failed DMA transfer is retried using PIO.
+ * @see ata_do_readv
+ */
+int ata_readv(ata_device_t *device, int drive, ata_lba_t lba, uint8_t * const *buffers, uint16_t count)
+{
+	int status = 0;
+
+	semaphore_down(&device->lock);
+	if (ata_dma_usable(device, drive)) {
+		status = ata_do_readv(device, drive, lba, buffers, count, 1);
+		if (!status)
+			ata_dma_failed(device, drive);
+	}
+	if (!status)
+		status = ata_do_readv(device, drive, lba, buffers, count, 0);
+	semaphore_up(&device->lock);
+	return status;
+}
+
+/**
+ * @brief Write consecutive sectors from separate buffers
+ *
+ * Uses DMA when possible, a failed DMA transfer is retried using PIO.
+ * @see ata_do_writev
+ */
+int ata_writev(ata_device_t *device, int drive, ata_lba_t lba, uint8_t * const *buffers, uint16_t count)
+{
+	int status = 0;
+
+	semaphore_down(&device->lock);
+	if (ata_dma_usable(device, drive)) {
+		status = ata_do_writev(device, drive, lba, buffers, count, 1);
+		if (!status)
+			ata_dma_failed(device, drive);
+	}
+	if (!status)
+		status = ata_do_writev(device, drive, lba, buffers, count, 0);
+	semaphore_up(&device->lock);
+	return status;
+}
+
+int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, uint16_t count)
+{
+	uint8_t *buffers[ATA_MAX_MULTI];
+	int n, run;
+
+	while (count) {
+		run = count > ATA_MAX_MULTI ? ATA_MAX_MULTI : count;
+		for (n = 0; n < run; n++)
+			buffers[n] = buffer + 512 * n;
+		if (!ata_readv(device, drive, lba, buffers, run))
+			return 0;
+		buffer += 512 * run;
+		lba += run;
+		count -= run;
 	}
+
+	return 1;
+}
+
+int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, uint16_t count)
+{
+	uint8_t *buffers[ATA_MAX_MULTI];
+	int n, run;
+
+	while (count) {
+		run = count > ATA_MAX_MULTI ? ATA_MAX_MULTI : count;
+		for (n = 0; n < run; n++)
+			buffers[n] = buffer + 512 * n;
+		if (!ata_writev(device, drive, lba, buffers, run))
+			return 0;
+		buffer += 512 * run;
+		lba += run;
+		count -= run;
+	}
+
+	return 1;
 }
 
 int ata_blk_open(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd, __attribute__((__unused__)) int options) {return 0;}
 
 int ata_blk_close(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd) {return 0;}
 
-int ata_blk_write(dev_t device, aoff_t file_offset, const void * buffer )
+/**
+ * @brief Translate a block device offset to a drive and LBA
+ * @param device The block device
+ * @param file_offset The offset on the block device
+ * @param count The number of sectors to be accessed
+ * @param _dev Output for the ATA device
+ * @param drive Output for the drive number
+ * @param lba Output for the LBA on the drive
+ * @return An error code on failure, 0 on success
+ */
+static int ata_blk_map(dev_t device, aoff_t file_offset, int count,
+                       ata_device_t **_dev, int *drive, ata_lba_t *lba)
 {
 	dev_t major = MAJOR(device);
 	dev_t minor = MINOR(device);
-	ata_device_t *_dev = ata_buses[major - 0x10];
-	ata_lba_t lba = ((ata_lba_t) file_offset) >> 9;
-	int drive = (minor & 32) ? 1 : 0;
 
-	if ((_dev == NULL) || (major >= 64))
+	if (major >= 64)
+		return ENODEV;
+
+	*_dev = ata_buses[major - 0x10];
+	*lba = ((ata_lba_t) file_offset) >> 9;
+	*drive = (minor & 32) ? 1 : 0;
+
+	if (*_dev == NULL)
 		return ENODEV;
 
 	minor &= 0x1F;
 
 	if (minor) {
-		if (_dev->drives[drive].partitions[minor - 1].type == 0)
+		if ((*_dev)->drives[*drive].partitions[minor - 1].type == 0)
 			return ENODEV;
-		if (lba > _dev->drives[drive].partitions[minor - 1].end)
+		if (*lba + count - 1 > (*_dev)->drives[*drive].partitions[minor - 1].end)
 			return ENOSPC;
-		lba += _dev->drives[drive].partitions[minor - 1].start;
+		*lba += (*_dev)->drives[*drive].partitions[minor - 1].start;
 	}
 
+	return 0;
+}
 
-	if(!ata_write(_dev, drive, lba, (uint8_t *) buffer, 1))
-		return EIO;
+int ata_blk_writev(dev_t device, aoff_t file_offset, void * const *buffers, int count)
+{
+	ata_device_t *_dev;
+	ata_lba_t lba;
+	int drive, run, status;
+
+	status = ata_blk_map(device, file_offset, count, &_dev, &drive, &lba);
+	if (status)
+		return status;
+
+	for (; count; count -= run, buffers += run, lba += run) {
+		run = count > ATA_MAX_MULTI ? ATA_MAX_MULTI : count;
+		if(!ata_writev(_dev, drive, lba, (uint8_t * const *) buffers, run))
+			return EIO;
+	}
 	return 0;
 }
 
-int ata_blk_read(dev_t device, aoff_t file_offset, void * buffer )
+int ata_blk_readv(dev_t device, aoff_t file_offset, void * const *buffers, int count)
 {
-	dev_t major = MAJOR(device);
-	dev_t minor = MINOR(device);
-	ata_device_t *_dev = ata_buses[major - 0x10];
-	ata_lba_t lba = ((ata_lba_t) file_offset) >> 9;
-	int drive = (minor & 32) ? 1 : 0;
+	ata_device_t *_dev;
+	ata_lba_t lba;
+	int drive, run, status;
+
+	status = ata_blk_map(device, file_offset, count, &_dev, &drive, &lba);
+	if (status)
+		return status;
+
+	for (; count; count -= run, buffers += run, lba += run) {
+		run = count > ATA_MAX_MULTI ? ATA_MAX_MULTI : count;
+		if(!ata_readv(_dev, drive, lba, (uint8_t * const *) buffers, run))
+			return EIO;
+	}
+	return 0;
+}
 
-	if ((_dev == NULL) || (major >= 64))
-		return ENODEV;
+/**
+ * @brief Perform a queued request
+ *
+ * Merged requests each have their own buffer list, the buffers of a command
+ * are gathered from them. At most ATA_MAX_MULTI sectors are transferred per
+ * command.
+ * @param device The ATA device to operate on
+ * @param req The request to perform
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int ata_req_perform(ata_device_t *device, blk_request_t *req)
+{
+	uint8_t *buffers[ATA_MAX_MULTI];
+	ata_device_t *_dev;
+	ata_lba_t lba;
+	int drive, done, run, n, status;
+
+	status = ata_blk_map(req->device, req->offset, req->total,
+	                     &_dev, &drive, &lba);
+	if (status)
+		return status;
+
+	for (done = 0; done < req->total; done += run) {
+		run = req->total - done;
+		if (run > ATA_MAX_MULTI)
+			run = ATA_MAX_MULTI;
+		for (n = 0; n < run; n++)
+			buffers[n] = blk_request_buffer(req, done + n);
+		if (req->write)
+			status = ata_writev(device, drive, lba + done, buffers, run);
+		else
+			status = ata_readv(device, drive, lba + done, buffers, run);
+		if (!status)
+			return EIO;
+	}
 
-	minor &= 0x1F;
+	return 0;
+}
 
-	if (minor) {
-		if (_dev->drives[drive].partitions[minor - 1].type == 0)
-			return ENODEV;
-		if (lba > _dev->drives[drive].partitions[minor - 1].end)
-			return ENOSPC;
-		lba += _dev->drives[drive].partitions[minor - 1].start;
+/**
+ * @brief Perform the queued requests of a bus
+ *
+ * Runs as a task of its own so that waiting for the drive, and polling it
+ * where it does not interrupt, never happens in interrupt context. The
+ * transfers take the device lock like the synchronous calls do.
+ * @param device The ATA device to operate on
+ */
+static void ata_req_main(ata_device_t *device)
+{
+	blk_request_t *req;
+	int s;
+
+	for (;;) {
+		semaphore_down(&device->req_wake);
+
+		for (;;) {
+			s = disable();
+			req = blk_queue_next(&device->blk->queue);
+			restore(s);
+			if (!req)
+				break;
+			device_block_complete(req, ata_req_perform(device, req));
+		}
+	}
+}
+
+/**
+ * @brief Queue a block request
+ * @see blk_ops
+ */
+int ata_blk_submit(blk_request_t *req)
+{
+	ata_device_t *_dev;
+	ata_lba_t lba;
+	int drive, status, s;
+
+	status = ata_blk_map(req->device, req->offset, req->count, &_dev, &drive, &lba);
+	if (status)
+		return status;
+
+	/* Without interrupts the request can only be performed synchronously */
+	if (!ata_interrupt_enabled || !_dev->req_task) {
+		if (req->write)
+			status = ata_blk_writev(req->device, req->offset, req->buffers, req->count);
+		else
+			status = ata_blk_readv(req->device, req->offset, req->buffers, req->count);
+		device_block_complete(req, status);
+		return 0;
 	}
 
-	if(!ata_read(_dev, drive, lba, (uint8_t *) buffer, 1))
-		return EIO;
+	/* Sort by drive first, then by position on the drive */
+	req->pos = lba + (((uint64_t) drive) << 48);
+
+	s = disable();
+	blk_queue_add(&_dev->blk->queue, req);
+	restore(s);
+
+	semaphore_up(&_dev->req_wake);
+
 	return 0;
 }
 
-int ata_blk_ioctl(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd, __attribute__((__unused__)) int func, __attribute__((__unused__)) int arg)
+int ata_blk_write(dev_t device, aoff_t file_offset, const void * buffer )
 {
-	return 0;
+	void *buffers[1] = { (void *) buffer };
+	return ata_blk_writev(device, file_offset, buffers, 1);
+}
+
+int ata_blk_read(dev_t device, aoff_t file_offset, void * buffer )
+{
+	void *buffers[1] = { buffer };
+	return ata_blk_readv(device, file_offset, buffers, 1);
+}
+
+/**
+ * @brief Time reading from the start of a drive using PIO and DMA
+ *
+ * The bus is held for the whole run, queued requests and other callers wait
+ * until the benchmark is done so they do not skew the results.
+ * @param device The ATA device to benchmark
+ * @param drive The drive to benchmark
+ * @param bench Holds the number of sectors to read, receives the results
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int ata_benchmark(ata_device_t *device, int drive, ata_bench_t *bench)
+{
+	uint8_t *buffers[ATA_MAX_MULTI];
+	uint8_t *buffer;
+	ktime_t start;
+	unsigned int done, run;
+	int n, dma, status = 0;
+
+	if (bench->ab_sectors == 0 ||
+	    bench->ab_sectors > device->drives[drive].max_lba)
+		return EINVAL;
+
+	buffer = heapmm_alloc(ATA_MAX_MULTI * 512);
+	if (!buffer)
+		return ENOMEM;
+
+	for (n = 0; n < ATA_MAX_MULTI; n++)
+		buffers[n] = buffer + 512 * n;
+
+	bench->ab_pio_time = 0;
+	bench->ab_dma_time = 0;
+
+	semaphore_down(&device->lock);
+
+	for (dma = 0; dma < 2 && !status; dma++) {
+		if (dma && !ata_dma_usable(device, drive))
+			break;
+
+		start = system_time_micros;
+		for (done = 0; done < bench->ab_sectors; done += run) {
+			run = bench->ab_sectors - done;
+			if (run > ATA_MAX_MULTI)
+				run = ATA_MAX_MULTI;
+			if (!ata_do_readv(device, drive, done, buffers, run, dma)) {
+				status = EIO;
+				break;
+			}
+		}
+
+		if (dma)
+			bench->ab_dma_time = system_time_micros - start;
+		else
+			bench->ab_pio_time = system_time_micros - start;
+	}
+
+	semaphore_up(&device->lock);
+
+	heapmm_free(buffer, ATA_MAX_MULTI * 512);
+
+	return status;
+}
+
+int ata_blk_ioctl(dev_t device, __attribute__((__unused__)) int fd, int func, int arg)
+{
+	ata_device_t *_dev;
+	ata_bench_t bench;
+	ata_lba_t lba;
+	int drive, status;
+
+	status = ata_blk_map(device, 0, 1, &_dev, &drive, &lba);
+	if (status) {
+		syscall_errno = status;
+		return -1;
+	}
+
+	switch (func) {
+
+		case ATAIOCBENCH:
+			if (!copy_user_to_kern((void *) arg, &bench, sizeof(ata_bench_t))){
+				syscall_errno = EFAULT;
+				return -1;
+			}
+			status = ata_benchmark(_dev, drive, &bench);
+			if (status) {
+				syscall_errno = status;
+				return -1;
+			}
+			if (!copy_kern_to_user(&bench, (void *) arg, sizeof(ata_bench_t))){
+				syscall_errno = EFAULT;
+				return -1;
+			}
+			return 0;
+
+		case ATAIOCSDMA:
+			if (arg && !_dev->prd_list) {
+				syscall_errno = ENODEV;
+				return -1;
+			}
+			_dev->dma_enabled = arg ? 1 : 0;
+			return 0;
+
+		default:
+			return 0;
+
+	}
 }
 
 blk_ops_t ata_block_driver_ops = {
@@ -623,5 +1117,8 @@ blk_ops_t ata_block_driver_ops = {
 		&ata_blk_close,
 		&ata_blk_write,
 		&ata_blk_read,
-		&ata_blk_ioctl
+		&ata_blk_ioctl,
+		&ata_blk_writev,
+		&ata_blk_readv,
+		&ata_blk_submit
 };
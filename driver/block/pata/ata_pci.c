@@ -7,6 +7,7 @@
  *
  * Changelog:
  * 02-07-2014 - Created
+ * 17-10-2026 - Only use bus-master DMA on the secondary bus if BAR4 is set
  */
 
 #define CON_SRC "ata_pci"
@@ -57,7 +58,7 @@ int ata_pci_probe(uint32_t bus_addr) {
 
 	dev_s->pio_base = (bar2 > 1) ? bar2 : 0x170;
 	dev_s->ctrl_base = (bar3 > 1) ? bar3 : 0x374;
-	dev_s->bmio_base = bar4 + 8;
+	dev_s->bmio_base = bar4 ? bar4 + 8 : 0;
 	dev_s->irq = (irq && irq != 255) ? irq : 15;
 
 	ata_initialize(dev_p);
@@ -9,6 +9,7 @@
  *
  * Changelog:
  * \li 18-07-2016 - Created
+ * \li 17-10-2026 - Added multi-block calls
  */
 
 #include "config.h"
@@ -71,6 +72,40 @@ int ramblk_read(dev_t device, aoff_t file_offset, void * buffer )
 	return 0;
 }
 
+int ramblk_writev(dev_t device, aoff_t file_offset, void * const *buffers, int count)
+{
+	dev_t major = MAJOR(device);
+	ramblk_device_t *_dev = &ramblk_devs[major-0x30];
+	int n;
+
+	if (_dev->data == NULL)
+		return ENODEV;
+
+	if ((file_offset > _dev->size) || ((file_offset + 512 * count) > _dev->size)) {
+		return ENOSPC;
+	}
+	for (n = 0; n < count; n++)
+		memcpy( &_dev->data[file_offset + 512 * n], buffers[n], 512);
+	return 0;
+}
+
+int ramblk_readv(dev_t device, aoff_t file_offset, void * const *buffers, int count)
+{
+	dev_t major = MAJOR(device);
+	ramblk_device_t *_dev = &ramblk_devs[major-0x30];
+	int n;
+
+	if (_dev->data == NULL)
+		return ENODEV;
+
+	if ((file_offset > _dev->size) || ((file_offset + 512 * count) > _dev->size)) {
+		return ENOSPC;
+	}
+	for (n = 0; n < count; n++)
+		memcpy( buffers[n], &_dev->data[file_offset + 512 * n], 512);
+	return 0;
+}
+
 int ramblk_ioctl(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd, __attribute__((__unused__)) int func, __attribute__((__unused__)) int arg)
 {
 	return 0;
@@ -100,5 +135,8 @@ blk_ops_t ramblk_driver_ops = {
 		&ramblk_close,
 		&ramblk_write,
 		&ramblk_read,
-		&ramblk_ioctl
+		&ramblk_ioctl,
+		&ramblk_writev,
+		&ramblk_readv,
+		NULL
 };
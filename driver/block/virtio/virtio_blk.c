@@ -0,0 +1,541 @@
+/**
+ * @file driver/block/virtio/virtio_blk.c
+ *
+ * Implements a driver for virtio block devices
+ *
+ * Requests are taken from the block request queue and added to the
+ * virtqueue as long as there are descriptors left, so the device can work
+ * on many of them at once. Completed requests are collected from the
+ * interrupt handler.
+ *
+ * Part of P-OS driver library.
+ *
+ * @author Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * \li 17-10-2026 - Created
+ * \li 17-10-2026 - Check request bounds in sectors rather than blocks
+ * \li 17-10-2026 - Only publish a device once it is registered
+ */
+
+#include "config.h"
+#include <sys/errno.h>
+#include <string.h>
+
+#include "arch/i386/x86.h"
+#include "driver/block/virtio/virtio_blk.h"
+#define CON_SRC "virtio_blk"
+#include "kernel/console.h"
+#include "kernel/synch.h"
+#include "kernel/paging.h"
+#include "kernel/physmm.h"
+#include "kernel/heapmm.h"
+#include "kernel/device.h"
+#include "kernel/syscall.h"
+#include "fs/mbr.h"
+
+/** Set once the scheduler can wait for interrupts */
+int virtio_blk_interrupt_enabled = 0;
+
+int virtio_blk_device_counter = 0;
+
+virtio_blk_device_t *virtio_blk_devices[VIRTIO_BLK_MAX_DEVICES];
+
+extern blk_ops_t virtio_blk_driver_ops;
+
+/**
+ * @brief Look up the device and first sector for a block request
+ * @param device The device id
+ * @param file_offset The offset of the first block
+ * @param count The number of blocks
+ * @param _dev Receives the virtio device
+ * @param sector Receives the first sector on the disk
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int virtio_blk_map(dev_t device, aoff_t file_offset, int count,
+                          virtio_blk_device_t **_dev, uint64_t *sector)
+{
+	dev_t major = MAJOR(device);
+	dev_t minor = MINOR(device);
+	partition_info_t *part;
+	uint64_t sectors;
+
+	if (major < VIRTIO_BLK_MAJOR ||
+	    major >= VIRTIO_BLK_MAJOR + VIRTIO_BLK_MAX_DEVICES)
+		return ENODEV;
+
+	*_dev = virtio_blk_devices[major - VIRTIO_BLK_MAJOR];
+	*sector = ((uint64_t) file_offset) / VIRTIO_BLK_SECTOR_SIZE;
+	sectors = ((uint64_t) count) * (VIRTIO_BLK_BLOCK_SIZE / VIRTIO_BLK_SECTOR_SIZE);
+
+	if (*_dev == NULL || minor > VIRTIO_BLK_PARTITIONS)
+		return ENODEV;
+
+	if (minor) {
+		part = &(*_dev)->partitions[minor - 1];
+		if (part->type == 0)
+			return ENODEV;
+		if (*sector + sectors > part->size)
+			return ENOSPC;
+		*sector += part->start;
+	}
+
+	if (*sector + sectors > (*_dev)->capacity)
+		return ENOSPC;
+
+	return 0;
+}
+
+/**
+ * @brief Add a request to the virtqueue
+ *
+ * Must be called with interrupts disabled.
+ * @param device The virtio device to operate on
+ * @param req The request, possibly with requests merged into it
+ * @return 0 if successful, EAGAIN if the queue is full or a valid errorcode
+ */
+static int virtio_blk_issue(virtio_blk_device_t *device, blk_request_t *req)
+{
+	virtio_blk_device_t *_dev;
+	volatile virtio_blk_slot_t *slot;
+	virtq_buf_t *bufs = device->bufs;
+	physaddr_t phys, slot_phys;
+	uintptr_t addr, end;
+	uint64_t sector;
+	size_t chunk;
+	int head, status, n, b;
+
+	status = virtio_blk_map(req->device, req->offset, req->total, &_dev, &sector);
+	if (status)
+		return status;
+
+	if (req->write && (device->features & VIRTIO_BLK_F_RO))
+		return EROFS;
+
+	/* The chain will start at the head of the free list, the slot for
+	 * that descriptor holds the request header */
+	head = device->vq.free_head;
+	slot = &device->slots[head];
+	slot_phys = device->slots_phys + head * sizeof(virtio_blk_slot_t);
+
+	bufs[0].addr = slot_phys;
+	bufs[0].len = VIRTIO_BLK_HDR_SIZE;
+	bufs[0].write = 0;
+	n = 1;
+
+	for (b = 0; b < req->total; b++) {
+		addr = (uintptr_t) blk_request_buffer(req, b);
+		end  = addr + VIRTIO_BLK_BLOCK_SIZE;
+		while (addr < end) {
+			/* Split the buffer at page boundaries */
+			chunk = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+			if (chunk > end - addr)
+				chunk = end - addr;
+			phys = paging_get_physical_address((void *) addr);
+
+			/* Merge with the previous buffer if contiguous */
+			if (n > 1 && bufs[n - 1].addr + bufs[n - 1].len == phys) {
+				bufs[n - 1].len += chunk;
+			} else {
+				if (n - 1 == device->seg_max || n + 1 >= device->vq.size)
+					return EINVAL;
+				bufs[n].addr = phys;
+				bufs[n].len = chunk;
+				bufs[n].write = !req->write;
+				n++;
+			}
+
+			addr += chunk;
+		}
+	}
+
+	bufs[n].addr = slot_phys + VIRTIO_BLK_HDR_SIZE;
+	bufs[n].len = 1;
+	bufs[n].write = 1;
+	n++;
+
+	if (n > device->vq.num_free)
+		return EAGAIN;
+
+	slot->type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	slot->reserved = 0;
+	slot->sector = sector;
+	slot->status = 0xFF;
+
+	head = virtq_add(&device->vq, bufs, n);
+	device->reqs[head] = req;
+	device->in_flight++;
+
+	return 0;
+}
+
+/**
+ * @brief Add queued requests to the virtqueue while it has room
+ *
+ * Must be called with interrupts disabled.
+ * @param device The virtio device to operate on
+ */
+static void virtio_blk_start(virtio_blk_device_t *device)
+{
+	blk_request_t *req;
+	int status, added = 0;
+
+	for (;;) {
+		req = device->pending;
+		if (!req)
+			req = blk_queue_next(&device->blk->queue);
+		if (!req)
+			break;
+		device->pending = NULL;
+
+		status = virtio_blk_issue(device, req);
+		if (status == EAGAIN) {
+			/* Retry once earlier requests have completed */
+			device->pending = req;
+			break;
+		} else if (status) {
+			device_block_complete(req, status);
+		} else
+			added = 1;
+	}
+
+	if (added)
+		virtq_kick(&device->vq);
+}
+
+/**
+ * @brief Complete the requests the device is done with
+ *
+ * Must be called with interrupts disabled.
+ * @param device The virtio device to operate on
+ */
+static void virtio_blk_collect(virtio_blk_device_t *device)
+{
+	blk_request_t *req;
+	int head, status;
+
+	while ((head = virtq_get(&device->vq, NULL)) >= 0) {
+		req = device->reqs[head];
+		device->reqs[head] = NULL;
+		device->in_flight--;
+		if (!req)
+			continue;
+		status = device->slots[head].status;
+		if (status != VIRTIO_BLK_S_OK)
+			printf(CON_ERROR, "device %i request error %i at %i",
+			       device->number, status, (uint32_t) device->slots[head].sector);
+		device_block_complete(req, status == VIRTIO_BLK_S_OK ? 0 : EIO);
+	}
+}
+
+/**
+ * @brief Run the queue until it is empty without waiting for interrupts
+ *
+ * Must be called with interrupts disabled.
+ * @param device The virtio device to operate on
+ */
+static void virtio_blk_poll(virtio_blk_device_t *device)
+{
+	while (device->in_flight || device->pending || device->blk->queue.depth) {
+		/* Reading the ISR deasserts the interrupt */
+		i386_inb(device->iobase + VIRTIO_PCI_ISR);
+		virtio_blk_collect(device);
+		virtio_blk_start(device);
+	}
+}
+
+int virtio_blk_irq_handler(__attribute__((__unused__)) irq_id_t irq_id, void *context)
+{
+	virtio_blk_device_t *device = context;
+	uint8_t isr;
+
+	isr = i386_inb(device->iobase + VIRTIO_PCI_ISR);
+	if (!isr)
+		return 0;//Forward interrupt to next handlers
+
+	if (isr & VIRTIO_ISR_QUEUE) {
+		virtio_blk_collect(device);
+		virtio_blk_start(device);
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Queue a block request
+ * @see blk_ops
+ */
+int virtio_blk_submit(blk_request_t *req)
+{
+	virtio_blk_device_t *_dev;
+	uint64_t sector;
+	int status, s;
+
+	status = virtio_blk_map(req->device, req->offset, req->count, &_dev, &sector);
+	if (status)
+		return status;
+
+	req->pos = sector;
+
+	s = disable();
+	blk_queue_add(&_dev->blk->queue, req);
+	virtio_blk_start(_dev);
+
+	/* Without interrupts the request can only be performed synchronously */
+	if (!virtio_blk_interrupt_enabled)
+		virtio_blk_poll(_dev);
+
+	restore(s);
+
+	return 0;
+}
+
+/**
+ * @brief Perform a transfer through the request queue and wait for it
+ * @param device The device to operate on
+ * @param file_offset The offset of the first block
+ * @param buffers The buffers for each block
+ * @param count The number of blocks
+ * @param write Nonzero to write to the device
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int virtio_blk_transfer(dev_t device, aoff_t file_offset, void * const *buffers, int count, int write)
+{
+	blk_request_t req;
+	int status;
+
+	req.device = device;
+	req.offset = file_offset;
+	req.buffers = buffers;
+	req.count = count;
+	req.write = write;
+	req.complete = NULL;
+	req.param = NULL;
+
+	status = device_block_submit(&req);
+	if (status)
+		return status;
+
+	return device_block_wait(&req);
+}
+
+int virtio_blk_open(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd, __attribute__((__unused__)) int options) {return 0;}
+
+int virtio_blk_close(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd) {return 0;}
+
+int virtio_blk_writev(dev_t device, aoff_t file_offset, void * const *buffers, int count)
+{
+	return virtio_blk_transfer(device, file_offset, buffers, count, 1);
+}
+
+int virtio_blk_readv(dev_t device, aoff_t file_offset, void * const *buffers, int count)
+{
+	return virtio_blk_transfer(device, file_offset, buffers, count, 0);
+}
+
+int virtio_blk_write(dev_t device, aoff_t file_offset, const void * buffer )
+{
+	void *buffers[1] = { (void *) buffer };
+	return virtio_blk_writev(device, file_offset, buffers, 1);
+}
+
+int virtio_blk_read(dev_t device, aoff_t file_offset, void * buffer )
+{
+	void *buffers[1] = { buffer };
+	return virtio_blk_readv(device, file_offset, buffers, 1);
+}
+
+int virtio_blk_ioctl(__attribute__((__unused__)) dev_t device, __attribute__((__unused__)) int fd, __attribute__((__unused__)) int func, __attribute__((__unused__)) int arg)
+{
+	syscall_errno = ENOTTY;
+	return -1;
+}
+
+/**
+ * @brief Read the partition table of a device
+ * @param device The virtio device to operate on
+ */
+static void virtio_blk_load_partition_table(virtio_blk_device_t *device)
+{
+	uint8_t mbr[512];
+
+	if (virtio_blk_read(MAKEDEV(device->blk->major, 0), 0, mbr))
+		return;
+	mbr_parse(device->partitions, mbr);
+}
+
+/**
+ * @brief Set up the request slots of a device
+ * @param device The virtio device to operate on
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int virtio_blk_alloc_slots(virtio_blk_device_t *device)
+{
+	size_t size = device->vq.size * sizeof(virtio_blk_slot_t);
+
+	device->reqs = NULL;
+	device->slots_map = NULL;
+
+	device->bufs = heapmm_alloc(device->vq.size * sizeof(virtq_buf_t));
+	if (!device->bufs)
+		return ENOMEM;
+
+	device->reqs = heapmm_alloc(device->vq.size * sizeof(blk_request_t *));
+	if (!device->reqs)
+		return ENOMEM;
+	memset(device->reqs, 0, device->vq.size * sizeof(blk_request_t *));
+
+	/* The headers are handed to the device by physical address */
+	for (device->slots_order = 0; (PAGE_SIZE << device->slots_order) < size; device->slots_order++);
+	device->slots_phys = physmm_alloc_pages(device->slots_order);
+	if (device->slots_phys == PHYSMM_NO_FRAME)
+		return ENOMEM;
+
+	device->slots_map = paging_map_phys_range(device->slots_phys,
+	                                          PAGE_SIZE << device->slots_order,
+	                                          PAGING_PAGE_FLAG_RW);
+	if (!device->slots_map) {
+		physmm_free_pages(device->slots_phys, device->slots_order);
+		return ENOMEM;
+	}
+	device->slots = device->slots_map->virt;
+
+	return 0;
+}
+
+/**
+ * @brief Free the request slots of a device
+ *
+ * Also frees a partial allocation left by a failed virtio_blk_alloc_slots.
+ * @param device The virtio device to operate on
+ */
+static void virtio_blk_free_slots(virtio_blk_device_t *device)
+{
+	if (device->slots_map) {
+		paging_unmap_phys_range(device->slots_map);
+		physmm_free_pages(device->slots_phys, device->slots_order);
+	}
+	if (device->reqs)
+		heapmm_free(device->reqs, device->vq.size * sizeof(blk_request_t *));
+	if (device->bufs)
+		heapmm_free(device->bufs, device->vq.size * sizeof(virtq_buf_t));
+}
+
+/**
+ * @brief Initialize a virtio block device and register it
+ * @param device The device, with iobase and irq filled in
+ * @return 1 if successful, 0 if not
+ */
+int virtio_blk_initialize(virtio_blk_device_t *device)
+{
+	blk_dev_t *drv;
+	uint32_t features;
+	int limit;
+
+	if (virtio_blk_device_counter == VIRTIO_BLK_MAX_DEVICES) {
+		printf(CON_ERROR, "too many devices");
+		return 0;
+	}
+
+	device->blk = NULL;
+	device->in_flight = 0;
+	device->pending = NULL;
+	memset(device->partitions, 0, sizeof(device->partitions));
+
+	/* Reset the device and tell it we found it */
+	i386_outb(device->iobase + VIRTIO_PCI_STATUS, 0);
+	i386_outb(device->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	i386_outb(device->iobase + VIRTIO_PCI_STATUS,
+	          VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	features = i386_inl(device->iobase + VIRTIO_PCI_HOST_FEATURES);
+	device->features = features & (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO);
+	i386_outl(device->iobase + VIRTIO_PCI_GUEST_FEATURES, device->features);
+
+	device->capacity = i386_inl(device->iobase + VIRTIO_BLK_CFG_CAPACITY) |
+	        ((uint64_t) i386_inl(device->iobase + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+	if (virtq_init(&device->vq, device->iobase, 0)) {
+		printf(CON_ERROR, "could not set up request queue");
+		goto fail;
+	}
+
+	if (virtio_blk_alloc_slots(device)) {
+		printf(CON_ERROR, "could not set up request queue");
+		goto fail_slots;
+	}
+
+	/* The header and status take a descriptor each */
+	device->seg_max = device->vq.size - 2;
+	if (device->features & VIRTIO_BLK_F_SEG_MAX) {
+		limit = i386_inl(device->iobase + VIRTIO_BLK_CFG_SEG_MAX);
+		if (limit > 0 && limit < device->seg_max)
+			device->seg_max = limit;
+	}
+
+	/* The device is only published once it is registered, nothing can
+	 * fail after that */
+	device->number = virtio_blk_device_counter;
+
+	drv = heapmm_alloc(sizeof(blk_dev_t));
+	if (!drv) {
+		printf(CON_ERROR, "out of memory");
+		goto fail_drv;
+	}
+	drv->name = "virtio block driver";
+	drv->major = VIRTIO_BLK_MAJOR + device->number;
+	drv->minor_count = VIRTIO_BLK_PARTITIONS + 1;
+	drv->block_size = VIRTIO_BLK_BLOCK_SIZE;
+	drv->cache_size = 64;
+	drv->ops = &virtio_blk_driver_ops;
+	device->blk = drv;
+	if (!device_block_register(drv)) {
+		printf(CON_ERROR, "could not register device");
+		heapmm_free(drv, sizeof(blk_dev_t));
+		device->blk = NULL;
+		goto fail_drv;
+	}
+
+	/* A sector may span two pages, so every sector can take two
+	 * descriptors */
+	limit = device->seg_max / 2;
+	if (limit < drv->queue.max_merge)
+		drv->queue.max_merge = limit;
+	if (VIRTIO_BLK_MAX_MERGE < drv->queue.max_merge)
+		drv->queue.max_merge = VIRTIO_BLK_MAX_MERGE;
+
+	virtio_blk_device_counter++;
+	virtio_blk_devices[device->number] = device;
+
+	interrupt_register_handler(device->irq, &virtio_blk_irq_handler, device);
+
+	i386_outb(device->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+	          VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	printf(CON_INFO, "detected device: %i with %i sectors%s",
+	       device->number, (uint32_t) device->capacity,
+	       (device->features & VIRTIO_BLK_F_RO) ? ", read only" : "");
+
+	virtio_blk_load_partition_table(device);
+
+	return 1;
+
+fail_drv:
+	virtio_blk_free_slots(device);
+fail_slots:
+	virtq_free(&device->vq);
+fail:
+	i386_outb(device->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	return 0;
+}
+
+blk_ops_t virtio_blk_driver_ops = {
+		&virtio_blk_open,
+		&virtio_blk_close,
+		&virtio_blk_write,
+		&virtio_blk_read,
+		&virtio_blk_ioctl,
+		&virtio_blk_writev,
+		&virtio_blk_readv,
+		&virtio_blk_submit
+};
@@ -0,0 +1,71 @@
+/**
+ * driver/block/virtio/virtio_blk_pci.c
+ *
+ * Part of P-OS kernel.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#define CON_SRC "virtio_blk_pci"
+#include "kernel/console.h"
+#include "kernel/heapmm.h"
+#include "kernel/drivermgr.h"
+#include "driver/bus/pci.h"
+#include "driver/block/virtio/virtio_blk.h"
+
+int virtio_blk_pci_probe(uint32_t bus_addr) {
+	uint8_t bus	 = (uint8_t) ((bus_addr >> 16) & 0xFF);
+	uint8_t device	 = (uint8_t) ((bus_addr >>  8) & 0xFF);
+	uint8_t function = (uint8_t) ((bus_addr      ) & 0xFF);
+	uint32_t bar0 = pci_config_read_long( bus, device, function, PCI_CONFIG_BAR0 );
+	uint32_t irq  = pci_config_read_byte( bus, device, function, PCI_CONFIG_INTERRUPT_LINE ) ;
+	virtio_blk_device_t *dev;
+
+	printf(CON_INFO, "initializing controller %i:%i.%i (%x)->IRQ%i", bus, device, function, bar0, irq);
+
+	/* The legacy interface lives in an I/O BAR */
+	if ( !(bar0 & 1) ) {
+		printf(CON_ERROR, "controller %i:%i.%i has no legacy interface", bus, device, function);
+		return 0;
+	}
+
+	if ( irq == 255 ) {
+		printf(CON_ERROR, "controller %i:%i.%i has no irq", bus, device, function);
+		return 0;
+	}
+
+	dev = heapmm_alloc(sizeof(virtio_blk_device_t));
+	if (!dev) {
+		printf(CON_ERROR, "error initializing, out of memory!");
+		return 0;
+	}
+
+	/* Enable I/O space and bus mastering */
+	pci_config_write_short( bus, device, function, PCI_CONFIG_COMMAND,
+		pci_config_read_short( bus, device, function, PCI_CONFIG_COMMAND ) | 0x5 );
+
+	dev->iobase = bar0 & 0xFFFFFFFC;
+	dev->irq = irq;
+
+	if (!virtio_blk_initialize(dev)) {
+		heapmm_free(dev, sizeof(virtio_blk_device_t));
+		return 0;
+	}
+	return 1;
+}
+
+drivermgr_device_driver_t virtio_blk_pci_descriptor = {
+	{0,0},
+	DEVICE_TYPE_PCI,
+	VIRTIO_PCI_VID,
+	VIRTIO_BLK_PCI_PID,
+	&virtio_blk_pci_probe
+};
+
+void virtio_blk_register()
+{
+	drivermgr_register_device_driver(&virtio_blk_pci_descriptor);
+}
@@ -0,0 +1,219 @@
+/**
+ * @file driver/block/virtio/virtqueue.c
+ *
+ * Implements split virtqueues for legacy virtio PCI devices
+ *
+ * Part of P-OS driver library.
+ *
+ * @author Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * \li 17-10-2026 - Created
+ * \li 17-10-2026 - Added virtq_free
+ */
+
+#define CON_SRC "virtio"
+#include "kernel/console.h"
+#include <sys/errno.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arch/i386/x86.h"
+#include "driver/block/virtio/virtio.h"
+#include "kernel/physmm.h"
+#include "kernel/paging.h"
+
+/**
+ * Keep the compiler from reordering ring updates
+ *
+ * x86 does not reorder stores with other stores, so this is all that is
+ * needed to publish descriptors before the index that makes them visible.
+ */
+#define virtq_barrier()	asm volatile ( "" : : : "memory" )
+
+/**
+ * @brief Get the size of the queue memory for a queue
+ * @param size The number of descriptors
+ * @param used Receives the offset of the used ring
+ * @return The size in bytes
+ */
+static size_t virtq_mem_size( uint16_t size, size_t *used )
+{
+	size_t avail_end;
+
+	avail_end = sizeof( virtq_desc_t ) * size + sizeof( uint16_t ) * ( 3 + size );
+	*used = ( avail_end + VIRTQ_ALIGN - 1 ) & ~( VIRTQ_ALIGN - 1 );
+
+	return *used + ( ( sizeof( uint16_t ) * 3 + sizeof( virtq_used_elem_t ) * size +
+	                   VIRTQ_ALIGN - 1 ) & ~( VIRTQ_ALIGN - 1 ) );
+}
+
+/**
+ * @brief Set up a virtqueue and pass it to the device
+ *
+ * The device must be in the DRIVER state.
+ * @param vq The queue to initialize
+ * @param iobase The I/O base of the device
+ * @param index The queue number
+ * @return 0 on success, a valid errorcode on failure
+ */
+int virtq_init( virtq_t *vq, uint16_t iobase, uint16_t index )
+{
+	size_t mem_size, used_offset;
+	uint16_t n;
+
+	assert( vq != NULL );
+
+	vq->iobase = iobase;
+	vq->index  = index;
+
+	i386_outw( iobase + VIRTIO_PCI_QUEUE_SEL, index );
+	vq->size = i386_inw( iobase + VIRTIO_PCI_QUEUE_SIZE );
+	if ( vq->size == 0 )
+		return ENODEV;
+
+	mem_size = virtq_mem_size( vq->size, &used_offset );
+
+	/* Legacy devices need the whole queue physically contiguous */
+	for ( vq->order = 0; ( PAGE_SIZE << vq->order ) < mem_size; vq->order++ );
+	if ( vq->order > PHYSMM_MAX_ORDER )
+		return ENOMEM;
+
+	vq->phys = physmm_alloc_pages( vq->order );
+	if ( vq->phys == PHYSMM_NO_FRAME )
+		return ENOMEM;
+
+	vq->map = paging_map_phys_range( vq->phys, PAGE_SIZE << vq->order,
+	                                 PAGING_PAGE_FLAG_RW );
+	if ( !vq->map ) {
+		physmm_free_pages( vq->phys, vq->order );
+		return ENOMEM;
+	}
+
+	memset( vq->map->virt, 0, mem_size );
+
+	vq->desc  = vq->map->virt;
+	vq->avail = ( void * ) ( ( uintptr_t ) vq->map->virt +
+	                         sizeof( virtq_desc_t ) * vq->size );
+	vq->used  = ( void * ) ( ( uintptr_t ) vq->map->virt + used_offset );
+
+	/* Chain all descriptors on the free list */
+	for ( n = 0; n < vq->size; n++ )
+		vq->desc[ n ].next = n + 1;
+	vq->free_head = 0;
+	vq->num_free  = vq->size;
+	vq->last_used = 0;
+
+	i386_outl( iobase + VIRTIO_PCI_QUEUE_PFN, vq->phys / VIRTQ_ALIGN );
+
+	printf( CON_DEBUG, "queue %i: %i descriptors at %x",
+	        index, vq->size, vq->phys );
+
+	return 0;
+}
+
+/**
+ * @brief Take a virtqueue away from the device and free its memory
+ *
+ * The device must not be using the queue anymore, it must have been reset
+ * or not have been set to DRIVER_OK yet.
+ * @param vq The queue to free, set up by virtq_init
+ */
+void virtq_free( virtq_t *vq )
+{
+	assert( vq != NULL );
+
+	i386_outw( vq->iobase + VIRTIO_PCI_QUEUE_SEL, vq->index );
+	i386_outl( vq->iobase + VIRTIO_PCI_QUEUE_PFN, 0 );
+
+	paging_unmap_phys_range( vq->map );
+	physmm_free_pages( vq->phys, vq->order );
+	vq->map = NULL;
+}
+
+/**
+ * @brief Add a chain of buffers to the available ring
+ *
+ * The chain takes its descriptors from the head of the free list, so the
+ * head of the new chain is vq->free_head before the call. The device is not
+ * notified until virtq_kick is called.
+ * @param vq The queue to add to
+ * @param bufs The buffers, the device readable ones must come first
+ * @param count The number of buffers
+ * @return The head of the chain, or -1 if there are not enough descriptors
+ */
+int virtq_add( virtq_t *vq, const virtq_buf_t *bufs, int count )
+{
+	uint16_t head, n;
+	int i;
+
+	assert( count > 0 );
+
+	if ( count > vq->num_free )
+		return -1;
+
+	head = n = vq->free_head;
+	for ( i = 0; i < count; i++ ) {
+		vq->desc[ n ].addr  = bufs[ i ].addr;
+		vq->desc[ n ].len   = bufs[ i ].len;
+		vq->desc[ n ].flags = ( bufs[ i ].write ? VIRTQ_DESC_F_WRITE : 0 ) |
+		                      ( ( i + 1 < count ) ? VIRTQ_DESC_F_NEXT : 0 );
+		n = vq->desc[ n ].next;
+	}
+
+	vq->free_head = n;
+	vq->num_free -= count;
+
+	vq->avail->ring[ vq->avail->idx % vq->size ] = head;
+	virtq_barrier();
+	vq->avail->idx++;
+
+	return head;
+}
+
+/**
+ * @brief Notify the device of new buffers
+ * @param vq The queue to notify about
+ */
+void virtq_kick( virtq_t *vq )
+{
+	virtq_barrier();
+	if ( !( vq->used->flags & VIRTQ_USED_F_NO_NOTIFY ) )
+		i386_outw( vq->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vq->index );
+}
+
+/**
+ * @brief Take the next chain the device is done with from the used ring
+ *
+ * The descriptors of the chain are returned to the free list.
+ * @param vq The queue to operate on
+ * @param len If not NULL, receives the number of bytes the device wrote
+ * @return The head of the chain, or -1 if the device has not used any
+ */
+int virtq_get( virtq_t *vq, uint32_t *len )
+{
+	volatile virtq_used_elem_t *elem;
+	uint16_t head, n;
+
+	if ( vq->last_used == vq->used->idx )
+		return -1;
+	virtq_barrier();
+
+	elem = &vq->used->ring[ vq->last_used % vq->size ];
+	head = elem->id;
+	if ( len )
+		*len = elem->len;
+	vq->last_used++;
+
+	/* Return the chain to the free list */
+	n = head;
+	vq->num_free++;
+	while ( vq->desc[ n ].flags & VIRTQ_DESC_F_NEXT ) {
+		n = vq->desc[ n ].next;
+		vq->num_free++;
+	}
+	vq->desc[ n ].next = vq->free_head;
+	vq->free_head = head;
+
+	return head;
+}
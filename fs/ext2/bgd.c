@@ -3,16 +3,22 @@
  * 
  * Implements functions for manipulating block groups
  *
+ * The group descriptors are read once at mount time and kept in memory along
+ * with the bitmaps of the groups that have been allocated from, changes are
+ * written back by ext2_sync.
+ *
  * Part of P-OS kernel.
  *
  * Written by Peter Bosch <peterbosc@gmail.com>
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Keep group descriptors and bitmaps resident
  */
 
 #include <stdint.h>
 #include <assert.h>
+#include <string.h>
 
 #include <sys/errno.h>
 #include <sys/types.h>
@@ -22,33 +28,174 @@
 #include "kernel/device.h"
 #include "kernel/vfs.h"
 
-SFUNC(ext2_block_group_desc_t *, ext2_load_bgd, 
-									ext2_device_t *device, 
-									uint32_t bg_id)
+SVFUNC(ext2_load_groups, ext2_device_t *device)
 {
-	//TODO: Cache BGDs
-	ext2_block_group_desc_t *bgd;
-	off_t bgd_addr;	
-	aoff_t read_size;
+	ext2_block_group_desc_t *table;
+	aoff_t block_size, table_size, read_size;
+	uint32_t first_b, bg_id;
 	int status;
 
 	assert ( device != NULL );
 
-	bgd = heapmm_alloc(sizeof(ext2_block_group_desc_t));
-	if (!bgd)
-		THROW ( ENOMEM, 0 );
-
-	bgd_addr = (device->bgdt_block << (10 + device->superblock.block_size_enc)) + 
-			bg_id * sizeof(ext2_block_group_desc_t);
-	
-	status = device_block_read(device->dev_id, bgd_addr, bgd, sizeof(ext2_block_group_desc_t), &read_size);
-	
-	if (status || (read_size != sizeof(ext2_block_group_desc_t))) {
-		heapmm_free(bgd, sizeof(ext2_block_group_desc_t));
+	block_size = 1024 << device->superblock.block_size_enc;
+	first_b = device->superblock.block_size_enc ? 0 : 1;
+
+	device->group_count = ext2_divup(device->superblock.block_count - first_b,
+					 device->superblock.blocks_per_group);
+	device->bbm_size = ext2_divup(device->superblock.blocks_per_group,
+				      block_size * 8) * block_size;
+	device->ibm_size = ext2_divup(device->superblock.inodes_per_group,
+				      block_size * 8) * block_size;
+
+	device->groups = heapmm_alloc(device->group_count * sizeof(ext2_group_t));
+	if (!device->groups)
+		THROWV(ENOMEM);
+	memset(device->groups, 0, device->group_count * sizeof(ext2_group_t));
+
+	table_size = device->group_count * sizeof(ext2_block_group_desc_t);
+	table = heapmm_alloc(table_size);
+	if (!table) {
+		heapmm_free(device->groups, device->group_count * sizeof(ext2_group_t));
+		THROWV(ENOMEM);
+	}
+
+	/* Read the whole descriptor table at once */
+	status = device_block_read(device->dev_id,
+			device->bgdt_block << (10 + device->superblock.block_size_enc),
+			table, table_size, &read_size);
+	if (!status && read_size != table_size)
+		status = EIO;
+
+	if (status) {
+		heapmm_free(table, table_size);
+		heapmm_free(device->groups, device->group_count * sizeof(ext2_group_t));
+		THROWV(status);
+	}
+
+	for (bg_id = 0; bg_id < device->group_count; bg_id++)
+		device->groups[bg_id].desc = table[bg_id];
+
+	heapmm_free(table, table_size);
+
+	RETURNV;
+}
+
+/**
+ * Loads a bitmap into memory if it is not resident yet
+ */
+static SFUNC(uint32_t *, ext2_load_bitmap,
+					ext2_device_t *device,
+					uint32_t block,
+					aoff_t size,
+					uint32_t **slot)
+{
+	uint32_t *map;
+	aoff_t rsize;
+	int status;
+
+	if (*slot)
+		RETURN(*slot);
+
+	map = heapmm_alloc(size);
+	if (!map)
+		THROW(ENOMEM, NULL);
+
+	status = ext2_read_block(device, block, 0, map, size, &rsize);
+	if (status) {
+		heapmm_free(map, size);
 		THROW(status, NULL);
 	}
 
-	RETURN(bgd);
+	/* Another task may have loaded it while we were reading */
+	if (*slot) {
+		heapmm_free(map, size);
+		RETURN(*slot);
+	}
+
+	*slot = map;
+	RETURN(map);
+}
+
+SFUNC(uint32_t *, ext2_load_block_bitmap, ext2_device_t *device, uint32_t bg_id)
+{
+	ext2_group_t *group;
+
+	assert ( device != NULL );
+	assert ( bg_id < device->group_count );
+
+	group = &device->groups[bg_id];
+	CHAINRET(ext2_load_bitmap, device, group->desc.block_bitmap,
+		 device->bbm_size, &group->block_bitmap);
+}
+
+SFUNC(uint32_t *, ext2_load_inode_bitmap, ext2_device_t *device, uint32_t bg_id)
+{
+	ext2_group_t *group;
+
+	assert ( device != NULL );
+	assert ( bg_id < device->group_count );
+
+	group = &device->groups[bg_id];
+	CHAINRET(ext2_load_bitmap, device, group->desc.inode_bitmap,
+		 device->ibm_size, &group->inode_bitmap);
+}
+
+SVFUNC(ext2_sync_groups, ext2_device_t *device)
+{
+	ext2_group_t *group;
+	uint32_t bg_id;
+	off_t bgd_addr;
+	aoff_t rsize;
+	int status, error = 0;
+
+	assert ( device != NULL );
+
+	for (bg_id = 0; bg_id < device->group_count; bg_id++) {
+		group = &device->groups[bg_id];
+
+		if (group->flags & EXT2_GROUP_DIRTY_BBM) {
+			status = ext2_write_block(device, group->desc.block_bitmap, 0,
+						  group->block_bitmap, device->bbm_size, &rsize);
+			if (status)
+				error = status;
+			else
+				group->flags &= ~EXT2_GROUP_DIRTY_BBM;
+		}
+
+		if (group->flags & EXT2_GROUP_DIRTY_IBM) {
+			status = ext2_write_block(device, group->desc.inode_bitmap, 0,
+						  group->inode_bitmap, device->ibm_size, &rsize);
+			if (status)
+				error = status;
+			else
+				group->flags &= ~EXT2_GROUP_DIRTY_IBM;
+		}
+
+		if (group->flags & EXT2_GROUP_DIRTY_DESC) {
+			bgd_addr = (device->bgdt_block << (10 + device->superblock.block_size_enc)) +
+					bg_id * sizeof(ext2_block_group_desc_t);
+			status = device_block_write(device->dev_id, bgd_addr, &group->desc,
+						    sizeof(ext2_block_group_desc_t), &rsize);
+			if (status)
+				error = status;
+			else
+				group->flags &= ~EXT2_GROUP_DIRTY_DESC;
+		}
+	}
+
+	THROWV(error);
+}
+
+SFUNC(ext2_block_group_desc_t *, ext2_load_bgd, 
+									ext2_device_t *device, 
+									uint32_t bg_id)
+{
+	assert ( device != NULL );
+
+	if (bg_id >= device->group_count)
+		THROW(EINVAL, NULL);
+
+	RETURN(&device->groups[bg_id].desc);
 }
 
 SVFUNC(ext2_store_bgd, 
@@ -56,27 +203,23 @@ SVFUNC(ext2_store_bgd,
 									uint32_t bg_id, 
 									ext2_block_group_desc_t *bgd)
 {
-	//TODO: Cache BGDs
-	off_t bgd_addr;	
-	aoff_t read_size;
-	int status;
+	ext2_group_t *group;
 
 	assert ( device != NULL );
+	assert ( bg_id < device->group_count );
 
-	bgd_addr = (device->bgdt_block << (10 + device->superblock.block_size_enc)) + 
-			bg_id * sizeof(ext2_block_group_desc_t);
-	
-	status = device_block_write(device->dev_id, bgd_addr, bgd, sizeof(ext2_block_group_desc_t), &read_size);
-	
-	if (status || (read_size != sizeof(ext2_block_group_desc_t))) {
-		THROWV(status);
-	}
+	group = &device->groups[bg_id];
+	if (bgd != &group->desc)
+		group->desc = *bgd;
+
+	/* Written back on the next sync */
+	group->flags |= EXT2_GROUP_DIRTY_DESC;
 
 	RETURNV;
 }
 
 void ext2_free_bgd(	__attribute__((__unused__)) ext2_device_t *device, 
-					ext2_block_group_desc_t *bgd)
+					__attribute__((__unused__)) ext2_block_group_desc_t *bgd)
 {
-	heapmm_free(bgd, sizeof(ext2_block_group_desc_t));
+	/* Descriptors stay resident */
 }
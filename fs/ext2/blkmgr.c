@@ -9,6 +9,8 @@
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Allocate from resident bitmaps, starting at a goal block
+ * 17-10-2026 - Added per-inode preallocation
  */
 
 #include <stdint.h>
@@ -23,21 +25,15 @@
 #include "kernel/vfs.h"
 #include "kernel/earlycon.h"
 
-
 SVFUNC(ext2_free_block, ext2_device_t *device, uint32_t block_id)
 {
 	uint32_t b_count = device->superblock.block_count;
-	uint32_t bgrp_id = 0;
 	uint32_t bgrp_bcnt = device->superblock.blocks_per_group;
-	uint32_t bm_block_size = 256u << device->superblock.block_size_enc;
-	uint32_t bm_block_bcnt = bm_block_size * 32;
-	uint32_t bm_id;
-	uint32_t block_map[bm_block_size];
 	uint32_t first_b = device->superblock.block_size_enc ? 0 : 1;
-	uint32_t idx ,nb;
-	aoff_t rsize;
+	uint32_t bgrp_id, idx;
+	uint32_t *block_map;
+	ext2_group_t *group;
 	int status;
-	ext2_block_group_desc_t *bgd;
 
 	assert ( device != NULL );
 	assert (block_id < b_count);
@@ -45,158 +41,212 @@ SVFUNC(ext2_free_block, ext2_device_t *device, uint32_t block_id)
 
 	bgrp_id = (block_id - first_b) / bgrp_bcnt;
 	idx = block_id - first_b - bgrp_id * bgrp_bcnt;
-	bm_id = idx / bm_block_bcnt;
-	idx -= bm_id * bm_block_bcnt;
-	nb = idx % 32;
-	idx -= nb;
-	idx /= 32;
 
-	status = ext2_load_bgd(device, bgrp_id, &bgd);
+	status = ext2_load_block_bitmap(device, bgrp_id, &block_map);
 	if (status)
 		THROWV(status);
 
-	status = ext2_read_block(device, bgd->block_bitmap + bm_id, 0, block_map, bm_block_size * 4, &rsize);
-	if (status)
-		THROWV(status);
+	if (!EXT2_BITMAP_GET(block_map[idx / 32], idx % 32)) {
+		debugcon_printf("ext2: freeing free block %i!\n", block_id);
+		RETURNV;
+	}
 
-	EXT2_BITMAP_CLR(block_map[idx], nb);
+	EXT2_BITMAP_CLR(block_map[idx / 32], idx % 32);
 
-	status = ext2_write_block(device, bgd->block_bitmap + bm_id, 0, block_map, bm_block_size * 4, &rsize);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (block bitmap), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
-		THROWV(status);
-	}
+	group = &device->groups[bgrp_id];
+	group->desc.free_block_count++;
+	group->flags |= EXT2_GROUP_DIRTY_BBM | EXT2_GROUP_DIRTY_DESC;
 
-	bgd->free_block_count++;
+	device->superblock.free_block_count++;
 
-	status = ext2_store_bgd(device, bgrp_id, bgd);
+	RETURNV;
+}
+
+/**
+ * Fills a newly allocated block with zeroes
+ */
+static SVFUNC(ext2_clear_block, ext2_device_t *device, uint32_t block_id)
+{
+	uint32_t bm_block_size = 256u << device->superblock.block_size_enc;
+	uint32_t zero_block[bm_block_size];
+	aoff_t rsize;
+	int status;
+
+	memset(zero_block, 0, bm_block_size * 4);
+
+	status = ext2_write_block(device, block_id, 0, zero_block, bm_block_size * 4, &rsize);
 	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (BGD), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
+		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (block clear)!");
 		ext2_handle_error(device);
 		THROWV(status);
 	}
-	ext2_free_bgd(device, bgd);
-
-	device->superblock.free_block_count++;
 
 	RETURNV;
 }
 
-SFUNC(uint32_t, ext2_alloc_block, ext2_device_t *device, uint32_t start)
+/**
+ * Allocates a block, preferring the first free block at or after goal.
+ * The search continues through the following groups and wraps around to the
+ * part of the goal group before the goal.
+ */
+SFUNC(uint32_t, ext2_alloc_block, ext2_device_t *device, uint32_t goal)
 {
 	uint32_t b_count = device->superblock.block_count;
-	uint32_t block_id = start;
-	uint32_t bgrp_id = 0;
 	uint32_t bgrp_bcnt = device->superblock.blocks_per_group;
-	uint32_t bgrp_count = ext2_divup(b_count,bgrp_bcnt);//DIVUP
-	uint32_t bm_block_size = 256u << device->superblock.block_size_enc;
-	uint32_t bm_block_bcnt = bm_block_size * 32;
-	uint32_t bgrp_bmcnt = ext2_divup(bgrp_bcnt,bm_block_bcnt);//DIVUP
-	uint32_t bm_id;
-	uint32_t block_map[bm_block_size];
 	uint32_t first_b = device->superblock.block_size_enc ? 0 : 1;
-	uint32_t idx ,nb;
-	aoff_t rsize;
+	uint32_t goal_grp, goal_idx, bgrp_id, g_bcnt, idx, n;
+	uint32_t block_id;
+	uint32_t *block_map;
+	ext2_group_t *group;
 	int status;
-	ext2_block_group_desc_t *bgd;
 
 	assert ( device != NULL );
-	assert (start < b_count);
 
-	if (start == 0)
-		block_id = first_b;
+	if (goal < first_b || goal >= b_count)
+		goal = first_b;
 
-	bgrp_id = (block_id - first_b) / bgrp_bcnt;
-	idx = block_id - first_b - bgrp_id * bgrp_bcnt;
-	bm_id = idx / bm_block_bcnt;
-	idx -= bm_id * bm_block_bcnt;
-	nb = idx % 32;
-	idx -= nb;
-	idx /= 32;
-	for (; bgrp_id < bgrp_count; bgrp_id++) {
-		status = ext2_load_bgd(device, bgrp_id, &bgd);
-		if (status)
-			THROW(status, 0);
+	goal_grp = (goal - first_b) / bgrp_bcnt;
+	goal_idx = (goal - first_b) % bgrp_bcnt;
 
-		if (bgd->free_block_count) {
-			for (; bm_id < bgrp_bmcnt; bm_id++) {
-				status = ext2_read_block(device, bgd->block_bitmap + bm_id, 0, block_map, bm_block_size * 4, &rsize);
-				if (status)
-					THROW(status, 0);
-				for (; idx < bm_block_size; idx++) {
-					if (block_map[idx] != 0xFFFFFFFF) {
-						for (; nb < 32; nb++)
-							if (!EXT2_BITMAP_GET(block_map[idx], nb))
-								goto found_it;
-					}
-					nb = 0;
-				}
-				idx = 0;
-			}
-		}
-		bm_id = 0;
-		ext2_free_bgd(device, bgd);
-	}
-	bgrp_id = 0;
-	for (; bgrp_id < bgrp_count; bgrp_id++) {
-		status = ext2_load_bgd(device, bgrp_id, &bgd);
+	for (n = 0; n <= device->group_count; n++) {
+		bgrp_id = (goal_grp + n) % device->group_count;
+		group = &device->groups[bgrp_id];
+
+		if (!group->desc.free_block_count)
+			continue;
+
+		status = ext2_load_block_bitmap(device, bgrp_id, &block_map);
 		if (status)
 			THROW(status, 0);
 
-		if (bgd->free_block_count) {
-			for (; bm_id < bgrp_bmcnt; bm_id++) {
-				status = ext2_read_block(device, bgd->block_bitmap + bm_id, 0, block_map, bm_block_size * 4, &rsize);
-				if (status)
-					THROW(status, 0);
-				for (; idx < bm_block_size; idx++) {
-					if (block_map[idx] != 0xFFFFFFFF) {
-						for (; nb < 32; nb++)
-							if (!EXT2_BITMAP_GET(block_map[idx], nb))
-								goto found_it;
-					}
-					nb = 0;
-				}
-				idx = 0;
-			}
-		}
-		bm_id = 0;
-		ext2_free_bgd(device, bgd);
+		/* The last group may be shorter */
+		g_bcnt = b_count - first_b - bgrp_id * bgrp_bcnt;
+		if (g_bcnt > bgrp_bcnt)
+			g_bcnt = bgrp_bcnt;
+
+		idx = ext2_bitmap_find_zero(block_map, n ? 0 : goal_idx, g_bcnt);
+		if (idx < g_bcnt)
+			goto found_it;
 	}
 
 	THROW(ENOSPC, 0);
 found_it:
 
-	block_id = nb + idx * 32 + bm_id * bm_block_bcnt + bgrp_id * bgrp_bcnt + first_b;
+	block_id = idx + bgrp_id * bgrp_bcnt + first_b;
 
-	EXT2_BITMAP_SET(block_map[idx], nb);
-	status = ext2_write_block(device, bgd->block_bitmap + bm_id, 0, block_map, bm_block_size * 4, &rsize);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (block bitmap), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
-		THROW(status, 0);
-	}
+	EXT2_BITMAP_SET(block_map[idx / 32], idx % 32);
 
-	bgd->free_block_count--;
+	group->desc.free_block_count--;
+	group->flags |= EXT2_GROUP_DIRTY_BBM | EXT2_GROUP_DIRTY_DESC;
 
-	status = ext2_store_bgd(device, bgrp_id, bgd);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (BGD), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
+	device->superblock.free_block_count--;
+
+	status = ext2_clear_block(device, block_id);
+	if (status)
 		THROW(status, 0);
+
+	RETURN(block_id);
+}
+
+/**
+ * Releases the blocks reserved for a file
+ */
+void ext2_discard_prealloc(ext2_device_t *device, ext2_vinode_t *inode)
+{
+	uint32_t bgrp_bcnt = device->superblock.blocks_per_group;
+	uint32_t first_b = device->superblock.block_size_enc ? 0 : 1;
+	uint32_t bgrp_id, idx, n;
+	ext2_group_t *group;
+
+	if (!inode->prealloc_count)
+		return;
+
+	/* A window never crosses a group boundary */
+	bgrp_id = (inode->prealloc_start - first_b) / bgrp_bcnt;
+	idx = inode->prealloc_start - first_b - bgrp_id * bgrp_bcnt;
+	group = &device->groups[bgrp_id];
+
+	for (n = 0; n < inode->prealloc_count; n++, idx++)
+		EXT2_BITMAP_CLR(group->block_bitmap[idx / 32], idx % 32);
+
+	group->desc.free_block_count += inode->prealloc_count;
+	group->flags |= EXT2_GROUP_DIRTY_BBM | EXT2_GROUP_DIRTY_DESC;
+
+	device->superblock.free_block_count += inode->prealloc_count;
+
+	inode->prealloc_count = 0;
+}
+
+/**
+ * Reserves the free blocks directly following a newly allocated block
+ */
+static void ext2_reserve_prealloc(ext2_device_t *device, ext2_vinode_t *inode, uint32_t block_id)
+{
+	uint32_t b_count = device->superblock.block_count;
+	uint32_t bgrp_bcnt = device->superblock.blocks_per_group;
+	uint32_t first_b = device->superblock.block_size_enc ? 0 : 1;
+	uint32_t bgrp_id, idx, g_bcnt, n;
+	ext2_group_t *group;
+
+	bgrp_id = (block_id - first_b) / bgrp_bcnt;
+	idx = block_id - first_b - bgrp_id * bgrp_bcnt + 1;
+	group = &device->groups[bgrp_id];
+
+	g_bcnt = b_count - first_b - bgrp_id * bgrp_bcnt;
+	if (g_bcnt > bgrp_bcnt)
+		g_bcnt = bgrp_bcnt;
+
+	for (n = 0; n < EXT2_PREALLOC_BLOCKS - 1 && idx < g_bcnt; n++, idx++) {
+		if (EXT2_BITMAP_GET(group->block_bitmap[idx / 32], idx % 32))
+			break;
+		EXT2_BITMAP_SET(group->block_bitmap[idx / 32], idx % 32);
 	}
-	ext2_free_bgd(device, bgd);
 
-	device->superblock.free_block_count--;
+	if (!n)
+		return;
 
-	memset(block_map, 0, bm_block_size * 4);
+	group->desc.free_block_count -= n;
+	group->flags |= EXT2_GROUP_DIRTY_BBM | EXT2_GROUP_DIRTY_DESC;
 
-	status = ext2_write_block(device, block_id, 0, block_map, bm_block_size * 4, &rsize);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (block clear)!");
-		ext2_handle_error(device);
-		THROW(status, 0);
+	device->superblock.free_block_count -= n;
+
+	inode->prealloc_start = block_id + 1;
+	inode->prealloc_count = n;
+}
+
+/**
+ * Allocates a data block for a file. Blocks are taken from the window
+ * reserved for the file while the file grows into it, otherwise the window
+ * is released and a new one is reserved after the newly allocated block.
+ * Files that grow by small appends thus stay contiguous even when other
+ * files grow at the same time.
+ */
+SFUNC(uint32_t, ext2_alloc_file_block, ext2_device_t *device, ext2_vinode_t *inode, uint32_t goal)
+{
+	uint32_t block_id;
+	int status;
+
+	assert ( device != NULL );
+	assert ( inode != NULL );
+
+	if (inode->prealloc_count && goal == inode->prealloc_start) {
+		block_id = inode->prealloc_start++;
+		inode->prealloc_count--;
+
+		status = ext2_clear_block(device, block_id);
+		if (status)
+			THROW(status, 0);
+
+		RETURN(block_id);
 	}
 
+	ext2_discard_prealloc(device, inode);
+
+	status = ext2_alloc_block(device, goal, &block_id);
+	if (status)
+		THROW(status, 0);
+
+	ext2_reserve_prealloc(device, inode, block_id);
+
 	RETURN(block_id);
 }
@@ -9,6 +9,8 @@
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Use the hashed index when a directory has one
+ * 17-10-2026 - Parse directories a block at a time
  */
 
 #include <stdint.h>
@@ -23,203 +25,289 @@
 #include "kernel/vfs.h"
 #include "kernel/streams.h"
 
-SVFUNC( ext2_unlink, inode_t *_inode, const char *name )
+/**
+ * Reads a whole directory block
+ * @param dir The directory to read from
+ * @param block The index of the block within the directory
+ * @param buf A buffer of one block to read into
+ */
+SVFUNC( ext2_dir_read_block, inode_t *dir, uint32_t block, void *buf )
 {
+	ext2_device_t *device = (ext2_device_t *) dir->device;
+	aoff_t block_size = 1024 << device->superblock.block_size_enc;
+	aoff_t nread;
+	int status;
 
-	size_t namelen;
-	ext2_dirent_t dirent;	
-	ext2_dirent_t f_dirent;	
-	
+	status = ext2_read_inode(dir, buf, block * block_size, block_size, &nread);
+	if (status || (nread != block_size))
+		THROWV(status ? status : EIO);
+
+	RETURNV;
+}
+
+/**
+ * Writes a whole directory block
+ * @param dir The directory to write to
+ * @param block The index of the block within the directory
+ * @param buf The new contents of the block
+ */
+SVFUNC( ext2_dir_write_block, inode_t *dir, uint32_t block, const void *buf )
+{
+	ext2_device_t *device = (ext2_device_t *) dir->device;
+	aoff_t block_size = 1024 << device->superblock.block_size_enc;
+	aoff_t nwritten;
 	int status;
-	char *namebuf;
 
-	aoff_t nread, pos, dsize, dpos = 0, lpos;
+	status = ext2_write_inode(dir, buf, block * block_size, block_size, &nwritten);
+	if (status || (nwritten != block_size))
+		THROWV(status ? status : EIO);
 
-	assert( _inode != NULL );
-	assert( name != NULL );
+	RETURNV;
+}
 
-	dsize = _inode->size;
+/**
+ * Returns the entry at an offset in a directory block
+ * @return The entry, or NULL at the end of the block or if it is corrupt
+ */
+ext2_dirent_t *ext2_dir_entry( void *block, aoff_t block_size, aoff_t pos )
+{
+	ext2_dirent_t *de;
 
-	namelen = strlen(name);
+	if ((pos + sizeof(ext2_dirent_t)) > block_size)
+		return NULL;
 
-	namebuf = heapmm_alloc(namelen + 1);
-	if (!namebuf)
-		THROWV(ENOMEM);
+	de = (ext2_dirent_t *) ((uint8_t *) block + pos);
 
-	for (pos = 0; pos < dsize; pos += f_dirent.rec_len) {
-		status = ext2_read_inode(_inode, &f_dirent, pos, sizeof(ext2_dirent_t), &nread);
-		if (status || (nread != sizeof(ext2_dirent_t))) {
-			heapmm_free( namebuf, namelen + 1 );
-			THROWV(status ? status : EIO);
-		}
+	if ((de->rec_len < sizeof(ext2_dirent_t)) ||
+	    ((pos + de->rec_len) > block_size) ||
+	    ((sizeof(ext2_dirent_t) + de->name_len) > de->rec_len))
+		return NULL;
 
-		if ( f_dirent.name_len != namelen ) {
-			lpos = pos;
-			dirent = f_dirent;
-			continue;
-		}
+	return de;
+}
 
-		ext2_read_inode(_inode, namebuf, pos + sizeof(ext2_dirent_t), f_dirent.name_len, &nread);
-		if (status || (nread != f_dirent.name_len)) {
-			heapmm_free( namebuf, namelen + 1 );
-			THROWV(status ? status : EIO);
+/**
+ * Looks for a name in a directory block
+ * @param prev If not NULL, receives the offset of the preceding entry or -1
+ * @return The offset of the entry, or -1 if it is not in the block
+ */
+int ext2_dir_find_in_block( void *block, aoff_t block_size,
+			    const char *name, size_t namelen, int *prev )
+{
+	ext2_dirent_t *de;
+	aoff_t pos;
+	int last = -1;
+
+	for (pos = 0; (de = ext2_dir_entry(block, block_size, pos)) != NULL; pos += de->rec_len) {
+		if (de->inode && (de->name_len == namelen) &&
+		    !strncmp((const char *) (de + 1), name, namelen)) {
+			if (prev)
+				*prev = last;
+			return pos;
 		}
+		last = pos;
+	}
+
+	return -1;
+}
+
+/**
+ * Adds an entry to a directory block if it has room for it
+ * @return 0 on success, -1 if the entry does not fit
+ */
+int ext2_dir_add_to_block( void *block, aoff_t block_size,
+			   const char *name, size_t namelen, ino_t ino_id )
+{
+	ext2_dirent_t *de, *nde;
+	aoff_t pos, used, reclen;
+
+	reclen = ext2_roundup(sizeof(ext2_dirent_t) + namelen, 4);
+
+	for (pos = 0; (de = ext2_dir_entry(block, block_size, pos)) != NULL; pos += de->rec_len) {
+		used = (de->inode && de->name_len) ?
+			ext2_roundup(sizeof(ext2_dirent_t) + de->name_len, 4) : 0;
 
-		namebuf[namelen] = 0;
-		if ( strcmp( namebuf, name ) ) {
-			lpos = pos;
-			dirent = f_dirent;
+		if ((de->rec_len - used) < reclen)
 			continue;
-		}
 
-		/* Found the dirent to delete */
-		heapmm_free( namebuf, namelen + 1 );
-		
-		if ( pos != 0 ) {
-			/* Not the first dirent, extend the previous one */
-			dirent.rec_len += f_dirent.rec_len;
-			ext2_write_inode(_inode, &dirent, lpos, sizeof(ext2_dirent_t), &nread);
-			if (status || (nread != sizeof(ext2_dirent_t)))
-				THROWV(status ? status : EIO);
-			RETURNV;
-
-		} else {
-			dpos = f_dirent.rec_len;
-			break;
+		if (used) {
+			/* Split the unused space off the entry */
+			nde = (ext2_dirent_t *) ((uint8_t *) de + used);
+			nde->rec_len = de->rec_len - used;
+			de->rec_len = used;
+			de = nde;
 		}
-		
+
+		de->inode = ino_id;
+		de->name_len = namelen;
+		//TODO: Set file type
+		de->file_type = EXT2_FT_UNKNOWN;
+		memcpy(de + 1, name, namelen);
+		return 0;
 	}
 
-	if ( !dpos ) {
-		heapmm_free( namebuf, namelen + 1 );
-		THROWV(ENOENT);
+	return -1;
+}
+
+/**
+ * Removes the entry at pos from a directory block
+ * @param prev The offset of the preceding entry, or -1 if it is the first
+ */
+void ext2_dir_remove_from_block( void *block, int pos, int prev )
+{
+	ext2_dirent_t *de = (ext2_dirent_t *) ((uint8_t *) block + pos);
+
+	if (prev >= 0) {
+		/* Not the first dirent, extend the previous one */
+		((ext2_dirent_t *) ((uint8_t *) block + prev))->rec_len += de->rec_len;
+	} else {
+		/* First dirent, mark it unused */
+		de->inode = 0;
 	}
+}
 
-	/* First dirent, move next one */
-	
-	ext2_read_inode(_inode, &dirent, dpos, sizeof(ext2_dirent_t), &nread);
-	if (status || (nread != sizeof(ext2_dirent_t)))
-		THROWV(status ? status : EIO);
+/**
+ * Fills a VFS directory entry from an on-disk one
+ */
+void ext2_dir_fill_dirent( inode_t *dir, sys_dirent_t *dirent, const ext2_dirent_t *de )
+{
+	memcpy(dirent->d_name, de + 1, de->name_len);
+	dirent->d_name[de->name_len] = 0;
+	dirent->d_ino = de->inode;
+	dirent->d_dev = dir->device_id;
+	dirent->d_reclen = 11 + de->name_len;
+}
 
-	namelen = dirent.name_len;
-	namebuf = heapmm_alloc(namelen + 1);
-	if (!namebuf)
-		THROWV(ENOMEM);
+SVFUNC( ext2_unlink, inode_t *_inode, const char *name )
+{
+	ext2_device_t *device;
+	size_t namelen;
+	uint8_t *buf;
+	uint32_t block, nblocks;
+	aoff_t block_size;
+	int status = 0, pos, prev;
 
-	dirent.rec_len += f_dirent.rec_len;
+	assert( _inode != NULL );
+	assert( name != NULL );
 
-	ext2_write_inode(_inode, &dirent, 0, sizeof(ext2_dirent_t), &nread);
-	if (status || (nread != sizeof(ext2_dirent_t))) {
-		heapmm_free( namebuf, namelen + 1 );
-		THROWV(status ? status : EIO);
+	if ( ext2_dx_indexed( _inode ) ) {
+		status = ext2_dx_unlink( _inode, name );
+		if ( status != ENOTSUP )
+			THROWV( status );
+		/* The index can not be maintained, fall back to a linear directory */
+		((ext2_vinode_t *) _inode)->inode.flags &= ~EXT2_INDEX_FL;
 	}
-	
-	ext2_read_inode(_inode, namebuf, dpos + sizeof(ext2_dirent_t), namelen, &nread);
-	if (status || (nread != namelen)) {
-		heapmm_free( namebuf, namelen + 1 );
-		THROWV(status ? status : EIO);
-	}
-	
-	ext2_write_inode(_inode, namebuf, sizeof(ext2_dirent_t), namelen, &nread);
-	if (status || (nread != namelen)) {
-		heapmm_free( namebuf, namelen + 1 );
-		THROWV(status ? status : EIO);
+
+	device = (ext2_device_t *) _inode->device;
+	block_size = 1024 << device->superblock.block_size_enc;
+	nblocks = _inode->size / block_size;
+
+	namelen = strlen(name);
+
+	buf = heapmm_alloc(block_size);
+	if (!buf)
+		THROWV(ENOMEM);
+
+	for (block = 0; block < nblocks; block++) {
+		status = ext2_dir_read_block(_inode, block, buf);
+		if (status)
+			break;
+
+		pos = ext2_dir_find_in_block(buf, block_size, name, namelen, &prev);
+		if (pos < 0)
+			continue;
+
+		/* Found the dirent to delete */
+		ext2_dir_remove_from_block(buf, pos, prev);
+
+		status = ext2_dir_write_block(_inode, block, buf);
+		break;
 	}
-	heapmm_free( namebuf, namelen + 1 );
 
+	if (block == nblocks)
+		status = ENOENT;
+
+	heapmm_free(buf, block_size);
 
-	RETURNV;
+	THROWV(status);
 }
 
 SVFUNC( ext2_link, inode_t *_inode, const char *name, ino_t ino_id)
 {
 	ext2_device_t *device;
-
-	size_t reclen,namelen, f_reclen;
-	ext2_dirent_t dirent;	
-	ext2_dirent_t f_dirent;	
-	
-	int status, m = 0;
-
-	aoff_t split_offset, hole_offset, nread, pos, dsize, hole_size;
+	size_t namelen;
+	uint8_t *buf;
+	uint32_t block, nblocks;
+	aoff_t block_size;
+	int status;
 
 	assert( _inode != NULL );
 	assert( name != NULL );
 
 	device = (ext2_device_t *) _inode->device;
 
-	dsize = _inode->size;
+	if ( ext2_dx_indexed( _inode ) ) {
+		status = ext2_dx_link( _inode, name, ino_id );
+		if ( status != ENOTSUP )
+			THROWV( status );
+		/* The index can not be maintained, fall back to a linear directory */
+		((ext2_vinode_t *) _inode)->inode.flags &= ~EXT2_INDEX_FL;
+	}
+
+	block_size = 1024 << device->superblock.block_size_enc;
+	nblocks = _inode->size / block_size;
 
 	namelen = strlen(name);
-	reclen = ext2_roundup(sizeof(ext2_dirent_t) + namelen, 4);
 
-	split_offset = 0;
+	buf = heapmm_alloc(block_size);
+	if (!buf)
+		THROWV(ENOMEM);
 
-	for (pos = 0; pos < dsize; pos += f_dirent.rec_len) {
-		status = ext2_read_inode(_inode, &f_dirent, pos, sizeof(ext2_dirent_t), &nread);
-		if (status || (nread != sizeof(ext2_dirent_t)))
-			THROWV(status ? status : EIO);
-		
-		f_reclen = ext2_roundup (sizeof(ext2_dirent_t) + f_dirent.name_len, 4);
-		
-		if ((((!f_dirent.inode) || (!f_dirent.name_len))) && (f_dirent.rec_len >= reclen)) {
-			hole_offset = pos;
-			hole_size = f_dirent.rec_len;
-			m = 1;
-			break;
-		} else if ((f_dirent.rec_len - f_reclen) >= reclen) {
-			split_offset = pos;
-			hole_offset = pos + f_reclen;
-			hole_size = f_dirent.rec_len - f_reclen;
-			m = 2;
-			break;
+	for (block = 0; block < nblocks; block++) {
+		status = ext2_dir_read_block(_inode, block, buf);
+		if (status)
+			goto done;
+
+		if (!ext2_dir_add_to_block(buf, block_size, name, namelen, ino_id)) {
+			status = ext2_dir_write_block(_inode, block, buf);
+			goto done;
 		}
-		split_offset = pos;
 	}
 
-	if (m == 0) {
- 		//Append new block to the end of the file, split_offset contains the offset of the last dirent
-		hole_size = 1024 << device->superblock.block_size_enc;
-		hole_offset = pos;
-		_inode->size += hole_size;
+	if (nblocks == 1 &&
+	    (device->superblock.optional_features & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+		/* The first block is full, index the directory instead of growing it */
+		status = ext2_dx_create(_inode);
+		if (status == 0)
+			status = ext2_dx_link(_inode, name, ino_id);
+		if (status != ENOTSUP)
+			goto done;
 	}
 
-	dirent.rec_len = hole_size;
-	dirent.name_len = namelen;
-	dirent.inode = ino_id;
-	//TODO: Set file type
-	dirent.file_type = EXT2_FT_UNKNOWN;
-	
-	status = ext2_write_inode(_inode, name, hole_offset + sizeof(ext2_dirent_t), namelen, &nread);
-	if (status || (nread != namelen))
-		THROWV(status ? status : EIO);
-	
-	status = ext2_write_inode(_inode, &dirent, hole_offset, sizeof(ext2_dirent_t), &nread);
-	if (status || (nread != sizeof(ext2_dirent_t)))
-		THROWV(status ? status : EIO);
-	
-	if (m == 2){
-		f_dirent.rec_len = hole_offset - split_offset;
+	//Append new block to the end of the file
+	memset(buf, 0, block_size);
+	((ext2_dirent_t *) buf)->rec_len = block_size;
+	ext2_dir_add_to_block(buf, block_size, name, namelen, ino_id);
 
-		status = ext2_write_inode(_inode, &f_dirent, split_offset, sizeof(ext2_dirent_t), &nread);
-		if (status || (nread != sizeof(ext2_dirent_t)))
-			THROWV(status ? status : EIO);
-	}
+	_inode->size += block_size;
 
-	RETURNV;
-	
+	status = ext2_dir_write_block(_inode, nblocks, buf);
+
+done:
+	heapmm_free(buf, block_size);
+
+	THROWV(status);
 }
 
 SFUNC(aoff_t, ext2_readdir, inode_t *_inode, void *_buffer, aoff_t f_offset, aoff_t length)
 {///XXX: Dependent on : sizeof(vfs_dirent_t) == sizeof(ext2_dirent_t)
-	int status;
-
+	ext2_device_t *device;
 	ext2_dirent_t *dirent;
-	uint8_t *name;
 	uint8_t *buffer= _buffer;
-
+	uint8_t *block;
 	dirent_t *vfs_dir;
-	aoff_t pos, inode_nread;
+	aoff_t pos, in_blk, block_size;
+	int status;
 
 	assert( _inode != NULL );
 	assert( _buffer != NULL );
@@ -230,134 +318,175 @@ SFUNC(aoff_t, ext2_readdir, inode_t *_inode, void *_buffer, aoff_t f_offset, aof
 	if ((f_offset + length) > _inode->size)
 		length = _inode->size - f_offset;
 
-	dirent = heapmm_alloc(sizeof(ext2_dirent_t));
+	device = (ext2_device_t *) _inode->device;
+	block_size = 1024 << device->superblock.block_size_enc;
+
+	block = heapmm_alloc(block_size);
 	
-	if (!dirent)
+	if (!block)
 		THROW(ENOMEM, 0);
 
 	for (pos = 0; pos < length; pos += dirent->rec_len) {
+		in_blk = (pos + f_offset) % block_size;
+
+		if (pos == 0 || in_blk == 0) {
+			status = ext2_dir_read_block(_inode, (pos + f_offset) / block_size, block);
+			if (status) {
+				heapmm_free(block, block_size);
+				THROW(status, 0);
+			}
+		}
 
-		status = ext2_read_inode(_inode, dirent, pos + f_offset, sizeof(ext2_dirent_t), &inode_nread);
-		if (status || (inode_nread != sizeof(ext2_dirent_t))) {
-			heapmm_free(dirent, sizeof(ext2_dirent_t));
-			THROW(status ? status : EIO, 0);
+		dirent = ext2_dir_entry(block, block_size, in_blk);
+		if (!dirent) {
+			heapmm_free(block, block_size);
+			THROW(EIO, 0);
 		}
 
 		if ((dirent->name_len + pos + 9) > length){
-			heapmm_free(dirent, sizeof(ext2_dirent_t));
+			heapmm_free(block, block_size);
 			RETURN(pos);
 		}
 	
 		vfs_dir = (dirent_t *)&buffer[pos];
 
-		name = (uint8_t *) vfs_dir->name;
-		
-		status = ext2_read_inode(_inode, name, pos + f_offset + sizeof(ext2_dirent_t), dirent->name_len, &inode_nread);
-
-		if (status || (inode_nread != dirent->name_len)) {
-			heapmm_free(dirent, sizeof(ext2_dirent_t));
-			THROW(status ? status : EIO, 0);
-		}
-
-		name[dirent->name_len] = 0;
+		memcpy(vfs_dir->name, dirent + 1, dirent->name_len);
+		vfs_dir->name[dirent->name_len] = 0;
 		vfs_dir->inode_id = dirent->inode;
 		vfs_dir->device_id = _inode->device_id;
 		vfs_dir->d_reclen = dirent->rec_len;
 		
 	}
 
-	heapmm_free(dirent, sizeof(ext2_dirent_t));
+	heapmm_free(block, block_size);
 	
 	RETURN(pos);
 }
 
-
-
+/**
+ * Reads the next entry from a directory
+ * @param cache The last block read by this stream, refreshed whenever a new
+ *              block is entered
+ */
 SFUNC( aoff_t, ext2_ireaddir, 
 				inode_t *inode,
+				ext2_dir_stream_t *cache,
 				aoff_t *offset,
 				sys_dirent_t *buffer, 
 				aoff_t buflen)
 {
-	ext2_dirent_t	dirent_hdr;
+	ext2_device_t	*device;
+	ext2_dirent_t	*dirent_hdr;
 	errno_t			status;
-	aoff_t			inode_nread;
+	aoff_t			block_size, in_blk;
+	uint32_t		block;
 	
 	if ( sizeof(sys_dirent_t) > buflen )
 		THROW( E2BIG, sizeof(sys_dirent_t) );
+
+	device = (ext2_device_t *) inode->device;
+	block_size = 1024 << device->superblock.block_size_enc;
 	
-	if ( ( *offset + sizeof(ext2_dirent_t) ) > inode->size ) {
-		RETURN( 0 );
+	for (;;) {
+		if ( ( *offset + sizeof(ext2_dirent_t) ) > inode->size ) {
+			RETURN( 0 );
+		}
+
+		block = *offset / block_size;
+		in_blk = *offset % block_size;
+
+		if ( in_blk == 0 || cache->block != block ) {
+			status = ext2_dir_read_block( inode, block, cache->data );
+			if ( status ) {
+				cache->block = EXT2_DIR_NO_BLOCK;
+				THROW( status, 0 );
+			}
+			cache->block = block;
+		}
+
+		dirent_hdr = ext2_dir_entry( cache->data, block_size, in_blk );
+		if ( !dirent_hdr )
+			THROW( EIO, 0 );
+
+		/* Skip unused entries */
+		if ( dirent_hdr->inode )
+			break;
+
+		*offset += dirent_hdr->rec_len;
 	}
-		
-	status = ext2_read_inode(	inode, 
-								&dirent_hdr, 
-								*offset, 
-								sizeof(ext2_dirent_t), 
-								&inode_nread);
-	
-	if ( status ) 
-		THROW ( status, 0 );
-		
-	if ( inode_nread < sizeof( ext2_dirent_t ) )
-		THROW ( EIO, 0 );
 
-	if ((((aoff_t)dirent_hdr.name_len + 9)) > buflen)
-		THROW( E2BIG, dirent_hdr.name_len + 9 );
+	if ((((aoff_t)dirent_hdr->name_len + 9)) > buflen)
+		THROW( E2BIG, dirent_hdr->name_len + 9 );
 		
-	status = ext2_read_inode( 	inode, 
-								buffer->d_name, 
-								*offset + sizeof(ext2_dirent_t), 
-								dirent_hdr.name_len, 
-								&inode_nread);
-
-	if (status || (inode_nread != dirent_hdr.name_len)) 
-		THROW(status ? status : EIO, 0);
-
-	buffer->d_name[dirent_hdr.name_len] = 0;
-	buffer->d_ino = dirent_hdr.inode;
-	buffer->d_dev = inode->device_id;
-	buffer->d_reclen = 11 + dirent_hdr.name_len;
+	ext2_dir_fill_dirent( inode, buffer, dirent_hdr );
 		
-	*offset += dirent_hdr.rec_len;
+	*offset += dirent_hdr->rec_len;
 		
-	RETURN( dirent_hdr.name_len + 11);
+	RETURN( dirent_hdr->name_len + 11);
 }
 
 SFUNC(dirent_t *, ext2_finddir, inode_t *_inode, const char * name)
 {
+	ext2_device_t	*device;
 	sys_dirent_t	*dirent;
-	errno_t			status;
-	aoff_t			nread;
-	aoff_t 			offset = 0;
+	errno_t			status = 0;
+	uint8_t			*buf;
+	uint32_t		block, nblocks;
+	aoff_t			block_size;
+	size_t			namelen;
+	int				pos;
+
+	if ( ext2_dx_indexed( _inode ) ) {
+		status = ext2_dx_find( _inode, name, ( dirent_t ** ) &dirent );
+		if ( status != ENOTSUP ) {
+			if ( status )
+				THROW( status, NULL );
+			RETURN( ( dirent_t * ) dirent );
+		}
+	}
+
+	device = (ext2_device_t *) _inode->device;
+	block_size = 1024 << device->superblock.block_size_enc;
+	nblocks = _inode->size / block_size;
+	namelen = strlen( name );
 	
-	dirent = heapmm_alloc( sizeof ( sys_dirent_t ) );
+	buf = heapmm_alloc( block_size );
 	
-	if ( dirent == NULL )
+	if ( buf == NULL )
 		THROW( ENOMEM, NULL );
 	
-	while ( (status = ext2_ireaddir(	_inode, 
-										&offset, 
-										dirent, 
-										sizeof(sys_dirent_t), 
-										&nread ) ) == 0 && nread != 0) {
-		if ( strcmp ( dirent->d_name, name ) == 0 )
-			RETURN( ( dirent_t * ) dirent);
-											
+	for ( block = 0; block < nblocks; block++ ) {
+		status = ext2_dir_read_block( _inode, block, buf );
+		if ( status )
+			break;
+
+		pos = ext2_dir_find_in_block( buf, block_size, name, namelen, NULL );
+		if ( pos < 0 )
+			continue;
+
+		dirent = heapmm_alloc( sizeof ( sys_dirent_t ) );
+		if ( dirent == NULL ) {
+			status = ENOMEM;
+			break;
+		}
+
+		ext2_dir_fill_dirent( _inode, dirent, ( ext2_dirent_t * ) ( buf + pos ) );
+		heapmm_free( buf, block_size );
+		RETURN( ( dirent_t * ) dirent );
 	}
-	
-	assert ( status != E2BIG );
-	
+
 	if ( status == 0 )
 		status = ENOENT;
 	
-	heapmm_free( dirent, sizeof ( sys_dirent_t ));
+	heapmm_free( buf, block_size );
 	
 	THROW( status, NULL );
 	
 }
 
 
+
+
 SVFUNC(ext2_mkdir, inode_t *_inode) {
 	ext2_block_group_desc_t *bgd;
 	ext2_device_t *device;
@@ -398,8 +527,15 @@ SFUNC( aoff_t, ext2_dir_write_stub,
 	THROW(EISDIR, 0);
 }
 
+
 SVFUNC( ext2_dir_close, stream_info_t *stream )
 {
+	ext2_device_t *device = (ext2_device_t *) stream->inode->device;
+
+	/* Release the block cache */
+	if ( stream->impl )
+		heapmm_free( stream->impl, sizeof( ext2_dir_stream_t ) +
+			( 1024 << device->superblock.block_size_enc ) );
 
 	stream->inode->open_count--;
 	
@@ -415,5 +551,18 @@ SVFUNC( ext2_dir_close, stream_info_t *stream )
 
 SFUNC( aoff_t, ext2_dir_readdir, stream_info_t *stream, sys_dirent_t *buffer, aoff_t buflen)
 {
-	CHAINRET( ext2_ireaddir, stream->inode, &stream->offset, buffer, buflen );
+	ext2_device_t *device = (ext2_device_t *) stream->inode->device;
+	ext2_dir_stream_t *cache = stream->impl;
+
+	if ( !cache ) {
+		cache = heapmm_alloc( sizeof( ext2_dir_stream_t ) +
+			( 1024 << device->superblock.block_size_enc ) );
+		if ( !cache )
+			THROW( ENOMEM, 0 );
+		cache->block = EXT2_DIR_NO_BLOCK;
+		cache->data = ( uint8_t * ) ( cache + 1 );
+		stream->impl = cache;
+	}
+
+	CHAINRET( ext2_ireaddir, stream->inode, cache, &stream->offset, buffer, buflen );
 }
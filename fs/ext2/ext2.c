@@ -7,6 +7,7 @@
  *
  * Changelog:
  * 09-07-2014 - Created
+ * 17-10-2026 - Load the block groups at mount, write them back on sync
  */
 
 #include <stdint.h>
@@ -38,6 +39,12 @@ SVFUNC( ext2_sync, fs_device_t *device )
 
 	dev = (ext2_device_t *) device;
 
+	status = ext2_sync_groups(dev);
+	if ( status ) {
+		printf(CON_ERROR, "could not write block groups, error:%i", status);
+		THROWV( status );
+	}
+
 	status = device_block_write(dev->dev_id, 1024, &(dev->superblock), 1024, &_read_size);
 
 	//TODO: Update alternate superblocks
@@ -80,6 +87,7 @@ SVFUNC ( ext2_open_inode, inode_t *inode, void *_stream )
 
 		stream->type		= STREAM_TYPE_EXTERNAL;
 		stream->ops  		= &ext2_dir_ops;
+		stream->impl		= NULL;
 		stream->impl_flags  = 	STREAM_IMPL_FILE_CHDIR |
 								STREAM_IMPL_FILE_CHMOD |
 								STREAM_IMPL_FILE_CHOWN |
@@ -108,6 +116,7 @@ fs_device_operations_t ext2_ops = {
 	&ext2_unlink,//Remove directory entry
 	&ext2_trunc_inode, //Change file length
 	&ext2_sync,
+	&ext2_release_inode,
 };
 
 SFUNC(fs_device_t *, ext2_mount, dev_t device, __attribute__((unused)) uint32_t flags)
@@ -127,6 +136,7 @@ SFUNC(fs_device_t *, ext2_mount, dev_t device, __attribute__((unused)) uint32_t
 	semaphore_init(&dev->device.lock);
 	semaphore_up(&dev->device.lock);
 	dev->device.inode_size = sizeof(ext2_vinode_t);
+	dev->device.flags = 0;
 
 	status = device_block_read(dev->dev_id, 1024, &(dev->superblock), 1024, &_read_size);
 
@@ -169,6 +179,13 @@ SFUNC(fs_device_t *, ext2_mount, dev_t device, __attribute__((unused)) uint32_t
 
 	dev->bgdt_block = dev->superblock.block_size_enc ? 1 : 2;
 
+	status = ext2_load_groups(dev);
+	if (status) {
+		printf(CON_ERROR, "could not read block group descriptors, error:%i", status);
+		heapmm_free(dev, sizeof(ext2_device_t));
+		THROW(status, NULL);
+	}
+
 	RETURN( (fs_device_t *) dev );
 }
 
@@ -0,0 +1,223 @@
+/**
+ * fs/ext2/hash.c
+ *
+ * Implements the filename hashes used by hashed directory indexes
+ *
+ * Part of P-OS kernel.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fs/ext2/fsapi.h"
+
+/** The hash value reserved to mark the end of the index */
+#define EXT2_DX_HASH_EOF	(0x7FFFFFFFu << 1)
+
+#define EXT2_TEA_DELTA		(0x9E3779B9u)
+
+#define ROL32(V,S)		(((V) << (S)) | ((V) >> (32 - (S))))
+
+#define MD4_F(x,y,z)		((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x,y,z)		(((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x,y,z)		((x) ^ (y) ^ (z))
+#define MD4_ROUND(f,a,b,c,d,x,s) ( a += f(b, c, d) + (x), a = ROL32(a, s) )
+#define MD4_K1			(0u)
+#define MD4_K2			(013240474631u)
+#define MD4_K3			(015666365641u)
+
+/**
+ * The reduced MD4 transform, takes 8 words of input
+ */
+static void ext2_half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1,  3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1,  7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+	MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1,  3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1,  7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+	MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2,  3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2,  5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2,  9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+	MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2,  3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2,  5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2,  9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+	MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3,  3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3,  9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+	MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3,  3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3,  9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/**
+ * The TEA transform, takes 4 words of input
+ */
+static void ext2_tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	int n;
+
+	for (n = 0; n < 16; n++) {
+		sum += EXT2_TEA_DELTA;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+/**
+ * Returns a character of a name as it is fed to the hash
+ */
+static inline uint32_t ext2_hash_char(const char *name, size_t i, int is_unsigned)
+{
+	if (is_unsigned)
+		return (uint32_t) ((const unsigned char *) name)[i];
+	return (uint32_t) (int) ((const signed char *) name)[i];
+}
+
+/**
+ * The original directory index hash
+ */
+static uint32_t ext2_dx_hack_hash(const char *name, size_t len, int is_unsigned)
+{
+	uint32_t hash, hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = hash1 + (hash0 ^ (ext2_hash_char(name, i, is_unsigned) * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7FFFFFFF;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+
+	return hash0 << 1;
+}
+
+/**
+ * Packs part of a name into words padded with its length
+ */
+static void ext2_str2hashbuf(const char *name, size_t len, uint32_t *buf, int num, int is_unsigned)
+{
+	uint32_t pad, val;
+	size_t i;
+
+	pad = (uint32_t) len | ((uint32_t) len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > (size_t) num * 4)
+		len = num * 4;
+
+	for (i = 0; i < len; i++) {
+		val = ext2_hash_char(name, i, is_unsigned) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/**
+ * Computes the directory index hash of a name
+ * @param device The filesystem, provides the hash seed
+ * @param version The hash version, one of EXT2_DX_HASH_
+ * @param name The name to hash, need not be terminated
+ * @param len The length of the name
+ * @return The hash with the lowest bit clear
+ */
+uint32_t ext2_dx_hash(ext2_device_t *device, int version, const char *name, size_t len)
+{
+	uint32_t buf[4], in[8];
+	uint32_t hash;
+	int is_unsigned = 0, n;
+
+	buf[0] = 0x67452301;
+	buf[1] = 0xEFCDAB89;
+	buf[2] = 0x98BADCFE;
+	buf[3] = 0x10325476;
+
+	/* An all zero seed means the default seed is used */
+	for (n = 0; n < 4; n++) {
+		if (device->superblock.hash_seed[n]) {
+			for (n = 0; n < 4; n++)
+				buf[n] = device->superblock.hash_seed[n];
+			break;
+		}
+	}
+
+	switch (version) {
+		case EXT2_DX_HASH_LEGACY_UNSIGNED:
+			is_unsigned = 1;
+			/* fall through */
+		case EXT2_DX_HASH_LEGACY:
+			hash = ext2_dx_hack_hash(name, len, is_unsigned);
+			break;
+		case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+			is_unsigned = 1;
+			/* fall through */
+		case EXT2_DX_HASH_HALF_MD4:
+			for (;;) {
+				ext2_str2hashbuf(name, len, in, 8, is_unsigned);
+				ext2_half_md4_transform(buf, in);
+				if (len <= 32)
+					break;
+				len -= 32;
+				name += 32;
+			}
+			hash = buf[1];
+			break;
+		case EXT2_DX_HASH_TEA_UNSIGNED:
+			is_unsigned = 1;
+			/* fall through */
+		case EXT2_DX_HASH_TEA:
+		default:
+			for (;;) {
+				ext2_str2hashbuf(name, len, in, 4, is_unsigned);
+				ext2_tea_transform(buf, in);
+				if (len <= 16)
+					break;
+				len -= 16;
+				name += 16;
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1u;
+	if (hash == EXT2_DX_HASH_EOF)
+		hash = (0x7FFFFFFFu - 1) << 1;
+
+	return hash;
+}
@@ -0,0 +1,686 @@
+/**
+ * fs/ext2/htree.c
+ *
+ * Implements hashed directory indexes
+ *
+ * The first block of an indexed directory holds the "." and ".." entries,
+ * with the latter spanning the rest of the block, followed by the root of a
+ * tree of index nodes. Every index entry maps a range of name hashes to a
+ * directory block, so a lookup reads one block per tree level and a single
+ * leaf block instead of the whole directory. Index nodes below the root are
+ * stored in blocks that contain a single empty directory entry, so code that
+ * does not know about the index sees an ordinary directory.
+ *
+ * Trees of up to two levels below the root are used. Directories whose index
+ * can not be handled fall back to a linear scan, their index is dropped when
+ * they are modified.
+ *
+ * Part of P-OS kernel.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/dirent.h>
+
+#include "fs/ext2/fsapi.h"
+#include "kernel/heapmm.h"
+#include "kernel/vfs.h"
+
+/** The deepest index supported, in levels below the root */
+#define EXT2_DX_MAX_LEVELS	(1)
+
+/** The offset of the root info in the first block */
+#define EXT2_DX_ROOT_INFO	(24)
+
+/** The number of block buffers used by an operation */
+#define EXT2_DX_BUFFERS		(6)
+
+#define EXT2_DIRENT_LEN(NaMeLeN) ext2_roundup(sizeof(ext2_dirent_t) + (NaMeLeN), 4)
+
+typedef struct ext2_dx_frame	ext2_dx_frame_t;
+
+/**
+ * The position in an index node on the path to a leaf
+ */
+struct ext2_dx_frame {
+	/** The directory block holding the node */
+	uint32_t		 block;
+	/** The contents of the node */
+	uint8_t			*buf;
+	ext2_dx_countlimit_t	*cl;
+	ext2_dx_entry_t		*entries;
+	/** The entry that was followed */
+	ext2_dx_entry_t		*at;
+};
+
+/**
+ * The state of an operation on an indexed directory
+ */
+typedef struct ext2_dx_path {
+	inode_t			*dir;
+	ext2_device_t		*device;
+	aoff_t			 block_size;
+	int			 hash_version;
+	uint32_t		 hash;
+	/** The number of levels below the root */
+	int			 levels;
+	ext2_dx_frame_t		 frames[EXT2_DX_MAX_LEVELS + 1];
+	/** Block sized scratch buffers */
+	uint8_t			*bufs;
+} ext2_dx_path_t;
+
+static inline uint8_t *ext2_dx_buf(ext2_dx_path_t *path, int n)
+{
+	return path->bufs + n * path->block_size;
+}
+
+static inline uint16_t ext2_dx_root_limit(aoff_t block_size)
+{
+	return (block_size - EXT2_DX_ROOT_INFO - sizeof(ext2_dx_root_info_t)) /
+		sizeof(ext2_dx_entry_t);
+}
+
+static inline uint16_t ext2_dx_node_limit(aoff_t block_size)
+{
+	return (block_size - sizeof(ext2_dirent_t)) / sizeof(ext2_dx_entry_t);
+}
+
+/**
+ * Checks whether a directory has an index that should be used
+ */
+int ext2_dx_indexed(inode_t *dir)
+{
+	ext2_device_t *device = (ext2_device_t *) dir->device;
+	ext2_vinode_t *inode = (ext2_vinode_t *) dir;
+
+	return (inode->inode.flags & EXT2_INDEX_FL) &&
+	       (device->superblock.optional_features & EXT2_FEATURE_COMPAT_DIR_INDEX);
+}
+
+/**
+ * Sets up the state for an operation on an indexed directory
+ */
+static SVFUNC(ext2_dx_begin, ext2_dx_path_t *path, inode_t *dir)
+{
+	memset(path, 0, sizeof(ext2_dx_path_t));
+
+	path->dir = dir;
+	path->device = (ext2_device_t *) dir->device;
+	path->block_size = 1024 << path->device->superblock.block_size_enc;
+
+	path->bufs = heapmm_alloc(EXT2_DX_BUFFERS * path->block_size);
+	if (!path->bufs)
+		THROWV(ENOMEM);
+
+	RETURNV;
+}
+
+static void ext2_dx_end(ext2_dx_path_t *path)
+{
+	heapmm_free(path->bufs, EXT2_DX_BUFFERS * path->block_size);
+}
+
+/**
+ * Finds the last entry of an index node whose hash is not above hash
+ */
+static ext2_dx_entry_t *ext2_dx_search(ext2_dx_frame_t *frame, uint32_t hash)
+{
+	ext2_dx_entry_t *p, *q, *m;
+
+	p = frame->entries + 1;
+	q = frame->entries + frame->cl->count - 1;
+	while (p <= q) {
+		m = p + (q - p) / 2;
+		if (m->hash > hash)
+			q = m - 1;
+		else
+			p = m + 1;
+	}
+
+	return p - 1;
+}
+
+/**
+ * Walks the index from the root to the leaf that holds name
+ * @exception ENOTSUP The index is of an unsupported format
+ */
+static SVFUNC(ext2_dx_probe, ext2_dx_path_t *path, const char *name, size_t namelen)
+{
+	ext2_dx_root_info_t *info;
+	ext2_dx_frame_t *frame;
+	uint8_t *root;
+	int status, level;
+
+	root = ext2_dx_buf(path, 0);
+
+	status = ext2_dir_read_block(path->dir, 0, root);
+	if (status)
+		THROWV(status);
+
+	info = (ext2_dx_root_info_t *) (root + EXT2_DX_ROOT_INFO);
+	if (info->reserved_zero ||
+	    info->info_length != sizeof(ext2_dx_root_info_t) ||
+	    info->indirect_levels > EXT2_DX_MAX_LEVELS ||
+	    info->hash_version > EXT2_DX_HASH_TEA)
+		THROWV(ENOTSUP);
+
+	path->levels = info->indirect_levels;
+	path->hash_version = info->hash_version;
+	if (path->device->superblock.flags & EXT2_FLAGS_UNSIGNED_HASH)
+		path->hash_version += EXT2_DX_HASH_LEGACY_UNSIGNED;
+
+	path->hash = ext2_dx_hash(path->device, path->hash_version, name, namelen);
+
+	frame = &path->frames[0];
+	frame->block = 0;
+	frame->buf = root;
+	frame->entries = (ext2_dx_entry_t *) (root + EXT2_DX_ROOT_INFO + info->info_length);
+	frame->cl = (ext2_dx_countlimit_t *) frame->entries;
+	if (frame->cl->limit != ext2_dx_root_limit(path->block_size) ||
+	    !frame->cl->count || frame->cl->count > frame->cl->limit)
+		THROWV(ENOTSUP);
+
+	for (level = 0;; level++) {
+		frame = &path->frames[level];
+		frame->at = ext2_dx_search(frame, path->hash);
+
+		if (level == path->levels)
+			break;
+
+		frame[1].block = frame->at->block;
+		frame[1].buf = ext2_dx_buf(path, level + 1);
+
+		status = ext2_dir_read_block(path->dir, frame[1].block, frame[1].buf);
+		if (status)
+			THROWV(status);
+
+		frame[1].entries = (ext2_dx_entry_t *) (frame[1].buf + sizeof(ext2_dirent_t));
+		frame[1].cl = (ext2_dx_countlimit_t *) frame[1].entries;
+		if (frame[1].cl->limit != ext2_dx_node_limit(path->block_size) ||
+		    !frame[1].cl->count || frame[1].cl->count > frame[1].cl->limit)
+			THROWV(ENOTSUP);
+	}
+
+	RETURNV;
+}
+
+/**
+ * Finds the leaf block that holds a name and its entry in it
+ * @return The offset of the entry in the leaf, read into buffer 2
+ */
+static SFUNC(int, ext2_dx_lookup, ext2_dx_path_t *path, const char *name, size_t namelen, int *prev)
+{
+	ext2_dx_frame_t *frame;
+	uint8_t *leaf;
+	int status, pos;
+
+	status = ext2_dx_probe(path, name, namelen);
+	if (status)
+		THROW(status, -1);
+
+	frame = &path->frames[path->levels];
+	leaf = ext2_dx_buf(path, 2);
+
+	for (;;) {
+		status = ext2_dir_read_block(path->dir, frame->at->block, leaf);
+		if (status)
+			THROW(status, -1);
+
+		pos = ext2_dir_find_in_block(leaf, path->block_size, name, namelen, prev);
+		if (pos >= 0)
+			RETURN(pos);
+
+		/* Names with the same hash may continue in the next leaf */
+		if (frame->at + 1 >= frame->entries + frame->cl->count ||
+		    (frame->at[1].hash & ~1u) != path->hash)
+			THROW(ENOENT, -1);
+
+		frame->at++;
+	}
+}
+
+SFUNC(dirent_t *, ext2_dx_find, inode_t *dir, const char *name)
+{
+	ext2_dx_path_t path;
+	sys_dirent_t *dirent;
+	ext2_dirent_t *de;
+	size_t namelen;
+	int status, pos;
+
+	assert( dir != NULL );
+	assert( name != NULL );
+
+	namelen = strlen(name);
+
+	status = ext2_dx_begin(&path, dir);
+	if (status)
+		THROW(status, NULL);
+
+	status = ext2_dx_lookup(&path, name, namelen, NULL, &pos);
+	if (status) {
+		ext2_dx_end(&path);
+		THROW(status, NULL);
+	}
+
+	dirent = heapmm_alloc( sizeof ( sys_dirent_t ) );
+	if (!dirent) {
+		ext2_dx_end(&path);
+		THROW(ENOMEM, NULL);
+	}
+
+	de = (ext2_dirent_t *) (ext2_dx_buf(&path, 2) + pos);
+	ext2_dir_fill_dirent(dir, dirent, de);
+
+	ext2_dx_end(&path);
+
+	RETURN((dirent_t *) dirent);
+}
+
+SVFUNC(ext2_dx_unlink, inode_t *dir, const char *name)
+{
+	ext2_dx_path_t path;
+	uint8_t *leaf;
+	int status, pos, prev;
+
+	assert( dir != NULL );
+	assert( name != NULL );
+
+	status = ext2_dx_begin(&path, dir);
+	if (status)
+		THROWV(status);
+
+	status = ext2_dx_lookup(&path, name, strlen(name), &prev, &pos);
+	if (status) {
+		ext2_dx_end(&path);
+		THROWV(status);
+	}
+
+	leaf = ext2_dx_buf(&path, 2);
+	ext2_dir_remove_from_block(leaf, pos, prev);
+
+	status = ext2_dir_write_block(dir, path.frames[path.levels].at->block, leaf);
+
+	ext2_dx_end(&path);
+
+	THROWV(status);
+}
+
+/**
+ * Adds a new directory block at the end of the directory
+ */
+static uint32_t ext2_dx_append_block(ext2_dx_path_t *path)
+{
+	uint32_t block = path->dir->size / path->block_size;
+
+	path->dir->size += path->block_size;
+
+	return block;
+}
+
+/**
+ * Inserts an index entry after the entry that was followed in a node
+ */
+static void ext2_dx_insert(ext2_dx_frame_t *frame, uint32_t hash, uint32_t block)
+{
+	ext2_dx_entry_t *p;
+
+	assert(frame->cl->count < frame->cl->limit);
+
+	for (p = frame->entries + frame->cl->count; p > frame->at + 1; p--)
+		p[0] = p[-1];
+	frame->at[1].hash = hash;
+	frame->at[1].block = block;
+	frame->cl->count++;
+}
+
+/**
+ * Makes room for another entry in the lowest index node
+ * @exception ENOTSUP The index is full
+ */
+static SVFUNC(ext2_dx_grow_index, ext2_dx_path_t *path)
+{
+	ext2_dx_frame_t *root = &path->frames[0], *node = &path->frames[1];
+	ext2_dx_root_info_t *info;
+	ext2_dx_countlimit_t *ncl;
+	ext2_dx_entry_t *nentries;
+	ext2_dirent_t *fake;
+	uint8_t *nbuf;
+	uint32_t nblock, hash;
+	int count, split, status;
+
+	nbuf = ext2_dx_buf(path, 5);
+	memset(nbuf, 0, path->block_size);
+
+	/* Index nodes are hidden behind an empty directory entry */
+	fake = (ext2_dirent_t *) nbuf;
+	fake->rec_len = path->block_size;
+	nentries = (ext2_dx_entry_t *) (nbuf + sizeof(ext2_dirent_t));
+	ncl = (ext2_dx_countlimit_t *) nentries;
+
+	if (path->levels == 0) {
+		/* Move the root entries to a new node below the root */
+		count = root->cl->count;
+		nblock = ext2_dx_append_block(path);
+
+		memcpy(nentries, root->entries, count * sizeof(ext2_dx_entry_t));
+		ncl->limit = ext2_dx_node_limit(path->block_size);
+		ncl->count = count;
+
+		node->block = nblock;
+		node->buf = ext2_dx_buf(path, 1);
+		memcpy(node->buf, nbuf, path->block_size);
+		node->entries = (ext2_dx_entry_t *) (node->buf + sizeof(ext2_dirent_t));
+		node->cl = (ext2_dx_countlimit_t *) node->entries;
+		node->at = node->entries + (root->at - root->entries);
+
+		root->cl->count = 1;
+		root->entries[0].block = nblock;
+		root->at = root->entries;
+
+		info = (ext2_dx_root_info_t *) (root->buf + EXT2_DX_ROOT_INFO);
+		info->indirect_levels = 1;
+		path->levels = 1;
+
+		status = ext2_dir_write_block(path->dir, node->block, node->buf);
+		if (status)
+			THROWV(status);
+
+		CHAINRETV(ext2_dir_write_block, path->dir, 0, root->buf);
+	}
+
+	if (root->cl->count == root->cl->limit)
+		THROWV(ENOTSUP);
+
+	/* Move the upper half of the node to a new node */
+	count = node->cl->count;
+	split = count / 2;
+	hash = node->entries[split].hash;
+	nblock = ext2_dx_append_block(path);
+
+	memcpy(nentries, node->entries + split, (count - split) * sizeof(ext2_dx_entry_t));
+	ncl->limit = ext2_dx_node_limit(path->block_size);
+	ncl->count = count - split;
+	node->cl->count = split;
+
+	ext2_dx_insert(root, hash, nblock);
+
+	status = ext2_dir_write_block(path->dir, 0, root->buf);
+	if (status)
+		THROWV(status);
+
+	status = ext2_dir_write_block(path->dir, nblock, nbuf);
+	if (status)
+		THROWV(status);
+
+	status = ext2_dir_write_block(path->dir, node->block, node->buf);
+	if (status)
+		THROWV(status);
+
+	/* Continue in the node that now holds the followed entry */
+	if (node->at >= node->entries + split) {
+		root->at++;
+		memcpy(node->buf, nbuf, path->block_size);
+		node->block = nblock;
+		node->at = node->entries + (node->at - node->entries - split);
+	}
+
+	RETURNV;
+}
+
+typedef struct ext2_dx_map {
+	uint32_t hash;
+	uint16_t offset;
+	uint16_t size;
+} ext2_dx_map_t;
+
+/**
+ * Copies the entries in map to a block, packed
+ */
+static void ext2_dx_pack(uint8_t *dst, const uint8_t *src, aoff_t block_size,
+			 ext2_dx_map_t *map, int count)
+{
+	ext2_dirent_t *de = NULL;
+	aoff_t pos = 0;
+	int n;
+
+	memset(dst, 0, block_size);
+
+	for (n = 0; n < count; n++) {
+		de = (ext2_dirent_t *) (dst + pos);
+		memcpy(de, src + map[n].offset, map[n].size);
+		de->rec_len = map[n].size;
+		pos += map[n].size;
+	}
+
+	if (de)
+		de->rec_len += block_size - pos;
+	else
+		((ext2_dirent_t *) dst)->rec_len = block_size;
+}
+
+/**
+ * Moves the upper half of the hash range in a full leaf to a new leaf
+ * @return The leaf that the new name goes in, in buffer 2 or 3
+ */
+static SFUNC(int, ext2_dx_split_leaf, ext2_dx_path_t *path, uint32_t *leaf_block)
+{
+	ext2_dx_frame_t *frame = &path->frames[path->levels];
+	ext2_dx_map_t *map, tmp;
+	ext2_dirent_t *de;
+	uint8_t *leaf, *nleaf, *scratch;
+	uint32_t nblock, split_hash;
+	aoff_t pos;
+	int count = 0, max, split, n, m, status;
+
+	leaf = ext2_dx_buf(path, 2);
+	nleaf = ext2_dx_buf(path, 3);
+	scratch = ext2_dx_buf(path, 4);
+
+	max = path->block_size / EXT2_DIRENT_LEN(1);
+	map = heapmm_alloc(max * sizeof(ext2_dx_map_t));
+	if (!map)
+		THROW(ENOMEM, 0);
+
+	for (pos = 0; (de = ext2_dir_entry(leaf, path->block_size, pos)) != NULL; pos += de->rec_len) {
+		if (!de->inode || count == max)
+			continue;
+		map[count].hash = ext2_dx_hash(path->device, path->hash_version,
+					       (char *) de + sizeof(ext2_dirent_t), de->name_len);
+		map[count].offset = pos;
+		map[count].size = EXT2_DIRENT_LEN(de->name_len);
+		count++;
+	}
+
+	/* Sort by hash */
+	for (n = 1; n < count; n++) {
+		tmp = map[n];
+		for (m = n; m > 0 && map[m - 1].hash > tmp.hash; m--)
+			map[m] = map[m - 1];
+		map[m] = tmp;
+	}
+
+	split = count / 2;
+	split_hash = count ? map[split].hash : path->hash;
+
+	/* Mark the range as continued if names with this hash stay behind */
+	if (split > 0 && map[split - 1].hash == split_hash)
+		split_hash |= 1;
+
+	nblock = ext2_dx_append_block(path);
+
+	ext2_dx_pack(nleaf, leaf, path->block_size, map + split, count - split);
+	ext2_dx_pack(scratch, leaf, path->block_size, map, split);
+	memcpy(leaf, scratch, path->block_size);
+
+	heapmm_free(map, max * sizeof(ext2_dx_map_t));
+
+	ext2_dx_insert(frame, split_hash, nblock);
+
+	status = ext2_dir_write_block(path->dir, frame->block, frame->buf);
+	if (status)
+		THROW(status, 0);
+
+	if (path->hash >= split_hash) {
+		status = ext2_dir_write_block(path->dir, frame->at->block, leaf);
+		if (status)
+			THROW(status, 0);
+		*leaf_block = nblock;
+		RETURN(3);
+	}
+
+	status = ext2_dir_write_block(path->dir, nblock, nleaf);
+	if (status)
+		THROW(status, 0);
+	*leaf_block = frame->at->block;
+	RETURN(2);
+}
+
+SVFUNC(ext2_dx_link, inode_t *dir, const char *name, ino_t ino_id)
+{
+	ext2_dx_path_t path;
+	ext2_dx_frame_t *frame;
+	uint32_t leaf_block;
+	size_t namelen;
+	int status, leaf;
+
+	assert( dir != NULL );
+	assert( name != NULL );
+
+	namelen = strlen(name);
+
+	status = ext2_dx_begin(&path, dir);
+	if (status)
+		THROWV(status);
+
+	status = ext2_dx_probe(&path, name, namelen);
+	if (status)
+		goto done;
+
+	frame = &path.frames[path.levels];
+	leaf_block = frame->at->block;
+
+	status = ext2_dir_read_block(dir, leaf_block, ext2_dx_buf(&path, 2));
+	if (status)
+		goto done;
+
+	leaf = 2;
+	if (ext2_dir_add_to_block(ext2_dx_buf(&path, 2), path.block_size, name, namelen, ino_id)) {
+		/* The leaf is full, split it */
+		if (frame->cl->count == frame->cl->limit) {
+			status = ext2_dx_grow_index(&path);
+			if (status)
+				goto done;
+			frame = &path.frames[path.levels];
+		}
+
+		status = ext2_dx_split_leaf(&path, &leaf_block, &leaf);
+		if (status)
+			goto done;
+
+		if (ext2_dir_add_to_block(ext2_dx_buf(&path, leaf), path.block_size, name, namelen, ino_id)) {
+			status = ENOSPC;
+			goto done;
+		}
+	}
+
+	status = ext2_dir_write_block(dir, leaf_block, ext2_dx_buf(&path, leaf));
+
+done:
+	ext2_dx_end(&path);
+	THROWV(status);
+}
+
+SVFUNC(ext2_dx_create, inode_t *dir)
+{
+	ext2_dx_path_t path;
+	ext2_dx_root_info_t *info;
+	ext2_dx_countlimit_t *cl;
+	ext2_dx_entry_t *entries;
+	ext2_dirent_t *dot, *dotdot, *de;
+	uint8_t *root, *leaf;
+	aoff_t rest, pos;
+	uint32_t block;
+	int status;
+
+	assert( dir != NULL );
+
+	status = ext2_dx_begin(&path, dir);
+	if (status)
+		THROWV(status);
+
+	root = ext2_dx_buf(&path, 0);
+	leaf = ext2_dx_buf(&path, 1);
+
+	status = ext2_dir_read_block(dir, 0, root);
+	if (status)
+		goto done;
+
+	dot = (ext2_dirent_t *) root;
+	if (dot->rec_len != EXT2_DIRENT_LEN(1) || dot->name_len != 1) {
+		status = ENOTSUP;
+		goto done;
+	}
+
+	dotdot = (ext2_dirent_t *) (root + dot->rec_len);
+	rest = dot->rec_len + dotdot->rec_len;
+	if (dotdot->name_len != 2 || rest >= path.block_size) {
+		status = ENOTSUP;
+		goto done;
+	}
+
+	/* Move the other entries to a new leaf */
+	memset(leaf, 0, path.block_size);
+	memcpy(leaf, root + rest, path.block_size - rest);
+	de = (ext2_dirent_t *) leaf;
+	for (pos = 0; pos < path.block_size - rest; pos += de->rec_len) {
+		de = (ext2_dirent_t *) (leaf + pos);
+		if (de->rec_len < sizeof(ext2_dirent_t) ||
+		    pos + de->rec_len > path.block_size - rest) {
+			status = ENOTSUP;
+			goto done;
+		}
+	}
+	de->rec_len += rest;
+
+	block = ext2_dx_append_block(&path);
+
+	status = ext2_dir_write_block(dir, block, leaf);
+	if (status)
+		goto done;
+
+	/* Build the root */
+	memset(root + rest, 0, path.block_size - rest);
+	dotdot->rec_len = path.block_size - dot->rec_len;
+
+	info = (ext2_dx_root_info_t *) (root + EXT2_DX_ROOT_INFO);
+	memset(info, 0, sizeof(ext2_dx_root_info_t));
+	info->hash_version = path.device->superblock.def_hash_version;
+	if (info->hash_version > EXT2_DX_HASH_TEA)
+		info->hash_version = EXT2_DX_HASH_HALF_MD4;
+	info->info_length = sizeof(ext2_dx_root_info_t);
+
+	entries = (ext2_dx_entry_t *) (info + 1);
+	cl = (ext2_dx_countlimit_t *) entries;
+	cl->limit = ext2_dx_root_limit(path.block_size);
+	cl->count = 1;
+	entries[0].block = block;
+
+	status = ext2_dir_write_block(dir, 0, root);
+	if (status)
+		goto done;
+
+	((ext2_vinode_t *) dir)->inode.flags |= EXT2_INDEX_FL;
+
+done:
+	ext2_dx_end(&path);
+	THROWV(status);
+}
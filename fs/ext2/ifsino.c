@@ -9,6 +9,8 @@
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Initialize the block map cache
+ * 17-10-2026 - Release preallocated blocks when an inode is released
  */
 
 #include <stdint.h>
@@ -154,6 +156,8 @@ SFUNC(inode_t *, ext2_load_inode, fs_device_t *device, ino_t id) {
 		THROW(status, NULL);
 
 	ext2_e2tovfs_inode(_dev, ino, id);
+	ext2_bmap_invalidate(ino);
+	ino->prealloc_count = 0;
 
 	RETURN((inode_t *) ino);
 }
@@ -176,5 +180,19 @@ SVFUNC(ext2_store_inode,inode_t *_inode) {
 	CHAINRETV(ext2_store_e2inode, device, &(inode->inode), _inode->id);
 }
 
+SVFUNC(ext2_release_inode, inode_t *_inode) {
+
+	if (!_inode) {
+		THROWV(EFAULT);
+	}
+
+	/* Nobody is writing to the file anymore, return the blocks that were */
+	/* reserved for it so they do not stay marked used on disk */
+	ext2_discard_prealloc((ext2_device_t *) _inode->device,
+	                      (ext2_vinode_t *) _inode);
+
+	RETURNV;
+}
+
 
 
@@ -9,6 +9,8 @@
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Place indirect blocks near the data they map
+ * 17-10-2026 - Cache runs of indirectly mapped blocks per inode
  */
 
 #include <stdint.h>
@@ -27,14 +29,15 @@ void *ext2_zero_buffer = NULL;
 
 SFUNC(uint32_t, ext2_allocate_indirect_block, 
 					ext2_device_t *device, 
-					ext2_inode_t *inode)
+					ext2_inode_t *inode,
+					uint32_t goal)
 {
 	int status;
 	size_t block_size = 1024 << device->superblock.block_size_enc;
 	aoff_t size;
 	uint32_t id;
 
-	status = ext2_alloc_block(device, 0, &id);//TODO: Prevent fragmentation, swap 0 for previous block in inode
+	status = ext2_alloc_block(device, goal, &id);
 
 	if (status)
 		THROW(status, 0);
@@ -54,13 +57,86 @@ SFUNC(uint32_t, ext2_allocate_indirect_block,
 	RETURN(id);
 }
 
+/**
+ * Drops all cached block runs of an inode
+ */
+void ext2_bmap_invalidate(ext2_vinode_t *inode)
+{
+	int n;
+
+	for (n = 0; n < EXT2_BMAP_EXTENTS; n++)
+		inode->bmap[n].count = 0;
+	inode->bmap_next = 0;
+}
+
+/**
+ * Looks up a block in the cached block runs of an inode
+ * @return The block on disk, or 0 if it is not cached
+ */
+static uint32_t ext2_bmap_lookup(ext2_vinode_t *inode, uint32_t block_id)
+{
+	ext2_bmap_extent_t *e;
+	int n;
+
+	for (n = 0; n < EXT2_BMAP_EXTENTS; n++) {
+		e = &inode->bmap[n];
+		if (block_id - e->lblock < e->count)
+			return e->pblock + block_id - e->lblock;
+	}
+
+	return 0;
+}
+
+/**
+ * Caches a run of blocks, replacing the oldest cached run
+ */
+static void ext2_bmap_insert(ext2_vinode_t *inode, uint32_t lblock, uint32_t pblock, uint32_t count)
+{
+	ext2_bmap_extent_t *e = &inode->bmap[inode->bmap_next];
+
+	e->lblock = lblock;
+	e->pblock = pblock;
+	e->count  = count;
+	inode->bmap_next = (inode->bmap_next + 1) % EXT2_BMAP_EXTENTS;
+}
+
+/**
+ * Updates the cached block runs after a block was mapped or unmapped.
+ * A run that ends right before a newly mapped block is extended, so files
+ * that are written sequentially stay cached as a single run.
+ */
+static void ext2_bmap_update(ext2_vinode_t *inode, uint32_t block_id, uint32_t block_v)
+{
+	ext2_bmap_extent_t *e;
+	int n;
+
+	for (n = 0; n < EXT2_BMAP_EXTENTS; n++) {
+		e = &inode->bmap[n];
+		if (block_id - e->lblock < e->count) {
+			/* Cut the run short at the changed block */
+			e->count = block_id - e->lblock;
+		} else if (block_v && e->count &&
+			   block_id == e->lblock + e->count &&
+			   block_v == e->pblock + e->count) {
+			e->count++;
+			block_v = 0;
+		}
+	}
+
+	/* Start a new run if the block did not extend one */
+	if (block_v)
+		ext2_bmap_insert(inode, block_id, block_v, 1);
+}
+
 SFUNC(uint32_t, ext2_decode_block_id, 
 					ext2_device_t *device, 
-					ext2_inode_t *inode, 
+					ext2_vinode_t *inode, 
 					uint32_t block_id)
 {
 	uint32_t indirect_count = 256 << device->superblock.block_size_enc;
 	uint32_t indirect_id, indirect_off, indirect_rd;
+	uint32_t batch[EXT2_BMAP_BATCH];
+	uint32_t lblock, count, n;
 	uint32_t s_indir_l = indirect_count;
 	uint32_t d_indir_l = indirect_count * indirect_count;
 	uint32_t s_indir_s = 12;
@@ -71,9 +147,18 @@ SFUNC(uint32_t, ext2_decode_block_id,
 
 	assert ( device != NULL );
 
+	if (block_id < s_indir_s)
+		RETURN(inode->inode.block[block_id]);
+
+	/* Indirectly mapped blocks take up to three reads, try the cache */
+	indirect_rd = ext2_bmap_lookup(inode, block_id);
+	if (indirect_rd)
+		RETURN(indirect_rd);
+
+	lblock = block_id;
 
 	if (block_id >= t_indir_s) { //Triply indirect
-		indirect_id = inode->block[14];
+		indirect_id = inode->inode.block[14];
 		indirect_off = (block_id - t_indir_s) / d_indir_l;
 
 		if (!indirect_id)
@@ -90,7 +175,7 @@ SFUNC(uint32_t, ext2_decode_block_id,
 		
 	} else if (block_id >= d_indir_s) {
 
-		indirect_id = inode->block[13];
+		indirect_id = inode->inode.block[13];
 
 		if (!indirect_id)
 			RETURN(0);
@@ -110,7 +195,7 @@ SFUNC(uint32_t, ext2_decode_block_id,
 
 	} else if (block_id >= s_indir_s) {
 
-		indirect_id = inode->block[12];
+		indirect_id = inode->inode.block[12];
 
 		if (!indirect_id)
 			RETURN(indirect_id);
@@ -121,24 +206,33 @@ SFUNC(uint32_t, ext2_decode_block_id,
 
 		indirect_off = block_id - s_indir_s;
 
-		status = ext2_read_block(device, indirect_id, indirect_off * 4, &indirect_rd, 4, &rsize);
-		if (status || !indirect_rd) {
+		/* Read the pointers that follow as well to find a run */
+		count = s_indir_l - indirect_off;
+		if (count > EXT2_BMAP_BATCH)
+			count = EXT2_BMAP_BATCH;
+
+		status = ext2_read_block(device, indirect_id, indirect_off * 4, batch, count * 4, &rsize);
+		if (status || !batch[0]) {
 			THROW(status, 0);
 		}
-		
-		RETURN(indirect_rd);
+
+		for (n = 1; n < count && batch[n] == batch[0] + n; n++);
+		ext2_bmap_insert(inode, lblock, batch[0], n);
+
+		RETURN(batch[0]);
 	}
 
-	RETURN(inode->block[block_id]);
+	RETURN(inode->inode.block[block_id]);
 }
 
 SVFUNC(ext2_set_block_id, ext2_device_t *device, 
-							ext2_inode_t *inode, 
+							ext2_vinode_t *inode, 
 							uint32_t block_id, 
 							uint32_t block_v)
 {
 	uint32_t indirect_count = 256 << device->superblock.block_size_enc;
 	uint32_t indirect_id, indirect_off, indirect_rd;
+	uint32_t lblock = block_id;
 	uint32_t s_indir_l = indirect_count;
 	uint32_t d_indir_l = indirect_count * indirect_count;
 	uint32_t s_indir_s = 12;
@@ -150,17 +244,17 @@ SVFUNC(ext2_set_block_id, ext2_device_t *device,
 	assert ( device != NULL );
 
 	if (block_id >= t_indir_s) { //Triply indirect
-		indirect_id = inode->block[14];
+		indirect_id = inode->inode.block[14];
 		indirect_off = (block_id - t_indir_s) / d_indir_l;
 
 		if (!indirect_id) {
 
-			status = ext2_allocate_indirect_block(device, inode, &indirect_id);
+			status = ext2_allocate_indirect_block(device, &(inode->inode), block_v, &indirect_id);
 
 			if (status)
 				THROWV(status);	
 
-			inode->block[14] = indirect_id;
+			inode->inode.block[14] = indirect_id;
 		}
 
 		status = ext2_read_block(device, indirect_id, indirect_off * 4, &indirect_rd, 4, &rsize);
@@ -169,7 +263,7 @@ SVFUNC(ext2_set_block_id, ext2_device_t *device,
 
 		if (!indirect_rd) {
 
-			status = ext2_allocate_indirect_block(device, inode, &indirect_id);
+			status = ext2_allocate_indirect_block(device, &(inode->inode), block_v, &indirect_rd);
 
 			if (status)
 				THROWV(status);	
@@ -185,16 +279,16 @@ SVFUNC(ext2_set_block_id, ext2_device_t *device,
 		
 	} else if (block_id >= d_indir_s) {
 
-		indirect_id = inode->block[13];
+		indirect_id = inode->inode.block[13];
 
 		if (!indirect_id) {
 
-			status = ext2_allocate_indirect_block(device, inode, &indirect_id);
+			status = ext2_allocate_indirect_block(device, &(inode->inode), block_v, &indirect_id);
 
 			if (status)
 				THROWV(status);	
 
-			inode->block[13] = indirect_id;
+			inode->inode.block[13] = indirect_id;
 		}
 	}
 
@@ -207,7 +301,7 @@ SVFUNC(ext2_set_block_id, ext2_device_t *device,
 
 		if (!indirect_rd) {
 
-			status = ext2_allocate_indirect_block(device, inode, &indirect_id);
+			status = ext2_allocate_indirect_block(device, &(inode->inode), block_v, &indirect_rd);
 
 			if (status)
 				THROWV(status);	
@@ -223,16 +317,16 @@ SVFUNC(ext2_set_block_id, ext2_device_t *device,
 
 	} else if (block_id >= s_indir_s){
 
-		indirect_id = inode->block[12];
+		indirect_id = inode->inode.block[12];
 
 		if (!indirect_id) {
 
-			status = ext2_allocate_indirect_block(device, inode, &indirect_id);
+			status = ext2_allocate_indirect_block(device, &(inode->inode), block_v, &indirect_id);
 
 			if (status)
 				THROWV(status);	
 
-			inode->block[12] = indirect_id;
+			inode->inode.block[12] = indirect_id;
 		}
 
 	}
@@ -245,10 +339,12 @@ SVFUNC(ext2_set_block_id, ext2_device_t *device,
 		if (status)
 			THROWV(status);	
 
+		ext2_bmap_update(inode, lblock, block_v);
+
 		RETURNV;
 	}
 
-	inode->block[block_id] = block_v;
+	inode->inode.block[block_id] = block_v;
 
 	RETURNV;
 }
@@ -9,6 +9,9 @@
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Allocate new blocks after the preceding block of the file
+ * 17-10-2026 - Keep the block map cache coherent
+ * 17-10-2026 - Grow files through preallocation windows
  */
 
 #include <stdint.h>
@@ -23,7 +26,7 @@
 #include "kernel/vfs.h"
 #include "kernel/earlycon.h"
 
-SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_inode_t *inode, aoff_t old_size, aoff_t new_size)
+SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_vinode_t *inode, aoff_t old_size, aoff_t new_size)
 {
 	aoff_t count;
 	aoff_t length = old_size - new_size;
@@ -36,6 +39,8 @@ SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_inode_t *inode, aoff_t old
 
 	block_size = 1024 << device->superblock.block_size_enc;
 
+	ext2_bmap_invalidate(inode);
+
 	for (count = 0; count < length; count += in_blk_size) {
 		in_file = count + new_size;
 		in_blk = in_file % block_size;				
@@ -63,7 +68,7 @@ SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_inode_t *inode, aoff_t old
 			if (status)
 				THROWV(status);
 
-			inode->blocks -= 2 << device->superblock.block_size_enc;;
+			inode->inode.blocks -= 2 << device->superblock.block_size_enc;
 		}
 	}
 
@@ -71,7 +76,25 @@ SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_inode_t *inode, aoff_t old
 	RETURNV;
 }
 
-	
+/**
+ * Picks the block at which to start looking for space when a file grows:
+ * the block after the preceding block of the file, or the start of the block
+ * group that holds the inode.
+ */
+static uint32_t ext2_block_goal(ext2_device_t *device, ext2_vinode_t *inode, uint32_t block)
+{
+	uint32_t first_b = device->superblock.block_size_enc ? 0 : 1;
+	uint32_t prev = 0;
+
+	if (block > 0 &&
+	    !ext2_decode_block_id(device, inode, block - 1, &prev) &&
+	    prev)
+		return prev + 1;
+
+	return first_b + ((inode->vfs_ino.id - 1) / device->superblock.inodes_per_group) *
+			 device->superblock.blocks_per_group;
+}
+
 SVFUNC(ext2_trunc_inode, inode_t *_inode, aoff_t size)//buffer, f_offset, length -> numbytes
 {
 	ext2_device_t *device;
@@ -87,7 +110,8 @@ SVFUNC(ext2_trunc_inode, inode_t *_inode, aoff_t size)//buffer, f_offset, length
 	if (size > _inode->size) {
 		//TODO: Implement explicit file growth
 	} else if (size < _inode->size) {
-		CHAINRETV(ext2_shrink_inode, device, &(inode->inode), _inode->size, size);
+		ext2_discard_prealloc(device, inode);
+		CHAINRETV(ext2_shrink_inode, device, inode, _inode->size, size);
 	}
 	RETURNV;	
 }
@@ -130,17 +154,20 @@ SFUNC(aoff_t, ext2_write_inode, inode_t *_inode, const void *_buffer, aoff_t f_o
 		if (in_blk_size > (block_size - in_blk))
 			in_blk_size = block_size - in_blk;
 
-		status = ext2_decode_block_id (device, &(inode->inode), in_file / block_size, &block_addr);
+		status = ext2_decode_block_id (device, inode, in_file / block_size, &block_addr);
 		if (status)
 			THROW(status, 0);
 
 		if (!block_addr) {
 			//debugcon_printf("ext2: growing file!\n");
-			status = ext2_alloc_block(device, p_block_addr, &block_addr);
+			status = ext2_alloc_file_block(device, inode,
+				p_block_addr ? p_block_addr + 1 :
+				ext2_block_goal(device, inode, in_file / block_size),
+				&block_addr);
 			if (status) 
 				THROW(status, 0);
 
-			status = ext2_set_block_id(device, &(inode->inode), in_file / block_size, block_addr);
+			status = ext2_set_block_id(device, inode, in_file / block_size, block_addr);
 			if (status)
 				THROW(status, 0);
 
@@ -199,7 +226,7 @@ SFUNC(aoff_t, ext2_read_inode, inode_t *_inode, void *_buffer, aoff_t f_offset,
 		if (in_blk_size > (block_size - in_blk))
 			in_blk_size = block_size - in_blk;
 
-		status = ext2_decode_block_id (device, &(inode->inode), in_file / block_size, &block_addr);
+		status = ext2_decode_block_id (device, inode, in_file / block_size, &block_addr);
 		if (status)
 			THROW(status, 0);
 
@@ -234,6 +261,8 @@ SVFUNC(ext2_mknod, inode_t *_inode) {
 		THROWV(status);
 
 	memset(&(inode->inode), 0, sizeof(ext2_inode_t));
+	ext2_bmap_invalidate(inode);
+	inode->prealloc_count = 0;
 
 	ext2_vfstoe2_inode(inode, _inode->id);
 
@@ -9,6 +9,7 @@
  *
  * Changelog:
  * 29-08-2015 - Created
+ * 17-10-2026 - Allocate from resident bitmaps
  */
 
 #include <stdint.h>
@@ -23,85 +24,53 @@
 #include "kernel/vfs.h"
 #include "kernel/earlycon.h"
 
-
 SFUNC(uint32_t, ext2_alloc_inode, ext2_device_t *device)
 {
 	uint32_t i_count = device->superblock.inode_count;
-	uint32_t inode_id = 11;
-	uint32_t bgrp_id = 0;
 	uint32_t bgrp_icnt = device->superblock.inodes_per_group;
-	uint32_t bgrp_count = ext2_divup(i_count,bgrp_icnt);//DIVUP
-	uint32_t bm_block_size = 256u << device->superblock.block_size_enc;
-	uint32_t bm_block_icnt = bm_block_size * 32;
-	uint32_t bgrp_bmcnt = ext2_divup(bgrp_icnt,bm_block_icnt);//DIVUP
-	uint32_t bm_id;
-	uint32_t inode_map[bm_block_size];
 	uint32_t first_i = 1;
-	uint32_t idx ,nb;
-	aoff_t rsize;
-
+	uint32_t bgrp_id, g_icnt, idx, start;
+	uint32_t inode_id;
+	uint32_t *inode_map;
+	ext2_group_t *group;
 	int status;
 
-	ext2_block_group_desc_t *bgd;
-
 	assert ( device != NULL );
 
-	bgrp_id = (inode_id - first_i) / bgrp_icnt;
-	idx = inode_id - first_i - bgrp_id * bgrp_icnt;
-	bm_id = idx / bm_block_icnt;
-	idx -= bm_id * bm_block_icnt;
-	nb = idx % 32;
-	idx -= nb;
-	idx /= 32;
-
-	for (; bgrp_id < bgrp_count; bgrp_id++) {
-		status = ext2_load_bgd(device, bgrp_id, &bgd);
+	for (bgrp_id = 0; bgrp_id < device->group_count; bgrp_id++) {
+		group = &device->groups[bgrp_id];
+
+		if (!group->desc.free_inode_count)
+			continue;
+
+		status = ext2_load_inode_bitmap(device, bgrp_id, &inode_map);
 		if (status)
 			THROW(status, 0);
 
-		if (bgd->free_inode_count) {
-			for (; bm_id < bgrp_bmcnt; bm_id++) {
-				status = ext2_read_block(device, bgd->inode_bitmap + bm_id, 0, inode_map, bm_block_size * 4, &rsize);
-				if (status)
-					THROW(status, 0);
-				for (; idx < bm_block_size; idx++) {
-					if (inode_map[idx] != 0xFFFFFFFF) {
-						for (; nb < 32; nb++)
-							if (!EXT2_BITMAP_GET(inode_map[idx], nb))
-								goto found_it;
-					}
-					nb = 0;
-				}
-				idx = 0;
-			}
-		}
-		bm_id = 0;
-		ext2_free_bgd(device, bgd);
+		/* The last group may be shorter */
+		g_icnt = i_count - bgrp_id * bgrp_icnt;
+		if (g_icnt > bgrp_icnt)
+			g_icnt = bgrp_icnt;
+
+		/* Skip the reserved inodes */
+		start = 0;
+		if (bgrp_id == 0)
+			start = device->superblock.first_inode - first_i;
+
+		idx = ext2_bitmap_find_zero(inode_map, start, g_icnt);
+		if (idx < g_icnt)
+			goto found_it;
 	}
-	bgrp_id = 0;
 
 	THROW(ENOSPC, 0);
 found_it:
 
-	inode_id = nb + idx * 32 + bm_id * bm_block_icnt + bgrp_id * bgrp_icnt + first_i;
+	inode_id = idx + bgrp_id * bgrp_icnt + first_i;
 
-	EXT2_BITMAP_SET(inode_map[idx], nb);
-	status = ext2_write_block(device, bgd->inode_bitmap + bm_id, 0, inode_map, bm_block_size * 4, &rsize);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (inode bitmap), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
-		THROW(status, 0);
-	}
+	EXT2_BITMAP_SET(inode_map[idx / 32], idx % 32);
 
-	bgd->free_inode_count--;
-
-	status = ext2_store_bgd(device, bgrp_id, bgd);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (BGD), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
-		THROW(status, 0);
-	}
-	ext2_free_bgd(device, bgd);
+	group->desc.free_inode_count--;
+	group->flags |= EXT2_GROUP_DIRTY_IBM | EXT2_GROUP_DIRTY_DESC;
 
 	device->superblock.free_inode_count--;
 
@@ -111,20 +80,13 @@ found_it:
 SVFUNC( ext2_free_inode, ext2_device_t *device, uint32_t inode_id)
 {
 	uint32_t i_count = device->superblock.inode_count;
-	uint32_t bgrp_id = 0;
 	uint32_t bgrp_icnt = device->superblock.inodes_per_group;
-	uint32_t bm_block_size = 256u << device->superblock.block_size_enc;
-	uint32_t bm_block_icnt = bm_block_size * 32;
-	uint32_t bm_id;
-	uint32_t inode_map[bm_block_size];
 	uint32_t first_i = 1;
-	uint32_t idx ,nb;
-	aoff_t rsize;
-
+	uint32_t bgrp_id, idx;
+	uint32_t *inode_map;
+	ext2_group_t *group;
 	int status;
 
-	ext2_block_group_desc_t *bgd;
-
 	assert ( device != NULL );
 
 	assert (inode_id < i_count);
@@ -132,38 +94,21 @@ SVFUNC( ext2_free_inode, ext2_device_t *device, uint32_t inode_id)
 
 	bgrp_id = (inode_id - first_i) / bgrp_icnt;
 	idx = inode_id - first_i - bgrp_id * bgrp_icnt;
-	bm_id = idx / bm_block_icnt;
-	idx -= bm_id * bm_block_icnt;
-	nb = idx % 32;
-	idx -= nb;
-	idx /= 32;
-
-	status = ext2_load_bgd(device, bgrp_id, &bgd);
-	if (status)
-		THROWV(status);
 
-	status = ext2_read_block(device, bgd->inode_bitmap + bm_id, 0, inode_map, bm_block_size * 4, &rsize);
+	status = ext2_load_inode_bitmap(device, bgrp_id, &inode_map);
 	if (status)
 		THROWV(status);
 
-	EXT2_BITMAP_CLR(inode_map[idx], nb);
-
-	status = ext2_write_block(device, bgd->inode_bitmap + bm_id, 0, inode_map, bm_block_size * 4, &rsize);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (inode bitmap), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
-		THROWV(status);
+	if (!EXT2_BITMAP_GET(inode_map[idx / 32], idx % 32)) {
+		debugcon_printf("ext2: freeing free inode %i!\n", inode_id);
+		RETURNV;
 	}
 
-	bgd->free_inode_count++;
+	EXT2_BITMAP_CLR(inode_map[idx / 32], idx % 32);
 
-	status = ext2_store_bgd(device, bgrp_id, bgd);
-	if (status) {
-		debugcon_printf("ext2: MAYDAY MAYDAY MAYDAY: write error (BGD), FILESYSTEM IS PROBABLY CORRUPTED NOW!");
-		ext2_handle_error(device);
-		THROWV(status);
-	}
-	ext2_free_bgd(device, bgd);
+	group = &device->groups[bgrp_id];
+	group->desc.free_inode_count++;
+	group->flags |= EXT2_GROUP_DIRTY_IBM | EXT2_GROUP_DIRTY_DESC;
 
 	device->superblock.free_inode_count++;
 
@@ -9,6 +9,7 @@
  *
  * Changelog:
  * 09-07-2014 - Created
+ * 17-10-2026 - Added ext2_bitmap_find_zero
  */
 
 #include <stdint.h>
@@ -25,3 +26,27 @@ uint32_t ext2_roundup(uint32_t a, uint32_t b)
 	b--;
 	return (a+b) & ~b;
 }
+
+/**
+ * Finds the first clear bit in a bitmap, testing a word at a time
+ * @param map The bitmap
+ * @param start The first bit to test
+ * @param end The bit after the last bit to test
+ * @return The index of the bit or end if all bits in the range are set
+ */
+uint32_t ext2_bitmap_find_zero(const uint32_t *map, uint32_t start, uint32_t end)
+{
+	uint32_t idx, word;
+
+	while ( start < end ) {
+		idx = start / 32;
+		/* Treat the bits before start as set */
+		word = map[idx] | ((1u << (start % 32)) - 1);
+		if ( word != 0xFFFFFFFF ) {
+			start = idx * 32 + __builtin_ctz(~word);
+			return start < end ? start : end;
+		}
+		start = (idx + 1) * 32;
+	}
+	return end;
+}
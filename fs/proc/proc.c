@@ -174,6 +174,7 @@ fs_device_operations_t proc_ops = {
 	NULL,              //Remove directory entry
 	NULL,              //Change file length
 	&proc_sync,
+	NULL,              //Release inode
 };
 
 fs_device_t proc_dev = {
@@ -181,7 +182,10 @@ fs_device_t proc_dev = {
 	.root_inode_id = PROC_INO_ROOT,
 	.ops = &proc_ops,
 	.lock = 1,
-	.inode_size = sizeof(inode_t)
+	.inode_size = sizeof(inode_t),
+	/* Process directories come and go without link or unlink calls and
+	 * file contents change without write calls */
+	.flags = FS_DEVICE_FLAG_NODCACHE | FS_DEVICE_FLAG_NOPCACHE
 };
 
 SFUNC(fs_device_t *, proc_mount, __attribute__((__unused__)) dev_t device, __attribute__((__unused__)) uint32_t flags)
@@ -7,6 +7,7 @@
  *
  * Changelog:
  * 18-04-2014 - Created
+ * 17-10-2026 - Return directory entries the caller can free
  */
 #include "kernel/heapmm.h"
 #include "kernel/vfs.h"
@@ -204,9 +205,15 @@ SFUNC(dirent_t *, ramfs_find_dirent, inode_t *_inode, const char *name )	//dir_i
 {
 	ramfs_inode_t *inode = (ramfs_inode_t *) _inode;
 	ramfs_dirent_t *dirent = (ramfs_dirent_t *) llist_iterate_select(inode->dirent_list, &ramfs_dirent_search_iterator, (void *) name);
+	dirent_t *copy;
 	if (dirent == NULL)
 		THROW(ENOENT, NULL);
-	RETURN(&(dirent->dir));
+	/* The caller frees the entry, hand out a copy */
+	copy = heapmm_alloc(sizeof(dirent_t));
+	if (copy == NULL)
+		THROW(ENOMEM, NULL);
+	memcpy(copy, &(dirent->dir), sizeof(dirent_t));
+	RETURN(copy);
 }
 
 SVFUNC(ramfs_mkdir, inode_t *_inode)
@@ -399,6 +406,7 @@ SFUNC(fs_device_t *, ramfs_mount,
 		ramfs_ops->unlink = &ramfs_unlink;
 		ramfs_ops->trunc_inode = &ramfs_trunc_inode;
 		ramfs_ops->open_inode = &ramfs_open_inode;
+		ramfs_ops->release_inode = NULL;
 	}
 	dev->inode_id_ctr = 0;
 	dev->device.id = ramfs_device_ctr;
@@ -406,6 +414,7 @@ SFUNC(fs_device_t *, ramfs_mount,
 	semaphore_init(&dev->device.lock);
 	dev->device.ops = ramfs_ops;
 	dev->device.inode_size = sizeof(ramfs_inode_t);
+	dev->device.flags = 0;
 	ramfs_device_ctr = ramfs_device_ctr + 1;
 	RETURN( (fs_device_t *)dev );
 }
@@ -29,6 +29,26 @@
 #undef CONFIG_ATA_DEBUG
 #define CONFIG_INODE_CACHE_SIZE			(4096)
 #define CONFIG_INODE_CACHE_TABLESIZE	(128)
+
+/* Open inode lookup table size (power of two) */
+#define CONFIG_OPEN_INODE_TABLESIZE		(1024)
+
+/* Page cache lookup table size (power of two) */
+#define CONFIG_PAGE_CACHE_TABLESIZE		(1024)
+
+/* Largest read issued when populating the page cache, in bytes */
+#define CONFIG_PAGE_CACHE_POPULATE_SIZE		(0x10000)
+
+/* Cached file pages mapped around a faulting page (power of two) */
+#define CONFIG_FAULT_AROUND_PAGES		(16)
+
+/* Unused directory cache entries kept, and lookup table size (power of two) */
+#define CONFIG_DIR_CACHE_SIZE			(1024)
+#define CONFIG_DIR_CACHE_TABLESIZE		(256)
+
+/* Free pages below which caches are shrunk, and up to which they are shrunk */
+#define CONFIG_RECLAIM_LOW_PAGES		(256)
+#define CONFIG_RECLAIM_HIGH_PAGES		(512)
 #undef	HAVE_LIBGCC
 
 #ifdef ARCH_I386
@@ -0,0 +1,77 @@
+/*
+ * crt/spawn.h
+ *
+ * Part of P-OS kernel and libc.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#ifndef __spawn_h__
+#define __spawn_h__
+
+#include <sys/types.h>
+
+/** The maximum number of file actions that can be passed to posix_spawn */
+#define SPAWN_MAX_FILE_ACTIONS	(16)
+
+/** File action: open fa_path as fa_fd */
+#define SPAWN_FA_OPEN		(0)
+/** File action: close fa_fd */
+#define SPAWN_FA_CLOSE		(1)
+/** File action: duplicate fa_fd to fa_newfd */
+#define SPAWN_FA_DUP2		(2)
+
+/** Put the child in the process group given by the attributes */
+#define POSIX_SPAWN_SETPGROUP	(1<<0)
+
+struct posix_spawn_file_action {
+	/** The action to perform */
+	int			 fa_type;
+	/** The descriptor to act on */
+	int			 fa_fd;
+	/** The target descriptor for SPAWN_FA_DUP2 */
+	int			 fa_newfd;
+	/** The open flags for SPAWN_FA_OPEN */
+	int			 fa_oflag;
+	/** The creation mode for SPAWN_FA_OPEN */
+	mode_t			 fa_mode;
+	/** The path to open for SPAWN_FA_OPEN */
+	const char		*fa_path;
+};
+
+typedef struct {
+	/** The number of actions in the list */
+	int				fa_count;
+	/** The actions, performed in order by the child */
+	struct posix_spawn_file_action	fa_list[SPAWN_MAX_FILE_ACTIONS];
+} posix_spawn_file_actions_t;
+
+typedef struct {
+	/** Any of the POSIX_SPAWN flags */
+	short			 sa_flags;
+	/** The process group for POSIX_SPAWN_SETPGROUP */
+	pid_t			 sa_pgroup;
+} posix_spawnattr_t;
+
+int posix_spawn_file_actions_init( posix_spawn_file_actions_t * );
+int posix_spawn_file_actions_destroy( posix_spawn_file_actions_t * );
+int posix_spawn_file_actions_addopen( posix_spawn_file_actions_t *, int,
+                                      const char *, int, mode_t );
+int posix_spawn_file_actions_addclose( posix_spawn_file_actions_t *, int );
+int posix_spawn_file_actions_adddup2( posix_spawn_file_actions_t *, int,
+                                      int );
+
+int posix_spawnattr_init( posix_spawnattr_t * );
+int posix_spawnattr_destroy( posix_spawnattr_t * );
+int posix_spawnattr_setflags( posix_spawnattr_t *, short );
+int posix_spawnattr_setpgroup( posix_spawnattr_t *, pid_t );
+
+int posix_spawn( pid_t *, const char *,
+                 const posix_spawn_file_actions_t *,
+                 const posix_spawnattr_t *,
+                 char *const [], char *const [] );
+
+#endif
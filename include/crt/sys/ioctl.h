@@ -92,6 +92,55 @@ typedef struct fb_mode_info {
 #define EVIOCGBIT(ev,len)	(27)
 #define EVIOCGABS(abs)		(28)
 
+/* block device ioctls */
+
+#define BLKSCHEDGET		(29)
+#define BLKSCHEDSET		(30)
+#define BLKQSTATS		(31)
+#define BLKRASTATS		(34)
+
+/* block device request schedulers */
+
+#define BLKSCHED_FIFO		(0)
+#define BLKSCHED_CLOOK		(1)
+#define BLKSCHED_DEADLINE	(2)
+
+typedef struct blk_queue_stats {
+	/** The number of requests submitted */
+	unsigned int		bqs_requests;
+	/** The number of requests merged into other requests */
+	unsigned int		bqs_merges;
+	/** The number of requests sent to the device */
+	unsigned int		bqs_dispatched;
+	/** The sum of the queue depth seen by every submitted request */
+	unsigned long long	bqs_depth_sum;
+} blk_queue_stats_t;
+
+typedef struct blk_ra_stats {
+	/** The number of read-ahead blocks that were used */
+	unsigned int		brs_hits;
+	/** The number of blocks that had to be read synchronously */
+	unsigned int		brs_misses;
+	/** The number of blocks that were read ahead */
+	unsigned int		brs_issued;
+	/** The number of read-ahead blocks evicted before they were used */
+	unsigned int		brs_wasted;
+} blk_ra_stats_t;
+
+/* ATA ioctls */
+
+#define ATAIOCBENCH		(32)
+#define ATAIOCSDMA		(33)
+
+typedef struct ata_bench {
+	/** The number of sectors to read, set by the caller */
+	unsigned int		ab_sectors;
+	/** The time taken using PIO in microseconds */
+	unsigned int		ab_pio_time;
+	/** The time taken using DMA in microseconds, 0 if DMA is unavailable */
+	unsigned int		ab_dma_time;
+} ata_bench_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -26,12 +26,19 @@ extern "C" {
 #define MAP_SHARED	(1<<0)
 #define MAP_PRIVATE	(0)
 #define MAP_FIXED	(1<<2)
+#define MAP_POPULATE	(1<<3)
 #define MAP_FAILED	((void *)0)
 
+#define MS_ASYNC	(1<<0)
+#define MS_SYNC		(1<<1)
+#define MS_INVALIDATE	(1<<2)
+
 void *mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off);
 
 int munmap(void *addr, size_t len);
 
+int msync(void *addr, size_t len, int flags);
+
 #ifdef __cplusplus
 }
 #endif
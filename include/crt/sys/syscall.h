@@ -114,6 +114,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define SYS_SIGSUSPEND	82
 #define SYS_UNAME	83
 #define SYS_ACCESS  84
+#define SYS_VFORK   85
+#define SYS_SPAWN   86
+#define SYS_MSYNC   87
 
 uint32_t syscall( int,
             uint32_t a, uint32_t b, uint32_t c,
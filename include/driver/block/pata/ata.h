@@ -7,6 +7,9 @@
  *
  * Changelog:
  * 01-07-2014 - Created
+ * 17-10-2026 - Added request queue
+ * 17-10-2026 - Added bus-master DMA writes
+ * 17-10-2026 - Replaced the request state with a request task
  */
 
 #ifndef __DRIVER_BLOCK_PATA_ATA_H__
@@ -15,7 +18,11 @@
 #include <stdint.h>
 #include "kernel/interrupt.h"
 #include "kernel/synch.h"
+#include "kernel/scheduler.h"
 #include "fs/partition.h"
+#include "kernel/device.h"
+#include "kernel/physmm.h"
+#include "kernel/paging.h"
 
 #define ATA_DATA_PORT				(0)
 
@@ -125,7 +132,12 @@
 #define ATA_MODE_LBA28				(1)
 #define ATA_MODE_LBA48				(2)
 
-#define ATA_PRD_LIST_SIZE			(16)
+/** The PRD table of a bus fills a single frame */
+#define ATA_PRD_LIST_SIZE			(PHYSMM_PAGE_SIZE / 8)
+
+/** The maximum number of sectors in a single command, a sector takes two
+ *  PRDs at most so this always fits in the PRD table */
+#define ATA_MAX_MULTI				(128)
 
 typedef struct ata_device ata_device_t;
 
@@ -170,6 +182,22 @@ struct ata_device {
 	semaphore_t      lock;
 	semaphore_t      int_wait;
 	uint8_t		 int_status;
+
+	/** The PRD table used for bus-master DMA, NULL if DMA is unavailable */
+	volatile ata_prd_t *prd_list;
+	/** The physical address of the PRD table */
+	physaddr_t	 prd_phys;
+	/** The mapping of the PRD table */
+	physmap_t	*prd_map;
+	/** Nonzero if DMA may be used on this bus */
+	int		 dma_enabled;
+
+	/** The block driver, which holds the request queue */
+	blk_dev_t	*blk;
+	/** Raised when a request is queued */
+	semaphore_t	 req_wake;
+	/** The task performing the queued requests, NULL if there is none */
+	scheduler_task_t *req_task;
 };
 
 struct ata_prd {
@@ -196,4 +224,6 @@ void ata_set_interrupts(ata_device_t *device, int enabled);
 void ata_initialize(ata_device_t *device);
 int ata_write(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, uint16_t count);
 int ata_read(ata_device_t *device, int drive, ata_lba_t lba, uint8_t *buffer, uint16_t count);
+int ata_writev(ata_device_t *device, int drive, ata_lba_t lba, uint8_t * const *buffers, uint16_t count);
+int ata_readv(ata_device_t *device, int drive, ata_lba_t lba, uint8_t * const *buffers, uint16_t count);
 #endif
@@ -0,0 +1,127 @@
+/**
+ * driver/block/virtio/virtio.h
+ *
+ * Part of P-OS kernel.
+ *
+ * Definitions for legacy virtio PCI devices and split virtqueues
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#ifndef __DRIVER_BLOCK_VIRTIO_VIRTIO_H__
+#define __DRIVER_BLOCK_VIRTIO_VIRTIO_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "kernel/paging.h"
+
+#define VIRTIO_PCI_VID				(0x1AF4)
+
+/* Legacy PCI register offsets in the I/O BAR */
+#define VIRTIO_PCI_HOST_FEATURES	(0x00)
+#define VIRTIO_PCI_GUEST_FEATURES	(0x04)
+#define VIRTIO_PCI_QUEUE_PFN		(0x08)
+#define VIRTIO_PCI_QUEUE_SIZE		(0x0C)
+#define VIRTIO_PCI_QUEUE_SEL		(0x0E)
+#define VIRTIO_PCI_QUEUE_NOTIFY		(0x10)
+#define VIRTIO_PCI_STATUS			(0x12)
+#define VIRTIO_PCI_ISR				(0x13)
+#define VIRTIO_PCI_CONFIG			(0x14)
+
+#define VIRTIO_STATUS_ACKNOWLEDGE	(1<<0)
+#define VIRTIO_STATUS_DRIVER		(1<<1)
+#define VIRTIO_STATUS_DRIVER_OK		(1<<2)
+#define VIRTIO_STATUS_FAILED		(1<<7)
+
+#define VIRTIO_ISR_QUEUE			(1<<0)
+#define VIRTIO_ISR_CONFIG			(1<<1)
+
+#define VIRTQ_DESC_F_NEXT			(1<<0)
+#define VIRTQ_DESC_F_WRITE			(1<<1)
+
+#define VIRTQ_USED_F_NO_NOTIFY		(1<<0)
+
+/** The alignment of the used ring for legacy devices */
+#define VIRTQ_ALIGN					(4096)
+
+typedef struct virtq_desc {
+	uint64_t	addr;
+	uint32_t	len;
+	uint16_t	flags;
+	uint16_t	next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct virtq_avail {
+	uint16_t	flags;
+	uint16_t	idx;
+	uint16_t	ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct virtq_used_elem {
+	uint32_t	id;
+	uint32_t	len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct virtq_used {
+	uint16_t	flags;
+	uint16_t	idx;
+	virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+/**
+ * @brief A buffer to be added to a virtqueue
+ */
+typedef struct virtq_buf {
+	/** The physical address of the buffer */
+	physaddr_t	addr;
+	/** The length of the buffer in bytes */
+	uint32_t	len;
+	/** Nonzero if the device writes to the buffer */
+	int		write;
+} virtq_buf_t;
+
+/**
+ * @brief A split virtqueue
+ *
+ * The descriptor table, available ring and used ring are placed in a
+ * single physically contiguous block as legacy devices only take the
+ * address of the descriptor table.
+ */
+typedef struct virtq {
+	/** The number of descriptors, set by the device */
+	uint16_t	 size;
+	/** The queue number */
+	uint16_t	 index;
+	/** The I/O base of the device */
+	uint16_t	 iobase;
+	/** The physical address of the queue memory */
+	physaddr_t	 phys;
+	/** The buddy order of the queue memory */
+	int		 order;
+	/** The mapping of the queue memory */
+	physmap_t	*map;
+	volatile virtq_desc_t	*desc;
+	volatile virtq_avail_t	*avail;
+	volatile virtq_used_t	*used;
+	/** The first descriptor on the free list */
+	uint16_t	 free_head;
+	/** The number of descriptors on the free list */
+	uint16_t	 num_free;
+	/** The used ring index up to which buffers were collected */
+	uint16_t	 last_used;
+} virtq_t;
+
+int virtq_init( virtq_t *vq, uint16_t iobase, uint16_t index );
+
+void virtq_free( virtq_t *vq );
+
+int virtq_add( virtq_t *vq, const virtq_buf_t *bufs, int count );
+
+void virtq_kick( virtq_t *vq );
+
+int virtq_get( virtq_t *vq, uint32_t *len );
+
+#endif
@@ -0,0 +1,109 @@
+/**
+ * driver/block/virtio/virtio_blk.h
+ *
+ * Part of P-OS kernel.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ * 17-10-2026 - Separate the block size from the sector size
+ */
+
+#ifndef __DRIVER_BLOCK_VIRTIO_VIRTIO_BLK_H__
+#define __DRIVER_BLOCK_VIRTIO_VIRTIO_BLK_H__
+
+#include <stdint.h>
+#include "kernel/interrupt.h"
+#include "kernel/device.h"
+#include "fs/partition.h"
+#include "driver/block/virtio/virtio.h"
+
+/** The legacy (transitional) virtio block device id */
+#define VIRTIO_BLK_PCI_PID			(0x1001)
+
+#define VIRTIO_BLK_F_SIZE_MAX		(1<<1)
+#define VIRTIO_BLK_F_SEG_MAX		(1<<2)
+#define VIRTIO_BLK_F_RO				(1<<5)
+
+/* Device configuration offsets */
+#define VIRTIO_BLK_CFG_CAPACITY		(VIRTIO_PCI_CONFIG + 0)
+#define VIRTIO_BLK_CFG_SIZE_MAX		(VIRTIO_PCI_CONFIG + 8)
+#define VIRTIO_BLK_CFG_SEG_MAX		(VIRTIO_PCI_CONFIG + 12)
+
+#define VIRTIO_BLK_T_IN				(0)
+#define VIRTIO_BLK_T_OUT			(1)
+
+/** The size of the device readable part of a request slot */
+#define VIRTIO_BLK_HDR_SIZE			(16)
+
+#define VIRTIO_BLK_S_OK				(0)
+#define VIRTIO_BLK_S_IOERR			(1)
+#define VIRTIO_BLK_S_UNSUPP			(2)
+
+#define VIRTIO_BLK_MAJOR			(0x20)
+#define VIRTIO_BLK_MAX_DEVICES		(16)
+#define VIRTIO_BLK_PARTITIONS		(15)
+
+/** The unit of virtio request positions and the device capacity */
+#define VIRTIO_BLK_SECTOR_SIZE		(512)
+/** The block size the device is registered with */
+#define VIRTIO_BLK_BLOCK_SIZE		(512)
+
+/** The largest request that is merged by the request queue */
+#define VIRTIO_BLK_MAX_MERGE		(64)
+
+typedef struct virtio_blk_device virtio_blk_device_t;
+
+/**
+ * @brief The request header and status for a single request
+ *
+ * There is one of these for every descriptor, the one belonging to the
+ * head descriptor of a request is used.
+ */
+typedef struct virtio_blk_slot {
+	/* Device readable */
+	uint32_t	type;
+	uint32_t	reserved;
+	uint64_t	sector;
+	/* Device writable */
+	uint8_t		status;
+	uint8_t		pad[15];
+} __attribute__((packed)) virtio_blk_slot_t;
+
+struct virtio_blk_device {
+	int		 number;
+	uint16_t	 iobase;
+	irq_id_t	 irq;
+	uint32_t	 features;
+	/** The size of the disk in sectors */
+	uint64_t	 capacity;
+	/** The maximum number of data buffers in a request */
+	int		 seg_max;
+
+	virtq_t		 vq;
+	/** Holds the buffers while a request is built */
+	virtq_buf_t	*bufs;
+
+	/** The request slots, indexed by head descriptor */
+	volatile virtio_blk_slot_t *slots;
+	physaddr_t	 slots_phys;
+	int		 slots_order;
+	physmap_t	*slots_map;
+
+	/** The request for each head descriptor in use */
+	blk_request_t	**reqs;
+	/** The number of requests submitted to the device */
+	int		 in_flight;
+	/** A request that did not fit in the queue */
+	blk_request_t	*pending;
+
+	/** The block driver, which holds the request queue */
+	blk_dev_t	*blk;
+
+	partition_info_t partitions[VIRTIO_BLK_PARTITIONS];
+};
+
+int virtio_blk_initialize(virtio_blk_device_t *device);
+
+#endif
@@ -7,6 +7,11 @@
  *
  * Changelog:
  * 09-07-2014 - Created
+ * 17-10-2026 - Added resident block group state
+ * 17-10-2026 - Added the per-inode block map cache
+ * 17-10-2026 - Added per-inode preallocation
+ * 17-10-2026 - Added hashed directory indexes
+ * 17-10-2026 - Added block based directory parsing
  */
 
 #ifndef __FS_EXT2_FSAPI_H__
@@ -26,12 +31,78 @@
 
 #define EXT2_SUPPORTED_ROF_FEATURES	(0)
 
+/** The group descriptor was changed since the last sync */
+#define EXT2_GROUP_DIRTY_DESC		(1<<0)
+/** The block bitmap was changed since the last sync */
+#define EXT2_GROUP_DIRTY_BBM		(1<<1)
+/** The inode bitmap was changed since the last sync */
+#define EXT2_GROUP_DIRTY_IBM		(1<<2)
+
+/** The number of block runs cached per inode */
+#define EXT2_BMAP_EXTENTS		(4)
+
+/** The number of block pointers read at once from an indirect block */
+#define EXT2_BMAP_BATCH			(32)
+
+/** The number of blocks reserved for a file when it grows */
+#define EXT2_PREALLOC_BLOCKS		(8)
+
+/** Marks a directory stream block cache as empty */
+#define EXT2_DIR_NO_BLOCK		(0xFFFFFFFF)
+
 typedef struct ext2_vinode				ext2_vinode_t;
+typedef struct ext2_bmap_extent			ext2_bmap_extent_t;
 typedef struct ext2_device				ext2_device_t;
+typedef struct ext2_group				ext2_group_t;
+typedef struct ext2_dir_stream			ext2_dir_stream_t;
+
+/**
+ * A run of file blocks that is contiguous on disk
+ */
+struct ext2_bmap_extent {
+	/** The first block in the file */
+	uint32_t	lblock;
+	/** The first block on disk */
+	uint32_t	pblock;
+	/** The number of blocks, zero if the slot is unused */
+	uint32_t	count;
+};
 
 struct ext2_vinode {
 	inode_t	     vfs_ino;
 	ext2_inode_t inode;
+	/** Recently decoded indirectly mapped blocks */
+	ext2_bmap_extent_t bmap[EXT2_BMAP_EXTENTS];
+	/** The slot to replace next */
+	int	     bmap_next;
+	/** The first block reserved for the file to grow into */
+	uint32_t     prealloc_start;
+	/** The number of reserved blocks, they are marked used on disk */
+	uint32_t     prealloc_count;
+};
+
+/**
+ * The in-memory state of a block group, kept for as long as the filesystem
+ * is mounted. Changes are written back by ext2_sync.
+ */
+struct ext2_group {
+	ext2_block_group_desc_t	 desc;
+	/** The block bitmap, NULL until it is first needed */
+	uint32_t		*block_bitmap;
+	/** The inode bitmap, NULL until it is first needed */
+	uint32_t		*inode_bitmap;
+	/** Combination of EXT2_GROUP_DIRTY_ */
+	int			 flags;
+};
+
+/**
+ * The directory block last read through a directory stream
+ */
+struct ext2_dir_stream {
+	/** The index of the block in the directory, or EXT2_DIR_NO_BLOCK */
+	uint32_t		 block;
+	/** The contents of the block */
+	uint8_t			*data;
 };
 
 struct ext2_device {
@@ -40,11 +111,20 @@ struct ext2_device {
 	dev_t			dev_id;
 	uint32_t		bgdt_block;
 	aoff_t			inode_load_size;
+	/** The number of block groups */
+	uint32_t		group_count;
+	/** The state of every block group */
+	ext2_group_t		*groups;
+	/** The size of a block bitmap in bytes, rounded up to whole blocks */
+	aoff_t			bbm_size;
+	/** The size of an inode bitmap in bytes, rounded up to whole blocks */
+	aoff_t			ibm_size;
 };
 
 void ext2_handle_error(ext2_device_t *device);
 uint32_t ext2_divup(uint32_t a, uint32_t b);
 uint32_t ext2_roundup(uint32_t a, uint32_t b);
+uint32_t ext2_bitmap_find_zero(const uint32_t *map, uint32_t start, uint32_t end);
 SFUNC(aoff_t, ext2_read_block,
 					ext2_device_t *dev,
 					uint32_t block_ptr,
@@ -66,33 +146,49 @@ SVFUNC(ext2_store_bgd,
 									ext2_block_group_desc_t *bgd);
 
 void ext2_free_bgd(	__attribute__((__unused__)) ext2_device_t *device,
-					ext2_block_group_desc_t *bgd);
+					__attribute__((__unused__)) ext2_block_group_desc_t *bgd);
+SVFUNC(ext2_load_groups, ext2_device_t *device);
+SVFUNC(ext2_sync_groups, ext2_device_t *device);
+SFUNC(uint32_t *, ext2_load_block_bitmap, ext2_device_t *device, uint32_t bg_id);
+SFUNC(uint32_t *, ext2_load_inode_bitmap, ext2_device_t *device, uint32_t bg_id);
 SVFUNC(ext2_free_block, ext2_device_t *device, uint32_t block_id);
 SFUNC(uint32_t, ext2_alloc_block, ext2_device_t *device, uint32_t start);
+SFUNC(uint32_t, ext2_alloc_file_block, ext2_device_t *device, ext2_vinode_t *inode, uint32_t goal);
+void ext2_discard_prealloc(ext2_device_t *device, ext2_vinode_t *inode);
 SFUNC(uint32_t, ext2_alloc_inode, ext2_device_t *device);
 SVFUNC( ext2_free_inode, ext2_device_t *device, uint32_t inode_id);
 SFUNC(uint32_t, ext2_allocate_indirect_block,
 					ext2_device_t *device,
-					ext2_inode_t *inode);
+					ext2_inode_t *inode,
+					uint32_t goal);
+void ext2_bmap_invalidate(ext2_vinode_t *inode);
 SFUNC(uint32_t, ext2_decode_block_id,
 					ext2_device_t *device,
-					ext2_inode_t *inode,
+					ext2_vinode_t *inode,
 					uint32_t block_id);
 SVFUNC(ext2_set_block_id, ext2_device_t *device,
-							ext2_inode_t *inode,
+							ext2_vinode_t *inode,
 							uint32_t block_id,
 							uint32_t block_v);
 void ext2_e2tovfs_inode(ext2_device_t *device, ext2_vinode_t *_ino, ino_t ino_id);
 void ext2_vfstoe2_inode(ext2_vinode_t *_ino, ino_t ino_id);
 SFUNC(inode_t *, ext2_load_inode, fs_device_t *device, ino_t id);
 SVFUNC(ext2_store_inode,inode_t *_inode);
-SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_inode_t *inode, aoff_t old_size, aoff_t new_size);
+SVFUNC(ext2_release_inode,inode_t *_inode);
+SVFUNC(ext2_shrink_inode, ext2_device_t *device, ext2_vinode_t *inode, aoff_t old_size, aoff_t new_size);
 SVFUNC(ext2_trunc_inode, inode_t *_inode, aoff_t size);
 SFUNC(aoff_t, ext2_write_inode, inode_t *_inode, const void *_buffer, aoff_t f_offset, aoff_t length);
 SFUNC(aoff_t, ext2_read_inode, inode_t *_inode, void *_buffer, aoff_t f_offset, aoff_t length);
 SVFUNC(ext2_load_e2inode, ext2_device_t *device, ext2_inode_t *ino, uint32_t ino_id);
 SVFUNC(ext2_store_e2inode, ext2_device_t *device, ext2_inode_t *ino, uint32_t ino_id);
 SVFUNC(ext2_mknod, inode_t *_inode) ;
+SVFUNC(ext2_dir_read_block, inode_t *dir, uint32_t block, void *buf);
+SVFUNC(ext2_dir_write_block, inode_t *dir, uint32_t block, const void *buf);
+ext2_dirent_t *ext2_dir_entry(void *block, aoff_t block_size, aoff_t pos);
+int ext2_dir_find_in_block(void *block, aoff_t block_size, const char *name, size_t namelen, int *prev);
+int ext2_dir_add_to_block(void *block, aoff_t block_size, const char *name, size_t namelen, ino_t ino_id);
+void ext2_dir_remove_from_block(void *block, int pos, int prev);
+void ext2_dir_fill_dirent(inode_t *dir, sys_dirent_t *dirent, const ext2_dirent_t *de);
 SFUNC(dirent_t *, ext2_finddir, inode_t *_inode, const char * name);
 SVFUNC(ext2_mkdir, inode_t *_inode);
 SVFUNC( ext2_unlink, inode_t *_inode, const char *name );
@@ -107,5 +203,11 @@ SFUNC( aoff_t, ext2_dir_write_stub,
 					__attribute__((__unused__)) const void *buffer,
 					__attribute__((__unused__)) aoff_t length );
 SVFUNC( ext2_dir_close, stream_info_t *stream );
+uint32_t ext2_dx_hash(ext2_device_t *device, int version, const char *name, size_t len);
+int ext2_dx_indexed(inode_t *dir);
+SFUNC(dirent_t *, ext2_dx_find, inode_t *dir, const char *name);
+SVFUNC(ext2_dx_unlink, inode_t *dir, const char *name);
+SVFUNC(ext2_dx_link, inode_t *dir, const char *name, ino_t ino_id);
+SVFUNC(ext2_dx_create, inode_t *dir);
 SFUNC( aoff_t, ext2_dir_readdir, stream_info_t *stream, sys_dirent_t *buffer, aoff_t buflen);
 #endif
@@ -7,6 +7,7 @@
  *
  * Changelog:
  * 09-07-2014 - Created
+ * 17-10-2026 - Added hashed directory index structures
  */
 
 #ifndef __FS_EXT2_FSDATA_H__
@@ -56,10 +57,31 @@
 
 #define EXT2_ENOSPC			(1)
 
+/* Optional features */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX	(0x0020)
+
+/* Superblock flags */
+#define EXT2_FLAGS_SIGNED_HASH		(0x0001)
+#define EXT2_FLAGS_UNSIGNED_HASH	(0x0002)
+
+/* Inode flags */
+#define EXT2_INDEX_FL			(0x00001000)
+
+/* Directory index hash versions */
+#define EXT2_DX_HASH_LEGACY		(0)
+#define EXT2_DX_HASH_HALF_MD4		(1)
+#define EXT2_DX_HASH_TEA		(2)
+#define EXT2_DX_HASH_LEGACY_UNSIGNED	(3)
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED	(4)
+#define EXT2_DX_HASH_TEA_UNSIGNED	(5)
+
 typedef struct ext2_superblock			ext2_superblock_t;
 typedef struct ext2_block_group_desc	ext2_block_group_desc_t;
 typedef struct ext2_inode				ext2_inode_t;
 typedef struct ext2_dirent				ext2_dirent_t;
+typedef struct ext2_dx_root_info		ext2_dx_root_info_t;
+typedef struct ext2_dx_countlimit		ext2_dx_countlimit_t;
+typedef struct ext2_dx_entry			ext2_dx_entry_t;
 
 struct ext2_superblock {
 	uint32_t inode_count;
@@ -116,7 +138,9 @@ struct ext2_superblock {
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
 
-	uint8_t  spare_2[788];
+	uint8_t  spare_2[88];
+	uint32_t flags;//352
+	uint8_t  spare_3[696];
 }  __attribute__((packed));
 
 struct ext2_block_group_desc {
@@ -157,5 +181,25 @@ struct ext2_dirent {
 	uint8_t  file_type;
 }  __attribute__((packed)); //8 long
 
+/* Follows the "." and ".." entries in the first block of an indexed directory */
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t  hash_version;
+	uint8_t  info_length;
+	uint8_t  indirect_levels;
+	uint8_t  unused_flags;
+}  __attribute__((packed));
+
+/* Takes the place of the hash of the first entry of an index node */
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+}  __attribute__((packed));
+
+struct ext2_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+}  __attribute__((packed));
+
 
 #endif
@@ -10,38 +10,75 @@
  * Changelog:
  * 06-06-2014 - Created
  * 01-07-2014 - Fully implemented, commented.
+ * 17-10-2026 - Added hash table and dirty list
+ * 17-10-2026 - Added write-back state and dirty accounting
+ * 17-10-2026 - Added read-ahead state
+ * 17-10-2026 - Added blkcache_shrink
+ * 17-10-2026 - Keep dirty blocks off the LRU list
  */
 
 #ifndef __KERNEL_BLKCACHE_H__
 #define __KERNEL_BLKCACHE_H__
 
 #include "kernel/synch.h"
+#include "kernel/time.h"
 #include <sys/types.h>
 #include "util/llist.h"
 
 #define BLKCACHE_ENTRY_FLAG_DIRTY	( 1<<1 )
+/** The block is being written back, it may not be discarded */
+#define BLKCACHE_ENTRY_FLAG_WRITEBACK	( 1<<2 )
+/** The block is being read ahead, its data is not valid yet */
+#define BLKCACHE_ENTRY_FLAG_READING	( 1<<3 )
+/** The block was read ahead and has not been used yet */
+#define BLKCACHE_ENTRY_FLAG_READAHEAD	( 1<<4 )
+/** Reading the block ahead failed, its data is not valid */
+#define BLKCACHE_ENTRY_FLAG_ERROR	( 1<<5 )
+
+/** Let blkcache_get exceed the size limit rather than fail */
+#define BLKCACHE_GET_GROW		( 1<<0 )
 
 #define BLKCACHE_ENOMEM			( (blkcache_entry_t *) 0xFFFFFFFF )
 
+typedef struct blkcache_cache blkcache_cache_t;
+typedef struct blkcache_entry blkcache_entry_t;
+
 struct blkcache_cache {
 	int	 	 entry_count;
 	int	 	 max_entries;
 	aoff_t	 block_size;
+	/** Blocks that are not dirty or being written back, least recently
+	 *  used first */
 	llist_t	 block_list;
+	/** Blocks that are dirty or being written back */
+	llist_t	 busy_list;
+	/** Dirty blocks, oldest first */
+	llist_t	 dirty_list;
+	/** Hash table indexed by block number */
+	blkcache_entry_t **table;
+	/** The number of buckets, a power of two */
+	int		 table_size;
+	/** The number of dirty blocks */
+	int		 dirty_count;
+	/** The number of blocks being written back */
+	int		 writeback_count;
+	/** The number of read-ahead blocks evicted before they were used */
+	unsigned int	 readahead_wasted;
 	semaphore_t lock;
 };
 
 struct blkcache_entry {
 	llist_t	 link;
+	llist_t	 dirty_link;
+	blkcache_entry_t *bkt_next;
 	aoff_t	 offset;
 	int	 	 flags;
 	int	 	 access_count;
+	/** The time at which the block became dirty */
+	ktime_t	 dirtied;
 	void	*data;
 };
 
-typedef struct blkcache_cache blkcache_cache_t;
-typedef struct blkcache_entry blkcache_entry_t;
-
 /**
  * blkcache_create - Creates a new, empty block cache
  *
@@ -75,6 +112,26 @@ int blkcache_free( blkcache_cache_t *cache );
 
 blkcache_entry_t *blkcache_find( blkcache_cache_t *cache, aoff_t offset );
 
+/**
+ * blkcache_peek - Get a block from the cache without marking it as used
+ *
+ * @param cache The cache to get the block from
+ * @param offset The offset of the block to get
+ *
+ * @return The block that was requested, or NULL incase it is not in the cache
+ */
+
+blkcache_entry_t *blkcache_peek( blkcache_cache_t *cache, aoff_t offset );
+
+/**
+ * blkcache_remove - Drop a block from the cache
+ *
+ * @param cache The cache to operate on
+ * @param entry The block to drop, its contents are discarded even if dirty
+ */
+
+void blkcache_remove( blkcache_cache_t *cache, blkcache_entry_t *entry );
+
 /**
  * blkcache_bump - Notify the cache of the usage of a block
  *
@@ -83,28 +140,94 @@ blkcache_entry_t *blkcache_find( blkcache_cache_t *cache, aoff_t offset );
  */
 void blkcache_bump( blkcache_cache_t *cache, blkcache_entry_t *entry );
 
+/**
+ * blkcache_get_dirty - Get the oldest dirty block from the cache that is not
+ * being written back
+ *
+ * @param cache The cache to get the block from
+ *
+ * @return The block that was requested, or NULL if no blocks are dirty
+ */
 blkcache_entry_t *blkcache_get_dirty( blkcache_cache_t *cache );
 
+/**
+ * blkcache_mark_dirty - Mark a block as modified
+ *
+ * @param cache The cache the block belongs to
+ * @param entry The block that was modified
+ */
+void blkcache_mark_dirty( blkcache_cache_t *cache, blkcache_entry_t *entry );
+
+/**
+ * blkcache_mark_clean - Mark a block as written back to storage
+ *
+ * @param cache The cache the block belongs to
+ * @param entry The block that was written back
+ */
+void blkcache_mark_clean( blkcache_cache_t *cache, blkcache_entry_t *entry );
+
+/**
+ * blkcache_start_writeback - Mark a dirty block as being written back
+ *
+ * The block is marked clean so that writes during the write-back dirty it
+ * again, and it is kept in the cache until blkcache_end_writeback is called.
+ *
+ * @param cache The cache the block belongs to
+ * @param entry The block that is to be written back
+ */
+void blkcache_start_writeback( blkcache_cache_t *cache,
+			       blkcache_entry_t *entry );
+
+/**
+ * blkcache_end_writeback - Mark the write-back of a block as finished
+ *
+ * @param cache The cache the block belongs to
+ * @param entry The block that was written back
+ * @param failed Nonzero if the block did not reach storage, it is marked
+ *		 dirty again in that case
+ */
+void blkcache_end_writeback( blkcache_cache_t *cache,
+			     blkcache_entry_t *entry, int failed );
+
 /**
  * blkcache_get_discard_candidate - Returns the block to be discarded next
  *
  * @param cache The cache to operate on
  *
- * @return The block to be discarded next
+ * The caller must hold the cache lock.
+ *
+ * @return The least recently used block that can be discarded without
+ *	writing it back, or NULL if there is none
  */
 blkcache_entry_t *blkcache_get_discard_candidate( blkcache_cache_t *cache );
 
+/**
+ * blkcache_shrink - Discard clean blocks to release memory
+ *
+ * Does nothing if the cache is locked, as the holder may be waiting for
+ * memory.
+ *
+ * @param cache The cache to operate on
+ * @param nr The maximum number of blocks to discard
+ *
+ * @return The number of blocks that were discarded
+ */
+int blkcache_shrink( blkcache_cache_t *cache, int nr );
+
 /**
  * blkcache_get - Get a block from the cache or create it if
  * it does not exist yet.
  *
  * @param cache The cache to get the block from
  * @param offset The offset of the block to get/add
+ * @param flags BLKCACHE_GET_GROW to add a block beyond the size limit instead
+ *	of returning NULL
  *
  * @return The block that was requested, or NULL incase the cache was full and
- *	the block that was to be removed was dirty.
+ *	all blocks were dirty or being written back.
  * @exception 2^32-1 is returned if there was not enough memory to add the block
  */
-blkcache_entry_t *blkcache_get( blkcache_cache_t *cache, aoff_t offset );
+blkcache_entry_t *blkcache_get( blkcache_cache_t *cache, aoff_t offset,
+				int flags );
 
 #endif
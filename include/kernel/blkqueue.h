@@ -0,0 +1,138 @@
+/**
+ * kernel/blkqueue.h
+ *
+ * Part of P-OS kernel.
+ *
+ * Implements request scheduling for block devices
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ * 17-10-2026 - Request positions are in sectors
+ */
+
+#ifndef __KERNEL_BLKQUEUE_H__
+#define __KERNEL_BLKQUEUE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "kernel/synch.h"
+#include "kernel/time.h"
+#include "util/llist.h"
+
+/* These match the BLKSCHED_ values in sys/ioctl.h */
+
+/** Dispatch requests in arrival order */
+#define BLKQUEUE_SCHED_FIFO		(0)
+/** Dispatch requests in ascending position, wrapping around at the end */
+#define BLKQUEUE_SCHED_CLOOK		(1)
+/** C-LOOK, but dispatch requests that have waited too long first */
+#define BLKQUEUE_SCHED_DEADLINE		(2)
+
+#define BLKQUEUE_SCHED_COUNT		(3)
+
+/** The default maximum number of blocks in a merged request */
+#define BLKQUEUE_MAX_MERGE		(128)
+
+/** The unit of request positions */
+#define BLKQUEUE_SECTOR_SIZE		(512)
+
+/** The time a read may wait before it is dispatched out of order */
+#define BLKQUEUE_READ_EXPIRE		(500000)
+/** The time a write may wait before it is dispatched out of order */
+#define BLKQUEUE_WRITE_EXPIRE		(5000000)
+
+typedef struct blk_request blk_request_t;
+
+typedef struct blk_queue blk_queue_t;
+
+/**
+ * @brief Describes a request to transfer a run of blocks
+ *
+ * Requests are queued by the driver and completed from its interrupt
+ * handler through device_block_complete, the submitter sleeps on _done_ or
+ * gets notified through _complete_.
+ */
+
+struct blk_request {
+	/** Link for the queue sorted by position */
+	llist_t			  node;
+	/** Link for the queue in arrival order */
+	llist_t			  fifo_node;
+	/** The device to operate on */
+	dev_t			  device;
+	/** The start of the first block */
+	aoff_t			  offset;
+	/** The buffers for each block */
+	void * const		 *buffers;
+	/** The number of blocks */
+	int			  count;
+	/** Nonzero for a write request */
+	int			  write;
+	/** The result of the request, valid after completion */
+	int			  status;
+	/** Raised when the request completes */
+	semaphore_t		  done;
+	/** Called on completion, possibly from interrupt context, may be NULL */
+	void			(*complete)(blk_request_t *);
+	/** Free for use by the submitter */
+	void			 *param;
+
+	/** The position on the physical device in sectors, set by the driver */
+	uint64_t		  pos;
+	/** The time after which the request should be dispatched */
+	utime_t			  deadline;
+	/** Requests for the following blocks that were merged into this one */
+	blk_request_t		 *merged;
+	/** The number of blocks in this request and the merged ones */
+	int			  total;
+};
+
+/**
+ * @brief A queue of block requests waiting for a device
+ *
+ * All requests are kept in both position and arrival order so each of the
+ * schedulers can pick the next request without scanning. Queue functions
+ * must be called with interrupts disabled as drivers dispatch requests from
+ * their interrupt handlers.
+ */
+
+struct blk_queue {
+	/** The scheduler in use, one of BLKQUEUE_SCHED_ */
+	int			  scheduler;
+	/** The block size of the device */
+	aoff_t			  block_size;
+	/** The maximum number of blocks in a merged request, drivers may
+	 *  lower this after registering */
+	int			  max_merge;
+	/** Queued requests sorted by position */
+	llist_t			  sorted;
+	/** Queued requests in arrival order */
+	llist_t			  fifo;
+	/** The position just past the last dispatched request */
+	uint64_t		  head;
+	/** The number of queued requests */
+	int			  depth;
+
+	/** The number of requests added */
+	uint32_t		  requests;
+	/** The number of requests merged into other requests */
+	uint32_t		  merges;
+	/** The number of requests dispatched */
+	uint32_t		  dispatched;
+	/** The sum of the queue depth seen by every added request */
+	uint64_t		  depth_sum;
+};
+
+void blk_queue_init( blk_queue_t *queue, aoff_t block_size );
+
+int blk_queue_set_scheduler( blk_queue_t *queue, int scheduler );
+
+void blk_queue_add( blk_queue_t *queue, blk_request_t *request );
+
+blk_request_t *blk_queue_next( blk_queue_t *queue );
+
+void *blk_request_buffer( blk_request_t *request, int block );
+
+#endif
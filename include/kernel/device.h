@@ -15,14 +15,19 @@
  * Changelog:
  * @li 17-04-2014 - Created
  * @li 14-07-2014 - Documented
+ * @li 17-10-2026 - Added asynchronous block requests
+ * @li 17-10-2026 - Added request scheduling
+ * @li 17-10-2026 - Added sequential read-ahead
  */
 
 #ifndef __KERNEL_DEVICE_H__
 #define __KERNEL_DEVICE_H__
 #include <sys/types.h>
 #include "kernel/blkcache.h"
+#include "kernel/blkqueue.h"
 #include "kernel/synch.h"
 #include "kernel/streams.h"
+#include "util/llist.h"
 
 /**
  * @defgroup drvapi Device driver interface
@@ -64,6 +69,13 @@ typedef struct char_ops	char_ops_t;
 
 typedef struct blk_ops	blk_ops_t;
 
+/**
+ * @brief Describes the read-ahead state of a block device, private to the
+ * block device interface
+ */
+
+typedef struct blk_readahead	blk_readahead_t;
+
 /**
  * @brief Describes a character device driver instance
  *
@@ -216,8 +228,12 @@ struct blk_dev {
 	semaphore_t		 *locks;
 	/** Block cache instances for each minor device */
 	blkcache_cache_t	**caches;
+	/** Read-ahead state for each minor device */
+	blk_readahead_t		**readahead;
 	/** A pointer to the callback table containing the driver functions */
 	blk_ops_t		 *ops;
+	/** The request queue, used by drivers that implement submit */
+	blk_queue_t		  queue;
 };
 
 /**
@@ -310,6 +326,60 @@ struct blk_ops {
 	 */
 	int	(*ioctl)	  (dev_t, int, int, int);		//device, fd, func, arg
 
+	/**
+	 * @brief Write consecutive blocks to storage
+ 	 *
+	 * Writes a run of consecutive blocks starting at the specified linear
+	 * offset in a single request. The blocks need not be contiguous in
+	 * memory, so every block has its own buffer.@n
+	 * @n
+         * Minimal implementation: @n
+	 * NULL, the block layer will call write for every block
+	 * @param device The device to write to
+	 * @param offset The start of the first block to write
+	 * @param buffers The buffers containing the data for each block
+	 * @param count The number of blocks to write
+	 * @return An error code on failure, 0 on success
+	 */
+
+	int	(*writev)	  (dev_t, aoff_t, void * const *, int);	//device, offset, bufs, count
+
+	/**
+	 * @brief Read consecutive blocks from storage
+ 	 *
+	 * Reads a run of consecutive blocks starting at the specified linear
+	 * offset in a single request.@n
+	 * @n
+         * Minimal implementation: @n
+	 * NULL, the block layer will call read for every block
+	 * @param device The device to read from
+	 * @param offset The start of the first block to read
+	 * @param buffers The buffers to read each block to
+	 * @param count The number of blocks to read
+	 * @return An error code on failure, 0 on success
+	 */
+
+	int	(*readv)	  (dev_t, aoff_t, void * const *, int);	//device, offset, bufs, count
+
+	/**
+	 * @brief Queue a block request
+ 	 *
+	 * Adds a request to the device queue and returns without waiting for
+	 * it. The driver should add the request to the queue in its blk_dev_t
+	 * using blk_queue_add and take the next request to execute from it using
+	 * blk_queue_next, which may return a chain of merged requests. The
+	 * driver must call device_block_complete when the request is
+	 * finished.@n
+	 * @n
+         * Minimal implementation: @n
+	 * NULL, the block layer will perform the request synchronously
+	 * @param request The request to queue
+	 * @return An error code if the request could not be queued, 0 on
+	 *         success
+	 */
+
+	int	(*submit)	  (blk_request_t *);			//request
+
 };
 
 void device_char_init(void);
@@ -332,8 +402,16 @@ int device_block_read(dev_t device, aoff_t file_offset, void * buffer, aoff_t co
 
 int device_block_flush_all(dev_t device);
 
+int device_block_submit(blk_request_t *request);
+
+void device_block_complete(blk_request_t *request, int status);
+
+int device_block_wait(blk_request_t *request);
+
 int device_block_flush_global(void);
 
+void device_block_start_flusher(void);
+
 int device_char_ioctl(dev_t device, int fd, int func, int arg);
 
 int device_char_open(dev_t device, stream_ptr_t *fd, int options);
@@ -7,6 +7,8 @@
  *
  * Changelog:
  * 28-03-2014 - Created
+ * 17-10-2026 - Added heapmm_release_core and the heap shrinker
+ * 17-10-2026 - Added heapmm_alloc_nowait
  */
 
 #ifndef __KERNEL_HEAPMM_H__
@@ -34,6 +36,13 @@ struct heapmm_block {
 
 size_t heapmm_request_core ( void *address, size_t size );
 
+void heapmm_release_core ( void *address, size_t size );
+
+/**
+ * Registers the shrinker that returns free heap memory
+ */
+void heapmm_register_shrinker(void);
+
 /**
  * Initializes the heap memory manager
  * @param heap_start The start of the heap
@@ -65,6 +74,12 @@ void *heapmm_alloc_alligned(size_t size, uintptr_t alignment);
  */
 void *heapmm_alloc(size_t size);
 
+/**
+ * Allocates a new block of memory of given size to the caller, fails
+ * instead of waiting for memory to be reclaimed
+ */
+void *heapmm_alloc_nowait(size_t size);
+
 /**
  * Allocates a new block of memory of given size to the caller
  */
@@ -7,6 +7,9 @@
  *
  * Changelog:
  * 30-03-2014 - Created
+ * 17-10-2026 - Added paging_read_frame and paging_write_frame
+ * 17-10-2026 - Added dirty page tracking
+ * 17-10-2026 - Added page table sharing
  */
 
 #ifndef __KERNEL_PAGING_H__
@@ -75,8 +78,20 @@ uintptr_t	paging_get_physical_address(const void * virt_addr);
 
 uintptr_t paging_get_physical_address_other(page_dir_t *dir,const void * virt_addr);
 
+int		paging_clear_dirty(void * virt_addr);
+
+int		paging_is_dirty_other(page_dir_t *dir, const void * virt_addr);
+
+int		paging_unshare_table(void * virt_addr);
+
+void		paging_release_shared_tables(page_dir_t *dir);
+
 physmap_t *paging_map_phys_range( physaddr_t addr, size_t size, int flags );
 
 int paging_unmap_phys_range( physmap_t *map );
 
+int paging_copy_to_frame( physaddr_t frame, const void *src );
+int paging_read_frame( physaddr_t frame, size_t offset, void *dst, size_t size );
+int paging_write_frame( physaddr_t frame, size_t offset, const void *src, size_t size );
+
 #endif
@@ -31,14 +31,39 @@
 
 #define PHYSMM_NO_FRAME	(1)
 
+/**
+ * The largest block the buddy allocator manages: 2^10 frames (4 MiB)
+ */
+#define PHYSMM_MAX_ORDER	(10)
+
 extern uint32_t physmm_bitmap[PHYSMM_BITMAP_SIZE];
 
 void physmm_free_range(physaddr_t start, physaddr_t end);
 
 void physmm_claim_range(physaddr_t start, physaddr_t end);
 
+/**
+ * Returns the amount of free physical memory in bytes
+ */
 physaddr_t physmm_count_free(void);
 physaddr_t physmm_alloc_bmcopy() ;
+
+/**
+ * Allocates 2^order physically contiguous frames, aligned to their size
+ * @return The address of the first frame or PHYSMM_NO_FRAME
+ */
+physaddr_t physmm_alloc_pages(int order);
+
+/**
+ * Releases a block allocated by physmm_alloc_pages
+ */
+void physmm_free_pages(physaddr_t address, int order);
+
+/**
+ * Replaces the physical memory state with the one described by a frame
+ * bitmap, used to take over the map passed in by a boot loader
+ */
+void physmm_load_bitmap(const uint32_t *bitmap);
 /**
  * Allocates a physical frame
  */
@@ -50,7 +75,21 @@ physaddr_t physmm_alloc_frame(void);
 physaddr_t physmm_alloc_quadframe(void);
 
 /**
- * Releases a frame to be used again
+ * Adds a reference to an allocated frame, used when a frame is mapped more
+ * than once. Every reference is dropped by a call to physmm_free_frame.
+ * @return Zero on success, nonzero if no memory was available to track the
+ *         reference
+ */
+int physmm_ref_frame(physaddr_t address);
+
+/**
+ * Returns the number of references to an allocated frame
+ */
+uint32_t physmm_frame_refs(physaddr_t address);
+
+/**
+ * Releases a frame to be used again, if it was shared this only drops a
+ * reference
  */
 void physmm_free_frame(physaddr_t address);
 
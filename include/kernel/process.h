@@ -7,6 +7,9 @@
  *
  * Changelog:
  * 07-04-2014 - Created
+ * 17-10-2026 - Index memory regions by address
+ * 17-10-2026 - Added procvmm_check_write
+ * 17-10-2026 - Added process_abort_child
  */
 
 #ifndef __KERNEL_PROCESS_H__
@@ -16,11 +19,14 @@
 #include <stdint.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <spawn.h>
 
 typedef struct process_info process_info_t;
 
 typedef struct process_mmap process_mmap_t;
 
+typedef struct process_memory_map process_memory_map_t;
+
 typedef struct process_child_event process_child_event_t;
 
 #include "kernel/paging.h"
@@ -42,6 +48,7 @@ typedef struct process_child_event process_child_event_t;
 #define PROCESS_STOPPED		7
 
 #define PROCESS_FLAG_TRACED (1 << 0)
+#define PROCESS_FLAG_VFORK  (1 << 1)
 
 #define PROCESS_TERM_EXIT	0
 #define PROCESS_TERM_SIGNAL	1
@@ -76,6 +83,21 @@ struct process_mmap {
 	aoff_t		 offset;
 	aoff_t		 file_sz;
 	shm_info_t	*shm;
+
+	/* Address tree links and subtree summary, see procvmm.c */
+	process_mmap_t	*tree_left;
+	process_mmap_t	*tree_right;
+	int		 tree_height;
+	uintptr_t	 tree_min_start;
+	uintptr_t	 tree_max_end;
+	size_t		 tree_max_gap;
+};
+
+struct process_memory_map {
+	/** All regions, in the order they were mapped */
+	llist_t		 regions;
+	/** The regions, indexed by address */
+	process_mmap_t	*tree;
 };
 
 struct process_child_event {
@@ -138,7 +160,7 @@ struct process_info {
 	int          flags;
 
 	/* Process memory */
-	llist_t		*memory_map;
+	process_memory_map_t	*memory_map;
 	void		*image_start;
 	void		*image_end;
 	void		*heap_start;
@@ -159,6 +181,9 @@ struct process_info {
 
 	semaphore_t	 child_sema;
 	llist_t		 child_events;
+
+	/* Raised when a vfork child stops using the parent address space */
+	semaphore_t	 vfork_sema;
 };
 
 
@@ -196,7 +221,9 @@ int process_signal_pgroup(pid_t pid, int signal, struct siginfo info);
 
 process_mmap_t *procvmm_get_memory_region(const void *address);
 
-int procvmm_copy_memory_map (llist_t *target);
+process_memory_map_t *procvmm_alloc_memory_map( void );
+
+int procvmm_copy_memory_map (process_memory_map_t *target);
 
 int procvmm_resize_map(void *start, size_t newsize);
 
@@ -210,6 +237,8 @@ void procvmm_unmmap(process_mmap_t *region);
 
 int procvmm_handle_fault(void *address);
 
+int procvmm_handle_cow(void *address);
+
 int procvmm_do_exec_mmaps(void);
 
 void procvmm_clear_mmaps(void);
@@ -218,7 +247,20 @@ void process_init(void);
 
 process_info_t *fork_process( void );
 
+process_info_t *vfork_process( void );
+
+process_info_t *spawn_process( void );
+
+void process_abort_child( process_info_t *child );
+
+void process_create_vm( process_info_t *process );
+
+void process_vfork_release( process_info_t *process );
+
+int process_detach_vfork( process_info_t *process );
+
 int procvmm_check( const void *dest, size_t size);
+int procvmm_check_write( const void *dest, size_t size);
 int procvmm_check_string( const char *dest, size_t size_max );
 int procvmm_check_stringlist(	const char **dest,
 				size_t len_max );
@@ -226,7 +268,16 @@ int procvmm_check_stringlist(	const char **dest,
 void process_load_exec_state( void *entry, void *stack );
 
 int posix_fork(void);
+int posix_vfork(void);
 int process_exec(const char *path, char * const args[], char * const envs[] );
+int process_spawn(	pid_t *pid,
+			const char *path,
+			char * const args[],
+			char * const envs[],
+			posix_spawn_file_actions_t *actions,
+			posix_spawnattr_t *attr );
+void process_free_strlist( char **list );
+void process_free_file_actions( posix_spawn_file_actions_t *actions );
 
 void *procvmm_attach_shm(void *addr, shm_info_t *shm, int flags);
 
@@ -234,6 +285,8 @@ int procvmm_detach_shm(void *shmaddr);
 
 void *_sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
 
+int _sys_msync(void *addr, size_t len, int flags);
+
 void process_interrupt_all( process_info_t *process );
 
 void process_stop( process_info_t *process );
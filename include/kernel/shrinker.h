@@ -0,0 +1,98 @@
+/**
+ * kernel/shrinker.h
+ *
+ * Part of P-OS kernel.
+ *
+ * Registry of caches that give memory back when physical memory runs low
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#ifndef __KERNEL_SHRINKER_H__
+#define __KERNEL_SHRINKER_H__
+
+#include <stddef.h>
+#include "util/llist.h"
+
+/** Shrinkers for caches of objects, these run first */
+#define SHRINKER_PASS_CACHE	(0)
+/** Shrinkers for allocators, these run after the caches released objects */
+#define SHRINKER_PASS_ALLOCATOR	(1)
+
+typedef struct shrinker shrinker_t;
+
+/**
+ * @brief Describes a cache that can release memory
+ *
+ * Shrinkers are called from the reclaim task, which holds no other locks.
+ * They should still skip objects whose locks are taken instead of waiting
+ * for them, as the holder may itself be waiting for memory.
+ */
+struct shrinker {
+	llist_t		 node;
+	/** The name of the cache, for diagnostics */
+	const char	*name;
+	/** One of SHRINKER_PASS_ */
+	int		 pass;
+	/**
+	 * @brief Count the objects that could be released
+	 * @param shrinker The shrinker that is called
+	 * @return The number of objects
+	 */
+	size_t		(*count)(shrinker_t *shrinker);
+	/**
+	 * @brief Release objects, least recently used first
+	 * @param shrinker The shrinker that is called
+	 * @param nr The number of objects to release
+	 * @return The number of objects that were released
+	 */
+	size_t		(*scan)(shrinker_t *shrinker, size_t nr);
+	/** Free for use by the cache */
+	void		*param;
+};
+
+/**
+ * @brief Add a cache to the registry
+ * @param shrinker The shrinker of the cache, must stay valid until it is
+ *		   unregistered
+ */
+void shrinker_register(shrinker_t *shrinker);
+
+/**
+ * @brief Remove a cache from the registry
+ * @param shrinker The shrinker to remove
+ */
+void shrinker_unregister(shrinker_t *shrinker);
+
+/**
+ * @brief Check whether there is enough free memory for caches to grow
+ * @return Nonzero if caches may grow beyond their normal size
+ */
+int shrinker_may_grow(void);
+
+/**
+ * @brief Wake the reclaim task if memory is running low
+ *
+ * May be called from any context.
+ */
+void shrinker_check(void);
+
+/**
+ * @brief Wait for the reclaim task to release memory
+ *
+ * Returns immediately if the reclaim task is not running, if it is the
+ * caller or if interrupts are disabled. May only be called from task
+ * context.
+ * @return Nonzero if memory was released
+ */
+int shrinker_wait(void);
+
+/**
+ * @brief Start the reclaim task
+ */
+void shrinker_start(void);
+
+#endif
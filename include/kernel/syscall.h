@@ -257,6 +257,9 @@ uint32_t sys_sigpending(uint32_t a,uint32_t b,uint32_t c,uint32_t d,uint32_t e,
 
 uint32_t sys_uname( uint32_t a,uint32_t b,uint32_t c,uint32_t d,uint32_t e, uint32_t f);
 uint32_t sys_access( uint32_t a,uint32_t b,uint32_t c,uint32_t d,uint32_t e, uint32_t f);
+uint32_t sys_vfork( uint32_t a,uint32_t b,uint32_t c,uint32_t d,uint32_t e, uint32_t f);
+uint32_t sys_spawn( uint32_t a,uint32_t b,uint32_t c,uint32_t d,uint32_t e, uint32_t f);
+uint32_t sys_msync( uint32_t a,uint32_t b,uint32_t c,uint32_t d,uint32_t e, uint32_t f);
 
 
 #endif
@@ -10,6 +10,12 @@
  * Changelog:
  * \li 09-04-2014 - Created
  * \li 12-07-2014 - Documented
+ * \li 17-10-2026 - Added the name keyed directory cache
+ * \li 17-10-2026 - Added the open inode table
+ * \li 17-10-2026 - Added the page cache
+ * \li 17-10-2026 - Added write-back of shared file mappings
+ * \li 17-10-2026 - Added page cache population
+ * \li 17-10-2026 - Added the inode release hook
  *
  */
 
@@ -39,6 +45,15 @@
 #define PATHRES_FLAG_NOSYMLINK	(1<<0)
 #define PATHRES_FLAG_PARENT	(1<<1)
 
+/** The directory cache entry is in the lookup table */
+#define DIR_CACHE_FLAG_HASHED	(1<<0)
+
+/** Directory lookups on this filesystem may not be cached */
+#define FS_DEVICE_FLAG_NODCACHE	(1<<0)
+
+/** File data on this filesystem may not be cached */
+#define FS_DEVICE_FLAG_NOPCACHE	(1<<1)
+
 
 /**
  * Bit definition for inode->mode, this file is readable
@@ -61,6 +76,12 @@
  */
 typedef struct inode inode_t;
 
+/**
+ * @brief A page of file data in the page cache
+ * @see page_cache
+ */
+typedef struct page_cache page_cache_t;
+
 /**
  * @brief An entry in the path element cache
  * @see dirent
@@ -79,6 +100,33 @@ typedef struct dir_cache dir_cache_t;
  */
 typedef struct fs_device fs_device_t;
 
+/**
+ * @brief A page of file data in the page cache
+ *
+ * The frame holding the data may also be mapped into processes, each mapping
+ * holds its own reference to the frame so it outlives the cache entry.
+ */
+struct page_cache {
+	/** Link in the LRU list, must be the first member */
+	llist_t		 lru_link;
+	/** The file the data belongs to */
+	inode_t		*inode;
+	/** The offset of the page in the file */
+	aoff_t		 offset;
+	/** The frame holding the data, the cache holds a reference to it */
+	physaddr_t	 frame;
+	/** Next page in the lookup table bucket */
+	page_cache_t	*hash_next;
+	/** The link pointing at this page in the lookup table bucket */
+	page_cache_t	**hash_pprev;
+	/** Next page of the same file */
+	page_cache_t	*inode_next;
+	/** The link pointing at this page in the list of the file */
+	page_cache_t	**inode_pprev;
+	/** Number of users copying from or mapping the page right now */
+	uint32_t	 usage_count;
+};
+
 /**
  * @brief Contains callbacks for all filesystem driver functions
  * @see fs_device_operations
@@ -142,6 +190,12 @@ struct inode {
 	ktime_t		 ctime;
 	/** Deletion time */
 	ktime_t		 dtime;
+	/** Next inode in the open inode table bucket */
+	inode_t		*open_next;
+	/** The link pointing at this inode in the open inode table bucket */
+	inode_t		**open_pprev;
+	/** The pages of this file in the page cache */
+	page_cache_t	*pages;
 };
 
 /**
@@ -167,14 +221,27 @@ struct dirent {
  * The kernel keeps track of these to resolve the . and .. special directories
  */
 struct dir_cache {
+	/** Link in the list of unused entries, or of entries about to be freed */
+	llist_t		 lru_link;
 	/** The parent directory of this entry */
 	dir_cache_t	*parent;
-	/** The inode for this entry */
+	/** The inode for this entry, NULL if the name does not exist */
 	inode_t		*inode;
 	/** @brief The number of times this dir_cache is referenced
           * This is used for a basic form of garbage collection, when this
-          * hits 0 the dir_cache will be free'd */
+          * hits 0 the dir_cache will be free'd, or kept in the unused list
+          * if it is in the lookup table */
 	uint32_t	 usage_count;
+	/** The name of this entry in its parent, NULL for a root */
+	char		*name;
+	/** Hash of the parent inode and name */
+	uint32_t	 hash;
+	/** Next entry in the lookup table bucket */
+	dir_cache_t	*hash_next;
+	/** The number of entries in the lookup table that have this parent */
+	uint32_t	 children;
+	/** Combination of DIR_CACHE_FLAG_ */
+	int		 flags;
 };
 
 /**
@@ -292,7 +359,8 @@ struct fs_device_operations {
 	 * @param inode The directory to search
 	 * @param name  The filename to match
 	 * @return The directory entry matching name from the directory inode,
-	 *          if none, NULL is returned
+	 *          if none, NULL is returned. The entry is allocated on the
+	 *          heap and freed by the caller
 	 */
 	SFUNCPTR( dirent_t *, find_dirent, inode_t *, const char * );	//dir_inode_id, filename -> dirent_t
 
@@ -356,6 +424,18 @@ struct fs_device_operations {
 	 * @param size	      The new size of the file
 	 */
 	SVFUNCPTR( sync, fs_device_t * );
+
+	/**
+	 * @brief Release an inode that is no longer referenced
+	 *
+	 * Called when the last reference to an inode is dropped, before it is
+	 * moved to the inode cache. Implementations may drop any state that is
+	 * only kept while the file is in use.
+	 * This function is optional
+	 *
+	 * @param inode       The inode to release
+	 */
+	SVFUNCPTR( release_inode, inode_t * );
 };
 
 /**
@@ -388,6 +468,8 @@ struct fs_device {
           * of this driver.
           */
 	size_t 			inode_size;
+	/** Combination of FS_DEVICE_FLAG_ */
+	int			flags;
 };
 
 /**
@@ -476,6 +558,7 @@ int vfs_access( const char *path, int mode );
  */
 ///@{
 void vfs_inode_cache(inode_t *inode);
+void vfs_inode_uncache(inode_t *inode);
 inode_t *vfs_get_cached_inode(fs_device_t *device, ino_t inode_id);
 
 dir_cache_t *vfs_dir_cache_mkroot(inode_t *root_inode);
@@ -494,6 +577,40 @@ dir_cache_t *vfs_dir_cache_ref(dir_cache_t *dirc);
 
 SFUNC( dir_cache_t *, vfs_dir_cache_new, dir_cache_t *par, ino_t inode_id );
 
+SFUNC( dir_cache_t *, vfs_dir_cache_lookup, dir_cache_t *par, const char *name, size_t namelen );
+
+void vfs_dir_cache_invalidate( inode_t *dir, const char *name );
+
+void vfs_dir_cache_purge( void );
+
+void vfs_dcache_initialize( void );
+
+void vfs_pcache_initialize( void );
+
+page_cache_t *vfs_page_cache_lookup( inode_t *inode, aoff_t offset );
+
+SFUNC( page_cache_t *, vfs_page_cache_get, inode_t *inode, aoff_t offset );
+
+SVFUNC( vfs_page_cache_populate, inode_t *inode, aoff_t offset, aoff_t count );
+
+void vfs_page_cache_release( page_cache_t *page );
+
+SFUNC( aoff_t, vfs_page_cache_read, inode_t *inode, void *buffer, aoff_t file_offset, aoff_t count );
+
+void vfs_page_cache_write( inode_t *inode, const void *buffer, aoff_t file_offset, aoff_t count );
+
+SVFUNC( vfs_page_cache_writeback, inode_t *inode, aoff_t offset, physaddr_t frame, aoff_t count );
+
+void vfs_page_cache_truncate( inode_t *inode, aoff_t size );
+
+void vfs_page_cache_drop( inode_t *inode );
+
+SFUNC( physaddr_t, vfs_map_page, inode_t *inode, aoff_t offset, int cached );
+
+SVFUNC( vfs_populate, inode_t *inode, aoff_t offset, aoff_t count );
+
+SVFUNC( vfs_write_page, inode_t *inode, aoff_t offset, physaddr_t frame, aoff_t count );
+
 ///@}
 
 int vfs_initialize(dev_t root_device, char *root_fs_type);
@@ -514,6 +631,7 @@ SFUNC( aoff_t, ifs_read, inode_t * inode, void * buffer, aoff_t file_offset, aof
 SFUNC( aoff_t, ifs_write, inode_t * inode, const void * buffer, aoff_t file_offset, aoff_t count );
 SVFUNC( ifs_truncate, inode_t * inode, aoff_t size);
 SVFUNC( ifs_sync, fs_device_t *device );
+SVFUNC( ifs_release_inode, inode_t *inode );
 SFUNC(dir_cache_t *, vfs_find_dirc_parent, const char * path);
 SFUNC(dir_cache_t *, vfs_find_dirc_parent_at, dir_cache_t *curdir, const char * path);
 SFUNC(dir_cache_t *,_vfs_find_dirc_at,dir_cache_t *curdir, const char * path,int flags,
@@ -5,23 +5,89 @@
  *
  * Implements a LRU cache for blocks
  *
- * TODO: Rewrite this to be more time-efficient (stop using llist)
+ * Blocks are indexed by a hash table keyed on their offset. Clean blocks are
+ * kept on a LRU list, blocks that are dirty or being written back are moved
+ * to a busy list and dirty blocks are additionally kept on a dirty list, so
+ * lookup, insertion, eviction and finding dirty blocks are all O(1).
+ *
+ * Blocks that are dirty or being written back are never discarded, the cache
+ * is allowed to grow past its limit when a reader finds no clean block to
+ * replace and shrinks back once blocks have been written back. Blocks that
+ * are being read ahead are not discarded either, their flags are changed from
+ * interrupt context when the read completes so they stay on the LRU list and
+ * eviction passes over them. Only a few reads are in flight at a time.
+ *
+ * While there is plenty of free memory the cache grows past its limit
+ * instead of replacing blocks, the reclaim task shrinks it through
+ * blkcache_shrink when memory runs low. The hash table is not resized, so
+ * the cache does not grow past BLKCACHE_GROW_LIMIT blocks per bucket.
  *
  * Written by Peter Bosch <peterbosc@gmail.com>
  *
  * Changelog:
  * 06-06-2014 - Created
  * 01-07-2014 - Fully implemented, commented.
+ * 17-10-2026 - Replaced list scans with a hash table and a dirty list
+ * 17-10-2026 - Added write-back state and dirty accounting
+ * 17-10-2026 - Added read-ahead state
+ * 17-10-2026 - Grow into free memory, added blkcache_shrink
+ * 17-10-2026 - Keep dirty blocks off the LRU list
+ * 17-10-2026 - Limit growth into free memory to the hash table size
  */
 
 #include "kernel/heapmm.h"
 #include "kernel/blkcache.h"
+#include "kernel/shrinker.h"
 #include "kernel/device.h"
+#include "kernel/time.h"
 #include <sys/types.h>
 #include <sys/errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
+/**
+ * The number of blocks per hash bucket up to which a cache grows into free
+ * memory
+ */
+#define BLKCACHE_GROW_LIMIT	(4)
+
+/**
+ * Get the entry containing a dirty list link
+ */
+#define BLKCACHE_DIRTY_ENTRY(Link)	( (blkcache_entry_t *) \
+		( ( (uintptr_t) (Link) ) - __builtin_offsetof( blkcache_entry_t, dirty_link ) ) )
+
+/**
+ * Nonzero if a block can be discarded without writing it back
+ */
+#define BLKCACHE_DISCARDABLE(Entry)	( !( (Entry)->flags & \
+		( BLKCACHE_ENTRY_FLAG_DIRTY | BLKCACHE_ENTRY_FLAG_WRITEBACK | \
+		  BLKCACHE_ENTRY_FLAG_READING ) ) )
+
+/**
+ * Nonzero if a block belongs on the busy list
+ */
+#define BLKCACHE_BUSY(Entry)	( (Entry)->flags & \
+		( BLKCACHE_ENTRY_FLAG_DIRTY | BLKCACHE_ENTRY_FLAG_WRITEBACK ) )
+
+/**
+ * blkcache_bucket - INTERNAL function that gets the hash bucket for an offset
+ *
+ * @param cache The cache to operate on
+ * @param offset The offset of the block
+ *
+ * @return A pointer to the head of the bucket
+ */
+
+static inline blkcache_entry_t **blkcache_bucket( blkcache_cache_t *cache,
+						    aoff_t offset )
+{
+	/* Consecutive blocks hash to consecutive buckets */
+	return &cache->table[ ( offset / cache->block_size ) &
+			      ( cache->table_size - 1 ) ];
+}
+
 /**
  * blkcache_create - Creates a new, empty block cache
  *
@@ -41,16 +107,91 @@ blkcache_cache_t *blkcache_create( aoff_t block_size, int max_entries )
 	cache->max_entries = max_entries;
 	cache->block_size = block_size;
 	cache->entry_count = 0;
+	cache->dirty_count = 0;
+	cache->writeback_count = 0;
+	cache->readahead_wasted = 0;
+
+	/* Size the table to the next power of two above the entry limit so
+	 * chains stay short when the cache is full */
+	for ( cache->table_size = 1;
+	      cache->table_size < max_entries;
+	      cache->table_size <<= 1 );
+
+	cache->table = heapmm_alloc( cache->table_size *
+				     sizeof( blkcache_entry_t * ) );
+	if ( !cache->table ) {
+		heapmm_free( cache, sizeof( blkcache_cache_t ) );
+		return NULL;
+	}
+
+	memset( cache->table, 0, cache->table_size *
+				 sizeof( blkcache_entry_t * ) );
+
 	semaphore_init(&cache->lock);
 
 	/* Release lock */
 	semaphore_up( &cache->lock );
 
 	llist_create( ( llist_t * ) &( cache->block_list ) );
+	llist_create( ( llist_t * ) &( cache->busy_list ) );
+	llist_create( ( llist_t * ) &( cache->dirty_list ) );
 
 	return cache;
 }
 
+/**
+ * blkcache_unhash - INTERNAL function that removes a block from the hash table
+ *
+ * @param cache The cache to operate on
+ * @param entry The block to remove
+ */
+
+static void blkcache_unhash( blkcache_cache_t *cache, blkcache_entry_t *entry )
+{
+	blkcache_entry_t **link;
+
+	for ( link = blkcache_bucket( cache, entry->offset );
+	      *link != entry;
+	      link = &( *link )->bkt_next )
+		assert( *link != NULL );
+
+	*link = entry->bkt_next;
+	entry->bkt_next = NULL;
+}
+
+/**
+ * blkcache_hash - INTERNAL function that adds a block to the hash table
+ *
+ * @param cache The cache to operate on
+ * @param entry The block to add
+ */
+
+static void blkcache_hash( blkcache_cache_t *cache, blkcache_entry_t *entry )
+{
+	blkcache_entry_t **bkt = blkcache_bucket( cache, entry->offset );
+
+	entry->bkt_next = *bkt;
+	*bkt = entry;
+}
+
+/**
+ * blkcache_relink - INTERNAL function that moves a block to the list matching
+ * its flags, the caller must hold the cache lock.
+ *
+ * A block that becomes clean is treated as the most recently used one.
+ *
+ * @param cache The cache to operate on
+ * @param entry The block whose flags changed
+ */
+
+static void blkcache_relink( blkcache_cache_t *cache, blkcache_entry_t *entry )
+{
+	llist_unlink( ( llist_t * ) entry );
+	llist_add_end( BLKCACHE_BUSY( entry ) ? &cache->busy_list :
+						&cache->block_list,
+		       ( llist_t * ) entry );
+}
+
 /**
  * blkcache_free - Destroys a cache and releases all memory associated with it
  *
@@ -63,8 +204,8 @@ blkcache_cache_t *blkcache_create( aoff_t block_size, int max_entries )
 int blkcache_free( blkcache_cache_t *cache )
 {
 	blkcache_entry_t	*entry;
-	llist_t			*_e;
-	int			successful = 1;
+	llist_t			*_e, *_n;
+	int			successful;
 
 	assert(cache != NULL);
 
@@ -74,25 +215,22 @@ int blkcache_free( blkcache_cache_t *cache )
 	/* Iterate over the blocklist */
 	for (_e = cache->block_list.next;
 		_e != &( cache->block_list ) ;
-		_e = cache->block_list.next ) {
+		_e = _n ) {
+
+		_n = _e->next;
 
 		entry = ( blkcache_entry_t * ) _e;
 
 		assert (entry != NULL);
 
-		/* Check if the block is dirty */
-
-		if (entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY) {
-
-			/* If so, skip this block and note that we have */
-			/* dirty blocks left */
-			successful = 0;
+		/* Skip blocks that are being read */
+		if ( !BLKCACHE_DISCARDABLE( entry ) )
 			continue;
 
-		}
-
-		/* Remove the block from the list */
+		/* Remove the block from the list and the table */
 		llist_unlink( _e );
+		blkcache_unhash( cache, entry );
+		cache->entry_count--;
 
 		/* Release its data memory */
 		heapmm_free( entry->data, cache->block_size );
@@ -102,11 +240,16 @@ int blkcache_free( blkcache_cache_t *cache )
 
 	}
 
+	successful = llist_get_first( &cache->dirty_list ) == NULL &&
+		     cache->writeback_count == 0;
+
 	/* Release lock */
 	semaphore_up( &cache->lock );
 
 	/* If there were no dirty blocks left, release the cache */
 	if ( successful ) {
+		heapmm_free( cache->table, cache->table_size *
+					   sizeof( blkcache_entry_t * ) );
 		heapmm_free( cache, sizeof( blkcache_cache_t ) );
 	}
 
@@ -115,62 +258,204 @@ int blkcache_free( blkcache_cache_t *cache )
 }
 
 /**
- * blkcache_get_iterator - INTERNAL function that selects the block to be
- * returned by llist_iterate_select in blkcache_get_dirty
+ * blkcache_get_dirty - Get the oldest dirty block from the cache that is not
+ * being written back
+ *
+ * @param cache The cache to get the block from
+ *
+ * @return The block that was requested, or NULL if no blocks are dirty
+ */
+
+blkcache_entry_t *blkcache_get_dirty( blkcache_cache_t *cache )
+{
+	blkcache_entry_t *entry = NULL;
+	llist_t *link;
+
+	assert (cache != NULL);
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
+	/* Blocks that were written to while being written back can only be
+	 * written again once that finishes, they are rare so just skip them */
+	for ( link = cache->dirty_list.next;
+	      link != &cache->dirty_list;
+	      link = link->next ) {
+		entry = BLKCACHE_DIRTY_ENTRY( link );
+		if ( !( entry->flags & BLKCACHE_ENTRY_FLAG_WRITEBACK ) )
+			break;
+		entry = NULL;
+	}
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
+
+	return entry;
+}
+
+/**
+ * blkcache_mark_dirty - Mark a block as modified
  *
- * @param node The block to be tested
- * @param param UNUSED
+ * @param cache The cache the block belongs to
+ * @param entry The block that was modified
+ */
+
+void blkcache_mark_dirty( blkcache_cache_t *cache, blkcache_entry_t *entry )
+{
+	assert (cache != NULL);
+	assert (entry != NULL);
+
+	if ( entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY )
+		return;
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
+	/* A failed write-back may have marked it dirty in the meantime */
+	if ( entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY ) {
+		semaphore_up( &cache->lock );
+		return;
+	}
+
+	entry->flags |= BLKCACHE_ENTRY_FLAG_DIRTY;
+	entry->dirtied = system_time;
+	llist_add_end( &cache->dirty_list, &entry->dirty_link );
+	cache->dirty_count++;
+	blkcache_relink( cache, entry );
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
+}
+
+/**
+ * blkcache_mark_clean - Mark a block as written back to storage
  *
- * @return TRUE when node starts at the specified offset, FALSE otherwise
+ * @param cache The cache the block belongs to
+ * @param entry The block that was written back
  */
 
-int blkcache_dirty_iterator ( llist_t *node, __attribute__(( unused ))
-											void *param )
+void blkcache_mark_clean( blkcache_cache_t *cache, blkcache_entry_t *entry )
 {
-	blkcache_entry_t *block = (blkcache_entry_t *) node;
+	assert (cache != NULL);
+	assert (entry != NULL);
+
+	if ( !( entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY ) )
+		return;
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
 
-	/* If the block starts at the requested offset return TRUE. */
-	return block->flags & BLKCACHE_ENTRY_FLAG_DIRTY;
+	entry->flags &= ~BLKCACHE_ENTRY_FLAG_DIRTY;
+	llist_unlink( &entry->dirty_link );
+	cache->dirty_count--;
+	blkcache_relink( cache, entry );
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
 }
 
 /**
- * blkcache_find - Get the first dirty block from the cache
+ * blkcache_start_writeback - Mark a dirty block as being written back
  *
- * @param cache The cache to get the block from
+ * The block is marked clean so that writes during the write-back dirty it
+ * again, and it is kept in the cache until blkcache_end_writeback is called.
  *
- * @return The block that was requested, or NULL incase it is not in the cache
+ * @param cache The cache the block belongs to
+ * @param entry The block that is to be written back
  */
 
-blkcache_entry_t *blkcache_get_dirty( blkcache_cache_t *cache )
+void blkcache_start_writeback( blkcache_cache_t *cache,
+			       blkcache_entry_t *entry )
 {
-	/* Look up the block in the cache which satisfies the condition for */
-	/* blkcache_dirty_iterator */
+	assert (cache != NULL);
+	assert (entry != NULL);
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
+	assert( entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY );
+	assert( !( entry->flags & BLKCACHE_ENTRY_FLAG_WRITEBACK ) );
+
+	entry->flags &= ~BLKCACHE_ENTRY_FLAG_DIRTY;
+	entry->flags |= BLKCACHE_ENTRY_FLAG_WRITEBACK;
+	llist_unlink( &entry->dirty_link );
+	cache->dirty_count--;
+	cache->writeback_count++;
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
+}
+
+/**
+ * blkcache_end_writeback - Mark the write-back of a block as finished
+ *
+ * @param cache The cache the block belongs to
+ * @param entry The block that was written back
+ * @param failed Nonzero if the block did not reach storage, it is marked
+ *		 dirty again in that case
+ */
 
+void blkcache_end_writeback( blkcache_cache_t *cache,
+			     blkcache_entry_t *entry, int failed )
+{
 	assert (cache != NULL);
+	assert (entry != NULL);
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
+	assert( entry->flags & BLKCACHE_ENTRY_FLAG_WRITEBACK );
 
-	return (blkcache_entry_t *)
-		llist_iterate_select(	&(cache->block_list),
-					&blkcache_dirty_iterator,
-					NULL);
+	entry->flags &= ~BLKCACHE_ENTRY_FLAG_WRITEBACK;
+	cache->writeback_count--;
 
+	/* Put a block that was not written to storage back at the head of
+	 * the dirty list, it keeps the time at which it became dirty */
+	if ( failed && !( entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY ) ) {
+		entry->flags |= BLKCACHE_ENTRY_FLAG_DIRTY;
+		llist_add_end( cache->dirty_list.next, &entry->dirty_link );
+		cache->dirty_count++;
+	}
+
+	blkcache_relink( cache, entry );
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
 }
 
 /**
- * blkcache_get_iterator - INTERNAL function that selects the block to be
- * returned by llist_iterate_select in blkcache_find
+ * blkcache_lookup - INTERNAL function that looks up a block and marks it as
+ * most recently used, the caller must hold the cache lock.
  *
- * @param node The block to be tested
- * @param param The offset we are testing the blocks for
+ * @param cache The cache to get the block from
+ * @param offset The offset of the block to get
  *
- * @return TRUE when node starts at the specified offset, FALSE otherwise
+ * @return The block that was requested, or NULL incase it is not in the cache
  */
 
-int blkcache_get_iterator ( llist_t *node, void *param )
+static blkcache_entry_t *blkcache_lookup( blkcache_cache_t *cache,
+					  aoff_t offset )
 {
-	blkcache_entry_t *block = (blkcache_entry_t *) node;
+	blkcache_entry_t *entry;
+
+	for ( entry = *blkcache_bucket( cache, offset );
+	      entry != NULL;
+	      entry = entry->bkt_next ) {
+
+		if ( entry->offset != offset )
+			continue;
 
-	/* If the block starts at the requested offset return TRUE. */
-	return block->offset == (aoff_t) param;
+		/* Move the block to the most recently used end of the list */
+		if ( !BLKCACHE_BUSY( entry ) ) {
+			llist_unlink( ( llist_t * ) entry );
+			llist_add_end( &( cache->block_list ), ( llist_t * ) entry );
+		}
+
+		return entry;
+
+	}
+
+	return NULL;
 }
 
 /**
@@ -186,24 +471,82 @@ blkcache_entry_t *blkcache_find( blkcache_cache_t *cache, aoff_t offset )
 {
 	blkcache_entry_t *entry;
 
-	/* Look up the block in the cache which satisfies the condition for */
-	/* blkcache_get_iterator */
+	assert (cache != NULL);
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
+	entry = blkcache_lookup( cache, offset );
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
+
+	return entry;
+
+}
+
+/**
+ * blkcache_peek - Get a block from the cache without marking it as used
+ *
+ * @param cache The cache to get the block from
+ * @param offset The offset of the block to get
+ *
+ * @return The block that was requested, or NULL incase it is not in the cache
+ */
+
+blkcache_entry_t *blkcache_peek( blkcache_cache_t *cache, aoff_t offset )
+{
+	blkcache_entry_t *entry;
 
 	assert (cache != NULL);
 
 	/* Acquire lock on cache */
 	semaphore_down( &cache->lock );
 
-	entry = (blkcache_entry_t *)
-		llist_iterate_select(	&(cache->block_list),
-					&blkcache_get_iterator,
-					(void *) offset);
+	for ( entry = *blkcache_bucket( cache, offset );
+	      entry != NULL;
+	      entry = entry->bkt_next )
+		if ( entry->offset == offset )
+			break;
 
 	/* Release lock */
 	semaphore_up( &cache->lock );
 
 	return entry;
+}
+
+/**
+ * blkcache_remove - Drop a block from the cache
+ *
+ * @param cache The cache to operate on
+ * @param entry The block to drop, its contents are discarded even if dirty
+ */
+
+void blkcache_remove( blkcache_cache_t *cache, blkcache_entry_t *entry )
+{
+	assert (cache != NULL);
+	assert (entry != NULL);
+
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
+	assert( !( entry->flags & ( BLKCACHE_ENTRY_FLAG_WRITEBACK |
+				   BLKCACHE_ENTRY_FLAG_READING ) ) );
+
+	if ( entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY ) {
+		llist_unlink( &entry->dirty_link );
+		cache->dirty_count--;
+	}
+
+	llist_unlink( ( llist_t * ) entry );
+	blkcache_unhash( cache, entry );
+	cache->entry_count--;
+
+	/* Release lock */
+	semaphore_up( &cache->lock );
 
+	heapmm_free( entry->data, cache->block_size );
+	heapmm_free( entry, sizeof(blkcache_entry_t) );
 }
 
 /**
@@ -215,9 +558,9 @@ blkcache_entry_t *blkcache_find( blkcache_cache_t *cache, aoff_t offset )
 
 void blkcache_bump( blkcache_cache_t *cache, blkcache_entry_t *entry )
 {
-	/* The current implementation of the cache removes the first block  */
-	/* in the list when full so to implement a LRU cache we simply move */
-	/* the block to the end of the list */
+	/* The cache removes the first block in the list when full so to */
+	/* implement a LRU cache we simply move the block to the end of */
+	/* the list */
 
 	assert (cache != NULL);
 	assert (entry != NULL);
@@ -225,11 +568,14 @@ void blkcache_bump( blkcache_cache_t *cache, blkcache_entry_t *entry )
 	/* Acquire lock on cache */
 	semaphore_down( &cache->lock );
 
-	/* Remove the block from the list */
-	llist_unlink((llist_t *) &entry);
+	/* Blocks on the busy list are not ordered */
+	if ( !BLKCACHE_BUSY( entry ) ) {
+		/* Remove the block from the list */
+		llist_unlink((llist_t *) entry);
 
-	/* Re-add it at the end of the list */
-	llist_add_end(&(cache->block_list), (llist_t *) entry);
+		/* Re-add it at the end of the list */
+		llist_add_end(&(cache->block_list), (llist_t *) entry);
+	}
 
 	/* Release lock */
 	semaphore_up( &cache->lock );
@@ -240,17 +586,94 @@ void blkcache_bump( blkcache_cache_t *cache, blkcache_entry_t *entry )
  *
  * @param cache The cache to operate on
  *
- * @return The block to be discarded next
+ * @return The least recently used block that can be discarded without
+ *	writing it back, or NULL if there is none
  */
 
 blkcache_entry_t *blkcache_get_discard_candidate( blkcache_cache_t *cache )
 {
-	/* The current implementation of the cache removes the first block  */
-	/* in the list when full so simply return that block */
+	blkcache_entry_t *entry, *first = NULL;
+	llist_t *_e;
+
+	/* The cache removes the least recently used clean block when full, */
+	/* dirty blocks are on the busy list and are left for the flusher */
 
 	assert (cache != NULL);
 
-	return (blkcache_entry_t *) cache->block_list.next;
+	while ( ( _e = llist_get_first( &cache->block_list ) ) ) {
+		entry = ( blkcache_entry_t * ) _e;
+
+		if ( BLKCACHE_DISCARDABLE( entry ) )
+			return entry;
+
+		/* Every block left is being read */
+		if ( entry == first )
+			break;
+		if ( !first )
+			first = entry;
+
+		/* Pass over a block that is being read, it was only just
+		 * added so it goes back to the most recently used end */
+		llist_unlink( _e );
+		llist_add_end( &cache->block_list, _e );
+	}
+
+	return NULL;
+}
+
+/**
+ * blkcache_discard - INTERNAL function that drops a clean block and frees it,
+ * the caller must hold the cache lock.
+ *
+ * @param cache The cache to operate on
+ * @param entry The block to drop
+ */
+
+static void blkcache_discard( blkcache_cache_t *cache, blkcache_entry_t *entry )
+{
+	llist_unlink( ( llist_t * ) entry );
+	blkcache_unhash( cache, entry );
+	cache->entry_count--;
+
+	heapmm_free( entry->data, cache->block_size );
+	heapmm_free( entry, sizeof(blkcache_entry_t) );
+}
+
+/**
+ * blkcache_shrink - Discard clean blocks to release memory
+ *
+ * Does nothing if the cache is locked, as the holder may be waiting for
+ * memory.
+ *
+ * @param cache The cache to operate on
+ * @param nr The maximum number of blocks to discard
+ *
+ * @return The number of blocks that were discarded
+ */
+
+int blkcache_shrink( blkcache_cache_t *cache, int nr )
+{
+	blkcache_entry_t *entry;
+	int count = 0;
+
+	assert (cache != NULL);
+
+	if ( !semaphore_try_down( &cache->lock ) )
+		return 0;
+
+	while ( count < nr ) {
+		entry = blkcache_get_discard_candidate( cache );
+		if ( !entry )
+			break;
+		if ( entry->flags & BLKCACHE_ENTRY_FLAG_READAHEAD )
+			cache->readahead_wasted++;
+		blkcache_discard( cache, entry );
+		count++;
+	}
+
+	semaphore_up( &cache->lock );
+
+	return count;
 }
 
 /**
@@ -259,50 +682,72 @@ blkcache_entry_t *blkcache_get_discard_candidate( blkcache_cache_t *cache )
  *
  * @param cache The cache to get the block from
  * @param offset The offset of the block to get/add
+ * @param flags BLKCACHE_GET_GROW to add a block beyond the size limit instead
+ *	of returning NULL
  *
  * @return The block that was requested, or NULL incase the cache was full and
- *	the block that was to be removed was dirty.
+ *	all blocks were dirty or being written back.
  * @exception 2^32-1 is returned if there was not enough memory to add the block
  */
 
-blkcache_entry_t *blkcache_get( blkcache_cache_t *cache, aoff_t offset )
+blkcache_entry_t *blkcache_get( blkcache_cache_t *cache, aoff_t offset,
+				int flags )
 {
-	blkcache_entry_t	*entry;
+	blkcache_entry_t	*entry, *victim;
 
 	assert (cache != NULL);
 
+	/* Acquire lock on cache */
+	semaphore_down( &cache->lock );
+
 	/* Attempt to get cached block */
-	entry = blkcache_find( cache, offset );
-	if ( entry )
+	entry = blkcache_lookup( cache, offset );
+	if ( entry ) {
+		semaphore_up( &cache->lock );
 		return entry;
+	}
 
 	/* Block not cached, add new block */
 
-	/* Acquire lock on cache */
-	semaphore_down( &cache->lock );
-
-	/* Enforce cache size limit */
-	if ( cache->entry_count == cache->max_entries ) {
-		/* Cache full, proceed to remove item */
-
-		/* Get the block to be removed */
+	/* Enforce cache size limit, unless there is memory to spare and the
+	 * hash chains are still short */
+	entry = NULL;
+	if ( cache->entry_count >= cache->max_entries &&
+	     ( !shrinker_may_grow() ||
+	       cache->entry_count >= cache->table_size * BLKCACHE_GROW_LIMIT ) ) {
+		/* Cache full, get the block to be removed */
 		entry = blkcache_get_discard_candidate( cache );
 
-		assert (entry != NULL);
-
-		/* Check whether block is dirty */
-		if (entry->flags & BLKCACHE_ENTRY_FLAG_DIRTY) {
-			/* Block was dirty, return NULL to indicate a flush */
-			/* is required */
+		/* Check whether all blocks are dirty */
+		if ( !entry && !( flags & BLKCACHE_GET_GROW ) ) {
+			/* Return NULL to indicate a flush is required */
 
 			/* Release lock */
 			semaphore_up( &cache->lock );
 
 			return NULL;
 		}
+	}
+
+	if ( entry ) {
+		/* Cache full, proceed to remove item */
+
+		if ( entry->flags & BLKCACHE_ENTRY_FLAG_READAHEAD )
+			cache->readahead_wasted++;
 
-		/* Actually remove block from the list */
+		/* Actually remove block from the list and the table */
 		llist_unlink((llist_t *) entry);
+		blkcache_unhash( cache, entry );
+
+		/* Shrink back to the limit if the cache was grown */
+		while ( cache->entry_count > cache->max_entries ) {
+			victim = blkcache_get_discard_candidate( cache );
+			if ( !victim )
+				break;
+			if ( victim->flags & BLKCACHE_ENTRY_FLAG_READAHEAD )
+				cache->readahead_wasted++;
+			blkcache_discard( cache, victim );
+		}
 
 		/* Proceed to reuse the block memory, reset descriptor */
 		entry->offset = offset;
@@ -311,9 +756,6 @@ blkcache_entry_t *blkcache_get( blkcache_cache_t *cache, aoff_t offset )
 		/* ... clear its data memory */
 		memset(entry->data, 0, cache->block_size);
 
-		/* And add it as the new block */
-		llist_add_end(&(cache->block_list), (llist_t *) entry);
-
 	} else {
 		/* There is still room left in the cache */
 
@@ -353,12 +795,14 @@ blkcache_entry_t *blkcache_get( blkcache_cache_t *cache, aoff_t offset )
 		/* ... clear it */
 		memset(entry->data, 0, cache->block_size);
 
-		/* Add the new block */
 		cache->entry_count++;
-		llist_add_end(&(cache->block_list), (llist_t *) entry);
 
 	}
 
+	/* Add the new block */
+	llist_add_end(&(cache->block_list), (llist_t *) entry);
+	blkcache_hash( cache, entry );
+
 	/* Release lock */
 	semaphore_up( &cache->lock );
 
@@ -8,22 +8,316 @@
  * Changelog:
  * @li 17-04-2014 - Created
  * @li 14-07-2014 - Documented
+ * @li 17-10-2026 - Coalesce consecutive blocks into multi-block requests
+ * @li 17-10-2026 - Added request scheduling
+ * @li 17-10-2026 - Added the write-back flusher and dirty throttling
+ * @li 17-10-2026 - Added sequential read-ahead
+ * @li 17-10-2026 - Added the block cache shrinker
  */
 
 #include "kernel/heapmm.h"
 #include "kernel/device.h"
+#include "kernel/syscall.h"
+#include "kernel/scheduler.h"
+#include "kernel/time.h"
+#include "kernel/shrinker.h"
 #define CON_SRC ("blkdev")
 #include "kernel/console.h"
 #include <sys/types.h>
 #include <sys/errno.h>
+#include <sys/ioctl.h>
 #include <string.h>
 #include <assert.h>
 
+/**
+ * @brief The maximum number of blocks transferred in a single request
+ */
+#define BLKDEV_MAX_RUN	(32)
+
+/**
+ * @brief The age in seconds after which the flusher writes back a dirty block
+ */
+#define BLKDEV_DIRTY_EXPIRE	(5)
+
+/**
+ * @brief The percentage of a cache that may be dirty before the flusher
+ * starts writing back blocks regardless of their age
+ */
+#define BLKDEV_DIRTY_BACKGROUND	(25)
+
+/**
+ * @brief The percentage of a cache that may be dirty before writers are made
+ * to wait for the flusher
+ */
+#define BLKDEV_DIRTY_LIMIT	(50)
+
+/**
+ * @brief The interval in microseconds at which the flusher looks for expired
+ * dirty blocks
+ */
+#define BLKDEV_FLUSH_INTERVAL	(1000000)
+
+/**
+ * @brief The time in microseconds a throttled writer waits before checking
+ * the dirty limit again
+ */
+#define BLKDEV_THROTTLE_WAIT	(10000)
+
+/**
+ * @brief The number of sequential streams tracked for each device
+ */
+#define BLKDEV_RA_STREAMS	(4)
+
+/**
+ * @brief The number of read-ahead requests that may be in flight per device
+ */
+#define BLKDEV_RA_SLOTS		(4)
+
+/**
+ * @brief The read-ahead window in blocks once a stream is found sequential
+ */
+#define BLKDEV_RA_MIN		(2)
+
+/**
+ * @brief The time in microseconds a reader waits before checking a block that
+ * is being read ahead again
+ */
+#define BLKDEV_RA_WAIT		(10000)
+
+/**
+ * @brief Check whether the dirty blocks of a cache exceed a percentage of it
+ */
+#define BLKDEV_DIRTY_ABOVE(Cache, Pct) \
+	((Cache)->dirty_count * 100 > (Cache)->max_entries * (Pct))
+
+/**
+ * @brief Tracks a stream of sequential reads
+ */
+typedef struct blk_ra_stream {
+	/** The offset at which the next read of the stream starts */
+	aoff_t		 next;
+	/** The end of the blocks read ahead for the stream */
+	aoff_t		 ra_end;
+	/** The number of blocks to read ahead, 0 until the stream is found
+	 *  to be sequential */
+	int		 window;
+} blk_ra_stream_t;
+
+/**
+ * @brief A read-ahead request and the blocks it fills
+ */
+typedef struct blk_ra_slot {
+	blk_request_t	 req;
+	blk_readahead_t	*ra;
+	blkcache_entry_t *run[BLKDEV_MAX_RUN];
+	void		*buffers[BLKDEV_MAX_RUN];
+	/** Nonzero while the request is in flight */
+	volatile int	 busy;
+} blk_ra_slot_t;
+
+struct blk_readahead {
+	blk_ra_stream_t	 streams[BLKDEV_RA_STREAMS];
+	/** The stream that is replaced by the next new stream */
+	int		 replace;
+	blk_ra_slot_t	 slots[BLKDEV_RA_SLOTS];
+	/** Raised when a read-ahead request completes */
+	semaphore_t	 done;
+	unsigned int	 hits;
+	unsigned int	 misses;
+	unsigned int	 issued;
+};
+
 /**
  * @brief Stores the driver descriptors for each block major device
  */
 blk_dev_t **block_dev_table;
 
+/**
+ * @brief Nonzero once the flusher task is running
+ */
+static int device_block_flusher_running = 0;
+
+/**
+ * @brief Raised to make the flusher look for work before its interval ends
+ */
+static semaphore_t device_block_flusher_wake;
+
+/**
+ * @brief Raised by the flusher every time it wrote back a run of blocks
+ */
+static semaphore_t device_block_cleaned;
+
+/**
+ * @brief Get the maximum request length for a device
+ *
+ * Requests are built from cache entries, so they are limited to half the
+ * cache to keep the blocks of a request from evicting each other.
+ * @param drv The driver to get the limit for
+ * @return The maximum number of blocks in a single request
+ */
+static int device_block_max_run(blk_dev_t *drv)
+{
+	int max = drv->cache_size / 2;
+
+	if (max > BLKDEV_MAX_RUN)
+		max = BLKDEV_MAX_RUN;
+
+	return max < 1 ? 1 : max;
+}
+
+/**
+ * @brief Get the maximum read-ahead window for a device
+ *
+ * The window is kept to a quarter of the cache so blocks that were read
+ * ahead are not evicted before they are used.
+ * @param drv The driver to get the limit for
+ * @return The maximum number of blocks to read ahead
+ */
+static int device_block_ra_max(blk_dev_t *drv)
+{
+	int max = drv->cache_size / 4;
+
+	if (max > device_block_max_run(drv))
+		max = device_block_max_run(drv);
+
+	return max < BLKDEV_RA_MIN ? BLKDEV_RA_MIN : max;
+}
+
+/**
+ * @brief Transfer a run of consecutive blocks without the request queue
+ *
+ * Uses the vectored driver calls if present, falls back to one call per
+ * block otherwise.
+ * @param drv The driver to use
+ * @param device The device id to operate on
+ * @param offset The starting offset of the first block
+ * @param buffers The buffers for each block
+ * @param count The number of blocks
+ * @param write Nonzero to write the blocks, zero to read them
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int device_block_transfer_sync(blk_dev_t *drv, dev_t device,
+                                      aoff_t offset, void * const *buffers,
+                                      int count, int write)
+{
+	int rv, n;
+
+	if (write && drv->ops->writev)
+		return drv->ops->writev(device, offset, buffers, count);
+	else if (!write && drv->ops->readv)
+		return drv->ops->readv(device, offset, buffers, count);
+
+	for (n = 0; n < count; n++) {
+		if (write)
+			rv = drv->ops->write(device, offset, buffers[n]);
+		else
+			rv = drv->ops->read(device, offset, buffers[n]);
+		if (rv)
+			return rv;
+		offset += drv->block_size;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Transfer a run of consecutive blocks between storage and memory
+ *
+ * Queues the request if the driver supports it and sleeps until it is done.
+ * @param drv The driver to use
+ * @param device The device id to operate on
+ * @param offset The starting offset of the first block
+ * @param buffers The buffers for each block
+ * @param count The number of blocks
+ * @param write Nonzero to write the blocks, zero to read them
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int device_block_transfer(blk_dev_t *drv, dev_t device, aoff_t offset,
+                                 void * const *buffers, int count, int write)
+{
+	blk_request_t req;
+	int rv;
+
+	if (!drv->ops->submit)
+		return device_block_transfer_sync(drv, device, offset,
+		                                  buffers, count, write);
+
+	req.device   = device;
+	req.offset   = offset;
+	req.buffers  = buffers;
+	req.count    = count;
+	req.write    = write;
+	req.complete = NULL;
+
+	rv = device_block_submit(&req);
+	if (rv)
+		return rv;
+
+	return device_block_wait(&req);
+}
+
+/**
+ * @brief Count the cached blocks that could be discarded
+ */
+static size_t device_block_shrinker_count(
+				__attribute__((unused)) shrinker_t *shrinker)
+{
+	blk_dev_t *drv;
+	blkcache_cache_t *cache;
+	dev_t mj,mi;
+	int count;
+	size_t total = 0;
+
+	for (mj = 0; mj < 256; mj++) {
+		drv = block_dev_table[mj];
+		if (!drv)
+			continue;
+		for (mi = 0; mi < drv->minor_count; mi++) {
+			cache = drv->caches[mi];
+			count = cache->entry_count - cache->dirty_count -
+				cache->writeback_count;
+			if (count > 0)
+				total += count;
+		}
+	}
+
+	return total;
+}
+
+/**
+ * @brief Discard clean cached blocks, devices that are in use are skipped
+ */
+static size_t device_block_shrinker_scan(
+				__attribute__((unused)) shrinker_t *shrinker,
+				size_t nr)
+{
+	blk_dev_t *drv;
+	dev_t mj,mi;
+	size_t released = 0;
+
+	for (mj = 0; mj < 256 && released < nr; mj++) {
+		drv = block_dev_table[mj];
+		if (!drv)
+			continue;
+		for (mi = 0; mi < drv->minor_count && released < nr; mi++) {
+			if (!semaphore_try_down(&drv->locks[mi]))
+				continue;
+			released += blkcache_shrink(drv->caches[mi],
+						    (int) (nr - released));
+			semaphore_up(&drv->locks[mi]);
+		}
+	}
+
+	return released;
+}
+
+static shrinker_t device_block_shrinker = {
+	.name  = "blkcache",
+	.pass  = SHRINKER_PASS_CACHE,
+	.count = device_block_shrinker_count,
+	.scan  = device_block_shrinker_scan
+};
+
 /**
  * @brief Initialize the block device interface
  */
@@ -35,6 +329,11 @@ void device_block_init()
 
 	/* Clear the device table */
 	memset( block_dev_table, 0, sizeof(blk_dev_t *) * 256 );
+
+	semaphore_init( &device_block_flusher_wake );
+	semaphore_init( &device_block_cleaned );
+
+	shrinker_register( &device_block_shrinker );
 }
 
 /**
@@ -54,6 +353,9 @@ int device_block_register(blk_dev_t *driver)
 	if (block_dev_table[driver->major])
 		return 0;
 
+	/* Initialize the request queue */
+	blk_queue_init(&driver->queue, driver->block_size);
+
 	/* Allocate memory for the minor device cache table */
 	driver->caches =
 		heapmm_alloc(sizeof(blkcache_cache_t *)
@@ -82,6 +384,27 @@ int device_block_register(blk_dev_t *driver)
 		}
 	}
 
+	/* Allocate the read-ahead state table, the state itself is allocated
+	 * on the first read */
+	driver->readahead =
+		heapmm_alloc(sizeof(blk_readahead_t *)
+				* driver->minor_count);
+
+	/* Check for errors */
+	if (!driver->readahead) {
+		/* Clean up */
+		for (_m = 0; _m < driver->minor_count; _m++)
+			blkcache_free(driver->caches[_m]);
+		heapmm_free(
+			driver->caches,
+			sizeof(blkcache_cache_t *)
+				* driver->minor_count);
+		return 0;
+	}
+
+	memset(driver->readahead, 0,
+	       sizeof(blk_readahead_t *) * driver->minor_count);
+
 	/* Allocate the minor device lock table */
 	driver->locks =
 		heapmm_alloc(sizeof(semaphore_t)
@@ -92,6 +415,10 @@ int device_block_register(blk_dev_t *driver)
 		/* Clean up */
 		for (_m = 0; _m < driver->minor_count; _m++)
 			blkcache_free(driver->caches[_m]);
+		heapmm_free(
+			driver->readahead,
+			sizeof(blk_readahead_t *)
+				* driver->minor_count);
 		heapmm_free(
 			driver->caches,
 			sizeof(blkcache_cache_t *)
@@ -112,6 +439,10 @@ int device_block_register(blk_dev_t *driver)
 				driver->locks,
 				sizeof(semaphore_t)
 					* driver->minor_count);
+			heapmm_free(
+				driver->readahead,
+				sizeof(blk_readahead_t *)
+					* driver->minor_count);
 			heapmm_free(
 				driver->caches,
 				sizeof(blkcache_cache_t *)
@@ -128,6 +459,160 @@ int device_block_register(blk_dev_t *driver)
 	return 1;
 }
 
+/**
+ * @brief Submit a block request
+ *
+ * The request is queued if the driver supports it, otherwise it is performed
+ * synchronously before this function returns. Either way, it is completed
+ * through device_block_complete.
+ * @param request The request to submit
+ * @return 0 if successful, a valid errorcode if the request was not queued
+ * @exception ENXIO _device_ does not refer to a valid block device
+ */
+int device_block_submit(blk_request_t *request)
+{
+	dev_t major = MAJOR(request->device);
+	dev_t minor = MINOR(request->device);
+	blk_dev_t *drv = block_dev_table[major];
+
+	/* Check if the device exists */
+	if ((!drv) || (minor >= drv->minor_count)) {
+		return ENXIO;
+	}
+
+	request->status = 0;
+	request->merged = NULL;
+	request->total = request->count;
+	semaphore_init(&request->done);
+
+	if (drv->ops->submit)
+		return drv->ops->submit(request);
+
+	device_block_complete(request,
+		device_block_transfer_sync(drv, request->device,
+		                           request->offset, request->buffers,
+		                           request->count, request->write));
+
+	return 0;
+}
+
+/**
+ * @brief Complete a block request
+ *
+ * Called by the driver when it is done with a request, this function may be
+ * called from interrupt context. Requests that were merged into _request_ by
+ * the scheduler are completed along with it.
+ * @param request The request that was completed
+ * @param status 0 if successful, a valid errorcode if not
+ */
+void device_block_complete(blk_request_t *request, int status)
+{
+	blk_request_t *next;
+
+	for (; request; request = next) {
+		/* The submitter may release the request once it is woken */
+		next = request->merged;
+		request->status = status;
+		if (request->complete)
+			request->complete(request);
+		semaphore_up(&request->done);
+	}
+}
+
+/**
+ * @brief Wait for a block request to complete
+ * @param request The request to wait for
+ * @return The status of the request
+ */
+int device_block_wait(blk_request_t *request)
+{
+	//TODO: Recover from lost interrupts
+	semaphore_down(&request->done);
+	return request->status;
+}
+
+/**
+ * @brief Check whether a block can be written back now
+ *
+ * A block that is being written back is not written again until that has
+ * finished, as the older data could otherwise reach storage last.
+ * @param entry The block to check, may be NULL
+ * @return Nonzero if the block is dirty and not being written back
+ */
+static inline int device_block_flushable(blkcache_entry_t *entry)
+{
+	return entry && (entry->flags & (BLKCACHE_ENTRY_FLAG_DIRTY |
+	                                 BLKCACHE_ENTRY_FLAG_WRITEBACK))
+	                == BLKCACHE_ENTRY_FLAG_DIRTY;
+}
+
+/**
+ * @brief Write back a dirty block along with its dirty neighbours
+ *
+ * Consecutive dirty blocks around _entry_ are written in a single request.
+ * The caller must hold the lock on the device, if _unlock_ is set it is
+ * released while the request is in progress so readers of the device do not
+ * have to wait for the write-back.
+ * @param drv The driver to use
+ * @param device The device id to operate on
+ * @param entry The dirty block to write back
+ * @param unlock Nonzero to release the device lock during the transfer
+ * @return 0 if successful, a valid errorcode if not
+ */
+static int device_block_flush_run(blk_dev_t *drv, dev_t device,
+                                  blkcache_entry_t *entry, int unlock)
+{
+	blkcache_cache_t *cache = drv->caches[MINOR(device)];
+	blkcache_entry_t *run[BLKDEV_MAX_RUN];
+	void *buffers[BLKDEV_MAX_RUN];
+	blkcache_entry_t *e;
+	aoff_t first;
+	int max = device_block_max_run(drv);
+	int count, n, rv;
+
+	assert(device_block_flushable(entry));
+
+	/* Find the start of the dirty run, leaving room for the block itself */
+	first = entry->offset;
+	for (count = 1; count < max && first >= drv->block_size; count++) {
+		e = blkcache_peek(cache, first - drv->block_size);
+		if (!device_block_flushable(e))
+			break;
+		first -= drv->block_size;
+	}
+
+	/* Collect the run */
+	for (count = 0; count < max; count++) {
+		e = blkcache_peek(cache, first + count * drv->block_size);
+		if (!device_block_flushable(e))
+			break;
+		run[count] = e;
+		buffers[count] = e->data;
+	}
+
+	assert(count > 0);
+
+	/* Keep the blocks in the cache until they are written, writes to them
+	 * from here on will mark them dirty again */
+	for (n = 0; n < count; n++)
+		blkcache_start_writeback(cache, run[n]);
+
+	if (unlock)
+		semaphore_up(&drv->locks[MINOR(device)]);
+
+	/* Call the driver to write the blocks to storage */
+	rv = device_block_transfer(drv, device, first, buffers, count, 1);
+
+	/* If this failed the blocks are marked dirty again */
+	for (n = 0; n < count; n++)
+		blkcache_end_writeback(cache, run[n], rv);
+
+	if (unlock)
+		semaphore_down(&drv->locks[MINOR(device)]);
+
+	return rv;
+}
+
 /**
  * @brief Flush a block from the cache
  * @param device The device id to operate on
@@ -138,126 +623,430 @@ int device_block_register(blk_dev_t *driver)
 
 int device_block_flush(dev_t device, aoff_t block_offset)
 {
-	int rv;
 	blkcache_entry_t *entry;
 	dev_t major = MAJOR(device);
 	dev_t minor = MINOR(device);
 	blk_dev_t *drv = block_dev_table[major];
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENXIO;
 	}
 
 	/* Get the entry from the cache */
-	entry = blkcache_find(drv->caches[minor], block_offset);
+	entry = blkcache_peek(drv->caches[minor], block_offset);
 
-	/* If the block is not cached, return success */
-	if (!entry) {
+	/* If the block is not cached, clean or already being written back,
+	 * return success */
+	if (!device_block_flushable(entry)) {
 		return 0;
 	}
 
-	/* Call the driver to write the block to storage */
-	rv = drv->ops->write(device, block_offset, entry->data);
-
-	/* If successful clear the DIRTY flag from the cache entry */
-	if (!rv)
-		entry->flags &= ~BLKCACHE_ENTRY_FLAG_DIRTY;
-
-	return rv;
+	return device_block_flush_run(drv, device, entry, 0);
 }
 
 /**
- * @brief Fetch a block from storage and add it to the cache
+ * @brief Fetch consecutive blocks from storage and add them to the cache
  * @param device The device id to operate on
- * @param block_offset The starting offset of the block to fetch
+ * @param block_offset The starting offset of the first block to fetch
+ * @param count The number of blocks to fetch, at most device_block_max_run
  * @return 0 if successful, a valid errorcode if not
  * @exception ENXIO _device_ does not refer to a valid block device
  */
 
-int device_block_fetch(dev_t device, aoff_t block_offset)
+static int device_block_fetch_run(dev_t device, aoff_t block_offset, int count)
 {
-	int rv;
+	int rv, n;
+	blkcache_entry_t *run[BLKDEV_MAX_RUN];
+	void *buffers[BLKDEV_MAX_RUN];
 	blkcache_entry_t *entry;
 	dev_t major = MAJOR(device);
 	dev_t minor = MINOR(device);
 	blk_dev_t *drv = block_dev_table[major];
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENXIO;
 	}
 
-	/* Get the block from the cache, if it does not exist it will be added */
-	entry = blkcache_get(drv->caches[minor], block_offset);
+	assert(count > 0 && count <= device_block_max_run(drv));
 
-	/* Check if the cache was full */
-	if (!entry) {
-		/* If it is, flush the discard candidate */
-		rv = device_block_flush(device,
-			blkcache_get_discard_candidate(drv->caches[minor])->offset);
+	for (n = 0; n < count; n++) {
 
-		/* Check for errors */
+		/* Get the block from the cache, if it does not exist it will
+		 * be added. Reads never write back blocks to make room, if
+		 * all blocks are dirty the cache grows instead */
+		entry = blkcache_get(drv->caches[minor], block_offset,
+		                     BLKCACHE_GET_GROW);
+
+		/* Check if the cache ran out of memory */
+		rv = (entry == BLKCACHE_ENOMEM) ? ENOMEM : 0;
+
+		/* Check for errors, a partial run is still useful */
 		if (rv) {
-			return rv;
+			if (!n)
+				return rv;
+			count = n;
+			break;
 		}
 
-		/* blkcache_get will flush the discard candidate if the cache
-                 * is full but only if it is not DIRTY, we have just flushed it
-                 * so it will not be. */
-		entry = blkcache_get(drv->caches[minor], block_offset);
+		assert(entry != NULL);
 
+		run[n] = entry;
+		buffers[n] = entry->data;
+		block_offset += drv->block_size;
 	}
 
-	/* Check if the cache ran out of memory */
-	if (entry == BLKCACHE_ENOMEM)
-		return ENOMEM;
-	assert(entry != NULL);
-
 	/* Call the driver to actually read the data */
-	//TODO: Invalidate cache entry if this fails
-	return drv->ops->read(device, block_offset, entry->data);
+	rv = device_block_transfer(drv, device,
+	                           run[0]->offset, buffers, count, 0);
+
+	/* Do not leave stale data in the cache if this failed */
+	if (rv)
+		for (n = 0; n < count; n++)
+			blkcache_remove(drv->caches[minor], run[n]);
+
+	return rv;
+
+}
+
+/**
+ * @brief Fetch a block from storage and add it to the cache
+ * @param device The device id to operate on
+ * @param block_offset The starting offset of the block to fetch
+ * @return 0 if successful, a valid errorcode if not
+ * @exception ENXIO _device_ does not refer to a valid block device
+ */
+
+int device_block_fetch(dev_t device, aoff_t block_offset)
+{
+	return device_block_fetch_run(device, block_offset, 1);
+}
+
+/**
+ * @brief Get the read-ahead state of a device, allocating it if needed
+ *
+ * The caller must hold the lock on the device.
+ * @param drv The driver of the device
+ * @param minor The minor number of the device
+ * @return The read-ahead state, or NULL if there was no memory for it
+ */
+static blk_readahead_t *device_block_get_readahead(blk_dev_t *drv, dev_t minor)
+{
+	blk_readahead_t *ra = drv->readahead[minor];
+	int n;
+
+	if (ra)
+		return ra;
+
+	ra = heapmm_alloc(sizeof(blk_readahead_t));
+	if (!ra)
+		return NULL;
+
+	memset(ra, 0, sizeof(blk_readahead_t));
+	semaphore_init(&ra->done);
+
+	for (n = 0; n < BLKDEV_RA_STREAMS; n++)
+		ra->streams[n].next = (aoff_t) -1;
+
+	for (n = 0; n < BLKDEV_RA_SLOTS; n++)
+		ra->slots[n].ra = ra;
+
+	drv->readahead[minor] = ra;
+	return ra;
+}
+
+/**
+ * @brief Completion callback for read-ahead requests
+ *
+ * Called from interrupt context, the flags of the blocks may be changed here
+ * as nothing else touches blocks that are being read.
+ * @param req The request that completed
+ */
+static void device_block_ra_complete(blk_request_t *req)
+{
+	blk_ra_slot_t *slot = req->param;
+	int n;
+
+	for (n = 0; n < req->count; n++) {
+		if (req->status)
+			slot->run[n]->flags |= BLKCACHE_ENTRY_FLAG_ERROR;
+		slot->run[n]->flags &= ~BLKCACHE_ENTRY_FLAG_READING;
+	}
+
+	slot->busy = 0;
+
+	if (!slot->ra->done)
+		semaphore_up(&slot->ra->done);
+}
+
+/**
+ * @brief Wait for a block that is being read ahead
+ *
+ * Blocks whose read-ahead failed are dropped from the cache. The caller must
+ * hold the lock on the device.
+ * @param drv The driver of the device
+ * @param minor The minor number of the device
+ * @param entry The block to wait for, may be NULL
+ * @return The block, or NULL if it was not cached or its read-ahead failed
+ */
+static blkcache_entry_t *device_block_settle(blk_dev_t *drv, dev_t minor,
+                                             blkcache_entry_t *entry)
+{
+	blk_readahead_t *ra = drv->readahead[minor];
+
+	if (!entry || !(entry->flags & (BLKCACHE_ENTRY_FLAG_READING |
+	                                BLKCACHE_ENTRY_FLAG_READAHEAD |
+	                                BLKCACHE_ENTRY_FLAG_ERROR)))
+		return entry;
+
+	/* Only read-ahead sets these flags, so the state exists */
+	assert(ra != NULL);
+
+	while (entry->flags & BLKCACHE_ENTRY_FLAG_READING)
+		semaphore_ndown(&ra->done, BLKDEV_RA_WAIT, SCHED_WAITF_TIMEOUT);
+
+	if (entry->flags & BLKCACHE_ENTRY_FLAG_READAHEAD) {
+		entry->flags &= ~BLKCACHE_ENTRY_FLAG_READAHEAD;
+		ra->hits++;
+	}
+
+	if (entry->flags & BLKCACHE_ENTRY_FLAG_ERROR) {
+		blkcache_remove(drv->caches[minor], entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/**
+ * @brief Start reading blocks into the cache without waiting for them
+ *
+ * Blocks that are already cached are skipped. Read-ahead never writes back
+ * dirty blocks or grows the cache to make room, it stops instead. The caller
+ * must hold the lock on the device.
+ * @param drv The driver of the device
+ * @param device The device id to operate on
+ * @param ra The read-ahead state of the device
+ * @param offset The starting offset of the first block
+ * @param count The number of blocks to read
+ */
+static void device_block_readahead(blk_dev_t *drv, dev_t device,
+                                   blk_readahead_t *ra, aoff_t offset,
+                                   int count)
+{
+	blkcache_cache_t *cache = drv->caches[MINOR(device)];
+	blkcache_entry_t *entry;
+	blk_ra_slot_t *slot;
+	int max = device_block_max_run(drv);
+	int n, len, full = 0;
+
+	while (count && !full) {
+		/* Skip blocks that are already cached */
+		if (blkcache_peek(cache, offset)) {
+			offset += drv->block_size;
+			count--;
+			continue;
+		}
+
+		/* Find a free request slot */
+		for (n = 0; n < BLKDEV_RA_SLOTS; n++)
+			if (!ra->slots[n].busy)
+				break;
+		if (n == BLKDEV_RA_SLOTS)
+			return;
+		slot = &ra->slots[n];
+
+		/* Collect a run of uncached blocks */
+		for (len = 0; len < count && len < max; len++) {
+			if (len && blkcache_peek(cache,
+			                         offset + len * drv->block_size))
+				break;
+			entry = blkcache_get(cache, offset + len * drv->block_size,
+			                     0);
+			if (!entry || entry == BLKCACHE_ENOMEM) {
+				full = 1;
+				break;
+			}
+			entry->flags |= BLKCACHE_ENTRY_FLAG_READING |
+			                BLKCACHE_ENTRY_FLAG_READAHEAD;
+			slot->run[len] = entry;
+			slot->buffers[len] = entry->data;
+		}
+
+		if (!len)
+			return;
+
+		slot->req.device   = device;
+		slot->req.offset   = offset;
+		slot->req.buffers  = slot->buffers;
+		slot->req.count    = len;
+		slot->req.write    = 0;
+		slot->req.complete = device_block_ra_complete;
+		slot->req.param    = slot;
+		slot->busy = 1;
+
+		if (device_block_submit(&slot->req)) {
+			slot->busy = 0;
+			for (n = 0; n < len; n++) {
+				slot->run[n]->flags = 0;
+				blkcache_remove(cache, slot->run[n]);
+			}
+			return;
+		}
+
+		ra->issued += len;
+		offset += len * drv->block_size;
+		count -= len;
+	}
+}
+
+/**
+ * @brief Track sequential reads and read ahead for them
+ *
+ * A read that starts where an earlier read ended continues its stream. The
+ * read-ahead window of a stream doubles while the blocks read ahead are used
+ * and halves when they were evicted before the stream got to them. New
+ * blocks are read ahead once half of the window has been consumed. The
+ * caller must hold the lock on the device.
+ * @param drv The driver of the device
+ * @param device The device id that was read
+ * @param offset The offset of the read
+ * @param count The length of the read
+ * @param hits The number of blocks of the read that were read ahead
+ * @param misses The number of blocks of the read that were fetched
+ */
+static void device_block_ra_update(blk_dev_t *drv, dev_t device,
+                                   aoff_t offset, aoff_t count,
+                                   unsigned int hits, unsigned int misses)
+{
+	blk_readahead_t *ra = drv->readahead[MINOR(device)];
+	blk_ra_stream_t *stream;
+	aoff_t end = offset + count;
+	aoff_t next_block, target;
+	int n, max = device_block_ra_max(drv);
+
+	next_block = end + drv->block_size - 1;
+	next_block -= next_block % drv->block_size;
+
+	for (n = 0; n < BLKDEV_RA_STREAMS; n++)
+		if (ra->streams[n].next == offset)
+			break;
+
+	if (n == BLKDEV_RA_STREAMS) {
+		/* Not a continuation of a known stream, track a new one */
+		stream = &ra->streams[ra->replace];
+		ra->replace = (ra->replace + 1) % BLKDEV_RA_STREAMS;
+		stream->next = end;
+		stream->ra_end = next_block;
+		stream->window = 0;
+		return;
+	}
+
+	stream = &ra->streams[n];
+	stream->next = end;
+
+	/* Adapt the window */
+	if (!stream->window)
+		stream->window = BLKDEV_RA_MIN;
+	else if (misses && offset < stream->ra_end)
+		stream->window = stream->window / 2 < BLKDEV_RA_MIN ?
+		                 BLKDEV_RA_MIN : stream->window / 2;
+	else if (hits)
+		stream->window = stream->window * 2 > max ?
+		                 max : stream->window * 2;
+
+	if (stream->ra_end < next_block)
+		stream->ra_end = next_block;
+
+	/* Wait until half of the window has been consumed */
+	if (stream->ra_end - next_block >
+	    (aoff_t) (stream->window / 2) * drv->block_size)
+		return;
+
+	target = next_block + stream->window * drv->block_size;
+	if (target <= stream->ra_end)
+		return;
+
+	device_block_readahead(drv, device, ra, stream->ra_end,
+	                       (target - stream->ra_end) / drv->block_size);
+	stream->ra_end = target;
+}
+
+/**
+ * @brief Copy the read-ahead statistics of a device to userland
+ * @param drv The driver of the device
+ * @param minor The minor number of the device
+ * @param arg The userland buffer to copy them to
+ * @return 0 on success, -1 on failure with syscall_errno set
+ */
+static int device_block_ra_stats(blk_dev_t *drv, dev_t minor, int arg)
+{
+	blk_readahead_t *ra = drv->readahead[minor];
+	blk_ra_stats_t stats;
 
+	memset(&stats, 0, sizeof(blk_ra_stats_t));
+
+	if (ra) {
+		stats.brs_hits = ra->hits;
+		stats.brs_misses = ra->misses;
+		stats.brs_issued = ra->issued;
+	}
+	stats.brs_wasted = drv->caches[minor]->readahead_wasted;
+
+	if (!copy_kern_to_user(&stats, (void *) arg, sizeof(blk_ra_stats_t))) {
+		syscall_errno = EFAULT;
+		return -1;
+	}
+
+	return 0;
 }
 
 int device_block_flush_all(dev_t device)
 {
-	blkcache_entry_t *entry = (blkcache_entry_t *) 1;
+	blkcache_entry_t *entry;
+	blkcache_cache_t *cache;
 	dev_t major = MAJOR(device);
 	dev_t minor = MINOR(device);
 	blk_dev_t *drv = block_dev_table[major];
 	int rv;
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENXIO;
 	}
 
-	while (entry) {/* Get the entry from the cache */
-		entry = blkcache_get_dirty(drv->caches[minor]);
+	cache = drv->caches[minor];
 
-		/* If the block is not cached, return success */
-		if (!entry) {
-			return 0;
+	/* Acquire a lock on the device */
+	semaphore_down(&drv->locks[minor]);
+
+	for (;;) {
+		/* Get the oldest dirty block from the cache */
+		entry = blkcache_get_dirty(cache);
+
+		if (entry) {
+			/* Write it back along with its dirty neighbours */
+			rv = device_block_flush_run(drv, device, entry, 1);
+			if (rv)
+				break;
+		} else if (cache->writeback_count) {
+			/* Wait for the flusher to finish its write-back, the
+			 * blocks may have been dirtied again meanwhile */
+			semaphore_up(&drv->locks[minor]);
+			semaphore_ndown(&device_block_cleaned,
+			                BLKDEV_THROTTLE_WAIT, SCHED_WAITF_TIMEOUT);
+			semaphore_down(&drv->locks[minor]);
+		} else {
+			rv = 0;
+			break;
 		}
+	}
 
-		/* Call the driver to write the block to storage */
-		rv = drv->ops->write(device, entry->offset, entry->data);
+	/* Release the lock on this device */
+	semaphore_up(&drv->locks[minor]);
 
-		/* If successful clear the DIRTY flag from the cache entry */
-		if (!rv)
-			entry->flags &= ~BLKCACHE_ENTRY_FLAG_DIRTY;
-		else
-			return rv;
-		//rv = drv->ops->read(device, entry->offset, entry->data);
-//		for (rv)
-		/* If successful clear the DIRTY flag from the cache entry */
-//		if (!rv)
-//			entry->flags &= ~BLKCACHE_ENTRY_FLAG_DIRTY;
-//		else
-//			return rv;
-	}
-	return 0;
+	return rv;
 }
 
 int device_block_flush_global()
@@ -281,10 +1070,152 @@ int device_block_flush_global()
 	return se;
 }
 
+/**
+ * @brief Wake up the flusher if it is not already awake
+ */
+static void device_block_kick_flusher(void)
+{
+	if (device_block_flusher_running && !device_block_flusher_wake)
+		semaphore_up(&device_block_flusher_wake);
+}
+
+/**
+ * @brief Make a writer wait until enough dirty blocks have been written back
+ *
+ * The caller must not hold the lock on the device.
+ * @param cache The cache that is over the dirty limit
+ */
+static void device_block_throttle(blkcache_cache_t *cache)
+{
+	while (BLKDEV_DIRTY_ABOVE(cache, BLKDEV_DIRTY_LIMIT)) {
+		device_block_kick_flusher();
+		semaphore_ndown(&device_block_cleaned,
+		                BLKDEV_THROTTLE_WAIT, SCHED_WAITF_TIMEOUT);
+	}
+}
+
+/**
+ * @brief Write back the dirty blocks of a device that are due
+ *
+ * Blocks are written back oldest first for as long as the oldest dirty block
+ * has expired or the device is above the background dirty ratio.
+ * @param drv The driver of the device
+ * @param minor The minor number of the device
+ */
+static void device_block_writeback(blk_dev_t *drv, dev_t minor)
+{
+	blkcache_cache_t *cache = drv->caches[minor];
+	blkcache_entry_t *entry;
+	dev_t device = MAKEDEV(drv->major, minor);
+	int rv;
+
+	/* Acquire a lock on the device */
+	semaphore_down(&drv->locks[minor]);
+
+	for (;;) {
+		entry = blkcache_get_dirty(cache);
+		if (!entry)
+			break;
+
+		if (system_time - entry->dirtied < BLKDEV_DIRTY_EXPIRE &&
+		    !BLKDEV_DIRTY_ABOVE(cache, BLKDEV_DIRTY_BACKGROUND))
+			break;
+
+		/* The lock is released during the transfer */
+		rv = device_block_flush_run(drv, device, entry, 1);
+
+		/* Let a throttled writer check the dirty limit again */
+		if (!device_block_cleaned)
+			semaphore_up(&device_block_cleaned);
+
+		if (rv) {
+			printf(CON_ERROR, "write-back on %i %i failed: %i",
+			       (int) drv->major, (int) minor, rv);
+			break;
+		}
+	}
+
+	/* Release the lock on this device */
+	semaphore_up(&drv->locks[minor]);
+}
+
+/**
+ * @brief The main loop of the flusher task
+ *
+ * Wakes up every BLKDEV_FLUSH_INTERVAL or when a writer asks for it and
+ * writes back the dirty blocks that are due on all devices.
+ * @param arg Unused
+ */
+static void device_block_flusher(__attribute__((unused)) void *arg)
+{
+	blk_dev_t *drv;
+	dev_t mj, mi;
+
+	for (;;) {
+		semaphore_ndown(&device_block_flusher_wake,
+		                BLKDEV_FLUSH_INTERVAL, SCHED_WAITF_TIMEOUT);
+
+		for (mj = 0; mj < 256; mj++) {
+			drv = block_dev_table[mj];
+			if (!drv)
+				continue;
+			for (mi = 0; mi < drv->minor_count; mi++)
+				device_block_writeback(drv, mi);
+		}
+	}
+}
+
+/**
+ * @brief Start the task that writes back dirty blocks in the background
+ *
+ * Until this is called, dirty blocks are only written back when they have to
+ * be evicted or when the caches are flushed explicitly.
+ */
+void device_block_start_flusher(void)
+{
+	int status;
+
+	status = scheduler_spawn(device_block_flusher, NULL, NULL);
+	if (status) {
+		printf(CON_ERROR, "failed to start the flusher: %i", status);
+		return;
+	}
+
+	device_block_flusher_running = 1;
+}
+
+/**
+ * @brief Copy the request queue statistics of a driver to userland
+ * @param drv The driver to get the statistics for
+ * @param arg The userland buffer to copy them to
+ * @return 0 on success, -1 on failure with syscall_errno set
+ */
+static int device_block_queue_stats(blk_dev_t *drv, int arg)
+{
+	blk_queue_stats_t stats;
+	int s;
+
+	/* The queue is updated from interrupt context */
+	s = disable();
+	stats.bqs_requests = drv->queue.requests;
+	stats.bqs_merges = drv->queue.merges;
+	stats.bqs_dispatched = drv->queue.dispatched;
+	stats.bqs_depth_sum = drv->queue.depth_sum;
+	restore(s);
+
+	if (!copy_kern_to_user(&stats, (void *) arg, sizeof(blk_queue_stats_t))) {
+		syscall_errno = EFAULT;
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * @brief Handles the ioctl(2) call on a device
  *
- * This function merely dispatches the call to the driver
+ * The request scheduler calls are handled here for drivers that queue their
+ * requests, all other calls are dispatched to the driver
  * @see _sys_ioctl for more information
  * @param device The device this call is to be performed on
  * @param fd The fd used for the call
@@ -301,10 +1232,28 @@ int device_block_ioctl(dev_t device, int fd, int func, int arg)
 	blk_dev_t *drv = block_dev_table[major];
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENXIO;
 	}
 
+	if (func == BLKRASTATS)
+		return device_block_ra_stats(drv, minor, arg);
+
+	if (drv->ops->submit) {
+		switch (func) {
+			case BLKSCHEDGET:
+				return drv->queue.scheduler;
+			case BLKSCHEDSET:
+				if (blk_queue_set_scheduler(&drv->queue, arg)) {
+					syscall_errno = EINVAL;
+					return -1;
+				}
+				return 0;
+			case BLKQSTATS:
+				return device_block_queue_stats(drv, arg);
+		}
+	}
+
 	return drv->ops->ioctl(device, fd, func, arg);
 }
 
@@ -327,7 +1276,7 @@ int device_block_open(dev_t device, int fd, int options)
 	blk_dev_t *drv = block_dev_table[major];
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENODEV;
 	}
 
@@ -353,7 +1302,7 @@ int device_block_close(dev_t device, int fd)
 	blk_dev_t *drv = block_dev_table[major];
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENODEV;
 	}
 
@@ -381,17 +1330,19 @@ int device_block_write(dev_t device, aoff_t file_offset, const void * buffer, ao
 	dev_t major = MAJOR(device);
 	dev_t minor = MINOR(device);
 	blk_dev_t *drv = block_dev_table[major];
-	blkcache_entry_t *entry;
+	blkcache_cache_t *cache;
+	blkcache_entry_t *entry, *victim;
 	aoff_t	block_offset;
 	aoff_t	in_block_count;
 	uintptr_t in_block, in_buffer;
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		printf(CON_ERROR, "invalid device %i %i\n", (int)major, (int)minor);
 		return ENODEV;
 	}
 
+	cache = drv->caches[minor];
 	in_buffer = 0;
 
 	/* Acquire a lock on the device */
@@ -401,6 +1352,14 @@ int device_block_write(dev_t device, aoff_t file_offset, const void * buffer, ao
 	/* Loop while we still have data left to write */
 	while (in_buffer != ((uintptr_t) count)) {
 
+		/* Wait for the flusher if too many blocks are dirty */
+		if (device_block_flusher_running &&
+		    BLKDEV_DIRTY_ABOVE(cache, BLKDEV_DIRTY_LIMIT)) {
+			semaphore_up(&drv->locks[minor]);
+			device_block_throttle(cache);
+			semaphore_down(&drv->locks[minor]);
+		}
+
 		/* Calculate the offset into the block for this chunk */
 		in_block  = (file_offset + in_buffer) % drv->block_size;
 
@@ -420,7 +1379,8 @@ int device_block_write(dev_t device, aoff_t file_offset, const void * buffer, ao
 			/* We are not, read-modify-write needed */
 
 			/* Get the block from the cache */
-			entry = blkcache_find(drv->caches[minor], block_offset);
+			entry = device_block_settle(drv, minor,
+				blkcache_find(drv->caches[minor], block_offset));
 
 			/* Check if it was cached */
 			if (!entry) {
@@ -445,16 +1405,19 @@ int device_block_write(dev_t device, aoff_t file_offset, const void * buffer, ao
 		} else { //Just add it to the cache
 			/* We are replacing the whole block */
 
+			/* Wait for the block if it is being read ahead */
+			device_block_settle(drv, minor,
+			                    blkcache_peek(cache, block_offset));
+
 			/* Get a new block cache entry from the cache */
-			entry = blkcache_get(drv->caches[minor], block_offset);
+			entry = blkcache_get(cache, block_offset, 0);
 
 			/* Check if the cache was full */
 			if (!entry) {
-				/* It is */
-
-				/* Flush the discard candidate */
-				rv = device_block_flush(device,
-					blkcache_get_discard_candidate(drv->caches[minor])->offset);
+				/* It is, write back the oldest dirty block */
+				victim = blkcache_get_dirty(cache);
+				rv = victim ?
+				     device_block_flush_run(drv, device, victim, 0) : 0;
 
 				/* Check for errors */
 				if (rv) {
@@ -463,8 +1426,10 @@ int device_block_write(dev_t device, aoff_t file_offset, const void * buffer, ao
 					return rv;
 				}
 
-				/* Retry */
-				entry = blkcache_get(drv->caches[minor], block_offset);
+				/* Retry, if all blocks were being written back
+				 * the cache has to grow */
+				entry = blkcache_get(cache, block_offset,
+				                     BLKCACHE_GET_GROW);
 
 			}
 
@@ -488,7 +1453,11 @@ int device_block_write(dev_t device, aoff_t file_offset, const void * buffer, ao
                         in_block_count );
 
 		/* Set the dirty flag on the entry */
-		entry->flags |= BLKCACHE_ENTRY_FLAG_DIRTY;
+		blkcache_mark_dirty(cache, entry);
+
+		/* Wake the flusher once enough blocks are dirty */
+		if (BLKDEV_DIRTY_ABOVE(cache, BLKDEV_DIRTY_BACKGROUND))
+			device_block_kick_flusher();
 
 		/* Advance position */
 		in_buffer += in_block_count;
@@ -526,21 +1495,28 @@ int device_block_read(dev_t device, aoff_t file_offset, void * buffer, aoff_t co
 	dev_t minor = MINOR(device);
 	blk_dev_t *drv = block_dev_table[major];
 	blkcache_entry_t *entry;
-	aoff_t	block_offset;
+	blk_readahead_t *ra;
+	aoff_t	block_offset, next;
 	aoff_t	in_block_count;
 	uintptr_t in_block, in_buffer;
+	unsigned int hits, misses = 0;
+	int run, max_run;
 
 	/* Check if the device exists */
-	if ((!drv) || (minor > drv->minor_count)) {
+	if ((!drv) || (minor >= drv->minor_count)) {
 		return ENODEV;
 	}
 
 	in_buffer = 0;
+	max_run = device_block_max_run(drv);
 
 	/* Acquire a lock on the device */
 	semaphore_down(&drv->locks[minor]);
 	assert((drv->locks[minor]) == 0);
 
+	ra = device_block_get_readahead(drv, minor);
+	hits = ra ? ra->hits : 0;
+
 	/* Loop while we still have data left to read */
 	while (in_buffer != ((uintptr_t) count)) {
 
@@ -559,12 +1535,22 @@ int device_block_read(dev_t device, aoff_t file_offset, void * buffer, aoff_t co
 			in_block_count = drv->block_size - in_block;
 
 		/* Get the block from the cache */
-		entry = blkcache_find(drv->caches[minor], block_offset);
+		entry = device_block_settle(drv, minor,
+			blkcache_find(drv->caches[minor], block_offset));
 
 		/* Check if it was cached */
 		if (!entry) {
-			/* If not, fetch it and retry */
-			rv = device_block_fetch(device, block_offset);
+			/* If not, fetch it together with the uncached blocks
+			 * that follow it in this request and retry */
+			for (run = 1; run < max_run; run++) {
+				next = block_offset + run * drv->block_size;
+				if (next >= file_offset + count)
+					break;
+				if (blkcache_peek(drv->caches[minor], next))
+					break;
+			}
+
+			rv = device_block_fetch_run(device, block_offset, run);
 
 			/* Check for errors */
 			if (rv) {
@@ -575,6 +1561,8 @@ int device_block_read(dev_t device, aoff_t file_offset, void * buffer, aoff_t co
 				return rv;
 			}
 
+			misses += run;
+
 			/* Retry */
 			entry = blkcache_find(drv->caches[minor], block_offset);
 		}
@@ -594,6 +1582,13 @@ int device_block_read(dev_t device, aoff_t file_offset, void * buffer, aoff_t co
 		*read_size = in_buffer;
 	}
 
+	/* Read ahead if this continues a sequential stream */
+	if (ra) {
+		ra->misses += misses;
+		device_block_ra_update(drv, device, file_offset, count,
+		                       ra->hits - hits, misses);
+	}
+
 	/* Release the lock on this device */
 	semaphore_up(&drv->locks[minor]);
 
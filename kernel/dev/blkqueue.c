@@ -0,0 +1,283 @@
+/**
+ * kernel/blkqueue.c
+ *
+ * Part of P-OS kernel.
+ *
+ * Implements request scheduling for block devices
+ *
+ * Requests are merged with queued requests for adjacent blocks and then
+ * dispatched in arrival order, as a C-LOOK elevator or as an elevator with
+ * deadlines to prevent starvation.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ * 17-10-2026 - Compare positions and lengths in sectors
+ */
+
+#include "kernel/blkqueue.h"
+#include "kernel/time.h"
+#include <sys/errno.h>
+#include <stddef.h>
+#include <assert.h>
+
+/**
+ * Get the request containing a fifo list link
+ */
+#define BLKQUEUE_FIFO_REQ(Link)	( (blk_request_t *) \
+		( ( (uintptr_t) (Link) ) - __builtin_offsetof( blk_request_t, fifo_node ) ) )
+
+/**
+ * Get the number of sectors covered by a number of blocks
+ */
+#define BLKQUEUE_SECTORS(Queue, Count)	( (uint64_t) (Count) * \
+		( (Queue)->block_size / BLKQUEUE_SECTOR_SIZE ) )
+
+/**
+ * blk_queue_init - Initialize an empty request queue
+ *
+ * @param queue The queue to initialize
+ * @param block_size The block size of the device
+ */
+
+void blk_queue_init( blk_queue_t *queue, aoff_t block_size )
+{
+	assert( queue != NULL );
+
+	queue->scheduler  = BLKQUEUE_SCHED_DEADLINE;
+	queue->block_size = block_size;
+	queue->max_merge  = BLKQUEUE_MAX_MERGE;
+	queue->head       = 0;
+	queue->depth      = 0;
+	queue->requests   = 0;
+	queue->merges     = 0;
+	queue->dispatched = 0;
+	queue->depth_sum  = 0;
+
+	llist_create( &queue->sorted );
+	llist_create( &queue->fifo );
+}
+
+/**
+ * blk_queue_set_scheduler - Select the scheduler for a queue
+ *
+ * @param queue The queue to operate on
+ * @param scheduler One of BLKQUEUE_SCHED_
+ *
+ * @return 0 on success, EINVAL if the scheduler does not exist
+ */
+
+int blk_queue_set_scheduler( blk_queue_t *queue, int scheduler )
+{
+	assert( queue != NULL );
+
+	if ( scheduler < 0 || scheduler >= BLKQUEUE_SCHED_COUNT )
+		return EINVAL;
+
+	/* Both lists are always maintained, so this can change at any time */
+	queue->scheduler = scheduler;
+
+	return 0;
+}
+
+/**
+ * blk_request_last - INTERNAL function that gets the last request of a chain
+ */
+
+static blk_request_t *blk_request_last( blk_request_t *request )
+{
+	while ( request->merged )
+		request = request->merged;
+	return request;
+}
+
+/**
+ * blk_queue_try_merge - INTERNAL function that merges a request with a
+ * queued request for the adjacent blocks
+ *
+ * @param queue The queue to operate on
+ * @param request The new request
+ *
+ * @return TRUE if the request was merged
+ */
+
+static int blk_queue_try_merge( blk_queue_t *queue, blk_request_t *request )
+{
+	llist_t *_e;
+	blk_request_t *queued, *last;
+
+	for ( _e = queue->sorted.next; _e != &queue->sorted; _e = _e->next ) {
+		queued = ( blk_request_t * ) _e;
+
+		if ( queued->device != request->device ||
+		     queued->write != request->write ||
+		     queued->total + request->count > queue->max_merge )
+			continue;
+
+		last = blk_request_last( queued );
+
+		/* Back merge: the request follows the queued one */
+		if ( last->offset + last->count * queue->block_size ==
+		     request->offset ) {
+			last->merged = request;
+			queued->total += request->count;
+			if ( request->deadline < queued->deadline )
+				queued->deadline = request->deadline;
+			return 1;
+		}
+
+		/* Front merge: the request precedes the queued one, it takes
+		 * its place in the queue */
+		if ( request->offset + request->count * queue->block_size ==
+		     queued->offset ) {
+			request->merged   = queued;
+			request->total    = request->count + queued->total;
+			if ( queued->deadline < request->deadline )
+				request->deadline = queued->deadline;
+			request->node.prev = queued->node.prev;
+			request->node.next = queued->node.next;
+			request->node.prev->next = &request->node;
+			request->node.next->prev = &request->node;
+			request->fifo_node.prev = queued->fifo_node.prev;
+			request->fifo_node.next = queued->fifo_node.next;
+			request->fifo_node.prev->next = &request->fifo_node;
+			request->fifo_node.next->prev = &request->fifo_node;
+			return 1;
+		}
+
+		/* The list is sorted, nothing further on can be adjacent */
+		if ( queued->pos >
+		     request->pos + BLKQUEUE_SECTORS( queue, request->count ) )
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * blk_queue_add - Add a request to a queue
+ *
+ * The driver must set the pos field of the request before calling this.
+ *
+ * @param queue The queue to add the request to
+ * @param request The request to add
+ */
+
+void blk_queue_add( blk_queue_t *queue, blk_request_t *request )
+{
+	llist_t *_e;
+
+	assert( queue != NULL );
+	assert( request != NULL );
+
+	request->merged   = NULL;
+	request->total    = request->count;
+	request->deadline = system_time_micros + ( request->write ?
+		BLKQUEUE_WRITE_EXPIRE : BLKQUEUE_READ_EXPIRE );
+
+	queue->requests++;
+	queue->depth_sum += queue->depth;
+
+	if ( blk_queue_try_merge( queue, request ) ) {
+		queue->merges++;
+		return;
+	}
+
+	/* Insert in position order */
+	for ( _e = queue->sorted.next; _e != &queue->sorted; _e = _e->next )
+		if ( ( ( blk_request_t * ) _e )->pos > request->pos )
+			break;
+
+	request->node.next = _e;
+	request->node.prev = _e->prev;
+	_e->prev->next = &request->node;
+	_e->prev = &request->node;
+
+	llist_add_end( &queue->fifo, &request->fifo_node );
+
+	queue->depth++;
+}
+
+/**
+ * blk_queue_clook - INTERNAL function that selects the first request at or
+ * after the head position, wrapping around to the lowest position
+ */
+
+static blk_request_t *blk_queue_clook( blk_queue_t *queue )
+{
+	llist_t *_e;
+
+	for ( _e = queue->sorted.next; _e != &queue->sorted; _e = _e->next )
+		if ( ( ( blk_request_t * ) _e )->pos >= queue->head )
+			return ( blk_request_t * ) _e;
+
+	return ( blk_request_t * ) llist_get_first( &queue->sorted );
+}
+
+/**
+ * blk_queue_next - Remove the next request to dispatch from a queue
+ *
+ * @param queue The queue to operate on
+ *
+ * @return The request to dispatch, or NULL if the queue is empty
+ */
+
+blk_request_t *blk_queue_next( blk_queue_t *queue )
+{
+	blk_request_t *request;
+	llist_t *first;
+
+	assert( queue != NULL );
+
+	first = llist_get_first( &queue->fifo );
+	if ( !first )
+		return NULL;
+
+	switch ( queue->scheduler ) {
+		case BLKQUEUE_SCHED_FIFO:
+			request = BLKQUEUE_FIFO_REQ( first );
+			break;
+		case BLKQUEUE_SCHED_DEADLINE:
+			/* The oldest request is the first to expire */
+			request = BLKQUEUE_FIFO_REQ( first );
+			if ( request->deadline <= system_time_micros )
+				break;
+			/* Fall through */
+		case BLKQUEUE_SCHED_CLOOK:
+		default:
+			request = blk_queue_clook( queue );
+			break;
+	}
+
+	llist_unlink( &request->node );
+	llist_unlink( &request->fifo_node );
+
+	queue->head = request->pos + BLKQUEUE_SECTORS( queue, request->total );
+	queue->depth--;
+	queue->dispatched++;
+
+	return request;
+}
+
+/**
+ * blk_request_buffer - Get the buffer for a block of a (merged) request
+ *
+ * @param request The first request of the chain
+ * @param block The index of the block within the chain
+ *
+ * @return The buffer for the block
+ */
+
+void *blk_request_buffer( blk_request_t *request, int block )
+{
+	assert( request != NULL );
+
+	while ( block >= request->count ) {
+		block -= request->count;
+		request = request->merged;
+		assert( request != NULL );
+	}
+
+	return request->buffers[ block ];
+}
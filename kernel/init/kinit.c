@@ -8,6 +8,8 @@
  */
 
 #include "kernel/physmm.h"
+#include "kernel/heapmm.h"
+#include "kernel/shrinker.h"
 #define CON_SRC ("kinit")
 #include "kernel/console.h"
 #include "kernel/system.h"
@@ -41,6 +43,7 @@ static void print_banner()
 void register_dev_drivers();
 
 extern int ata_interrupt_enabled;
+extern int virtio_blk_interrupt_enabled;
 
 void kmain()
 {
@@ -56,6 +59,8 @@ void kmain()
 
 	process_init();
 
+	heapmm_register_shrinker();
+
 	printf(CON_INFO, "initializing driver infrastructure");
 	drivermgr_init();
 	device_char_init();
@@ -89,8 +94,12 @@ void kmain()
 
 #ifdef ARCH_I386
 	ata_interrupt_enabled = 1;
+	virtio_blk_interrupt_enabled = 1;
 #endif
 
+	device_block_start_flusher();
+	shrinker_start();
+
 	kinit_start_uinit();
 
 	printf(CON_PANIC, "\n\nkernel main exited... halting!");
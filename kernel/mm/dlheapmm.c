@@ -9,10 +9,14 @@
  *
  * Changelog:
  * 14-07-2014 - Created
+ * 17-10-2026 - Retry failed allocations after reclaim, added heap shrinker
+ * 17-10-2026 - Added heapmm_alloc_nowait
  */
 
 #include "kernel/physmm.h"
 #include "kernel/heapmm.h"
+#include "kernel/paging.h"
+#include "kernel/shrinker.h"
 #define CON_SRC "heapmm"
 #include "kernel/console.h"
 #include "kernel/scheduler.h"
@@ -26,6 +30,7 @@ void* dlmemalign(size_t,size_t);
 void* dlrealloc(void *,size_t);
 void* dlmalloc(size_t);
 void  dlfree(void*);
+int   dlmalloc_trim(size_t);
 
 /**
  * Pointer to the top of the heap
@@ -63,6 +68,12 @@ void *heapmm_alloc_alligned(size_t size, uintptr_t alignment)
 	semaphore_down( &heap_lock );
 	r = dlmemalign((size_t) alignment, size);
 	semaphore_up( &heap_lock );
+	if ( !r ) {
+		paging_handle_out_of_memory();
+		semaphore_down( &heap_lock );
+		r = dlmemalign((size_t) alignment, size);
+		semaphore_up( &heap_lock );
+	}
 	return r;
 }
 
@@ -70,6 +81,25 @@ void *heapmm_alloc_alligned(size_t size, uintptr_t alignment)
  * Allocates a new block of memory of given size to the caller
  */
 void *heapmm_alloc(size_t size)
+{
+	void *r;
+	semaphore_down( &heap_lock );
+	r = dlmalloc(size);
+	semaphore_up( &heap_lock );
+	if ( !r ) {
+		paging_handle_out_of_memory();
+		semaphore_down( &heap_lock );
+		r = dlmalloc(size);
+		semaphore_up( &heap_lock );
+	}
+	return r;
+}
+
+/**
+ * Allocates a new block of memory of given size to the caller, fails
+ * instead of waiting for memory to be reclaimed
+ */
+void *heapmm_alloc_nowait(size_t size)
 {
 	void *r;
 	semaphore_down( &heap_lock );
@@ -105,28 +135,81 @@ void *heapmm_realloc( void* address,
 	semaphore_down( &heap_lock );
 	r = dlrealloc( address, size );
 	semaphore_up( &heap_lock );
+	if ( !r && size ) {
+		paging_handle_out_of_memory();
+		semaphore_down( &heap_lock );
+		r = dlrealloc( address, size );
+		semaphore_up( &heap_lock );
+	}
+	return r;
+}
+
+/**
+ * The heap can always try to give back its free top
+ */
+static size_t heapmm_shrinker_count( __attribute__((__unused__)) shrinker_t *shrinker )
+{
+	return 1;
+}
+
+/**
+ * Returns the free memory at the top of the heap to the physical memory
+ * manager. Skipped if the heap is in use, the holder may be waiting for
+ * memory itself.
+ */
+static size_t heapmm_shrinker_scan( __attribute__((__unused__)) shrinker_t *shrinker,
+                                    __attribute__((__unused__)) size_t nr )
+{
+	int r;
+	if ( !semaphore_try_down( &heap_lock ) )
+		return 0;
+	r = dlmalloc_trim( 0 );
+	semaphore_up( &heap_lock );
 	return r;
 }
 
+static shrinker_t heapmm_shrinker = {
+	.name  = "heap",
+	.pass  = SHRINKER_PASS_ALLOCATOR,
+	.count = heapmm_shrinker_count,
+	.scan  = heapmm_shrinker_scan
+};
+
+/**
+ * Registers the shrinker that returns free heap memory
+ */
+void heapmm_register_shrinker(void)
+{
+	shrinker_register( &heapmm_shrinker );
+}
+
 /**
  * Internal function
  * Requests more memory and adds it to the free block table,
  * then cleans up low space markers
  */
-void * dlheapmm_sbrk ( size_t size )
+void * dlheapmm_sbrk ( ptrdiff_t size )
 {
 	void *old = heapmm_top_of_heap;
+	size_t got;
 	if (size == 0) {
 		return heapmm_top_of_heap;
 	} else if (size > 0) {
-		size = heapmm_request_core ( heapmm_top_of_heap, size );
+		got = heapmm_request_core ( heapmm_top_of_heap, (size_t) size );
+		if ( got < (size_t) size ) {
+			/* dlmalloc can not use a partial extension */
+			heapmm_release_core ( heapmm_top_of_heap, got );
+			return (void *) -1;
+		}
 
 		/* Update top of heap pointer */
 		heapmm_top_of_heap = ( void * ) ( ((uintptr_t)heapmm_top_of_heap) + ((uintptr_t)size));
 
 		return old;
 	} else {
-		//TODO: WARN
-		return (void *) -1;
+		/* Trimming, dlmalloc only releases whole pages */
+		heapmm_top_of_heap = ( void * ) ( ((uintptr_t)heapmm_top_of_heap) - ((uintptr_t)-size));
+		heapmm_release_core ( heapmm_top_of_heap, (size_t) -size );
+		return old;
 	}
 }
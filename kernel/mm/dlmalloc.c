@@ -553,7 +553,8 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 
 #define MORECORE dlheapmm_sbrk
 #define ABORT dlheapmm_abort()
-#define MORECORE_CANNOT_TRIM
+/* The heap is only trimmed when the reclaim task asks for it */
+#define DEFAULT_TRIM_THRESHOLD MAX_SIZE_T
 
 #if USE_LOCKS /* Spin locks for gcc >= 4.1, older gcc on x86, MSC >= 1310 */
 #if ((defined(__GNUC__) &&                                              \
@@ -822,7 +823,7 @@ extern "C" {
 #endif /* USE_DL_PREFIX */
 
 void dlheapmm_abort();
-void * dlheapmm_sbrk ( size_t size );
+void * dlheapmm_sbrk ( ptrdiff_t size );
 
 /*
   malloc(size_t n)
@@ -7,6 +7,9 @@
  *
  * Changelog:
  * 30-03-2014 - Created
+ * 17-10-2026 - Release heap core and wait for reclaim when out of memory
+ * 17-10-2026 - Added paging_read_frame and paging_write_frame
+ * 17-10-2026 - Unshare page tables on write faults
  */
 
 #include <stddef.h>
@@ -19,6 +22,7 @@
 #define CON_SRC "paging"
 #include "kernel/console.h"
 #include "kernel/process.h"
+#include "kernel/shrinker.h"
 page_dir_t *paging_active_dir;
 
 size_t heapmm_request_core ( void *address, size_t size )
@@ -42,6 +46,23 @@ size_t heapmm_request_core ( void *address, size_t size )
 	return size_counter;
 }
 
+/**
+ * @brief Return heap core to the physical memory manager
+ * @param address The start of the range, must be page aligned
+ * @param size The size of the range, must be a multiple of the page size
+ */
+void heapmm_release_core ( void *address, size_t size )
+{
+	size_t size_counter;
+	physaddr_t frame;
+	for (size_counter = 0; size_counter < size; size_counter += PHYSMM_PAGE_SIZE) {
+		frame = paging_get_physical_address(address) & ~PHYSMM_PAGE_ADDRESS_MASK;
+		paging_unmap(address);
+		physmm_free_frame(frame);
+		address = (void *) ( ((uintptr_t) address) + ((uintptr_t) PHYSMM_PAGE_SIZE) );
+	}
+}
+
 /**
  * @brief Map a range of physical memory into virtual memory
  * This function maps an arbitrarily sized chunk of physical address space
@@ -159,9 +180,116 @@ fail_map:
 	return ENOMEM;
 }
 
+/**
+ * @brief Copy a page of mapped memory into a physical frame
+ * The frame is temporarily mapped into a page of kernel heap address space
+ * for the duration of the copy.
+ * @param frame The frame to copy to.
+ * @param src   The page aligned virtual address of the page to copy.
+ * @return Zero on success, an ERRNO code otherwise.
+ */
+int paging_copy_to_frame( physaddr_t frame, const void *src )
+{
+	physaddr_t page_frame;
+	void *page_ptr;
+
+	/* Get a bit of kernel heap address space */
+	page_ptr = heapmm_alloc_page();
+	if ( !page_ptr )
+		return ENOMEM;
+
+	/* Temporarily map the target frame over it */
+	page_frame = paging_get_physical_address( page_ptr );
+	paging_map( page_ptr, frame, PAGING_PAGE_FLAG_RW );
+
+	memcpy( page_ptr, src, PHYSMM_PAGE_SIZE );
+
+	/* Restore the heap page and release it */
+	paging_map( page_ptr, page_frame, PAGING_PAGE_FLAG_RW );
+	heapmm_free( page_ptr, PHYSMM_PAGE_SIZE );
+
+	return 0;
+}
+
+/**
+ * @brief Copy data out of part of a physical frame
+ * The frame is temporarily mapped into a page of kernel heap address space
+ * for the duration of the copy.
+ * @param frame  The frame to copy from.
+ * @param offset The offset in the frame to start copying at.
+ * @param dst    The buffer to copy to.
+ * @param size   The number of bytes to copy, must not cross the frame end.
+ * @return Zero on success, an ERRNO code otherwise.
+ */
+int paging_read_frame( physaddr_t frame, size_t offset, void *dst, size_t size )
+{
+	physaddr_t page_frame;
+	void *page_ptr;
+
+	/* Get a bit of kernel heap address space */
+	page_ptr = heapmm_alloc_page();
+	if ( !page_ptr )
+		return ENOMEM;
+
+	/* Temporarily map the source frame over it */
+	page_frame = paging_get_physical_address( page_ptr );
+	paging_map( page_ptr, frame, PAGING_PAGE_FLAG_RW );
+
+	memcpy( dst, page_ptr + offset, size );
+
+	/* Restore the heap page and release it */
+	paging_map( page_ptr, page_frame, PAGING_PAGE_FLAG_RW );
+	heapmm_free( page_ptr, PHYSMM_PAGE_SIZE );
+
+	return 0;
+}
+
+/**
+ * @brief Copy data into part of a physical frame
+ * The frame is temporarily mapped into a page of kernel heap address space
+ * for the duration of the copy.
+ * @param frame  The frame to copy to.
+ * @param offset The offset in the frame to start copying at.
+ * @param src    The data to copy, or NULL to fill the range with zeroes.
+ * @param size   The number of bytes to copy, must not cross the frame end.
+ * @return Zero on success, an ERRNO code otherwise.
+ */
+int paging_write_frame( physaddr_t frame, size_t offset, const void *src, size_t size )
+{
+	physaddr_t page_frame;
+	void *page_ptr;
+
+	/* Get a bit of kernel heap address space */
+	page_ptr = heapmm_alloc_page();
+	if ( !page_ptr )
+		return ENOMEM;
+
+	/* Temporarily map the target frame over it */
+	page_frame = paging_get_physical_address( page_ptr );
+	paging_map( page_ptr, frame, PAGING_PAGE_FLAG_RW );
+
+	if ( src )
+		memcpy( page_ptr + offset, src, size );
+	else
+		memset( page_ptr + offset, 0, size );
+
+	/* Restore the heap page and release it */
+	paging_map( page_ptr, page_frame, PAGING_PAGE_FLAG_RW );
+	heapmm_free( page_ptr, PHYSMM_PAGE_SIZE );
+
+	return 0;
+}
+
+/**
+ * @brief Try to make memory available after an allocation failed
+ *
+ * Waits for the reclaim task to shrink the kernel caches, the caller should
+ * retry the allocation afterwards.
+ */
 void paging_handle_out_of_memory()
 {
-	printf(CON_ERROR, "Out of memory! No handling for this yet");
+	if ( !shrinker_wait() )
+		printf(CON_WARN, "Out of memory! Reclaim did not release anything");
 }
 
 void paging_handle_fault(void *virt_addr, void * instr_ptr, int present, int write, int user)
@@ -197,8 +325,14 @@ void paging_handle_fault(void *virt_addr, void * instr_ptr, int present, int wri
 			if (procvmm_handle_fault(virt_addr))
 				return;
 		}
-	} else if (write) {
-		//TODO: Copy on write,
+	} else if (write && (addr < 0xC0000000)) {
+		/* Write to a present user page, its page table might still be
+		 * shared with another address space since a fork */
+		if (paging_unshare_table(virt_addr))
+			return;
+		/* Otherwise this might be copy on write */
+		if (procvmm_handle_cow(virt_addr))
+			return;
 	}
 	printf(CON_ERROR, "[0x%x] page fault in %i @ 0x%x (P:%i, U:%i, W:%i)", virt_addr, curpid(), instr_ptr, present, user, write);
 	if ( !present )
@@ -7,14 +7,78 @@
  *
  * Changelog:
  * 29-03-2014 - Created
+ * 17-10-2026 - Added buddy allocator
+ * 17-10-2026 - Added frame reference counts
+ * 17-10-2026 - Do not wait for reclaim when sharing a frame
+ * 17-10-2026 - Wake the reclaim task when memory runs low
+ *
+ * The frame bitmap (physmm_bitmap) remains the authoritative record of which
+ * frames are free, it is what the ARMv7 loader hands over to the kernel.
+ * On top of it a buddy allocator keeps, for every order, a bitmap of the
+ * free blocks of exactly that order. Every order bitmap carries two summary
+ * levels and a top word so that the first free block of an order can be found
+ * with four find-first-set operations instead of a linear scan.
+ *
+ * Frames that are mapped more than once (copy-on-write after fork) carry a
+ * reference count. As almost all frames only have a single user, only the
+ * shared frames are tracked, in a hash table keyed by frame number. A frame
+ * without an entry has an implicit reference count of one.
  */
 
 #include "kernel/physmm.h"
+#include "kernel/heapmm.h"
+#include "kernel/shrinker.h"
 #include <assert.h>
 #include <string.h>
 
+/**
+ * Free block index for a single buddy order
+ */
+typedef struct {
+	/** One bit per block of this order, set if the block is free */
+	uint32_t *map;
+	/** One bit per word in map, set if the word is nonzero */
+	uint32_t *sum1;
+	/** One bit per word in sum1, set if the word is nonzero */
+	uint32_t *sum2;
+	/** One bit per word in sum2, set if the word is nonzero */
+	uint32_t  top;
+	/** The number of words in map */
+	uint32_t  size;
+} physmm_order_t;
+
+/**
+ * Reference count for a shared frame
+ */
+typedef struct physmm_share physmm_share_t;
+
+struct physmm_share {
+	/** The next entry in the hash bucket */
+	physmm_share_t *next;
+	/** The frame number */
+	uint32_t        frame;
+	/** The number of references to the frame, always larger than one */
+	uint32_t        refs;
+};
+
+#define PHYSMM_SHARE_TABLE_SIZE	(1024)
+
+#define PHYSMM_BUDDY_POOL_SIZE	( PHYSMM_BITMAP_SIZE * 2 + \
+				  PHYSMM_BITMAP_SIZE / 8 + \
+				  4 * ( PHYSMM_MAX_ORDER + 1 ) )
+
 uint32_t physmm_bitmap[PHYSMM_BITMAP_SIZE];
 
+static uint32_t       physmm_buddy_pool[PHYSMM_BUDDY_POOL_SIZE];
+
+static physmm_order_t physmm_orders[PHYSMM_MAX_ORDER + 1];
+
+static uint32_t       physmm_free_count;
+
+static physmm_share_t *physmm_share_table[PHYSMM_SHARE_TABLE_SIZE];
+
+static uint32_t       physmm_share_count;
+
 void physmm_set_bit(physaddr_t address)
 {
 	address >>= 12;
@@ -27,11 +91,146 @@ void physmm_clear_bit(physaddr_t address)
 	physmm_bitmap[(address >> 5) & 0x7FFF] &= ~(1u << (address & 0x1F));
 }
 
+static int physmm_test_bit(physaddr_t address)
+{
+	address >>= 12;
+	return physmm_bitmap[(address >> 5) & 0x7FFF] & (1u << (address & 0x1F));
+}
+
+/**
+ * Marks the block starting at frame number <frame> free in the index of
+ * order <order>
+ */
+static void physmm_buddy_insert(int order, uint32_t frame)
+{
+	physmm_order_t *o = &physmm_orders[order];
+	uint32_t b = frame >> order;
+
+	o->map[b >> 5] |= 1u << (b & 0x1F);
+	b >>= 5;
+	o->sum1[b >> 5] |= 1u << (b & 0x1F);
+	b >>= 5;
+	o->sum2[b >> 5] |= 1u << (b & 0x1F);
+	b >>= 5;
+	o->top |= 1u << b;
+}
+
+/**
+ * Removes the block starting at frame number <frame> from the index of
+ * order <order>
+ */
+static void physmm_buddy_remove(int order, uint32_t frame)
+{
+	physmm_order_t *o = &physmm_orders[order];
+	uint32_t b = frame >> order;
+
+	o->map[b >> 5] &= ~(1u << (b & 0x1F));
+	if ( o->map[b >> 5] )
+		return;
+	b >>= 5;
+	o->sum1[b >> 5] &= ~(1u << (b & 0x1F));
+	if ( o->sum1[b >> 5] )
+		return;
+	b >>= 5;
+	o->sum2[b >> 5] &= ~(1u << (b & 0x1F));
+	if ( o->sum2[b >> 5] )
+		return;
+	b >>= 5;
+	o->top &= ~(1u << b);
+}
+
+/**
+ * Tests whether the block starting at frame number <frame> is a free block
+ * of order <order>
+ */
+static int physmm_buddy_test(int order, uint32_t frame)
+{
+	uint32_t b = frame >> order;
+	return physmm_orders[order].map[b >> 5] & (1u << (b & 0x1F));
+}
+
+/**
+ * Finds the lowest free block of order <order>
+ * @return The first frame number of the block or -1 if none are free
+ */
+static int32_t physmm_buddy_find(int order)
+{
+	physmm_order_t *o = &physmm_orders[order];
+	uint32_t b;
+
+	if ( o->top == 0 )
+		return -1;
+
+	b = __builtin_ctz( o->top );
+	b = ( b << 5 ) | __builtin_ctz( o->sum2[b] );
+	b = ( b << 5 ) | __builtin_ctz( o->sum1[b] );
+	b = ( b << 5 ) | __builtin_ctz( o->map[b] );
+
+	return (int32_t) ( b << order );
+}
+
+/**
+ * Returns a block to the buddy allocator and merges it with its buddies
+ */
+static void physmm_buddy_free(uint32_t frame, int order)
+{
+	uint32_t buddy;
+
+	while ( order < PHYSMM_MAX_ORDER ) {
+		buddy = frame ^ ( 1u << order );
+		if ( !physmm_buddy_test( order, buddy ) )
+			break;
+		physmm_buddy_remove( order, buddy );
+		frame &= ~( 1u << order );
+		order++;
+	}
+
+	physmm_buddy_insert( order, frame );
+}
+
+/**
+ * Splits the free block of order <order> at <frame> until the frame
+ * <target> is an order <target_order> block, returning the other halves to
+ * the free lists
+ */
+static void physmm_buddy_split(	uint32_t frame,
+				int order,
+				uint32_t target,
+				int target_order )
+{
+	uint32_t half;
+
+	while ( order > target_order ) {
+		order--;
+		half = 1u << order;
+		if ( target & half ) {
+			physmm_buddy_insert( order, frame );
+			frame += half;
+		} else
+			physmm_buddy_insert( order, frame + half );
+	}
+}
+
+static void physmm_mark_range(uint32_t frame, uint32_t count, int free)
+{
+	uint32_t n;
+	for ( n = 0; n < count; n++ ) {
+		if ( free ) {
+			assert( !physmm_test_bit( ( frame + n ) << 12 ) );
+			physmm_set_bit( ( frame + n ) << 12 );
+		} else
+			physmm_clear_bit( ( frame + n ) << 12 );
+	}
+}
+
 void physmm_free_range(physaddr_t start, physaddr_t end)
 {
 	physaddr_t counter;
 	assert(start < end);
 	for (counter = start; counter < end; counter += PHYSMM_PAGE_SIZE){
+		/* RAM regions reported by the firmware may overlap */
+		if ( physmm_test_bit( counter ) )
+			continue;
 		physmm_free_frame(counter);
 	}
 }
@@ -39,95 +238,229 @@ void physmm_free_range(physaddr_t start, physaddr_t end)
 void physmm_claim_range(physaddr_t start, physaddr_t end)
 {
 	physaddr_t counter;
+	uint32_t frame, head;
+	int order;
 	assert(start < end);
+	//TODO: Lock physmm_bitmap
 	for (counter = start; counter < end; counter += PHYSMM_PAGE_SIZE){
-		physmm_clear_bit(counter);
+		if ( !physmm_test_bit( counter ) )
+			continue;
+		frame = counter >> 12;
+		for ( order = 0; order <= PHYSMM_MAX_ORDER; order++ ) {
+			head = frame & ~( ( 1u << order ) - 1 );
+			if ( physmm_buddy_test( order, head ) )
+				break;
+		}
+		assert( order <= PHYSMM_MAX_ORDER );
+		physmm_buddy_remove( order, head );
+		physmm_buddy_split( head, order, frame, 0 );
+		physmm_clear_bit( counter );
+		physmm_free_count--;
 	}
+	//TODO: Release physmm_bitmap
 }
 
-physaddr_t physmm_alloc_frame()
+physaddr_t physmm_alloc_pages(int order)
 {
+	int32_t frame;
+	int o;
+
+	assert( order >= 0 && order <= PHYSMM_MAX_ORDER );
+
 	//TODO: Lock physmm_bitmap
-	physaddr_t counter, bit_counter;
-	for (counter = 0; counter < PHYSMM_BITMAP_SIZE; counter++) {
-		if (physmm_bitmap[counter] == 0)
+	for ( o = order; o <= PHYSMM_MAX_ORDER; o++ ) {
+		frame = physmm_buddy_find( o );
+		if ( frame < 0 )
 			continue;
-		for (bit_counter = 0; bit_counter < 32; bit_counter++) {
-			if (physmm_bitmap[counter] & (1u << bit_counter)) {
-				counter <<= 5;
-				counter |= bit_counter;
-				counter <<= 12;
-				physmm_clear_bit(counter);
-				//TODO: Release physmm_bitmap
-				return counter;
-			}
-		}
+		physmm_buddy_remove( o, frame );
+		physmm_buddy_split( frame, o, frame, order );
+		physmm_mark_range( frame, 1u << order, 0 );
+		physmm_free_count -= 1u << order;
+		//TODO: Release physmm_bitmap
+		shrinker_check();
+		return ( (physaddr_t) frame ) << 12;
 	}
 	//TODO: Release physmm_bitmap
+	shrinker_check();
 	return PHYSMM_NO_FRAME;
 }
 
-physaddr_t physmm_alloc_quadframe()
+void physmm_free_pages(physaddr_t address, int order)
 {
-	//TODO: Lock physmm_bitmap
-	physaddr_t counter, bit_counter;
-	for (counter = 0; counter < PHYSMM_BITMAP_SIZE; counter++) {
-		if (physmm_bitmap[counter] == 0)
-			continue;
-		for (bit_counter = 0; bit_counter < 32; bit_counter+=4) {
-			if ((physmm_bitmap[counter] & (0xF << bit_counter)) == 0xF) {
-				counter <<= 5;
-				counter |= bit_counter;
-				counter <<= 12;
-				physmm_clear_bit(counter+PHYSMM_PAGE_SIZE*0);
-				physmm_clear_bit(counter+PHYSMM_PAGE_SIZE*1);
-				physmm_clear_bit(counter+PHYSMM_PAGE_SIZE*2);
-				physmm_clear_bit(counter+PHYSMM_PAGE_SIZE*3);
-				//TODO: Release physmm_bitmap
-				return counter;
-			}
-		}
+	uint32_t frame = address >> 12;
+
+	assert( order >= 0 && order <= PHYSMM_MAX_ORDER );
+	assert( ( frame & ( ( 1u << order ) - 1 ) ) == 0 );
+
+	if ( order == 0 ) {
+		physmm_free_frame( address );
+		return;
 	}
+
+	//TODO: Lock physmm_bitmap
+	physmm_mark_range( frame, 1u << order, 1 );
+	physmm_free_count += 1u << order;
+	physmm_buddy_free( frame, order );
 	//TODO: Release physmm_bitmap
-	return PHYSMM_NO_FRAME;
+}
+
+physaddr_t physmm_alloc_frame()
+{
+	return physmm_alloc_pages( 0 );
+}
+
+physaddr_t physmm_alloc_quadframe()
+{
+	return physmm_alloc_pages( 2 );
 }
 
 physaddr_t physmm_alloc_bmcopy()
 {
-	//TODO: Lock physmm_bitmap
-	physaddr_t counter;
-	for (counter = 0; counter < PHYSMM_BITMAP_SIZE; counter++) {
-		if (physmm_bitmap[counter] != 0xFFFFFFFF)
-			continue;
-		physmm_bitmap[counter] = 0;
-		return counter << 17;
-	}
-	//TODO: Release physmm_bitmap
-	return PHYSMM_NO_FRAME;
+	/* The bitmap copy is PHYSMM_BITMAP_SIZE words: 32 frames */
+	return physmm_alloc_pages( 5 );
 }
 
 physaddr_t physmm_count_free()
 {
-	//TODO: Lock physmm_bitmap
-	physaddr_t counter, bit_counter, result;
-	result = 0;
-	for (counter = 0; counter < PHYSMM_BITMAP_SIZE; counter++) {
-		if (physmm_bitmap[counter] == 0)
-			continue;
-		for (bit_counter = 0; bit_counter < 32; bit_counter++) {
-			if (physmm_bitmap[counter] & (1u << bit_counter))
-				result += PHYSMM_PAGE_SIZE;
-		}
+	return physmm_free_count * PHYSMM_PAGE_SIZE;
+}
+
+/**
+ * Looks up the share entry for a frame
+ * @return A pointer to the link pointing at the entry, which points to NULL
+ *         if the frame is not shared
+ */
+static physmm_share_t **physmm_share_find(physaddr_t address)
+{
+	physmm_share_t **link;
+	uint32_t frame = address >> 12;
+
+	link = &physmm_share_table[frame & (PHYSMM_SHARE_TABLE_SIZE - 1)];
+	while ( *link && (*link)->frame != frame )
+		link = &(*link)->next;
+
+	return link;
+}
+
+int physmm_ref_frame(physaddr_t address)
+{
+	physmm_share_t **link;
+	physmm_share_t *share;
+
+	//TODO: Lock physmm_share_table
+	link = physmm_share_find( address );
+	if ( *link ) {
+		(*link)->refs++;
+		return 0;
 	}
-	//TODO: Release physmm_bitmap
-	return result;
+
+	/* Frames are shared while page tables are being copied, this must
+	 * not sleep waiting for memory to be reclaimed */
+	share = heapmm_alloc_nowait( sizeof( physmm_share_t ) );
+	if ( !share )
+		return -1;
+
+	share->frame = address >> 12;
+	share->refs  = 2;
+
+	/* The allocation may have touched the table, look the bucket up again */
+	link = physmm_share_find( address );
+	share->next = *link;
+	*link = share;
+	physmm_share_count++;
+	//TODO: Release physmm_share_table
+
+	return 0;
+}
+
+uint32_t physmm_frame_refs(physaddr_t address)
+{
+	physmm_share_t *share;
+
+	if ( physmm_share_count == 0 )
+		return 1;
+
+	share = *physmm_share_find( address );
+	return share ? share->refs : 1;
+}
+
+/**
+ * Drops a reference to a shared frame
+ * @return Nonzero if the frame is still in use
+ */
+static int physmm_unref_frame(physaddr_t address)
+{
+	physmm_share_t **link;
+	physmm_share_t *share;
+
+	if ( physmm_share_count == 0 )
+		return 0;
+
+	link = physmm_share_find( address );
+	share = *link;
+	if ( !share )
+		return 0;
+
+	if ( --share->refs == 1 ) {
+		*link = share->next;
+		physmm_share_count--;
+		heapmm_free( share, sizeof( physmm_share_t ) );
+	}
+
+	return 1;
 }
 
 void physmm_free_frame(physaddr_t address)
 {
+	if ( physmm_unref_frame( address ) )
+		return;
+
+	//TODO: Lock physmm_bitmap
+	assert( !physmm_test_bit( address ) );
 	physmm_set_bit(address);
+	physmm_free_count++;
+	physmm_buddy_free( address >> 12, 0 );
+	//TODO: Release physmm_bitmap
+}
+
+void physmm_load_bitmap(const uint32_t *bitmap)
+{
+	physaddr_t counter, bit_counter;
+	physmm_init();
+	for (counter = 0; counter < PHYSMM_BITMAP_SIZE; counter++) {
+		if (bitmap[counter] == 0)
+			continue;
+		for (bit_counter = 0; bit_counter < 32; bit_counter++) {
+			if (bitmap[counter] & (1u << bit_counter))
+				physmm_free_frame(
+					((counter << 5) | bit_counter) << 12);
+		}
+	}
 }
 
 void physmm_init(){
-	memset(physmm_bitmap, 0, 32768 * sizeof(uint32_t));
+	uint32_t *pool = physmm_buddy_pool;
+	physmm_order_t *o;
+	int order;
+
+	memset(physmm_bitmap, 0, PHYSMM_BITMAP_SIZE * sizeof(uint32_t));
+	memset(physmm_buddy_pool, 0, sizeof physmm_buddy_pool);
+	memset(physmm_share_table, 0, sizeof physmm_share_table);
+
+	for ( order = 0; order <= PHYSMM_MAX_ORDER; order++ ) {
+		o = &physmm_orders[order];
+		o->size = PHYSMM_BITMAP_SIZE >> order;
+		o->top  = 0;
+		o->map  = pool;
+		pool   += o->size;
+		o->sum1 = pool;
+		pool   += ( o->size + 31 ) / 32;
+		o->sum2 = pool;
+		pool   += ( o->size + 1023 ) / 1024;
+	}
+
+	assert( pool <= physmm_buddy_pool + PHYSMM_BUDDY_POOL_SIZE );
+
+	physmm_free_count = 0;
+	physmm_share_count = 0;
 }
@@ -0,0 +1,230 @@
+/**
+ * kernel/shrinker.c
+ *
+ * Part of P-OS kernel.
+ *
+ * Implements the registry of caches that give memory back when physical
+ * memory runs low.
+ *
+ * The physical memory manager calls shrinker_check on every allocation, once
+ * free memory drops below CONFIG_RECLAIM_LOW_PAGES the reclaim task is woken.
+ * It asks every registered cache to release a share of its objects, starting
+ * with a small share and doubling it every round, until free memory is back
+ * above CONFIG_RECLAIM_HIGH_PAGES. Allocators are asked after the caches so
+ * the memory the caches released can be returned to the physical memory
+ * manager. Allocations that fail outright wait for a reclaim run through
+ * paging_handle_out_of_memory and then retry.
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ * 17-10-2026 - Do not wait with interrupts disabled
+ */
+
+#include "kernel/shrinker.h"
+#include "kernel/physmm.h"
+#include "kernel/scheduler.h"
+#include "kernel/synch.h"
+#include "kernel/time.h"
+#define CON_SRC "shrinker"
+#include "kernel/console.h"
+#include "config.h"
+#include <assert.h>
+
+/**
+ * The share of its objects a cache is asked to release in the first round is
+ * 2^-SHRINKER_MAX_PRIORITY
+ */
+#define SHRINKER_MAX_PRIORITY	(12)
+
+/**
+ * The time in microseconds an allocation waits for the reclaim task
+ */
+#define SHRINKER_WAIT		(100000)
+
+/** The registered shrinkers */
+static llist_t shrinker_list = { &shrinker_list, &shrinker_list };
+
+/** Protects the shrinker list */
+static semaphore_t shrinker_lock = 1;
+
+/** Raised to wake the reclaim task */
+static semaphore_t shrinker_wake;
+
+/** Raised once for every waiter when a reclaim run finishes */
+static semaphore_t shrinker_done;
+
+/** The number of tasks waiting for the current reclaim run */
+static int shrinker_waiters = 0;
+
+/** Counts the finished reclaim runs */
+static unsigned int shrinker_generation = 0;
+
+/** The number of objects released by the last reclaim run */
+static size_t shrinker_released = 0;
+
+/** The time at which the last reclaim run finished */
+static ktime_t shrinker_last_run = 0;
+
+/** The reclaim task, NULL until it is started */
+static scheduler_task_t *shrinker_task = NULL;
+
+/**
+ * Returns the number of free physical pages
+ */
+static size_t shrinker_free_pages(void)
+{
+	return physmm_count_free() / PHYSMM_PAGE_SIZE;
+}
+
+void shrinker_register(shrinker_t *shrinker)
+{
+	assert( shrinker != NULL );
+	assert( shrinker->count != NULL && shrinker->scan != NULL );
+
+	semaphore_down( &shrinker_lock );
+	llist_add_end( &shrinker_list, &shrinker->node );
+	semaphore_up( &shrinker_lock );
+}
+
+void shrinker_unregister(shrinker_t *shrinker)
+{
+	assert( shrinker != NULL );
+
+	semaphore_down( &shrinker_lock );
+	llist_unlink( &shrinker->node );
+	semaphore_up( &shrinker_lock );
+}
+
+int shrinker_may_grow(void)
+{
+	return shrinker_free_pages() > CONFIG_RECLAIM_HIGH_PAGES;
+}
+
+/**
+ * Asks the registered caches to release objects until at least <target>
+ * pages are free
+ * @return The number of objects released
+ */
+static size_t shrinker_reclaim(size_t target)
+{
+	shrinker_t *shrinker;
+	llist_t *_e;
+	size_t released = 0, count;
+	int priority, pass;
+
+	semaphore_down( &shrinker_lock );
+
+	for ( priority = SHRINKER_MAX_PRIORITY;
+	      priority >= 0 && shrinker_free_pages() < target;
+	      priority-- ) {
+		for ( pass = SHRINKER_PASS_CACHE;
+		      pass <= SHRINKER_PASS_ALLOCATOR;
+		      pass++ ) {
+			for ( _e = shrinker_list.next;
+			      _e != &shrinker_list;
+			      _e = _e->next ) {
+				shrinker = ( shrinker_t * ) _e;
+				if ( shrinker->pass != pass )
+					continue;
+				count = shrinker->count( shrinker );
+				if ( !count )
+					continue;
+				count >>= priority;
+				released += shrinker->scan( shrinker,
+							    count ? count : 1 );
+			}
+		}
+	}
+
+	semaphore_up( &shrinker_lock );
+
+	return released;
+}
+
+/**
+ * The main loop of the reclaim task
+ */
+static void shrinker_main( __attribute__((unused)) void *arg )
+{
+	size_t released;
+	int s;
+
+	for (;;) {
+		semaphore_down( &shrinker_wake );
+
+		released = shrinker_reclaim( CONFIG_RECLAIM_HIGH_PAGES );
+
+		printf( CON_TRACE, "released %i objects, %i pages free",
+			released, shrinker_free_pages() );
+
+		/* Wake everyone that waited for this run */
+		s = disable();
+		shrinker_released = released;
+		shrinker_last_run = system_time;
+		shrinker_generation++;
+		semaphore_add( &shrinker_done, shrinker_waiters );
+		shrinker_waiters = 0;
+		restore( s );
+	}
+}
+
+void shrinker_check(void)
+{
+	if ( !shrinker_task || shrinker_free_pages() >= CONFIG_RECLAIM_LOW_PAGES )
+		return;
+
+	/* Do not keep the task busy if there was nothing left to release */
+	if ( !shrinker_released && shrinker_last_run == system_time )
+		return;
+
+	if ( !shrinker_wake )
+		semaphore_up( &shrinker_wake );
+}
+
+int shrinker_wait(void)
+{
+	unsigned int generation;
+	int s;
+
+	if ( !shrinker_task || scheduler_current_task == shrinker_task )
+		return 0;
+
+	/* Callers that run with interrupts disabled can not sleep, they
+	 * get to handle the failure */
+	s = disable();
+	if ( !s ) {
+		restore( s );
+		return 0;
+	}
+
+	generation = shrinker_generation;
+	shrinker_waiters++;
+	if ( !shrinker_wake )
+		semaphore_up( &shrinker_wake );
+	restore( s );
+
+	if ( semaphore_ndown( &shrinker_done, SHRINKER_WAIT,
+			      SCHED_WAITF_TIMEOUT ) ) {
+		/* Timed out, the run may have finished in the meantime */
+		s = disable();
+		if ( shrinker_generation == generation )
+			shrinker_waiters--;
+		else
+			semaphore_try_down( &shrinker_done );
+		restore( s );
+		return 0;
+	}
+
+	return shrinker_released != 0;
+}
+
+void shrinker_start(void)
+{
+	int status;
+
+	status = scheduler_spawn( shrinker_main, NULL, &shrinker_task );
+	if ( status )
+		printf( CON_ERROR, "failed to start the reclaim task: %i", status );
+}
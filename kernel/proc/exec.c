@@ -8,10 +8,13 @@
  * Changelog:
  * 07-04-2014 - Created
  *    05-2017 - Split off from process.c
+ * 17-10-2026 - Added posix_spawn
+ * 17-10-2026 - Clean up the child when its task can not be started
  */
 #include <string.h>
 #include <stddef.h>
 #include <sys/errno.h>
+#include <sys/stat.h>
 #include "kernel/process.h"
 #include "kernel/synch.h"
 #include "kernel/scheduler.h"
@@ -182,6 +185,16 @@ exec_start:
 		vfs_inode_release(current_process->image_inode);
 	}
 
+	/* A vfork child is still running on its parents address space, give
+	 * it one of its own instead of tearing down the parents */
+	if ( current_process->flags & PROCESS_FLAG_VFORK ) {
+		status = process_detach_vfork( current_process );
+		if ( status ) {
+			vfs_inode_release( inode );
+			return status;
+		}
+	}
+
 	procvmm_clear_mmaps();
 
 	signal_init_process( current_process );
@@ -264,3 +277,222 @@ exec_start:
 
 }
 
+
+/**
+ * State handed from process_spawn to the task running the new process
+ */
+typedef struct {
+	process_info_t             *process;
+	char                       *path;
+	char                      **args;
+	char                      **envs;
+	posix_spawn_file_actions_t *actions;
+	posix_spawnattr_t          *attr;
+} spawn_info_t;
+
+/**
+ * Free a kernel copy of an argument or environment list
+ */
+void process_free_strlist( char **list )
+{
+	int c, len;
+
+	if ( !list )
+		return;
+
+	len = strlistlen( list );
+
+	for ( c = 0; c < len; c++ )
+		heapmm_free( list[c], strlen( list[c] ) + 1 );
+
+	heapmm_free( list, ( len + 1 ) * sizeof( char * ) );
+}
+
+/**
+ * Free a kernel copy of a spawn file action list
+ */
+void process_free_file_actions( posix_spawn_file_actions_t *actions )
+{
+	struct posix_spawn_file_action *fa;
+	int c;
+
+	if ( !actions )
+		return;
+
+	for ( c = 0; c < actions->fa_count; c++ ) {
+		fa = &actions->fa_list[c];
+		if ( fa->fa_type == SPAWN_FA_OPEN && fa->fa_path )
+			heapmm_free( (char *) fa->fa_path, strlen( fa->fa_path ) + 1 );
+	}
+
+	heapmm_free( actions, sizeof( posix_spawn_file_actions_t ) );
+}
+
+static void spawn_free_info( spawn_info_t *info )
+{
+	heapmm_free( info->path, strlen( info->path ) + 1 );
+	process_free_strlist( info->args );
+	process_free_strlist( info->envs );
+	process_free_file_actions( info->actions );
+	if ( info->attr )
+		heapmm_free( info->attr, sizeof( posix_spawnattr_t ) );
+	heapmm_free( info, sizeof( spawn_info_t ) );
+}
+
+/**
+ * Perform the file actions for a spawned process
+ * @return Zero on success, an ERRNO code otherwise.
+ */
+static int spawn_do_file_actions( posix_spawn_file_actions_t *actions )
+{
+	struct posix_spawn_file_action *fa;
+	int c, fd;
+
+	for ( c = 0; c < actions->fa_count; c++ ) {
+		fa = &actions->fa_list[c];
+
+		switch ( fa->fa_type ) {
+			case SPAWN_FA_OPEN:
+				fd = _sys_open( fa->fa_path, fa->fa_oflag, fa->fa_mode );
+				if ( fd < 0 )
+					return syscall_errno;
+				if ( fd == fa->fa_fd )
+					break;
+				if ( _sys_dup2( fd, fa->fa_fd ) < 0 )
+					return syscall_errno;
+				_sys_close( fd );
+				break;
+
+			case SPAWN_FA_CLOSE:
+				if ( _sys_close( fa->fa_fd ) < 0 )
+					return syscall_errno;
+				break;
+
+			case SPAWN_FA_DUP2:
+				if ( _sys_dup2( fa->fa_fd, fa->fa_newfd ) < 0 )
+					return syscall_errno;
+				break;
+
+			default:
+				return EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Entry point for spawned processes
+ */
+static void spawn_main( void *arg )
+{
+	spawn_info_t *info = arg;
+	process_info_t *process = info->process;
+	posix_spawnattr_t *attr = info->attr;
+	int status;
+
+	/* Give the process an empty address space and attach to it */
+	process_create_vm( process );
+
+	/* Apply the spawn attributes */
+	if ( attr && ( attr->sa_flags & POSIX_SPAWN_SETPGROUP ) )
+		process->pgid = attr->sa_pgroup ? attr->sa_pgroup : process->pid;
+
+	if ( info->actions ) {
+		status = spawn_do_file_actions( info->actions );
+		if ( status ) {
+			printf( CON_WARN, "spawn file action failed: %i", status );
+			goto error;
+		}
+	}
+
+	status = process_exec( info->path, info->args, info->envs );
+	if ( status ) {
+		printf( CON_WARN, "spawn exec failed: %i", status );
+		goto error;
+	}
+
+	spawn_free_info( info );
+
+	/* Returning from a spawn entrypoint drops to user mode */
+	return;
+
+error:
+	spawn_free_info( info );
+	sys_exit( 127, 0, 0, 0, 0, 0 );
+}
+
+/**
+ * @brief Create a new process directly from an executable
+ * The new process starts out with an empty address space instead of a copy
+ * of the caller's, so this costs about as much as a single exec. All list
+ * and string arguments must be kernel heap copies, they are owned by the new
+ * process if the call succeeds.
+ * @param pid     Receives the pid of the new process.
+ * @param path    The executable to run.
+ * @param args    The argument list.
+ * @param envs    The environment list.
+ * @param actions The file actions to perform before exec, may be NULL.
+ * @param attr    The spawn attributes, may be NULL.
+ * @return Zero on success, an ERRNO code otherwise.
+ */
+int process_spawn(	pid_t *pid,
+			const char *path,
+			char * const args[],
+			char * const envs[],
+			posix_spawn_file_actions_t *actions,
+			posix_spawnattr_t *attr )
+{
+	spawn_info_t *info;
+	inode_t *inode;
+	pid_t child_pid;
+	int status;
+
+	/* Report the common exec errors to the caller, errors that occur
+	 * later can only be reported as the exit status of the child */
+	status = vfs_find_inode( path, &inode );
+	if ( status )
+		return status;
+
+	if ( !S_ISREG( inode->mode ) ||
+	     !vfs_have_permissions( inode, MODE_EXEC ) ) {
+		vfs_inode_release( inode );
+		return EACCES;
+	}
+
+	vfs_inode_release( inode );
+
+	info = heapmm_alloc( sizeof( spawn_info_t ) );
+	if ( !info )
+		return ENOMEM;
+
+	info->process = spawn_process();
+	if ( !info->process ) {
+		heapmm_free( info, sizeof( spawn_info_t ) );
+		return ENOMEM;
+	}
+
+	info->path    = (char *) path;
+	info->args    = (char **) args;
+	info->envs    = (char **) envs;
+	info->actions = actions;
+	info->attr    = attr;
+
+	/* The child owns info as soon as it runs */
+	child_pid = info->process->pid;
+
+	status = scheduler_spawn( spawn_main, info, NULL );
+	if ( status ) {
+
+		/* The arguments still belong to the caller */
+		process_abort_child( info->process );
+		heapmm_free( info, sizeof( spawn_info_t ) );
+
+		return status;
+
+	}
+
+	*pid = child_pid;
+
+	return 0;
+}
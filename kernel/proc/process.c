@@ -7,6 +7,9 @@
  *
  * Changelog:
  * 07-04-2014 - Created
+ * 17-10-2026 - Added vfork and spawn
+ * 17-10-2026 - Allocate memory maps through procvmm
+ * 17-10-2026 - Clean up children that could not be started
  */
 #include <string.h>
 #include <stddef.h>
@@ -45,8 +48,7 @@ void create_kprocess()
 	kernel_process.fd_table = heapmm_alloc(sizeof(llist_t));
 	llist_create(kernel_process.fd_table);
 
-	kernel_process.memory_map = heapmm_alloc(sizeof(llist_t));
-	llist_create(kernel_process.memory_map);
+	kernel_process.memory_map = procvmm_alloc_memory_map();
 
 	/* Initialize process memory info */
 	kernel_process.heap_start	 = (void *) 0xE0000000;
@@ -79,12 +81,18 @@ int posix_fork()
 
 	proc = fork_process();
 
+	if ( !proc ) {
+		syscall_errno = ENOMEM;
+		return -1;
+	}
+
 	status = scheduler_spawn( scheduler_fork_main, proc, NULL );
 
 	if ( status ) {
 
-		//TODO: Cleanup process
+		process_abort_child( proc );
 
+		syscall_errno = status;
 		return -1;
 
 	}
@@ -94,7 +102,72 @@ int posix_fork()
 }
 
 
-process_info_t *fork_process( void )
+int posix_vfork()
+{
+
+	int status;
+	process_info_t *proc;
+
+	proc = vfork_process();
+
+	if ( !proc ) {
+		syscall_errno = ENOMEM;
+		return -1;
+	}
+
+	status = scheduler_spawn( scheduler_fork_main, proc, NULL );
+
+	if ( status ) {
+
+		process_abort_child( proc );
+
+		syscall_errno = status;
+		return -1;
+
+	}
+
+	/* The child is running on our address space, wait for it to exec
+	 * or exit before returning to it */
+	semaphore_down( &proc->vfork_sema );
+
+	return proc->pid;
+
+}
+
+/**
+ * Release the state set up by process_alloc_child for a child that never
+ * ran, fields that were not set up yet are skipped
+ */
+static void process_free_child( process_info_t *child )
+{
+	if ( child->fd_table ) {
+		stream_do_close_all( child );
+		heapmm_free( child->fd_table, sizeof( llist_t ) );
+	}
+
+	/* process_alloc_child takes two references on each directory */
+	if ( child->root_directory ) {
+		vfs_dir_cache_release( child->root_directory );
+		vfs_dir_cache_release( child->root_directory );
+	}
+
+	if ( child->current_directory ) {
+		vfs_dir_cache_release( child->current_directory );
+		vfs_dir_cache_release( child->current_directory );
+	}
+
+	if ( child->name )
+		heapmm_free( child->name, CONFIG_PROCESS_MAX_NAME_LENGTH );
+
+	heapmm_free( child, sizeof( process_info_t ) );
+}
+
+/**
+ * Allocate a child of the current process and copy over the state that
+ * fork, vfork and spawn have in common. The memory map and page directory
+ * are left for the caller to set up.
+ */
+static process_info_t *process_alloc_child( void )
 {
 	process_info_t *child = ( process_info_t *)
 		heapmm_alloc(sizeof( process_info_t ));
@@ -115,22 +188,25 @@ process_info_t *fork_process( void )
 	child->parent_pid     = current_process->pid;
 
 	child->name = heapmm_alloc(CONFIG_PROCESS_MAX_NAME_LENGTH);//XXX: Why is this not part of process struct
-	//TODO: Handle out of memory condition here
+	if ( !child->name ) {
+		process_free_child( child );
+		return NULL;
+	}
 	strcpy(child->name, current_process->name);
 
 	child->fd_table = heapmm_alloc(sizeof(llist_t));//XXX: Why is this not part of process struct
+	if ( !child->fd_table ) {
+		process_free_child( child );
+		return NULL;
+	}
 	llist_create(child->fd_table);
 	stream_copy_fd_table (child->fd_table);
 	child->fd_ctr = current_process->fd_ctr;
 
-	child->memory_map = heapmm_alloc(sizeof(llist_t));//XXX: Why is this not part of process struct
-	llist_create(child->memory_map);
-	procvmm_copy_memory_map (child->memory_map);
-
 	child->current_directory = vfs_dir_cache_ref(current_process->current_directory);
 	child->root_directory = vfs_dir_cache_ref(current_process->root_directory);
-	child->root_directory->usage_count++;
-	child->current_directory->usage_count++;
+	vfs_dir_cache_ref(child->root_directory);
+	vfs_dir_cache_ref(child->current_directory);
 
 	/* Initialize proces signal handling */
 	memcpy( child->signal_actions,
@@ -144,20 +220,161 @@ process_info_t *fork_process( void )
 	child->stack_bottom	= current_process->stack_bottom;
 	child->stack_top	= current_process->stack_top;
 	semaphore_init(&child->child_sema);
+	semaphore_init(&child->vfork_sema);
 
 	llist_create(&child->child_events);
 	llist_create(&child->tasks);
 
-	/* fork the user pages */
-	child->page_directory = paging_create_dir(); //TODO: Check for errors
+	return child;
+}
 
+/**
+ * Make a process known to the scheduler
+ */
+static void process_add_child( process_info_t *child )
+{
 	/* Initialize process state */
 	child->state = PROCESS_READY;
 	llist_add_end( process_list, (llist_t *) child );
+}
+
+process_info_t *fork_process( void )
+{
+	process_info_t *child = process_alloc_child();
+
+	if ( !child )
+		return NULL;
+
+	child->memory_map = procvmm_alloc_memory_map();//XXX: Why is this not part of process struct
+	if ( !child->memory_map ) {
+		process_free_child( child );
+		return NULL;
+	}
+	procvmm_copy_memory_map (child->memory_map);
+
+	/* fork the user pages */
+	child->page_directory = paging_create_dir(); //TODO: Check for errors
+
+	process_add_child( child );
+
+	return child;
+}
+
+/**
+ * Create a child process that borrows the address space of the current
+ * process until it calls exec or exits.
+ */
+process_info_t *vfork_process( void )
+{
+	process_info_t *child = process_alloc_child();
+
+	if ( !child )
+		return NULL;
+
+	child->memory_map     = current_process->memory_map;
+	child->page_directory = current_process->page_directory;
+	child->flags         |= PROCESS_FLAG_VFORK;
+
+	process_add_child( child );
 
 	return child;
 }
 
+/**
+ * Create a child process without an address space, the task that runs it
+ * has to set one up using process_create_vm before using it.
+ */
+process_info_t *spawn_process( void )
+{
+	process_info_t *child = process_alloc_child();
+
+	if ( !child )
+		return NULL;
+
+	child->memory_map = procvmm_alloc_memory_map();//XXX: Why is this not part of process struct
+	if ( !child->memory_map ) {
+		process_free_child( child );
+		return NULL;
+	}
+
+	process_add_child( child );
+
+	return child;
+}
+
+/**
+ * Destroy a child created by fork_process, vfork_process or spawn_process
+ * that could not be started, before any task has run on it
+ */
+void process_abort_child( process_info_t *child )
+{
+	assert( child->state == PROCESS_READY );
+	assert( llist_get_first( &child->tasks ) == NULL );
+
+	llist_unlink( (llist_t *) child );
+
+	/* A vfork child uses the address space of its parent */
+	if ( ~child->flags & PROCESS_FLAG_VFORK ) {
+		if ( child->page_directory ) {
+			procvmm_clear_mmaps_other( child );
+			paging_free_dir( child->page_directory );
+		}
+		heapmm_free( child->memory_map, sizeof( process_memory_map_t ) );
+	}
+
+	process_free_child( child );
+}
+
+/**
+ * Give a process, which must be running on the current task and must have
+ * an empty memory map, a new page directory without any user pages
+ */
+void process_create_vm( process_info_t *process )
+{
+	scheduler_task_t *task = scheduler_current_task;
+
+	/* Create the directory from the kernel address space, so that there
+	 * are no user pages to copy into it */
+	scheduler_reown_task( task, &kernel_process );
+
+	process->page_directory = paging_create_dir(); //TODO: Check for errors
+
+	scheduler_reown_task( task, process );
+}
+
+/**
+ * Wake up the parent of a vfork child, called when the child is done
+ * using its parents address space.
+ */
+void process_vfork_release( process_info_t *process )
+{
+	assert( process->flags & PROCESS_FLAG_VFORK );
+
+	semaphore_up( &process->vfork_sema );
+}
+
+/**
+ * Give a vfork child its own address space and release its parent, this is
+ * done by exec before it tears down the old image.
+ * @return Zero on success, an ERRNO code otherwise.
+ */
+int process_detach_vfork( process_info_t *process )
+{
+	process_memory_map_t *map;
+
+	map = procvmm_alloc_memory_map();
+	if ( !map )
+		return ENOMEM;
+
+	process->memory_map = map;
+
+	process_create_vm( process );
+
+	process_vfork_release( process );
+	process->flags &= ~PROCESS_FLAG_VFORK;
+
+	return 0;
+}
 
 void process_init()
 {
@@ -333,8 +550,11 @@ void process_reap(process_info_t *process)
 		scheduler_reap ( ( scheduler_task_t * ) c );//TODO: Check for errors
 	}
 
-	procvmm_clear_mmaps_other( process );
-	paging_free_dir( process->page_directory );
+	/* A vfork child that exited never got an address space of its own */
+	if ( ~process->flags & PROCESS_FLAG_VFORK ) {
+		procvmm_clear_mmaps_other( process );
+		paging_free_dir( process->page_directory );
+	}
 	vfs_dir_cache_release(process->root_directory);
 	vfs_dir_cache_release(process->current_directory);
 
@@ -7,6 +7,13 @@
  *
  * Changelog:
  * 23-04-2014 - Created
+ * 17-10-2026 - Wait for reclaim before failing a fault for lack of memory
+ * 17-10-2026 - Map file pages from the page cache
+ * 17-10-2026 - Shared file mappings
+ * 17-10-2026 - Fault-around and MAP_POPULATE
+ * 17-10-2026 - Index regions in a balanced tree
+ * 17-10-2026 - Leave shared page tables alone when tearing down
+ * 17-10-2026 - Check for writable regions before kernel stores
  */
 
 #include "kernel/process.h"
@@ -26,6 +33,7 @@
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <assert.h>
 
 int strlistlen(const char **list);
@@ -40,10 +48,14 @@ void procvmm_clear_mmaps()
 
 	cproc = current_process;
 
+	/* Page tables still shared since a fork belong to the other processes
+	 * too, just drop them */
+	paging_release_shared_tables( cproc->page_directory );
+
 	/* Call procvmm_unmap for all regions */
-	for ( region = (process_mmap_t *) llist_get_last( cproc->memory_map );
+	for ( region = (process_mmap_t *) llist_get_last( &cproc->memory_map->regions );
 	      region != NULL;
-	      region = (process_mmap_t *) llist_get_last( cproc->memory_map ) )
+	      region = (process_mmap_t *) llist_get_last( &cproc->memory_map->regions ) )
 		procvmm_unmmap(region);
 }
 
@@ -54,10 +66,14 @@ void procvmm_clear_mmaps_other( process_info_t *info )
 {
 	process_mmap_t *region;
 
+	/* Page tables still shared since a fork belong to the other processes
+	 * too, just drop them */
+	paging_release_shared_tables( info->page_directory );
+
 	/* Call procvmm_unmap for all regions */
-	for ( region = (process_mmap_t *) llist_get_last( info->memory_map );
+	for ( region = (process_mmap_t *) llist_get_last( &info->memory_map->regions );
 	      region != NULL;
-	      region = (process_mmap_t *) llist_get_last( info->memory_map ) )
+	      region = (process_mmap_t *) llist_get_last( &info->memory_map->regions ) )
 		procvmm_unmmap_other(info, region);
 }
 /*
@@ -102,30 +118,66 @@ int procvmm_do_exec_mmaps()
 	return s;
 }
 
-int procvmm_check( const void *dest, size_t size)
+static int procvmm_check_access( const void *dest, size_t size, int write )
 {
+	process_mmap_t *region;
 	uintptr_t b;
+	uintptr_t e;
 	uintptr_t p;
 
-	/* Compute the start of the first page of the area */
-	b = ((uintptr_t)dest) & ~PAGE_ADDR_MASK;
-
 	/* If there is no current proces or the current process is the init
 	 * process, we always allow creating the mapping */ //TODO: WHY?
 	if ( (!current_process) || current_process->pid == 0 )
 		return 1;
 
-	/* Check if a mapping exists for any of the pages in the range */
-	for ( p = 0; p < size; p += PAGE_SIZE ) {
-		if (!procvmm_get_memory_region((void *) (b + p))) {
+	if ( size == 0 )
+		return 1;
+
+	/* Reject areas that wrap around the end of the address space */
+	e = (uintptr_t) dest + size - 1;
+	if ( e < (uintptr_t) dest )
+		return 0;
+
+	/* Compute the start of the first page of the area */
+	b = ((uintptr_t)dest) & ~PAGE_ADDR_MASK;
+
+	/* Check if a mapping exists for every page in the range, and that it
+	 * is writable if we are going to store to it: the kernel runs with
+	 * write protection enabled, so a store to a read only page would be
+	 * a fatal fault */
+	for ( p = b; p <= e && p >= b; p += PAGE_SIZE ) {
+		region = procvmm_get_memory_region((void *) p);
+		if ( !region )
+			return 0;
+		if ( write && !(region->flags & PROCESS_MMAP_FLAG_WRITE) )
 			return 0;
-		}
 	}
 
-	/* No overlap found, allow creating the mapping */
 	return 1;
 }
 
+/**
+ * @brief Checks whether the kernel may read a user memory area
+ * @param dest The start of the area
+ * @param size The size of the area
+ * @return Nonzero if every page of the area is mapped
+ */
+int procvmm_check( const void *dest, size_t size)
+{
+	return procvmm_check_access( dest, size, 0 );
+}
+
+/**
+ * @brief Checks whether the kernel may write to a user memory area
+ * @param dest The start of the area
+ * @param size The size of the area
+ * @return Nonzero if every page of the area is mapped writable
+ */
+int procvmm_check_write( const void *dest, size_t size)
+{
+	return procvmm_check_access( dest, size, 1 );
+}
+
 /**
  * @brief Safely determines the minimal storage area for a string.
  *
@@ -197,15 +249,370 @@ int procvmm_check_stringlist(	const char **dest,
 }
 
 /**
- * Iterator function that finds the mmap for the given address
+ * Iterator function that checks whether two regions overlap
+ */
+static int coll_check_iter ( llist_t *_b, void *_c )
+{
+	process_mmap_t *b, *c;
+	uintptr_t b_s, b_e, c_s, c_e;
+
+	b = (process_mmap_t *) _b;
+	c = (process_mmap_t *) _c;
+
+	/* Compute region B start and end */
+	b_s = (uintptr_t) b->start;
+	b_e = (uintptr_t) b->start + b->size;
+
+	/* Compute region C start and end */
+	c_s = (uintptr_t) c->start;
+	c_e = (uintptr_t) c->start + c->size;
+
+	/* Ignore collision with self */
+	if ( b == c )
+		return 0;
+
+	/* If the start of region C is in region B, there is overlap */
+	if ( (c_s >= b_s) && (c_s < b_e) )
+		return 1;
+
+	/* If the end of region C is in region B, there is overlap */
+	if ( (c_e > b_s) && (c_e < b_e) )
+		return 1;
+
+	/* If the start of region B is in region C, there is overlap */
+	if ( (b_s >= c_s) && (b_s < c_e) )
+		return 1;
+
+	/* If the end of region B is in region C, there is overlap */
+	if ( (b_e > c_s) && (b_e < c_e) )
+		return 1;
+
+	/* If none of these conditions were hit, there is no overlap */
+	return 0;
+}
+
+/*
+ * The regions of a process are kept in an AVL tree ordered by address, next
+ * to the list. Every node also summarizes its subtree: the lowest start, the
+ * highest end and the largest hole between two of its regions, with region
+ * ends rounded up to a page. Lookups, collision checks and the search for a
+ * free range use these to visit only O(log n) nodes.
+ */
+
+#define MMTREE_HEIGHT( NoDe )	( (NoDe) ? (NoDe)->tree_height : 0 )
+
+/**
+ * Get the end of a region
  */
-static int get_mmap_iter (llist_t *node, void *param)
+static inline uintptr_t mmap_end( process_mmap_t *region )
 {
-	process_mmap_t *m = (process_mmap_t *) node;
-	uintptr_t p   = (uintptr_t) param;
-	uintptr_t b_s = (uintptr_t) m->start;
-	uintptr_t b_e = b_s + m->size;
-	return (p >= b_s) && (p < b_e);
+	return (uintptr_t) region->start + region->size;
+}
+
+/**
+ * Compare the position of two regions in the tree
+ * @return Whether region a comes before region b
+ */
+static int mmtree_before( process_mmap_t *a, process_mmap_t *b )
+{
+	if ( a->start != b->start )
+		return a->start < b->start;
+
+	/* Only empty regions can share their start with another region */
+	if ( a->size != b->size )
+		return a->size < b->size;
+
+	return a < b;
+}
+
+/**
+ * Recompute the height and subtree summary of a node from its children
+ */
+static void mmtree_update( process_mmap_t *node )
+{
+	process_mmap_t *l = node->tree_left;
+	process_mmap_t *r = node->tree_right;
+	uintptr_t end, l_end;
+	size_t gap = 0;
+	int height;
+
+	height = MMTREE_HEIGHT( l );
+	if ( MMTREE_HEIGHT( r ) > height )
+		height = MMTREE_HEIGHT( r );
+	node->tree_height = height + 1;
+
+	end = PAGE_ROUND_UP( mmap_end( node ) );
+
+	node->tree_min_start = l ? l->tree_min_start : (uintptr_t) node->start;
+	node->tree_max_end   = r ? r->tree_max_end : mmap_end( node );
+
+	if ( l ) {
+		gap = l->tree_max_gap;
+		l_end = PAGE_ROUND_UP( l->tree_max_end );
+		if ( (uintptr_t) node->start > l_end &&
+		     (uintptr_t) node->start - l_end > gap )
+			gap = (uintptr_t) node->start - l_end;
+	}
+
+	if ( r ) {
+		if ( r->tree_max_gap > gap )
+			gap = r->tree_max_gap;
+		if ( r->tree_min_start > end &&
+		     r->tree_min_start - end > gap )
+			gap = r->tree_min_start - end;
+	}
+
+	node->tree_max_gap = gap;
+}
+
+static process_mmap_t *mmtree_rotate_right( process_mmap_t *node )
+{
+	process_mmap_t *l = node->tree_left;
+
+	node->tree_left = l->tree_right;
+	l->tree_right = node;
+
+	mmtree_update( node );
+	mmtree_update( l );
+
+	return l;
+}
+
+static process_mmap_t *mmtree_rotate_left( process_mmap_t *node )
+{
+	process_mmap_t *r = node->tree_right;
+
+	node->tree_right = r->tree_left;
+	r->tree_left = node;
+
+	mmtree_update( node );
+	mmtree_update( r );
+
+	return r;
+}
+
+/**
+ * Update a node whose subtrees changed and restore the AVL balance
+ * @return The new root of the subtree
+ */
+static process_mmap_t *mmtree_balance( process_mmap_t *node )
+{
+	int balance;
+
+	mmtree_update( node );
+
+	balance = MMTREE_HEIGHT( node->tree_left ) -
+	          MMTREE_HEIGHT( node->tree_right );
+
+	if ( balance > 1 ) {
+
+		if ( MMTREE_HEIGHT( node->tree_left->tree_left ) <
+		     MMTREE_HEIGHT( node->tree_left->tree_right ) )
+			node->tree_left = mmtree_rotate_left( node->tree_left );
+
+		return mmtree_rotate_right( node );
+
+	} else if ( balance < -1 ) {
+
+		if ( MMTREE_HEIGHT( node->tree_right->tree_right ) <
+		     MMTREE_HEIGHT( node->tree_right->tree_left ) )
+			node->tree_right = mmtree_rotate_right( node->tree_right );
+
+		return mmtree_rotate_left( node );
+
+	}
+
+	return node;
+}
+
+/**
+ * Insert a region into a subtree
+ * @return The new root of the subtree
+ */
+static process_mmap_t *mmtree_insert(
+        process_mmap_t *node,
+        process_mmap_t *region )
+{
+	if ( !node ) {
+		region->tree_left  = NULL;
+		region->tree_right = NULL;
+		mmtree_update( region );
+		return region;
+	}
+
+	if ( mmtree_before( region, node ) )
+		node->tree_left = mmtree_insert( node->tree_left, region );
+	else
+		node->tree_right = mmtree_insert( node->tree_right, region );
+
+	return mmtree_balance( node );
+}
+
+/**
+ * Remove the first region from a subtree
+ * @param first Set to the removed region
+ * @return      The new root of the subtree
+ */
+static process_mmap_t *mmtree_remove_first(
+        process_mmap_t *node,
+        process_mmap_t **first )
+{
+	if ( !node->tree_left ) {
+		*first = node;
+		return node->tree_right;
+	}
+
+	node->tree_left = mmtree_remove_first( node->tree_left, first );
+
+	return mmtree_balance( node );
+}
+
+/**
+ * Remove a region from a subtree
+ * @return The new root of the subtree
+ */
+static process_mmap_t *mmtree_remove(
+        process_mmap_t *node,
+        process_mmap_t *region )
+{
+	process_mmap_t *next;
+
+	assert( node != NULL );
+
+	if ( node == region ) {
+
+		if ( !node->tree_right )
+			return node->tree_left;
+
+		/* Replace the node by the region that follows it */
+		node->tree_right = mmtree_remove_first( node->tree_right, &next );
+		next->tree_left  = node->tree_left;
+		next->tree_right = node->tree_right;
+		node = next;
+
+	} else if ( mmtree_before( region, node ) )
+		node->tree_left = mmtree_remove( node->tree_left, region );
+	else
+		node->tree_right = mmtree_remove( node->tree_right, region );
+
+	return mmtree_balance( node );
+}
+
+/**
+ * Find a region that collides with a range
+ * @see coll_check_iter
+ */
+static process_mmap_t *mmtree_find_collide(
+        process_mmap_t *node,
+        process_mmap_t *region )
+{
+	process_mmap_t *found;
+	uintptr_t start, end;
+
+	start = (uintptr_t) region->start;
+	end   = mmap_end( region );
+
+	/* Skip subtrees that lie entirely before or after the range */
+	if ( !node || node->tree_max_end < start || node->tree_min_start > end )
+		return NULL;
+
+	if ( coll_check_iter( (llist_t *) node, region ) )
+		return node;
+
+	found = mmtree_find_collide( node->tree_left, region );
+	if ( found )
+		return found;
+
+	return mmtree_find_collide( node->tree_right, region );
+}
+
+/**
+ * Find the lowest free range of a given size above a floor
+ * @param node   The subtree to search
+ * @param floor  The lowest acceptable address
+ * @param size   The size of the range
+ * @param cursor The page rounded end of the regions before the subtree,
+ *               updated to include the subtree if nothing was found
+ * @return       The start of the range or 0 if it does not fit before the
+ *               end of the subtree
+ */
+static uintptr_t mmtree_find_gap(
+        process_mmap_t *node,
+        uintptr_t       floor,
+        size_t          size,
+        uintptr_t      *cursor )
+{
+	uintptr_t start, end, found;
+
+	if ( !node )
+		return 0;
+
+	end   = PAGE_ROUND_UP( node->tree_max_end );
+	start = ( *cursor > floor ) ? *cursor : floor;
+
+	/* Try the hole in front of the subtree */
+	if ( node->tree_min_start >= start &&
+	     node->tree_min_start - start >= size )
+		return start;
+
+	/* Skip subtrees below the floor or without a large enough hole */
+	if ( end <= floor || node->tree_max_gap < size ) {
+		if ( end > *cursor )
+			*cursor = end;
+		return 0;
+	}
+
+	found = mmtree_find_gap( node->tree_left, floor, size, cursor );
+	if ( found )
+		return found;
+
+	/* Try the hole between the left subtree and this region */
+	start = ( *cursor > floor ) ? *cursor : floor;
+	if ( (uintptr_t) node->start >= start &&
+	     (uintptr_t) node->start - start >= size )
+		return start;
+
+	end = PAGE_ROUND_UP( mmap_end( node ) );
+	if ( end > *cursor )
+		*cursor = end;
+
+	return mmtree_find_gap( node->tree_right, floor, size, cursor );
+}
+
+/**
+ * Allocate an empty memory map
+ * @return The map, or NULL if no kernel heap was available
+ */
+process_memory_map_t *procvmm_alloc_memory_map( void )
+{
+	process_memory_map_t *map;
+
+	map = heapmm_alloc( sizeof( process_memory_map_t ) );
+	if ( !map )
+		return NULL;
+
+	llist_create( &map->regions );
+	map->tree = NULL;
+
+	return map;
+}
+
+/**
+ * Add a region to a memory map
+ */
+static void mmap_link( process_memory_map_t *map, process_mmap_t *region )
+{
+	llist_add_end( &map->regions, (llist_t *) region );
+	map->tree = mmtree_insert( map->tree, region );
+}
+
+/**
+ * Remove a region from a memory map
+ */
+static void mmap_unlink( process_memory_map_t *map, process_mmap_t *region )
+{
+	llist_unlink( (llist_t *) region );
+	map->tree = mmtree_remove( map->tree, region );
 }
 
 /**
@@ -213,16 +620,25 @@ static int get_mmap_iter (llist_t *node, void *param)
  */
 process_mmap_t *procvmm_get_memory_region(const void *address)
 {
+	process_mmap_t *node;
 
 	/* If this task does not belong to a process or belongs to the
 	 * kernel the procvmm is not active, return NULL */
 	if ( (!current_process) || current_process->pid == 0 )
 		return NULL;
 
-	return (process_mmap_t *) llist_iterate_select(
-	    /* list     */ current_process->memory_map,
-	    /* iterator */ &get_mmap_iter,
-	    /* param    */ (void*) address );
+	node = current_process->memory_map->tree;
+
+	while ( node ) {
+		if ( address < node->start )
+			node = node->tree_left;
+		else if ( (uintptr_t) address >= mmap_end( node ) )
+			node = node->tree_right;
+		else
+			return node;
+	}
+
+	return NULL;
 }
 
 static process_mmap_t *mmap_alloc_init( const char *name ) {
@@ -278,13 +694,13 @@ static void mmap_free( process_mmap_t *region )
 	heapmm_free( region, sizeof( process_mmap_t ) );
 }
 
-static int mmap_copy_iter (llist_t *_src, void *_dstlist)
+static int mmap_copy_iter (llist_t *_src, void *_dstmap)
 {
-	llist_t *dstlist;
+	process_memory_map_t *dstmap;
 	process_mmap_t *src;
 	process_mmap_t *dst;
 
-	dstlist = (llist_t *) _dstlist;
+	dstmap  = (process_memory_map_t *) _dstmap;
 	src     = (process_mmap_t *) _src;
 
 	/* Allocate the destination map descriptor */
@@ -313,8 +729,8 @@ static int mmap_copy_iter (llist_t *_src, void *_dstlist)
 	if ( src->flags & PROCESS_MMAP_FLAG_SHM )
 		dst->shm = src->shm;
 
-	/* Add dst to dst list */
-	llist_add_end( dstlist, (llist_t *) dst );
+	/* Add dst to dst map */
+	mmap_link( dstmap, dst );
 
 	return 0;
 
@@ -325,57 +741,14 @@ error_desc:
 	return 1;
 }
 
-int procvmm_copy_memory_map ( llist_t *target )
+int procvmm_copy_memory_map ( process_memory_map_t *target )
 {
 	return llist_iterate_select(
-	    /* list     */ current_process->memory_map,
+	    /* list     */ &current_process->memory_map->regions,
 	    /* iterator */ &mmap_copy_iter,
 	    /* param    */ (void*) target ) != NULL;
 }
 
-/**
- * Iterator function that finds the mmap for the given address
- */
-static int coll_check_iter ( llist_t *_b, void *_c )
-{
-	process_mmap_t *b, *c;
-	uintptr_t b_s, b_e, c_s, c_e;
-
-	b = (process_mmap_t *) _b;
-	c = (process_mmap_t *) _c;
-
-	/* Compute region B start and end */
-	b_s = (uintptr_t) b->start;
-	b_e = (uintptr_t) b->start + b->size;
-
-	/* Compute region C start and end */
-	c_s = (uintptr_t) c->start;
-	c_e = (uintptr_t) c->start + c->size;
-
-	/* Ignore collision with self */
-	if ( b == c )
-		return 0;
-
-	/* If the start of region C is in region B, there is overlap */
-	if ( (c_s >= b_s) && (c_s < b_e) )
-		return 1;
-
-	/* If the end of region C is in region B, there is overlap */
-	if ( (c_e > b_s) && (c_e < b_e) )
-		return 1;
-
-	/* If the start of region B is in region C, there is overlap */
-	if ( (b_s >= c_s) && (b_s < c_e) )
-		return 1;
-
-	/* If the end of region B is in region C, there is overlap */
-	if ( (b_e > c_s) && (b_e < c_e) )
-		return 1;
-
-	/* If none of these conditions were hit, there is no overlap */
-	return 0;
-}
-
 /**
  * @brief Check whether region collides with any existing region
  *
@@ -384,17 +757,7 @@ static int coll_check_iter ( llist_t *_b, void *_c )
  */
 static process_mmap_t * find_collide( process_mmap_t *region )
 {
-	llist_t *overlap;
-
-	/* Find first overlapping region, if any */
-	overlap = llist_iterate_select(
-	     /* list     */ current_process->memory_map,
-		 /* iterator */ &coll_check_iter,
-		 /* param    */ region );
-
-	/* If no region was found, there are no collisions */
-	return ( process_mmap_t * ) overlap;
-
+	return mmtree_find_collide( current_process->memory_map->tree, region );
 }
 
 /**
@@ -415,31 +778,32 @@ static int does_collide( process_mmap_t *region )
  */
 static void *find_address( size_t size )
 {
-	process_mmap_t region, *_r;
-	uintptr_t end_region;
-
-	/* Set up the fake region to use to call find_collide */
-	region.start = (void *) current_process->heap_max;
-	region.size  = size;
+	uintptr_t floor, cursor, start;
 
-	/* As long as the address range tried overlaps with an existing
-	 * region, try to round up the end of the colliding region to a
-	 * page boundary and try that as the next address. This effectively
-	 * performs a greedy search for a sufficiently large hole in the
-	 * processes address map */
-	while ( ( _r = find_collide( &region ) ) != NULL ) {
+	/* Find the lowest hole above the heap that is large enough, holes
+	 * start at the page rounded end of a region */
+	floor  = (uintptr_t) current_process->heap_max;
+	cursor = 0;
 
-		end_region = (uintptr_t) ( _r->start + _r->size );
+	/* Even an empty region may not start inside another one */
+	if ( size == 0 )
+		size = 1;
 
-		region.start = ( void *) PAGE_ROUND_UP( end_region );
+	start = mmtree_find_gap(
+	    /* node   */ current_process->memory_map->tree,
+	    /* floor  */ floor,
+	    /* size   */ size,
+	    /* cursor */ &cursor );
 
-		/* Check if we ran out of address space */
-		if ( region.start >= current_process->stack_top )
-			return NULL;
+	/* If it does not fit before the last region, use the space after */
+	if ( !start )
+		start = ( cursor > floor ) ? cursor : floor;
 
-	}
+	/* Check if we ran out of address space */
+	if ( start >= (uintptr_t) current_process->stack_top )
+		return NULL;
 
-	return region.start;
+	return (void *) start;
 }
 
 
@@ -454,7 +818,7 @@ static int mmap_add( process_mmap_t *region )
 	} else {
 
 		/* No collision: add to mmap list */
-		llist_add_end( current_process->memory_map, (llist_t *) region );
+		mmap_link( current_process->memory_map, region );
 		return 0;
 
 	}
@@ -472,23 +836,33 @@ int procvmm_resize_map(void *start, size_t newsize)
 {
 	size_t oldsize;
 	process_mmap_t *region;
+	int status;
 
 	/* Try to find region */
 	region = procvmm_get_memory_region( start );
 	if ( !region )
 		return 1;
 
+	/* Take it out of the tree, its position depends on its size */
+	current_process->memory_map->tree = mmtree_remove(
+	    current_process->memory_map->tree,
+	    region );
+
 	/* Try to resize region */
 	oldsize = region->size;
 	region->size = newsize;
 	if ( does_collide( region ) ) {
 		/* Region overlapped, restore old size and signal error */
 		region->size = oldsize;
-		return EINVAL;
-	}
+		status = EINVAL;
+	} else
+		status = 0;
 
-	/* Return success */
-	return 0;
+	current_process->memory_map->tree = mmtree_insert(
+	    current_process->memory_map->tree,
+	    region );
+
+	return status;
 }
 
 /**
@@ -752,6 +1126,12 @@ int procvmm_mmap_stream (
 		return ENODEV;
 	}
 
+	/* Writes to a shared mapping go to the file, it must be writable */
+	if ( ( flags & PROCESS_MMAP_FLAG_PUBLIC ) &&
+	     ( flags & PROCESS_MMAP_FLAG_WRITE ) &&
+	     ( ptr->info->flags & O_ACCMODE ) == O_RDONLY )
+		return EACCES;
+
 	/* Get inode */
 	file = ptr->info->inode;
 
@@ -817,12 +1197,67 @@ int procvmm_mmap_shm(
 	return mmap_add( region );
 }
 
+/**
+ * Check whether writes to a region have to be written back to its file
+ * @param region The region to check
+ * @return       Whether the region is a shared, writable file mapping
+ */
+static int mmap_is_shared_file( process_mmap_t *region )
+{
+	int mask = PROCESS_MMAP_FLAG_FILE |
+	           PROCESS_MMAP_FLAG_PUBLIC |
+	           PROCESS_MMAP_FLAG_WRITE;
+
+	return ( ( region->flags & mask ) == mask ) &&
+	       ( ~region->flags & PROCESS_MMAP_FLAG_DEVICE );
+}
+
+/**
+ * Write a dirty page of a shared file mapping back to its file
+ * @param region  The region containing the page
+ * @param address The page aligned address of the page
+ * @param frame   The frame mapped at the address
+ * @return        Zero on success, an ERRNO otherwise
+ */
+static int mmap_write_back(
+        process_mmap_t *region,
+        uintptr_t       address,
+        physaddr_t      frame )
+{
+	uintptr_t in_region;
+	aoff_t count;
+	int status;
+
+	in_region = address - (uintptr_t) region->start;
+
+	/* Only the part of the page in the file map range is written */
+	if ( in_region >= (uintptr_t) region->file_sz )
+		return 0;
+
+	count = (aoff_t) region->file_sz - (aoff_t) in_region;
+	if ( count > PHYSMM_PAGE_SIZE )
+		count = PHYSMM_PAGE_SIZE;
+
+	status = vfs_write_page(
+	    /* file   */ region->file,
+	    /* offset */ region->offset + (aoff_t) in_region,
+	    /* frame  */ frame & ~PHYSMM_PAGE_ADDRESS_MASK,
+	    /* count  */ count );
+
+	if ( status )
+		printf( CON_ERROR,
+			"write back error %i at %i in %s",
+			status, in_region, region->name );
+
+	return status;
+}
+
 void procvmm_unmmap_other(process_info_t *task, process_mmap_t *region)
 {
 	uintptr_t start, page;
 	physaddr_t frame;
 
-	llist_unlink( (llist_t *) region );
+	mmap_unlink( task->memory_map, region );
 
 	start = (uintptr_t) region->start;
 
@@ -832,8 +1267,6 @@ void procvmm_unmmap_other(process_info_t *task, process_mmap_t *region)
 
 	} else {
 
-		//TODO: Write back dirty pages
-
 		for ( page = start;
 		      page < (start +region->size);
 		      page += PHYSMM_PAGE_SIZE ) {
@@ -844,6 +1277,13 @@ void procvmm_unmmap_other(process_info_t *task, process_mmap_t *region)
 
 			if (frame) {
 
+				/* Write back modified file data */
+				if ( mmap_is_shared_file( region ) &&
+				     paging_is_dirty_other(
+				         task->page_directory,
+				         (void *) page ) )
+					mmap_write_back( region, page, frame );
+
 				if ( ~region->flags & PROCESS_MMAP_FLAG_SHM )
 					physmm_free_frame(frame);
 
@@ -863,12 +1303,10 @@ void procvmm_unmmap(process_mmap_t *region)
 	uintptr_t start, page;
 	physaddr_t frame;
 
-	llist_unlink( (llist_t *) region );
+	mmap_unlink( current_process->memory_map, region );
 
 	start = (uintptr_t) region->start;
 
-	llist_unlink((llist_t *) region);
-
 	if (region->flags & PROCESS_MMAP_FLAG_DEVICE) {
 
 		device_char_unmmap(
@@ -880,7 +1318,6 @@ void procvmm_unmmap(process_mmap_t *region)
 		        region->file_sz);
 
 	} else {
-		//TODO: Write back dirty pages
 
 		for ( page = start;
 		      page < (start +region->size);
@@ -891,11 +1328,18 @@ void procvmm_unmmap(process_mmap_t *region)
 
 			if (frame) {
 
-				if ( ~region->flags & PROCESS_MMAP_FLAG_SHM )
-					physmm_free_frame(frame);
+				/* Write back modified file data */
+				if ( mmap_is_shared_file( region ) &&
+				     paging_clear_dirty( (void *) page ) )
+					mmap_write_back( region, page, frame );
 
+				/* Unmap before dropping the frame, this gives us
+				 * our own copy of a shared page table */
 				paging_unmap((void *) page);
 
+				if ( ~region->flags & PROCESS_MMAP_FLAG_SHM )
+					physmm_free_frame(frame);
+
 			}
 		}
 	}
@@ -903,6 +1347,107 @@ void procvmm_unmmap(process_mmap_t *region)
 	mmap_free( region );
 }
 
+/**
+ * Try to map a file page straight from the page cache
+ * @param region    The file mapping containing the page
+ * @param address   The page aligned address of the page
+ * @param in_region The offset of the page in the region
+ * @param flags     The flags to map the page with
+ * @param cached    Only map the page if it is cached already
+ * @return          Whether the page was mapped, if not it needs a private
+ *                  copy
+ */
+static int procvmm_map_cached(
+        process_mmap_t *region,
+        uintptr_t       address,
+        uintptr_t       in_region,
+        page_flags_t    flags,
+        int             cached )
+{
+	aoff_t file_off;
+	aoff_t file_sz;
+	physaddr_t frame;
+
+	/* Compute the offset into the file */
+	file_off = region->offset + (aoff_t) in_region;
+
+	/* The cache only holds whole, aligned pages */
+	if ( file_off & PHYSMM_PAGE_ADDRESS_MASK )
+		return 0;
+
+	/* Pages outside the file are not cached */
+	if ( in_region >= (uintptr_t) region->file_sz ||
+	     file_off >= region->file->size )
+		return 0;
+
+	/* The part of a private page past the file map range must read as
+	 * zeroes, cached pages are only cleared past the end of the file */
+	file_sz = (aoff_t) region->file_sz - (aoff_t) in_region;
+	if ( ( ~region->flags & PROCESS_MMAP_FLAG_PUBLIC ) &&
+	     file_sz < PHYSMM_PAGE_SIZE &&
+	     file_off + file_sz < region->file->size )
+		return 0;
+
+	if ( vfs_map_page( region->file, file_off, cached, &frame ) )
+		return 0;
+
+	/* Shared mappings write to the cached page directly, the dirty flag
+	 * tells which pages to write back. Private mappings get the page
+	 * read only, a write to it makes a copy. A read only region never
+	 * gets a copy, the kernel checks for PROCESS_MMAP_FLAG_WRITE with
+	 * procvmm_check_write before storing to user memory so it cannot
+	 * fault on, or scribble over, the cached page either */
+	if ( ~region->flags & PROCESS_MMAP_FLAG_PUBLIC )
+		flags &= ~PAGING_PAGE_FLAG_RW;
+
+	paging_map( (void *) address, frame, flags );
+
+	return 1;
+}
+
+/**
+ * Map the cached pages of a file mapping around a faulting page
+ *
+ * Pages that are mapped already or not in the page cache are left alone,
+ * they are faulted in when they are accessed.
+ * @param region  The file mapping containing the page
+ * @param address The page aligned address of the faulting page
+ * @param flags   The flags to map the pages with
+ */
+static void procvmm_fault_around(
+        process_mmap_t *region,
+        uintptr_t       address,
+        page_flags_t    flags )
+{
+	uintptr_t start, end, page;
+
+	/* Use the aligned window containing the faulting page, clipped to
+	 * the region */
+	start = address & ~( CONFIG_FAULT_AROUND_PAGES * PHYSMM_PAGE_SIZE - 1 );
+	end   = start + CONFIG_FAULT_AROUND_PAGES * PHYSMM_PAGE_SIZE;
+
+	if ( start < (uintptr_t) region->start )
+		start = (uintptr_t) region->start;
+
+	if ( end > (uintptr_t) region->start + region->size )
+		end = (uintptr_t) region->start + region->size;
+
+	for ( page = start; page < end; page += PHYSMM_PAGE_SIZE ) {
+
+		if ( page == address ||
+		     paging_get_physical_address( (void *) page ) )
+			continue;
+
+		procvmm_map_cached(
+		    /* region    */ region,
+		    /* address   */ page,
+		    /* in_region */ page - (uintptr_t) region->start,
+		    /* flags     */ flags,
+		    /* cached    */ 1 );
+
+	}
+}
+
 /**
  * Handle user land demand paging
  * @param _address The address where the fault occurred
@@ -954,18 +1499,29 @@ int procvmm_handle_fault( void *_address )
 		    region->shm->frames[in_region / PHYSMM_PAGE_SIZE],
 		    flags );
 
-	} else { //TODO: Handle shared mappings
+	} else if ( ( region->flags & PROCESS_MMAP_FLAG_FILE ) &&
+	            procvmm_map_cached( region, address, in_region, flags, 0 ) ) {
+
+		/* The page is shared with the page cache */
+
+	} else {
 
 		/* Try to allocate memory to fill the page */
 		frame = physmm_alloc_frame();
+		if ( frame == PHYSMM_NO_FRAME ) {
+			/* Wait for the kernel caches to release memory */
+			paging_handle_out_of_memory();
+			frame = physmm_alloc_frame();
+		}
 		if ( frame == PHYSMM_NO_FRAME ) {
 			//TODO: This should not kill process, only in the worst case
 			//      freeze it until more memory is available.
 			return 0;
 		}
 
-		/* Map and zero the newly allocated memory */
-		paging_map( (void *) address, frame, flags );
+		/* Map and zero the newly allocated memory, the page is
+		 * writable until it has been filled */
+		paging_map( (void *) address, frame, flags | PAGING_PAGE_FLAG_RW );
 		memset( (void *) address, 0, PAGE_SIZE );
 
 		/* If this is a file mapping, load the contents of the file */
@@ -1011,12 +1567,135 @@ int procvmm_handle_fault( void *_address )
 				}
 			}
 		}
+
+		/* Drop write access if the region is read only */
+		if ( ~flags & PAGING_PAGE_FLAG_RW )
+			paging_map( (void *) address, frame, flags );
+
+		/* Filling the page is not a write to the file */
+		if ( mmap_is_shared_file( region ) )
+			paging_clear_dirty( (void *) address );
 	}
 
+	/* Map the neighbouring pages that are cached to save their faults */
+	if ( region->flags & PROCESS_MMAP_FLAG_FILE )
+		procvmm_fault_around( region, address, flags );
+
 	return 1;
 
 }
 
+/**
+ * Handle a write to a page that is shared copy-on-write
+ * @param _address The address where the fault occurred
+ * @return         Returns whether or not the page fault could be
+ *                 resolved
+ */
+int procvmm_handle_cow( void *_address )
+{
+	page_flags_t flags = PAGING_PAGE_FLAG_USER | PAGING_PAGE_FLAG_RW;
+	physaddr_t frame, new_frame;
+	process_mmap_t *region;
+	uintptr_t address;
+
+	/* Find the region containing the address */
+	region = procvmm_get_memory_region( _address );
+
+	/* If there is none, this is a fatal fault */
+	if ( !region )
+		return 0;
+
+	/* Only private, writable regions are shared copy-on-write */
+	if ( ~region->flags & PROCESS_MMAP_FLAG_WRITE )
+		return 0;
+
+	if ( region->flags & ( PROCESS_MMAP_FLAG_PUBLIC |
+	                       PROCESS_MMAP_FLAG_DEVICE |
+	                       PROCESS_MMAP_FLAG_SHM ) )
+		return 0;
+
+	address = PAGE_ROUND_DOWN( (uintptr_t) _address );
+
+	frame = paging_get_physical_address( (void *) address );
+	if ( !frame )
+		return 0;
+
+	/* If we hold the last reference, the page can just be made writable */
+	if ( physmm_frame_refs( frame ) == 1 ) {
+		paging_map( (void *) address, frame, flags );
+		return 1;
+	}
+
+	/* Otherwise, make a private copy of the page */
+	new_frame = physmm_alloc_frame();
+	if ( new_frame == PHYSMM_NO_FRAME ) {
+		/* Wait for the kernel caches to release memory */
+		paging_handle_out_of_memory();
+		new_frame = physmm_alloc_frame();
+	}
+	if ( new_frame == PHYSMM_NO_FRAME ) {
+		//TODO: This should not kill process, only in the worst case
+		//      freeze it until more memory is available.
+		return 0;
+	}
+
+	if ( paging_copy_to_frame( new_frame, (void *) address ) ) {
+		physmm_free_frame( new_frame );
+		return 0;
+	}
+
+	paging_map( (void *) address, new_frame, flags );
+
+	/* Drop our reference to the shared frame */
+	physmm_free_frame( frame );
+
+	return 1;
+}
+
+/**
+ * Fault in all pages of a file mapping
+ *
+ * The missing file pages are read into the page cache with as few reads as
+ * possible first. Errors are ignored, pages that could not be mapped are
+ * faulted in when they are accessed.
+ * @param start The start of the mapping
+ */
+static void procvmm_populate( void *start )
+{
+	process_mmap_t *region;
+	uintptr_t page, end;
+	aoff_t in_page;
+
+	region = procvmm_get_memory_region( start );
+
+	if ( !region || ( ~region->flags & PROCESS_MMAP_FLAG_FILE ) ||
+	     ( region->flags & PROCESS_MMAP_FLAG_DEVICE ) )
+		return;
+
+	/* Read the mapped part of the file into the page cache */
+	in_page = region->offset & PHYSMM_PAGE_ADDRESS_MASK;
+
+	vfs_populate(
+	    /* file   */ region->file,
+	    /* offset */ region->offset - in_page,
+	    /* count  */ (aoff_t) region->file_sz + in_page );
+
+	/* Fault in the pages, each fault maps its cached neighbours */
+	end = (uintptr_t) region->start + region->size;
+
+	for ( page = (uintptr_t) region->start;
+	      page < end;
+	      page += PHYSMM_PAGE_SIZE ) {
+
+		if ( paging_get_physical_address( (void *) page ) )
+			continue;
+
+		if ( !procvmm_handle_fault( (void *) page ) )
+			return;
+
+	}
+}
+
 void *_sys_mmap(
         void *addr,
         size_t len,
@@ -1028,6 +1707,15 @@ void *_sys_mmap(
 	int st;
 	int _flags = 0;
 
+	/* Shared mappings map whole pages of the file */
+	if ( ( flags & MAP_SHARED ) &&
+	     ( ( offset & PHYSMM_PAGE_ADDRESS_MASK ) ||
+	       ( ( flags & MAP_FIXED ) &&
+	         ( (uintptr_t) addr & PHYSMM_PAGE_ADDRESS_MASK ) ) ) ) {
+		syscall_errno = EINVAL;
+		return MAP_FAILED;
+	}
+
 	/* If the address is not to be fixed, find a new address */
 	if ( ~flags & MAP_FIXED )
 		addr = find_address( len );
@@ -1052,8 +1740,79 @@ void *_sys_mmap(
 	if ( st ) {
 		syscall_errno = st;
 		return MAP_FAILED;
-	} else
-		return addr;
+	}
+
+	if ( flags & MAP_POPULATE )
+		procvmm_populate( addr );
+
+	return addr;
+}
+
+/**
+ * Write modified pages of shared file mappings back to their files
+ *
+ * There is no background write-back, so MS_ASYNC writes the pages before
+ * returning as well. The mapped pages are the cached file pages, there is
+ * nothing to invalidate for MS_INVALIDATE.
+ * @param addr  The page aligned start of the range to synchronize
+ * @param len   The length of the range
+ * @param flags MS_ASYNC or MS_SYNC, optionally with MS_INVALIDATE
+ * @return      Zero on success, -1 on error with syscall_errno set
+ */
+int _sys_msync( void *addr, size_t len, int flags )
+{
+	process_mmap_t *region;
+	uintptr_t page, end;
+	physaddr_t frame;
+	int st, status = 0;
+
+	/* Check arguments */
+	if ( ( (uintptr_t) addr & PHYSMM_PAGE_ADDRESS_MASK ) ||
+	     ( flags & ~( MS_ASYNC | MS_SYNC | MS_INVALIDATE ) ) ||
+	     ( ( flags & MS_ASYNC ) && ( flags & MS_SYNC ) ) ) {
+		syscall_errno = EINVAL;
+		return -1;
+	}
+
+	/* The range must not wrap around or extend into kernel space */
+	if ( (uintptr_t) addr + len < (uintptr_t) addr ||
+	     (uintptr_t) addr + len > 0xC0000000 ) {
+		syscall_errno = ENOMEM;
+		return -1;
+	}
+
+	end = PAGE_ROUND_UP( (uintptr_t) addr + len );
+
+	for ( page = (uintptr_t) addr; page < end; page += PHYSMM_PAGE_SIZE ) {
+
+		/* The whole range must be mapped */
+		region = procvmm_get_memory_region( (void *) page );
+		if ( !region ) {
+			syscall_errno = ENOMEM;
+			return -1;
+		}
+
+		if ( !mmap_is_shared_file( region ) )
+			continue;
+
+		frame = paging_get_physical_address( (void *) page );
+
+		/* Clear the dirty flag before writing, so writes made while
+		 * the write back blocks are caught by the next sync */
+		if ( frame && paging_clear_dirty( (void *) page ) ) {
+			st = mmap_write_back( region, page, frame );
+			if ( st )
+				status = st;
+		}
+
+	}
+
+	if ( status ) {
+		syscall_errno = status;
+		return -1;
+	}
+
+	return 0;
 }
 
 void *procvmm_attach_shm(void *addr, shm_info_t *shm, int flags)
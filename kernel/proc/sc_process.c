@@ -9,6 +9,9 @@
  *
  * Changelog:
  * 07-04-2014 - Created
+ * 17-10-2026 - Added vfork and spawn
+ * 17-10-2026 - Added msync
+ * 17-10-2026 - Share the argument copy code between execve and spawn
  */
 #include <sys/errno.h>
 #include <string.h>
@@ -38,6 +41,18 @@ SYSCALL_DEF0(fork)
 
 }
 
+/**
+ * @brief Syscall implementation: vfork
+ * Create a child process that borrows the address space of its parent until
+ * it calls exec or exits, the parent is suspended until then.
+ */
+SYSCALL_DEF0(vfork)
+{
+
+	return (uint32_t) posix_vfork();
+
+}
+
 /**
  * @brief Syscall implementation: kill
  * Sends a signal to a process.
@@ -184,7 +199,10 @@ SYSCALL_DEF1(exit)
 	current_process->state = PROCESS_KILLED;
 	process_child_event(current_process, PROCESS_CHILD_KILLED);
 	stream_do_close_all (current_process);
-	procvmm_clear_mmaps();
+	if ( current_process->flags & PROCESS_FLAG_VFORK )
+		process_vfork_release( current_process );
+	else
+		procvmm_clear_mmaps();
 	process_deschedule( current_process );
 	schedule();
 	return 0; // NEVER REACHED
@@ -392,131 +410,120 @@ SYSCALL_DEF1(sbrk)
 
 int strlistlen(char **list);
 
-//int execve(char *path, char **argv, char **envp);
-SYSCALL_DEF3(execve)
+/**
+ * Copy a NULL terminated string list from userland
+ * @return The kernel copy, or NULL with syscall_errno set.
+ */
+static char **copy_user_strlist( const char **list, int max, size_t len )
 {
-	int pl,argvc, envpc,sc,ct;
-	const char  *patho;
-	const char **argvo;
-	const char **envpo;
-	char  *path;
-	char **argv;
-	char **envp;
-	char  *user_str;
-	ssize_t status;
-	patho = ( const char * ) a;
-	argvo = ( const char ** ) b;
-	envpo = ( const char ** ) c;
-
-	pl = procvmm_check_string( patho, CONFIG_FILE_MAX_NAME_LENGTH );
-	if ( pl < 0 ) {
-		syscall_errno = EFAULT;
-		goto fault_a;
-	}
-
-	argvc = procvmm_check_stringlist( argvo, CONFIG_MAX_ARG_COUNT );
-	if ( argvc < 0 ) {
-		syscall_errno = EFAULT;
-		goto fault_a;
-	}
+	char **copy;
+	int count, ct, sc;
 
-	envpc = procvmm_check_stringlist( envpo, CONFIG_MAX_ENV_COUNT );
-	if ( envpc < 0 ) {
+	count = procvmm_check_stringlist( list, max );
+	if ( count < 0 ) {
 		syscall_errno = EFAULT;
-		goto fault_a;
+		return NULL;
 	}
 
-	path = heapmm_alloc( pl * sizeof( char ) );
-	if (!path) {
-		syscall_errno = ENOMEM;
-		goto fault_a;
-	}
-	argv = heapmm_alloc( argvc * sizeof ( char * ) );
-	if (!argv) {
-		syscall_errno = ENOMEM;
-		goto fault_b;
-	}
-	envp = heapmm_alloc( envpc * sizeof ( char * ) );
-	if (!envp) {
+	copy = heapmm_alloc( count * sizeof( char * ) );
+	if ( !copy ) {
 		syscall_errno = ENOMEM;
-		goto fault_c;
+		return NULL;
 	}
 
-	if (!copy_user_to_kern(patho, path, pl)) {
-		syscall_errno = EFAULT;
-		goto fault_d;
-	}
-	if (!copy_user_to_kern(argvo, argv, argvc * sizeof(char *))) {
-		syscall_errno = EFAULT;
-		goto fault_d;
-	}
-	if (!copy_user_to_kern(envpo, envp, envpc * sizeof ( char * ))) {
-		syscall_errno = EFAULT;
-		goto fault_d;
-	}
-
-	for (ct = 0; ct < argvc - 1; ct++) {
-		user_str = argv[ct];
-		sc = procvmm_check_string( user_str, CONFIG_MAX_ARG_LENGTH );
-		if (( sc < 0 ) || !(argv[ct] = heapmm_alloc(sc))) {
-			printf(CON_TRACE, "alloc %x %i",user_str,sc);
-			argvc = ct;
+	for ( ct = 0; ct < count - 1; ct++ ) {
+		sc = procvmm_check_string( list[ct], len );
+		if ( sc < 0 ) {
 			syscall_errno = EFAULT;
-			goto fault_e;
+			goto fault;
+		}
+		copy[ct] = heapmm_alloc( sc );
+		if ( !copy[ct] ) {
+			syscall_errno = ENOMEM;
+			goto fault;
 		}
-		if (!copy_user_to_kern(user_str, argv[ct], sc)) {
-			printf(CON_TRACE, "copy");
-			argvc = ct + 1;
-			memset ( argv[ct], ' ', sc );
-			argv[ct][sc - 1] = 0;
+		if ( !copy_user_to_kern( list[ct], copy[ct], sc ) ) {
+			heapmm_free( copy[ct], sc );
 			syscall_errno = EFAULT;
-			goto fault_e;
+			goto fault;
 		}
+		copy[ct][sc - 1] = 0;
 	}
+	copy[count - 1] = NULL;
 
-	for (ct = 0; ct < envpc - 1; ct++) {
-		user_str = envp[ct];
-		sc = procvmm_check_string( user_str, CONFIG_MAX_ENV_LENGTH );
-		if (( sc < 0 ) || !(envp[ct] = heapmm_alloc(sc))) {
-			envpc = ct;
-			syscall_errno = EFAULT;
-			goto fault_f;
-		}
-		if (!copy_user_to_kern(user_str, envp[ct], sc)) {
-			envpc = ct + 1;
-			memset ( envp[ct], ' ', sc );
-			envp[ct][sc - 1] = 0;
-			syscall_errno = EFAULT;
-			goto fault_f;
-		}
+	return copy;
+
+fault:
+	while ( ct-- )
+		heapmm_free( copy[ct], strlen( copy[ct] ) + 1 );
+	heapmm_free( copy, count * sizeof( char * ) );
+	return NULL;
+}
+
+/**
+ * Copy a string from userland
+ * @return The kernel copy, or NULL with syscall_errno set.
+ */
+static char *copy_user_string( const char *str, size_t len )
+{
+	char *copy;
+	int sc;
+
+	sc = procvmm_check_string( str, len );
+	if ( sc < 0 ) {
+		syscall_errno = EFAULT;
+		return NULL;
 	}
 
-	status = process_exec( path,  argv, envp );
-	if ( status != 0 ) {
-		syscall_errno = status;
-		status = -1;
+	copy = heapmm_alloc( sc );
+	if ( !copy ) {
+		syscall_errno = ENOMEM;
+		return NULL;
+	}
+
+	if ( !copy_user_to_kern( str, copy, sc ) ) {
+		heapmm_free( copy, sc );
+		syscall_errno = EFAULT;
+		return NULL;
 	}
+	copy[sc - 1] = 0;
 
-	return (uint32_t) status;
-fault_f:
-	printf(CON_ERROR, "exec fault f");
-	for (ct = 0; ct < envpc; ct++)
-		heapmm_free(envp[ct], strlen(envp[ct])+1);
-fault_e:
-	printf(CON_ERROR, "Fault e");
-	for (ct = 0; ct < argvc; ct++)
-		heapmm_free(argv[ct], strlen(argv[ct])+1);
-fault_d:
-	printf(CON_ERROR, "Fault d");
-	heapmm_free(envp , envpc * sizeof ( char * ));
-fault_c:
-	printf(CON_ERROR, "Fault c");
-	heapmm_free(argv , argvc * sizeof ( char * ));
-fault_b:
-	printf(CON_ERROR, "Fault b");
-	heapmm_free(path , pl * sizeof( char ));
-fault_a:
-	printf(CON_ERROR, "Fault a");
+	return copy;
+}
+
+//int execve(char *path, char **argv, char **envp);
+SYSCALL_DEF3(execve)
+{
+	char  *path;
+	char **argv = NULL;
+	char **envp = NULL;
+	int status;
+
+	path = copy_user_string( (const char *) a,
+	                         CONFIG_FILE_MAX_NAME_LENGTH );
+	if ( !path )
+		return (uint32_t) -1;
+
+	argv = copy_user_strlist( (const char **) b,
+	                          CONFIG_MAX_ARG_COUNT,
+	                          CONFIG_MAX_ARG_LENGTH );
+	if ( !argv )
+		goto fault;
+
+	envp = copy_user_strlist( (const char **) c,
+	                          CONFIG_MAX_ENV_COUNT,
+	                          CONFIG_MAX_ENV_LENGTH );
+	if ( !envp )
+		goto fault;
+
+	/* Only returns if the new image could not be loaded */
+	status = process_exec( path, argv, envp );
+	syscall_errno = status;
+
+fault:
+	heapmm_free( path, strlen( path ) + 1 );
+	process_free_strlist( argv );
+	process_free_strlist( envp );
 	return (uint32_t) -1;
 }
 
@@ -532,4 +539,125 @@ SYSCALL_DEF6(mmap)
 					(int)    f);
 }
 
+//int _sys_msync(void *addr, size_t len, int flags);
+
+SYSCALL_DEF3(msync)
+{
+	return (uint32_t) _sys_msync(	(void *) a,
+					(size_t) b,
+					(int)    c);
+}
+
+/**
+ * @brief Syscall implementation: spawn
+ * Create a new process running an executable without copying the address
+ * space of the caller.
+ * @param a The path of the executable
+ * @param b The argument list
+ * @param c The environment list
+ * @param d The file actions, may be NULL
+ * @param e The spawn attributes, may be NULL
+ * @return The pid of the new process or -1 on error
+ */
+SYSCALL_DEF5(spawn)
+{
+	posix_spawn_file_actions_t *actions = NULL;
+	posix_spawnattr_t *attr = NULL;
+	struct posix_spawn_file_action *fa;
+	const char *user_paths[SPAWN_MAX_FILE_ACTIONS];
+	char  *path;
+	char **argv = NULL;
+	char **envp = NULL;
+	pid_t pid;
+	int ct, status;
+
+	path = copy_user_string( (const char *) a,
+	                          CONFIG_FILE_MAX_NAME_LENGTH );
+	if ( !path )
+		return (uint32_t) -1;
+
+	argv = copy_user_strlist( (const char **) b,
+	                              CONFIG_MAX_ARG_COUNT,
+	                              CONFIG_MAX_ARG_LENGTH );
+	if ( !argv )
+		goto fault;
+
+	envp = copy_user_strlist( (const char **) c,
+	                              CONFIG_MAX_ENV_COUNT,
+	                              CONFIG_MAX_ENV_LENGTH );
+	if ( !envp )
+		goto fault;
+
+	if ( d ) {
+		actions = heapmm_alloc( sizeof( posix_spawn_file_actions_t ) );
+		if ( !actions ) {
+			syscall_errno = ENOMEM;
+			goto fault;
+		}
 
+		if ( !copy_user_to_kern( (void *) d, actions,
+		                         sizeof( posix_spawn_file_actions_t ) ) ) {
+			heapmm_free( actions, sizeof( posix_spawn_file_actions_t ) );
+			actions = NULL;
+			syscall_errno = EFAULT;
+			goto fault;
+		}
+
+		if ( actions->fa_count < 0 ||
+		     actions->fa_count > SPAWN_MAX_FILE_ACTIONS ) {
+			heapmm_free( actions, sizeof( posix_spawn_file_actions_t ) );
+			actions = NULL;
+			syscall_errno = EINVAL;
+			goto fault;
+		}
+
+		/* Replace the user path pointers by kernel copies, clearing
+		 * them first so a partial copy can be freed safely */
+		for ( ct = 0; ct < actions->fa_count; ct++ ) {
+			user_paths[ct] = actions->fa_list[ct].fa_path;
+			if ( actions->fa_list[ct].fa_type == SPAWN_FA_OPEN )
+				actions->fa_list[ct].fa_path = NULL;
+		}
+
+		for ( ct = 0; ct < actions->fa_count; ct++ ) {
+			fa = &actions->fa_list[ct];
+			if ( fa->fa_type != SPAWN_FA_OPEN )
+				continue;
+			fa->fa_path = copy_user_string( user_paths[ct],
+			                          CONFIG_FILE_MAX_NAME_LENGTH );
+			if ( !fa->fa_path )
+				goto fault;
+		}
+	}
+
+	if ( e ) {
+		attr = heapmm_alloc( sizeof( posix_spawnattr_t ) );
+		if ( !attr ) {
+			syscall_errno = ENOMEM;
+			goto fault;
+		}
+
+		if ( !copy_user_to_kern( (void *) e, attr,
+		                         sizeof( posix_spawnattr_t ) ) ) {
+			syscall_errno = EFAULT;
+			goto fault;
+		}
+	}
+
+	status = process_spawn( &pid, path, argv, envp, actions, attr );
+	if ( status ) {
+		syscall_errno = status;
+		goto fault;
+	}
+
+	return (uint32_t) pid;
+
+fault:
+	heapmm_free( path, strlen( path ) + 1 );
+	process_free_strlist( argv );
+	process_free_strlist( envp );
+	process_free_file_actions( actions );
+	if ( attr )
+		heapmm_free( attr, sizeof( posix_spawnattr_t ) );
+	return (uint32_t) -1;
+}
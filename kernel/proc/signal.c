@@ -449,7 +449,10 @@ int process_signal_handler_default( int signal, int thread )
 		debugcon_printf( "killedby: %i\n", signal );
 		process_child_event( cproc, PROCESS_CHILD_KILLED);
 		stream_do_close_all( cproc );
-		procvmm_clear_mmaps();
+		if ( cproc->flags & PROCESS_FLAG_VFORK )
+			process_vfork_release( cproc );
+		else
+			procvmm_clear_mmaps();
 		process_deschedule( cproc );
 		schedule();
 		return 0;
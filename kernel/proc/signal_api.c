@@ -53,7 +53,7 @@ int _sys_sigaction(	int sig,
 
 	/* Copy the old action to userland if requested */
 	if ( oact != NULL ) {
-		if ( !procvmm_check( oact, sizeof( struct sigaction ) ) ) {
+		if ( !procvmm_check_write( oact, sizeof( struct sigaction ) ) ) {
 			syscall_errno = EFAULT;
 			return -1;
 		}
@@ -83,7 +83,7 @@ int _sys_sigaltstack(	const stack_t *ss,
 
 	/* Copy the old stack to userland if requested */
 	if ( oss != NULL ) {
-		if ( !procvmm_check( oss, sizeof( stack_t ) ) ) {
+		if ( !procvmm_check_write( oss, sizeof( stack_t ) ) ) {
 			syscall_errno = EFAULT;
 			return -1;
 		}
@@ -132,7 +132,7 @@ int _sys_sigprocmask(	int how,
 
 	/* Copy the old mask to userland if requested */
 	if ( oset != NULL ) {
-		if ( !procvmm_check( oset, sizeof( sigset_t ) ) ) {
+		if ( !procvmm_check_write( oset, sizeof( sigset_t ) ) ) {
 			syscall_errno = EFAULT;
 			return -1;
 		}
@@ -206,7 +206,7 @@ int _sys_sigsuspend( const sigset_t *sigmask )
 int _sys_sigpending( sigset_t *set )
 {
 
- 	if ( !procvmm_check(  set, sizeof( sigset_t ) ) ) {
+ 	if ( !procvmm_check_write( set, sizeof( sigset_t ) ) ) {
 		syscall_errno = EFAULT;
 		return -1;
 	}
@@ -10,6 +10,7 @@
  * Changelog:
  * \i 22-07-2014 - Created
  * \i 22-07-2014 - Documented
+ * \i 17-10-2026 - Allocate segments in contiguous runs
  */
 #include <string.h>
 #include <sys/errno.h>
@@ -201,6 +202,44 @@ int _sys_shmctl(int id, int cmd, struct shmid_ds *buf)
 	}
 }
 
+/**
+ * @brief Allocate the frames for a segment
+ *
+ * The frames are taken from the buddy allocator in the largest runs that
+ * are available, they are released one by one.
+ * @param frames  The array to store the frame addresses in
+ * @param nframes The number of frames to allocate
+ * @return 0 on success, -1 if there was not enough memory
+ */
+static int shm_alloc_frames(physaddr_t *frames, int nframes)
+{
+	physaddr_t run;
+	int n, i, order;
+
+	for (n = 0; n < nframes; n += 1 << order) {
+		/* Start with the largest run that fits the remaining frames */
+		order = 0;
+		while (order < PHYSMM_MAX_ORDER && (2 << order) <= nframes - n)
+			order++;
+
+		/* Use smaller runs if memory is fragmented */
+		run = physmm_alloc_pages(order);
+		while (run == PHYSMM_NO_FRAME && order > 0)
+			run = physmm_alloc_pages(--order);
+
+		if (run == PHYSMM_NO_FRAME) {
+			for (i = 0; i < n; i++)
+				physmm_free_frame(frames[i]);
+			return -1;
+		}
+
+		for (i = 0; i < (1 << order); i++)
+			frames[n + i] = run + i * PHYSMM_PAGE_SIZE;
+	}
+
+	return 0;
+}
+
 void shm_do_delete(shm_info_t *info) {
 	int nframes,n;
 	llist_unlink((llist_t *) info);
@@ -241,18 +280,11 @@ int _sys_shmget(key_t key, size_t size, int flags)
 			return -1;
 		}
 
-		for (n = 0; n < nframes; n++) {
-			info->frames[n] = physmm_alloc_frame();
-			if (info->frames[n] == PHYSMM_NO_FRAME) {
-				nframes = n;
-				for (n = 0; n < nframes; n++)
-					physmm_free_frame(info->frames[n]);
-				heapmm_free(info->frames, sizeof(physaddr_t) * nframes);
-				heapmm_free(info, sizeof(shm_info_t));
-				syscall_errno = ENOMEM;
-				return -1;
-				
-			}
+		if (shm_alloc_frames(info->frames, nframes)) {
+			heapmm_free(info->frames, sizeof(physaddr_t) * nframes);
+			heapmm_free(info, sizeof(shm_info_t));
+			syscall_errno = ENOMEM;
+			return -1;
 		}
 
 		/* Initialize info */
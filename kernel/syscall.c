@@ -7,6 +7,7 @@
  *
  * Changelog:
  * 07-04-2014 - Created
+ * 17-10-2026 - Only copy out to writable user memory
  */
 
 #include <string.h>
@@ -110,7 +111,10 @@ char *syscall_names[] =
 	"sigpending",
 	"sigsuspend",
 	"uname",
-	"access"
+	"access",
+	"vfork",
+	"spawn",
+	"msync"
 };
 
 syscall_func_t syscall_table[CONFIG_MAX_SYSCALL_COUNT];
@@ -132,7 +136,7 @@ int copy_user_to_kern(const void *src, void *dest, size_t size)
 
 int copy_kern_to_user(const void *src, void *dest, size_t size)
 {
-	if (!procvmm_check(dest,size))
+	if (!procvmm_check_write(dest,size))
 		return 0;
 	memcpy(dest,src,size);
 	return 1;
@@ -174,7 +178,7 @@ void syscall_dispatch(void *user_param_block, void *instr_ptr)
 		printf( CON_TRACE, "[%s:%i] %s(%x, %x, %x, %x) = ", current_process->name, curpid(), syscall_names[call], params.param[0], params.param[1], params.param[2], params.param[3]);
 #endif
 	scheduler_current_task->in_syscall = params.call_id;
-	if ( call == SYS_FORK ) {
+	if ( call == SYS_FORK || call == SYS_VFORK ) {
 		params.return_val = 0;
 		params.sc_errno = 0;
 		copy_kern_to_user(&params, user_param_block, sizeof(syscall_params_t));
@@ -318,4 +322,7 @@ void syscall_init()
 	syscall_register(SYS_SIGSUSPEND, &sys_sigsuspend);
 	syscall_register(SYS_UNAME, &sys_uname);
 	syscall_register(SYS_ACCESS, &sys_access);
+	syscall_register(SYS_VFORK, &sys_vfork);
+	syscall_register(SYS_SPAWN, &sys_spawn);
+	syscall_register(SYS_MSYNC, &sys_msync);
 }
@@ -16,7 +16,7 @@ SYSCALL_DEF1(uname)
 
 	out = ( struct utsname * ) a;
 
-	if (!procvmm_check( out, sizeof( struct utsname ) )) {
+	if (!procvmm_check_write( out, sizeof( struct utsname ) )) {
 		syscall_errno = EFAULT;
 		return (uint32_t) -1;
 	}
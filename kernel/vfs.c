@@ -11,6 +11,10 @@
  * \li 12-04-2014 - Created
  * \li 11-07-2014 - Rewrite 1
  * \li 12-07-2014 - Commented
+ * \li 17-10-2026 - Remove freed inodes from the open inode table
+ * \li 17-10-2026 - Read and write regular files through the page cache
+ * \li 17-10-2026 - Write back pages of shared file mappings
+ * \li 17-10-2026 - Populate the page cache ahead of faults
  */
 
 #include <string.h>
@@ -277,6 +281,14 @@ int vfs_write(	inode_t	* _inode,
 			if (*write_size)
 				inode->mtime = system_time;
 
+			/* Keep the cached copy of the data up to date */
+			if ( *write_size &&
+			     !(inode->device->flags & FS_DEVICE_FLAG_NOPCACHE) )
+				vfs_page_cache_write(	inode,
+							buffer,
+							file_offset,
+							*write_size );
+
 			/* If the file grew, update file size */
 			if ((file_offset + *write_size) > inode->size)
 				inode->size = file_offset + *write_size;
@@ -475,8 +487,20 @@ int vfs_read(	inode_t	* _inode,
 				count = inode->size - file_offset;
 			}
 
-			/* Call on the FS driver to read the data */
-			status = ifs_read(inode, buffer, file_offset, count, read_size);
+			/* Read the data from the page cache, unless the */
+			/* filesystem does not allow caching it */
+			if (inode->device->flags & FS_DEVICE_FLAG_NOPCACHE)
+				status = ifs_read(	inode,
+							buffer,
+							file_offset,
+							count,
+							read_size );
+			else
+				status = vfs_page_cache_read(	inode,
+								buffer,
+								file_offset,
+								count,
+								read_size );
 
 			/* If data was actually read, update atime */
 			if (*read_size)
@@ -562,6 +586,231 @@ int vfs_read(	inode_t	* _inode,
 
 }
 
+/**
+ * @brief Get the frame holding a page of a file, for mapping it
+ *
+ * The frame is the one kept in the page cache, so everyone mapping the page
+ * shares it.
+ *
+ * @param _inode The inode for the file
+ * @param offset The page aligned offset of the page in the file
+ * @param cached Only return the page if it is cached already
+ * @return The frame, with a new reference the caller must release by calling
+ *         physmm_free_frame
+ *
+ * @exception EBADF   Tried to read from a file for which we do not have
+ *                    permission
+ * @exception ENOTSUP The file data can not be cached
+ * @exception EAGAIN  The page is not cached and cached was set
+ * @exception EIO     An IO error was encountered trying to read the page
+ * @exception ENOMEM  Could not allocate memory for the page
+ */
+
+SFUNC(physaddr_t, vfs_map_page, inode_t *_inode, aoff_t offset, int cached)
+{
+	page_cache_t *page;
+	physaddr_t frame;
+	inode_t *inode;
+	errno_t status;
+
+	/* Check for null pointers */
+	assert (_inode != NULL);
+
+	/* Resolve the effective inode */
+	inode = vfs_effective_inode(_inode);
+
+	/* Only regular files on cacheable filesystems can be shared */
+	if (!S_ISREG(inode->mode) ||
+	    (inode->device->flags & FS_DEVICE_FLAG_NOPCACHE)) {
+
+		/* Release the dereferenced inode */
+		vfs_inode_release(inode);
+
+		THROW(ENOTSUP, 0);
+
+	}
+
+	/* Accuire a lock on the inode */
+	semaphore_down(&inode->lock);
+
+	/* Verify read permission */
+	if (!vfs_have_permissions(inode, MODE_READ)) {
+
+		/* Release the lock on this inode */
+		semaphore_up(&inode->lock);
+
+		/* Release the dereferenced inode */
+		vfs_inode_release(inode);
+
+		THROW(EBADF, 0);
+
+	}
+
+	/* Get the page from the cache */
+	if (!cached)
+		status = vfs_page_cache_get(inode, offset, &page);
+	else if ((page = vfs_page_cache_lookup(inode, offset)) != NULL)
+		status = ESUCCESS;
+	else
+		status = EAGAIN;
+
+	if (!status) {
+
+		/* Take a reference to the frame for the caller */
+		frame = page->frame;
+		if (physmm_ref_frame(frame))
+			status = ENOMEM;
+
+		vfs_page_cache_release(page);
+
+	}
+
+	/* Release the lock on this inode */
+	semaphore_up(&inode->lock);
+
+	/* Release the dereferenced inode */
+	vfs_inode_release(inode);
+
+	if (status)
+		THROW(status, 0);
+
+	RETURN(frame);
+}
+
+/**
+ * @brief Read a range of a file into the page cache
+ *
+ * Pages that are not cached yet are read in as few reads as possible, so
+ * they can be mapped without reading them one at a time.
+ *
+ * @param _inode The inode for the file
+ * @param offset The page aligned offset of the range in the file
+ * @param count  The length of the range
+ *
+ * @exception EBADF   Tried to read from a file for which we do not have
+ *                    permission
+ * @exception ENOTSUP The file data can not be cached
+ * @exception EIO     An IO error was encountered trying to read the file
+ * @exception ENOMEM  Could not allocate memory for the pages
+ */
+
+SVFUNC(vfs_populate, inode_t *_inode, aoff_t offset, aoff_t count)
+{
+	inode_t *inode;
+	errno_t status;
+
+	/* Check for null pointers */
+	assert (_inode != NULL);
+
+	/* Resolve the effective inode */
+	inode = vfs_effective_inode(_inode);
+
+	/* Only regular files on cacheable filesystems can be populated */
+	if (!S_ISREG(inode->mode) ||
+	    (inode->device->flags & FS_DEVICE_FLAG_NOPCACHE)) {
+
+		/* Release the dereferenced inode */
+		vfs_inode_release(inode);
+
+		THROWV(ENOTSUP);
+
+	}
+
+	/* Accuire a lock on the inode */
+	semaphore_down(&inode->lock);
+
+	/* Verify read permission */
+	if (!vfs_have_permissions(inode, MODE_READ)) {
+
+		/* Release the lock on this inode */
+		semaphore_up(&inode->lock);
+
+		/* Release the dereferenced inode */
+		vfs_inode_release(inode);
+
+		THROWV(EBADF);
+
+	}
+
+	/* Read the missing pages */
+	status = vfs_page_cache_populate(inode, offset, count);
+
+	/* If the range is inside the file, update atime */
+	if (!status && offset < inode->size)
+		inode->atime = system_time;
+
+	/* Release the lock on this inode */
+	semaphore_up(&inode->lock);
+
+	/* Release the dereferenced inode */
+	vfs_inode_release(inode);
+
+	if (status)
+		THROWV(status);
+
+	RETURNV;
+}
+
+/**
+ * @brief Write a page of a shared file mapping back to the file
+ *
+ * Permissions are not checked, they were checked when the file was mapped.
+ * The file is not extended, data past its end is dropped.
+ *
+ * @param _inode The inode for the file
+ * @param offset The page aligned offset of the page in the file
+ * @param frame  The frame holding the data of the page
+ * @param count  The number of bytes at the start of the page to write
+ *
+ * @exception EISDIR Only regular files can be written back
+ * @exception EIO    An IO error was encountered trying to write the page
+ * @exception ENOMEM Could not allocate kernel heap for a temporary buffer
+ */
+
+SVFUNC(vfs_write_page, inode_t *_inode, aoff_t offset, physaddr_t frame,
+								aoff_t count)
+{
+	inode_t *inode;
+	errno_t status;
+
+	/* Check for null pointers */
+	assert (_inode != NULL);
+
+	/* Resolve the effective inode */
+	inode = vfs_effective_inode(_inode);
+
+	/* Only regular files can be mapped shared */
+	if (!S_ISREG(inode->mode)) {
+
+		/* Release the dereferenced inode */
+		vfs_inode_release(inode);
+
+		THROWV(EISDIR);
+
+	}
+
+	/* Accuire a lock on the inode */
+	semaphore_down(&inode->lock);
+
+	/* Write the data and update the cached copy */
+	status = vfs_page_cache_writeback(inode, offset, frame, count);
+
+	/* If data was actually written, update mtime */
+	if (!status && count && offset < inode->size)
+		inode->mtime = system_time;
+
+	/* Release the lock on this inode */
+	semaphore_up(&inode->lock);
+
+	/* Release the dereferenced inode */
+	vfs_inode_release(inode);
+
+	if (status)
+		THROWV(status);
+
+	RETURNV;
+}
+
 /**
  * @brief Read directory entries
  *
@@ -738,6 +987,9 @@ int vfs_truncate(inode_t * _inode, aoff_t length)
 			if (!status) {
 				inode->mtime = system_time;
 				inode->size = length;
+
+				/* Drop cached data past the new end */
+				vfs_page_cache_truncate(inode, length);
 			}
 
 			/* Release the lock on this inode */
@@ -1146,7 +1398,7 @@ int vfs_mknod(const char *path, mode_t mode, dev_t dev)
 	/* Check for errors */
 	if (status) {
 		/* If an error occurred, clean up */
-		llist_unlink((llist_t *) inode);
+		vfs_inode_uncache(inode);
 		ifs_rmnod(inode);
 		heapmm_free(inode, parent->device->inode_size);
 
@@ -1465,7 +1717,7 @@ int vfs_symlink(const char *oldpath, const char *path)
 	/* Check for errors */
 	if (status) {
 		/* If an error occurred, clean up */
-		llist_unlink((llist_t *) inode);
+		vfs_inode_uncache(inode);
 		ifs_rmnod(inode);
 		heapmm_free(inode, parent->device->inode_size);
 
@@ -1651,7 +1903,7 @@ int vfs_unlink(const char *path)
 		/* Delete the file itself */
 		ifs_rmnod(inode); //This might error but there is little we can do about that anyway
 		/* Remove its inode from the cache */
-		llist_unlink((llist_t *) inode);
+		vfs_inode_uncache(inode);
 		/* Free its inode */
 		heapmm_free(inode, inode->device->inode_size);
 
@@ -1885,6 +2137,10 @@ int vfs_initialize(dev_t root_device, char *root_fs_type)
 
 	vfs_icache_initialize();
 
+	vfs_dcache_initialize();
+
+	vfs_pcache_initialize();
+
 	vfs_ifsmgr_initialize();
 
 	/* Look up the rootfs driver */
@@ -3,6 +3,12 @@
  *
  * Implements the directory cache and GC
  *
+ * Entries that were reached by looking up a name in a directory are kept in a
+ * lookup table keyed by their parent and name, so repeated lookups of the same
+ * path do not have to go to the filesystem. Names that were found not to exist
+ * are cached as entries without an inode. Unused entries in the table are kept
+ * on an LRU list and freed when it grows too long or memory runs low.
+ *
  * Part of P-OS kernel.
  *
  * @author Peter Bosch <peterbosc@gmail.com>
@@ -12,24 +18,358 @@
  * \li 11-07-2014 - Rewrite 1
  * \li 12-07-2014 - Commented
  * \li 04-02-2015 - Split off from vfs.c
+ * \li 17-10-2026 - Added the name keyed lookup table and negative entries
+ * \li 17-10-2026 - Look up names that are not terminated
+ * \li 17-10-2026 - Protect the cache with its own lock
  */
 
 /* Includes */
 
 #include <assert.h>
 
+#include <string.h>
+
 #include "util/llist.h"
 
 #include "kernel/vfs.h"
 
 #include "kernel/heapmm.h"
+#include "kernel/shrinker.h"
 
 /* Global Variables */
 
+/** The lookup table, hashed on parent inode and name */
+dir_cache_t **dir_cache_table;
+
+/** The unused entries in the lookup table, least recently used first */
+llist_t dir_cache_lru;
+
+/** The number of entries on the LRU list */
+size_t dir_cache_unused;
+
+/** Changed whenever an entry is invalidated */
+uint32_t dir_cache_generation;
+
+/** Protects the lookup table, the LRU list and the reference counts */
+semaphore_t dir_cache_lock;
+
 /* Internal type definitions */
 
+#define DIR_CACHE_BUCKET( HaSh ) \
+	( dir_cache_table[ ( HaSh ) & ( CONFIG_DIR_CACHE_TABLESIZE - 1 ) ] )
+
+/* Internal functions */
+
+/**
+ * @brief Hash a name in a directory
+ */
+
+static uint32_t vfs_dir_cache_hash( inode_t *dir,
+				    const char *name,
+				    size_t namelen )
+{
+	uint32_t hash = 2166136261u ^ ( uint32_t ) ( uintptr_t ) dir;
+
+	while ( namelen-- ) {
+		hash ^= ( uint8_t ) *name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/**
+ * @brief Free a directory cache entry that has no references
+ *
+ * The caller must not hold dir_cache_lock, the parent reference is released.
+ */
+
+static void vfs_dir_cache_destroy( dir_cache_t *dirc )
+{
+	/* If this is not the graph root, release the parent ref */
+	if (dirc->parent != dirc) {
+
+		vfs_dir_cache_release(dirc->parent);
+
+	}
+
+	/* Decrease the inode reference count */
+	if (dirc->inode)
+		vfs_inode_release(dirc->inode);
+
+	if (dirc->name)
+		heapmm_free(dirc->name, strlen(dirc->name) + 1);
+
+	/* Release it's memory */
+	heapmm_free(dirc, sizeof(dir_cache_t));
+}
+
+/**
+ * @brief Free the entries collected by vfs_dir_cache_put
+ *
+ * This releases inodes and parent entries, so the caller must not hold
+ * dir_cache_lock.
+ */
+
+static void vfs_dir_cache_reap( llist_t *dead )
+{
+	dir_cache_t *dirc;
+
+	while ( ( dirc = ( dir_cache_t * ) llist_get_first( dead ) ) ) {
+		llist_unlink( &dirc->lru_link );
+		vfs_dir_cache_destroy( dirc );
+	}
+}
+
+/**
+ * @brief Take a reference to an entry
+ *
+ * The caller must hold dir_cache_lock.
+ */
+
+static dir_cache_t *vfs_dir_cache_get( dir_cache_t *dirc )
+{
+	/* Take it off the unused list */
+	if ( !dirc->usage_count && ( dirc->flags & DIR_CACHE_FLAG_HASHED ) ) {
+
+		llist_unlink( &dirc->lru_link );
+
+		dir_cache_unused--;
+
+	}
+
+	dirc->usage_count++;
+	return dirc;
+}
+
+/**
+ * @brief Drop a reference to an entry
+ *
+ * The caller must hold dir_cache_lock. An entry that is no longer used or
+ * hashed is added to dead, free it with vfs_dir_cache_reap once the lock
+ * is released.
+ */
+
+static void vfs_dir_cache_put( dir_cache_t *dirc, llist_t *dead )
+{
+	/* Decrease the reference count for this dir cache entry */
+	if (dirc->usage_count)
+		dirc->usage_count--;
+
+	/* If the entry has no more references, destroy it */
+	if (dirc->usage_count)
+		return;
+
+	/* Unless it can still be looked up, then keep it as unused */
+	if ( dirc->flags & DIR_CACHE_FLAG_HASHED ) {
+
+		llist_add_end( &dir_cache_lru, &dirc->lru_link );
+
+		dir_cache_unused++;
+
+		return;
+
+	}
+
+	llist_add_end( dead, &dirc->lru_link );
+}
+
+/**
+ * @brief Look up an entry in the lookup table
+ *
+ * The caller must hold dir_cache_lock.
+ * @return The entry, or NULL if it is not cached. No reference is taken.
+ */
+
+static dir_cache_t *vfs_dir_cache_find( dir_cache_t *par,
+					const char *name,
+					size_t namelen,
+					uint32_t hash )
+{
+	dir_cache_t *dirc;
+
+	for ( dirc = DIR_CACHE_BUCKET( hash ); dirc; dirc = dirc->hash_next )
+		if ( dirc->hash == hash && dirc->parent == par &&
+		     !strncmp( dirc->name, name, namelen ) &&
+		     dirc->name[ namelen ] == '\0' )
+			return dirc;
+
+	return NULL;
+}
+
+/**
+ * @brief Add an entry to the lookup table
+ *
+ * The entry is not added if an entry was invalidated since generation was
+ * sampled, as the name it was looked up by may have changed meanwhile. The
+ * caller must hold dir_cache_lock.
+ * @param name The name of the entry, owned by the entry if it was added
+ * @return Non-zero if the entry was added
+ */
+
+static int vfs_dir_cache_insert( dir_cache_t *dirc,
+				 char *name,
+				 uint32_t hash,
+				 uint32_t generation )
+{
+	if ( generation != dir_cache_generation )
+		return 0;
+
+	/* Another lookup of the same name may have finished first */
+	if ( vfs_dir_cache_find( dirc->parent, name, strlen( name ), hash ) )
+		return 0;
+
+	dirc->name = name;
+	dirc->hash = hash;
+	dirc->hash_next = DIR_CACHE_BUCKET( hash );
+	DIR_CACHE_BUCKET( hash ) = dirc;
+	dirc->flags |= DIR_CACHE_FLAG_HASHED;
+	dirc->parent->children++;
+
+	return 1;
+}
+
+/**
+ * @brief Remove an entry and everything below it from the lookup table
+ *
+ * Unused entries are added to dead. The caller must hold dir_cache_lock.
+ */
+
+static void vfs_dir_cache_unhash( dir_cache_t *dirc, llist_t *dead )
+{
+	dir_cache_t **link;
+	dir_cache_t *child;
+	int bucket;
+
+	assert( dirc->flags & DIR_CACHE_FLAG_HASHED );
+
+	/* Hold a reference while the children are removed */
+	vfs_dir_cache_get( dirc );
+
+	/* Unlink it from its bucket */
+	for ( link = &DIR_CACHE_BUCKET( dirc->hash ); *link != dirc;
+	      link = &(*link)->hash_next );
+
+	*link = dirc->hash_next;
+	dirc->hash_next = NULL;
+	dirc->flags &= ~DIR_CACHE_FLAG_HASHED;
+	dirc->parent->children--;
+
+	/* Entries below it can no longer be looked up */
+	for ( bucket = 0; dirc->children &&
+	      bucket < CONFIG_DIR_CACHE_TABLESIZE; bucket++ ) {
+	restart:
+		for ( child = dir_cache_table[ bucket ]; child;
+		      child = child->hash_next ) {
+			if ( child->parent == dirc ) {
+				vfs_dir_cache_unhash( child, dead );
+				goto restart;
+			}
+		}
+	}
+
+	/* This frees the entry if it was unused */
+	vfs_dir_cache_put( dirc, dead );
+}
+
+/**
+ * @brief Free unused entries until at most target are left
+ *
+ * The caller must hold dir_cache_lock, the entries are added to dead.
+ * @return The number of entries freed
+ */
+
+static size_t vfs_dir_cache_trim( size_t target, llist_t *dead )
+{
+	dir_cache_t *dirc;
+	size_t count = 0;
+
+	while ( dir_cache_unused > target ) {
+		dirc = ( dir_cache_t * ) llist_get_first( &dir_cache_lru );
+		if ( !dirc )
+			break;
+		vfs_dir_cache_unhash( dirc, dead );
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * @brief Count the unused entries, these can be freed
+ */
+
+static size_t vfs_dcache_shrinker_count(
+			__attribute__((unused)) shrinker_t *shrinker )
+{
+	return dir_cache_unused;
+}
+
+/**
+ * @brief Free the least recently used entries
+ *
+ * Does nothing if the cache is locked, as the holder may be waiting for
+ * memory.
+ */
+
+static size_t vfs_dcache_shrinker_scan(
+			__attribute__((unused)) shrinker_t *shrinker,
+			size_t nr )
+{
+	llist_t dead;
+	size_t count;
+
+	if ( !semaphore_try_down( &dir_cache_lock ) )
+		return 0;
+
+	llist_create( &dead );
+
+	if ( nr > dir_cache_unused )
+		nr = dir_cache_unused;
+
+	count = vfs_dir_cache_trim( dir_cache_unused - nr, &dead );
+
+	semaphore_up( &dir_cache_lock );
+
+	vfs_dir_cache_reap( &dead );
+
+	return count;
+}
+
+static shrinker_t vfs_dcache_shrinker = {
+	.name  = "dcache",
+	.pass  = SHRINKER_PASS_CACHE,
+	.count = vfs_dcache_shrinker_count,
+	.scan  = vfs_dcache_shrinker_scan
+};
+
 /* Public Functions */
 
+/**
+ * @brief Set up the directory cache lookup table
+ */
+
+void vfs_dcache_initialize( void )
+{
+	/* Allocate the lookup table */
+	dir_cache_table = heapmm_alloc( CONFIG_DIR_CACHE_TABLESIZE *
+					sizeof( dir_cache_t * ) );
+	assert( dir_cache_table != NULL );
+
+	memset( dir_cache_table, 0, CONFIG_DIR_CACHE_TABLESIZE *
+				    sizeof( dir_cache_t * ) );
+
+	/* Create the unused entry list */
+	llist_create( &dir_cache_lru );
+
+	dir_cache_unused = 0;
+
+	semaphore_init( &dir_cache_lock );
+	semaphore_up( &dir_cache_lock );
+
+	shrinker_register( &vfs_dcache_shrinker );
+}
+
 /**
  * @brief Create the initial dir cache entry
  * @param root_inode The root inode of the initial root filesystem
@@ -41,7 +381,9 @@ dir_cache_t *vfs_dir_cache_mkroot(inode_t *root_inode)
 	/* Allocate memory for the cache entry */
 	dir_cache_t *dirc = heapmm_alloc( sizeof( dir_cache_t ) );
 	assert (dirc != NULL);
-	
+
+	memset( dirc, 0, sizeof( dir_cache_t ) );
+
 	/* Set its parent to itself because it is the root of the graph */
 	dirc->parent = dirc;
 
@@ -51,7 +393,7 @@ dir_cache_t *vfs_dir_cache_mkroot(inode_t *root_inode)
 	/* Initialize the reference count to 1 */
 	dirc->usage_count = 1;
 
-	return dirc;	
+	return dirc;
 }
 
 /**
@@ -61,31 +403,17 @@ dir_cache_t *vfs_dir_cache_mkroot(inode_t *root_inode)
 
 void vfs_dir_cache_release( dir_cache_t *dirc )
 {
+	llist_t dead;
 
 	assert (dirc != NULL);
 
-	/* Decrease the reference count for this dir cache entry */
-	if (dirc->usage_count)
-		dirc->usage_count--;
-
-	/* If the entry has no more references, destroy it */
-	if (dirc->usage_count)
-		return;
-
-	/* If this is not the graph root, release the parent ref */
-	if (dirc->parent != dirc) {
-
-		vfs_dir_cache_release(dirc->parent);
-
-	}
-
-	/* Decrease the inode reference count */
-	vfs_inode_release(dirc->inode);
+	llist_create( &dead );
 
-	/* Release it's memory */
-	heapmm_free(dirc, sizeof(dir_cache_t));	
+	semaphore_down( &dir_cache_lock );
+	vfs_dir_cache_put( dirc, &dead );
+	semaphore_up( &dir_cache_lock );
 
-	return;
+	vfs_dir_cache_reap( &dead );
 }
 
 /**
@@ -97,7 +425,11 @@ void vfs_dir_cache_release( dir_cache_t *dirc )
 dir_cache_t *vfs_dir_cache_ref(dir_cache_t *dirc)
 {
 	assert (dirc != NULL);
-	dirc->usage_count++;
+
+	semaphore_down( &dir_cache_lock );
+	vfs_dir_cache_get( dirc );
+	semaphore_up( &dir_cache_lock );
+
 	return dirc;
 }
 
@@ -117,15 +449,17 @@ SFUNC( dir_cache_t *, vfs_dir_cache_new, dir_cache_t *par, ino_t inode_id )
 
 	/* Allocate memory for the cache entry */
 	dir_cache_t *dirc = heapmm_alloc(sizeof(dir_cache_t));
-	
+
 	/* Check if the allocation succeeded */
 	if (!dirc) {
 		/* It did not */
-		
-		/* Report the error to the caller ("Out of memory") */	
+
+		/* Report the error to the caller ("Out of memory") */
 		THROW(ENOMEM, NULL);
 	}
 
+	memset( dirc, 0, sizeof( dir_cache_t ) );
+
 	/* Set it's parent to the parent dirc passed to us */
 	dirc->parent = vfs_dir_cache_ref(par);
 
@@ -140,21 +474,21 @@ SFUNC( dir_cache_t *, vfs_dir_cache_new, dir_cache_t *par, ino_t inode_id )
 		heapmm_free(dirc, sizeof(dir_cache_t));
 
 		/* Release parent reference */
-		vfs_dir_cache_release(par); 
-	
+		vfs_dir_cache_release(par);
+
 		/* Pass the error to the caller */
 		THROW( status, NULL );
 	}
-	
+
 	/* Set the inode */
 	dirc->inode = vfs_effective_inode( oi );
 
 	assert(dirc->inode != NULL);
 
 	/* Release the outer inode */
-	if (oi) 
+	if (oi)
 		vfs_inode_release( oi );
-	
+
 	/*if (!dirc->inode) {
 		heapmm_free(dirc, sizeof(dir_cache_t));
 		vfs_dir_cache_release(par);
@@ -164,5 +498,236 @@ SFUNC( dir_cache_t *, vfs_dir_cache_new, dir_cache_t *par, ino_t inode_id )
 	/* Initialize the reference count to 1 */
 	dirc->usage_count = 1;
 
-	RETURN(dirc);	
+	RETURN(dirc);
+}
+
+/**
+ * @brief Look up a name in a directory
+ *
+ * The lookup table is consulted first, only if the name is not cached is the
+ * filesystem asked for it. Cache hits do not allocate memory.
+ * @param par The directory to search
+ * @param name The name to look up, must not be "." or ".."
+ * @param namelen The length of the name, it need not be terminated
+ * @return A new reference to the entry for name
+ *
+ * @exception EACCES The current user does not have permission to search par
+ * @exception ENOENT The name does not exist in the directory
+ * @exception ENOMEM Could not allocate memory for the entry
+ */
+
+SFUNC( dir_cache_t *, vfs_dir_cache_lookup,
+				dir_cache_t *par,
+				const char *name,
+				size_t namelen )
+{
+	dir_cache_t *dirc;
+	dirent_t *dirent;
+	inode_t *dir;
+	ino_t inode_id;
+	char *copy;
+	uint32_t hash, generation;
+	llist_t dead;
+	errno_t status;
+
+	/* Check for null pointers */
+	assert ( par != NULL );
+	assert ( name != NULL );
+
+	dir = par->inode;
+
+	/* Check permissions on parent dir */
+	if (!vfs_have_permissions(dir, MODE_EXEC)) {
+
+		/* If not: return the error "Permission denied" */
+		THROW( EACCES, NULL );
+
+	}
+
+	hash = vfs_dir_cache_hash( dir, name, namelen );
+
+	/* Check the lookup table */
+	semaphore_down( &dir_cache_lock );
+
+	dirc = vfs_dir_cache_find( par, name, namelen, hash );
+
+	if ( dirc ) {
+
+		/* Negative entries have no inode */
+		if ( !dirc->inode ) {
+			semaphore_up( &dir_cache_lock );
+			THROW( ENOENT, NULL );
+		}
+
+		vfs_dir_cache_get( dirc );
+
+		semaphore_up( &dir_cache_lock );
+
+		RETURN( dirc );
+
+	}
+
+	generation = dir_cache_generation;
+
+	semaphore_up( &dir_cache_lock );
+
+	/* Not cached, the filesystem wants a terminated name */
+	copy = heapmm_alloc( namelen + 1 );
+
+	if ( !copy )
+		THROW( ENOMEM, NULL );
+
+	memcpy( copy, name, namelen );
+	copy[ namelen ] = '\0';
+
+	status = ifs_find_dirent( dir, copy, &dirent );
+
+	/* Some filesystems change without telling us */
+	if ( dir->device->flags & FS_DEVICE_FLAG_NODCACHE ) {
+
+		heapmm_free( copy, namelen + 1 );
+
+		if ( status )
+			THROW( status, NULL );
+
+		inode_id = dirent->inode_id;
+
+		heapmm_free( dirent, sizeof( dirent_t ) );
+
+		CHAINRET( vfs_dir_cache_new, par, inode_id );
+
+	}
+
+	llist_create( &dead );
+
+	if ( status == ENOENT ) {
+
+		/* Remember that the name does not exist */
+		dirc = heapmm_alloc( sizeof( dir_cache_t ) );
+
+		if ( dirc ) {
+
+			memset( dirc, 0, sizeof( dir_cache_t ) );
+
+			dirc->parent = vfs_dir_cache_ref( par );
+			dirc->usage_count = 1;
+
+			semaphore_down( &dir_cache_lock );
+
+			if ( !vfs_dir_cache_insert( dirc, copy, hash, generation ) )
+				heapmm_free( copy, namelen + 1 );
+
+			vfs_dir_cache_put( dirc, &dead );
+			vfs_dir_cache_trim( CONFIG_DIR_CACHE_SIZE, &dead );
+
+			semaphore_up( &dir_cache_lock );
+
+			vfs_dir_cache_reap( &dead );
+
+		} else
+			heapmm_free( copy, namelen + 1 );
+
+		THROW( ENOENT, NULL );
+
+	} else if ( status ) {
+
+		heapmm_free( copy, namelen + 1 );
+
+		THROW( status, NULL );
+
+	}
+
+	/* Create new dirc entry for this element */
+	status = vfs_dir_cache_new( par, dirent->inode_id, &dirc );
+
+	heapmm_free( dirent, sizeof( dirent_t ) );
+
+	if ( status ) {
+
+		heapmm_free( copy, namelen + 1 );
+
+		THROW( status, NULL );
+
+	}
+
+	semaphore_down( &dir_cache_lock );
+
+	if ( !vfs_dir_cache_insert( dirc, copy, hash, generation ) )
+		heapmm_free( copy, namelen + 1 );
+
+	vfs_dir_cache_trim( CONFIG_DIR_CACHE_SIZE, &dead );
+
+	semaphore_up( &dir_cache_lock );
+
+	vfs_dir_cache_reap( &dead );
+
+	RETURN( dirc );
+}
+
+/**
+ * @brief Drop the cached entries for a name in a directory
+ *
+ * Must be called whenever a directory entry is created or removed
+ * @param dir The directory containing the name
+ * @param name The name that changed
+ */
+
+void vfs_dir_cache_invalidate( inode_t *dir, const char *name )
+{
+	dir_cache_t *dirc;
+	uint32_t hash;
+	llist_t dead;
+
+	/* Check for null pointers */
+	assert ( dir != NULL );
+	assert ( name != NULL );
+
+	llist_create( &dead );
+
+	hash = vfs_dir_cache_hash( dir, name, strlen( name ) );
+
+	semaphore_down( &dir_cache_lock );
+
+	/* Stop lookups that are in progress from adding stale entries */
+	dir_cache_generation++;
+
+restart:
+	for ( dirc = DIR_CACHE_BUCKET( hash ); dirc; dirc = dirc->hash_next ) {
+		if ( dirc->hash == hash && dirc->parent->inode == dir &&
+		     !strcmp( dirc->name, name ) ) {
+			vfs_dir_cache_unhash( dirc, &dead );
+			goto restart;
+		}
+	}
+
+	semaphore_up( &dir_cache_lock );
+
+	vfs_dir_cache_reap( &dead );
+}
+
+/**
+ * @brief Drop all entries from the lookup table
+ *
+ * Used when a filesystem is mounted, as that changes the inodes that names
+ * refer to.
+ */
+
+void vfs_dir_cache_purge( void )
+{
+	int bucket;
+	llist_t dead;
+
+	llist_create( &dead );
+
+	semaphore_down( &dir_cache_lock );
+
+	dir_cache_generation++;
+
+	for ( bucket = 0; bucket < CONFIG_DIR_CACHE_TABLESIZE; bucket++ )
+		while ( dir_cache_table[ bucket ] )
+			vfs_dir_cache_unhash( dir_cache_table[ bucket ], &dead );
+
+	semaphore_up( &dir_cache_lock );
+
+	vfs_dir_cache_reap( &dead );
 }
@@ -12,11 +12,16 @@
  * \li 11-07-2014 - Rewrite 1
  * \li 12-07-2014 - Commented
  * \li 16-02-2015 - Split off from vfs.c
+ * \li 17-10-2026 - Added the inode cache shrinker
+ * \li 17-10-2026 - Index open inodes by device and inode id
+ * \li 17-10-2026 - Drop the cached pages of freed inodes
+ * \li 17-10-2026 - Notify the filesystem when an inode is released
  */
 
 /* Includes */
 
 #include <assert.h>
+#include <string.h>
 
 #include "util/llist.h"
 #include "util/mruc.h"
@@ -24,6 +29,7 @@
 #include "kernel/vfs.h"
 
 #include "kernel/heapmm.h"
+#include "kernel/shrinker.h"
 
 #undef CON_SRC
 #define  CON_SRC "vfs"
@@ -34,20 +40,53 @@
 /** The linked list serving as open inode list */
 llist_t *open_inodes;
 
+/** The hash table used to look up open inodes */
+inode_t **open_inode_table;
+
 /** The linked list serving as inode cache */
 //TODO: Implement a proper inode cache
 mruc_t *inode_cache;
 
 /* Internal type definitions */
 
-typedef struct vfs_cache_params {
-	uint32_t device_id;
-	ino_t inode_id;
-} vfs_cache_params_t;
 #define INODE_HASHR( iD, DeV ) ((iD & 0xFFFFFFFFL) | \
 							(((uint64_t)((DeV & 0xFFFFFFFFL)) \
 							<< 32L)))
 #define INODE_HASH( iNoDe ) INODE_HASHR( (iNoDe)->id, (iNoDe)->device_id )
+#define OPEN_INODE_BUCKET( iD, DeV ) (&open_inode_table[ \
+			( ( uint32_t ) (iD) ^ ( (DeV) * 0x9E3779B1u ) ) & \
+			( CONFIG_OPEN_INODE_TABLESIZE - 1 ) ])
+
+/* Internal functions */
+
+/**
+ * @brief Add an inode to the open inode table
+ */
+static void vfs_open_inode_hash( inode_t *inode )
+{
+	inode_t **bkt = OPEN_INODE_BUCKET( inode->id, inode->device_id );
+
+	inode->open_next = *bkt;
+	inode->open_pprev = bkt;
+	if ( *bkt )
+		(*bkt)->open_pprev = &inode->open_next;
+	*bkt = inode;
+}
+
+/**
+ * @brief Remove an inode from the open inode table
+ */
+static void vfs_open_inode_unhash( inode_t *inode )
+{
+	if ( !inode->open_pprev )
+		return;
+
+	*inode->open_pprev = inode->open_next;
+	if ( inode->open_next )
+		inode->open_next->open_pprev = inode->open_pprev;
+	inode->open_next = NULL;
+	inode->open_pprev = NULL;
+}
 
 /* Public Functions */
 
@@ -69,6 +108,8 @@ void vfs_icache_evict( mruc_e_t *entry )
 
 	} else {
 
+		vfs_page_cache_drop( inode );
+
 		heapmm_free( inode, inode->device->inode_size );
 
 	}
@@ -77,6 +118,42 @@ void vfs_icache_evict( mruc_e_t *entry )
 
 }
 
+/**
+ * @brief Count the cached inodes, these have no references
+ */
+static size_t vfs_icache_shrinker_count(
+			__attribute__((unused)) shrinker_t *shrinker )
+{
+	return inode_cache->count;
+}
+
+/**
+ * @brief Evict the least recently used cached inodes
+ */
+static size_t vfs_icache_shrinker_scan(
+			__attribute__((unused)) shrinker_t *shrinker,
+			size_t nr )
+{
+	mruc_e_t *entry;
+	size_t count;
+
+	for ( count = 0; count < nr; count++ ) {
+		entry = mruc_get_lru( inode_cache );
+		if ( !entry )
+			break;
+		vfs_icache_evict( entry );
+	}
+
+	return count;
+}
+
+static shrinker_t vfs_icache_shrinker = {
+	.name  = "icache",
+	.pass  = SHRINKER_PASS_CACHE,
+	.count = vfs_icache_shrinker_count,
+	.scan  = vfs_icache_shrinker_scan
+};
+
 void vfs_icache_initialize()
 {
 
@@ -95,12 +172,22 @@ void vfs_icache_initialize()
 	/* Allocate table */
 	table = heapmm_alloc( tsize * sizeof(llist_t) );
 
+	/* Allocate open inode table */
+	open_inode_table = heapmm_alloc( CONFIG_OPEN_INODE_TABLESIZE *
+					 sizeof( inode_t * ) );
+	assert( open_inode_table != NULL );
+
+	memset( open_inode_table, 0, CONFIG_OPEN_INODE_TABLESIZE *
+				     sizeof( inode_t * ) );
+
 	/* Create the inode cache */
 	mruc_create( inode_cache, csize, tsize, vfs_icache_evict, table );
 
 	/* Create the open inode list */
 	llist_create(open_inodes);
 
+	shrinker_register( &vfs_icache_shrinker );
+
 }
 
 /**
@@ -110,6 +197,8 @@ void vfs_icache_initialize()
 
 void vfs_inode_release(inode_t *inode)
 {
+	errno_t status;
+
 	//debugcon_printf("rel inode: 0x%x rc: %i ENTER\n",inode,inode->usage_count);
 
 	/* Decrease the reference count for this inode */
@@ -128,7 +217,15 @@ void vfs_inode_release(inode_t *inode)
 	//	printf(CON_ERROR, failed to sync inode (%i)\n", status);
 	//}
 
+	/* Let the filesystem drop state it only keeps for files in use */
+	status = ifs_release_inode( inode );
+
+	if (status && status != ENOTSUP) {
+		printf(CON_ERROR, "error while releasing inode: %i", status);
+	}
+
 	llist_unlink((llist_t *) inode);
+	vfs_open_inode_unhash( inode );
 
 	mruc_add( inode_cache, ( mruc_e_t * ) inode, INODE_HASH(inode) );
 	//debugcon_printf("rel inode: 0x%x rc: %i EXITM\n",inode,inode->usage_count);
@@ -151,6 +248,7 @@ inode_t *vfs_inode_ref(inode_t *inode)
 		/* Move inode from cache to open inode list */
 		mruc_remove( ( mruc_e_t * ) inode );
 		llist_add_end( open_inodes, (llist_t *) inode );
+		vfs_open_inode_hash( inode );
 	}
 
 	inode->usage_count++;
@@ -170,18 +268,31 @@ void vfs_inode_cache(inode_t *inode)
 
 	assert (inode != NULL);
 
+	/* Inodes enter the caches here, nothing of the file is cached yet */
+	inode->pages = NULL;
+
 	mruc_add( inode_cache, ( mruc_e_t * ) inode, INODE_HASH(inode) );
 }
 
-/*
- * Iterator function that looks up the requested inode
+/**
+ * @brief Remove an inode from the caches before it is freed
+ * @param inode The inode to remove
  */
 
-int vfs_cache_find_iterator (llist_t *node, void *param)
+void vfs_inode_uncache(inode_t *inode)
 {
-	inode_t *inode = (inode_t *) node;
-	vfs_cache_params_t *p = (vfs_cache_params_t *) param;
-	return (inode->id == p->inode_id) && (inode->device_id == p->device_id);
+
+	assert (inode != NULL);
+
+	if ( inode->usage_count ) {
+		/* Remove inode from the open inode list */
+		llist_unlink( (llist_t *) inode );
+		vfs_open_inode_unhash( inode );
+	} else if ( inode->node.cache ) {
+		mruc_remove( ( mruc_e_t * ) inode );
+	}
+
+	vfs_page_cache_drop( inode );
 }
 
 /**
@@ -196,21 +307,19 @@ int vfs_cache_find_iterator (llist_t *node, void *param)
 inode_t *vfs_get_cached_inode(fs_device_t *device, ino_t inode_id)
 {
 	inode_t *result;
-	vfs_cache_params_t search_params;
 
 	/* Check for NULL pointers */
 	assert ( device != NULL );
 
-	/* Setup search parameters */
-	search_params.device_id = device->id;
-	search_params.inode_id = inode_id;
+	/* Search open inode table */
+	for ( result = *OPEN_INODE_BUCKET( inode_id, device->id ); result;
+	      result = result->open_next ) {
 
-	/* Search open inode list */
-	result = (inode_t *) llist_iterate_select(open_inodes, &vfs_cache_find_iterator, (void *) &search_params);
+		if ( result->id == inode_id && result->device_id == device->id ) {
+			/* Cache hit, return inode */
+			return vfs_inode_ref(result);
+		}
 
-	if (result) {
-		/* Cache hit, return inode */
-		return vfs_inode_ref(result);
 	}
 
 	/* Search inode cache */
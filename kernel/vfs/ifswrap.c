@@ -12,6 +12,8 @@
  * \li 11-07-2014 - Rewrite 1
  * \li 12-07-2014 - Commented
  * \li 04-03-2015 - Split off from vfs.c
+ * \li 17-10-2026 - Invalidate the directory cache on link and unlink
+ * \li 17-10-2026 - Added the inode release hook
  */
 
 /* Includes */
@@ -237,6 +239,8 @@ SFUNC(dirent_t *, ifs_find_dirent, inode_t * inode, const char * name)
 
 SVFUNC( ifs_link, inode_t * inode , const char * name , ino_t nod_id )
 {
+	errno_t status;
+
 	/* This function is implemented by the FS driver */
 	assert ( inode != NULL );
 	assert ( name != NULL );
@@ -250,7 +254,12 @@ SVFUNC( ifs_link, inode_t * inode , const char * name , ino_t nod_id )
 	}
 
 	/* Call the driver */
-	CHAINRETV( inode->device->ops->link, inode, name, nod_id );
+	status = inode->device->ops->link( inode, name, nod_id );
+
+	/* Drop any cached lookup of the name */
+	vfs_dir_cache_invalidate( inode, name );
+
+	THROWV( status );
 }
 
 /**
@@ -264,7 +273,9 @@ SVFUNC( ifs_link, inode_t * inode , const char * name , ino_t nod_id )
  */
 
 SVFUNC( ifs_unlink, inode_t * inode , const char * name )
-{	
+{
+	errno_t status;
+
 	/* This function is implemented by the FS driver */
 	assert ( inode != NULL );
 	assert ( name != NULL );
@@ -278,7 +289,12 @@ SVFUNC( ifs_unlink, inode_t * inode , const char * name )
 	}
 
 	/* Call the driver */
-	CHAINRETV( inode->device->ops->unlink, inode, name );
+	status = inode->device->ops->unlink( inode, name );
+
+	/* Drop any cached lookup of the name */
+	vfs_dir_cache_invalidate( inode, name );
+
+	THROWV( status );
 }
 
 /**
@@ -423,3 +439,23 @@ SVFUNC( ifs_sync, fs_device_t *device )
 	CHAINRETV( device->ops->sync, device );
 }
 
+/**
+ * @brief Notify the filesystem that an inode is no longer referenced
+ * @param inode The inode that was released
+ */
+
+SVFUNC( ifs_release_inode, inode_t *inode )
+{
+	/* This function is implemented by the FS driver */
+	assert (inode != NULL);
+
+	/* Check if the driver supports release */
+	if (!inode->device->ops->release_inode) {
+		/* If not: return the error "Operation not supported" */
+		THROWV(ENOTSUP);
+	}
+
+	/* Call the driver */
+	CHAINRETV( inode->device->ops->release_inode, inode );
+}
+
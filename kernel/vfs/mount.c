@@ -12,6 +12,7 @@
  * \li 11-07-2014 - Rewrite 1
  * \li 12-07-2014 - Commented
  * \li 05-04-2015 - Split off from ifsmgr.c
+ * \li 17-10-2026 - Purge the directory cache when mounting
  */
 
 /* Includes */
@@ -221,6 +222,9 @@ SVFUNC(vfs_do_mount, fs_driver_t *driver, dev_t device, inode_t *mountpoint, uin
 	/* Register the mount */
 	vfs_reg_mount ( fsdevice, mp_inode );
 
+	/* Cached lookups may refer to the covered directory */
+	vfs_dir_cache_purge();
+
 	/* Release the mountpoint inode */
 	vfs_inode_release(mp_inode);
 
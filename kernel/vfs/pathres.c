@@ -12,6 +12,8 @@
  * \li 11-07-2014 - Rewrite 1
  * \li 12-07-2014 - Commented
  * \li 04-02-2015 - Split off from vfs.c
+ * \li 17-10-2026 - Look up path elements through the directory cache
+ * \li 17-10-2026 - Compare path elements in place
  */
 
 /* Includes */
@@ -236,12 +238,10 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 	dir_cache_t *newc;
 	inode_t * parent = dirc->inode;
 	char * separator;
-	char * path_element;
 	const char * remaining_path = path;
 	char * end_of_path;
 	char * target;
 	size_t element_size;
-	dirent_t *dirent;
 	int element_count = 0;
 	errno_t status;
 	size_t rlsize;
@@ -267,20 +267,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 		THROW( ENOENT, NULL );
 	}
 
-	/* Allocate buffer for path element */
-	path_element = (char *) heapmm_alloc(CONFIG_FILE_MAX_NAME_LENGTH);
-
-	/* Check whether the allocation succeeded */
-	if (!path_element) {
-
-		/* Release current directory */
-		vfs_dir_cache_release(dirc);
-
-		/* Throw out of memory error */
-		THROW( ENOMEM, NULL);
-
-	}
-
 	/* Aqquire a pointer to the terminator */
 	end_of_path = strchr(remaining_path, 0);
 
@@ -313,7 +299,7 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 			/* Element size is 0 but not first element */
 
 			/* Check whether this is the last element */
-			if ((separator + 2) >= end_of_path) {
+			if ((separator + 1) >= end_of_path) {
 				/* If so, we have detected a trailing slash */
 				/* and reached the end of the path */
 				/* Because we arrived here after completing an*/
@@ -321,10 +307,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 				/* the S_ISDIR check and made sure dirc refers*/
 				/* to a directory */
 
-				/* Clean up */
-				heapmm_free(path_element,
-					 CONFIG_FILE_MAX_NAME_LENGTH);
-
 				/* Return dirc */
 				RETURN(dirc);
 			}
@@ -376,51 +358,32 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 				/* We have already determined the
 				 * parent, return that instead */
 
-				/* Clean up */
-				heapmm_free(path_element,
-					 CONFIG_FILE_MAX_NAME_LENGTH);
-
 				/* Return dirc */
 
 				RETURN(dirc);
 
 			}
 
-			/* Isolate it */
-			strncpy(path_element, remaining_path, element_size);
-			path_element[element_size] = '\0';
-
-			/* Find the directory entry for it */
-			status = vfs_find_dirent(parent, path_element, &dirent);
-
-			/* Check an error occurred */
-			if (status) {
-
-				/* If so, clean up and return */
-				heapmm_free(path_element,
-						CONFIG_FILE_MAX_NAME_LENGTH);
+			/* Check the element length */
+			if (element_size >= CONFIG_FILE_MAX_NAME_LENGTH) {
 
 				/* Release parent dirc */
 				vfs_dir_cache_release(dirc);
 
-				/* Pass the error to the caller */
-				THROW(status, NULL);
+				THROW(ENAMETOOLONG, NULL);
 			}
 
-			/* Create new dirc entry for this element */
-			status = vfs_dir_cache_new(	dirc,
-							dirent->inode_id,
+			/* Look up the dirc entry for this element, it is */
+			/* compared in place so no copy is needed */
+			status = vfs_dir_cache_lookup(	dirc,
+							remaining_path,
+							element_size,
 							&newc);
 
-			//TODO: Free dirent!!!
-
 			/* Check an error occurred */
 			if (status) {
 
 				/* If so, clean up and return */
-				heapmm_free(path_element,
-						CONFIG_FILE_MAX_NAME_LENGTH);
-
 				/* Release parent dirc */
 				vfs_dir_cache_release(dirc);
 
@@ -446,9 +409,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 					if ( parent->size >=
 						CONFIG_FILE_MAX_NAME_LENGTH ) {
 						/* If so, clean up and return */
-						heapmm_free(path_element,
-						   CONFIG_FILE_MAX_NAME_LENGTH);
-
 						/* Release newc */
 						vfs_dir_cache_release(newc);
 
@@ -465,9 +425,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 					/* Check whether the allocation failed*/
 					if ( !target ) {
 						/* If so, clean up and return */
-						heapmm_free(path_element,
-						   CONFIG_FILE_MAX_NAME_LENGTH);
-
 						/* Release newc */
 						vfs_dir_cache_release(newc);
 
@@ -487,8 +444,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 					/* Check if an error occurred */
 					if (status) {
 						/* If so, clean up and return */
-						heapmm_free(path_element,
-						   CONFIG_FILE_MAX_NAME_LENGTH);
 						heapmm_free(target,
 						   parent->size + 1);
 
@@ -522,8 +477,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 					/* Check if an error occurred */
 					if (status) {
 						/* If so, clean up and return */
-						heapmm_free(path_element,
-						   CONFIG_FILE_MAX_NAME_LENGTH);
 						heapmm_free(target,
 						   parent->size + 1);
 
@@ -559,13 +512,11 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 		/* Update remaining path to point to the start of the next
 		 * element */
 		remaining_path = separator + 1;
+		element_count++;
 
 		/* Check whether we have reached the end of the path */
 
 		if (remaining_path >= end_of_path) {
-			/* If so, return the current element */
-			heapmm_free(path_element, CONFIG_FILE_MAX_NAME_LENGTH);
-
 			/* Check if we were resolving the parent */
 			if ( flags & PATHRES_FLAG_PARENT ) {
 				/* We have apparently reached a final element */
@@ -573,6 +524,9 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 				/* the filesystem root ), this is not a valid */
 				/* operation */
 
+				/* Release dirc */
+				vfs_dir_cache_release(dirc);
+
 				/* Throw EINVAL: Invalid operation */
 				THROW(EINVAL, NULL);
 
@@ -589,9 +543,6 @@ SFUNC(dir_cache_t *, _vfs_find_dirc_at,
 			/* If not, return NULL because we can't search inside
                          * other kinds of files */
 
-			/* Clean up */
-			heapmm_free(path_element, CONFIG_FILE_MAX_NAME_LENGTH);
-
 			/* Release old element */
 			vfs_dir_cache_release(dirc);
 
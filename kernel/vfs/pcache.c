@@ -0,0 +1,721 @@
+/**
+ * @file kernel/vfs/pcache.c
+ *
+ * Implements the page cache
+ *
+ * File data read through the VFS is kept in physical frames, one page of a
+ * file per frame, in a lookup table keyed by inode and file offset. Reads
+ * copy from these frames and writes update them as well as the file, file
+ * mappings map the frames directly so processes mapping the same file share
+ * its memory. Pages nobody uses are freed when memory runs low.
+ *
+ * Part of P-OS kernel.
+ *
+ * @author Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * \li 17-10-2026 - Created
+ * \li 17-10-2026 - Protect the cache with its own lock
+ */
+
+/* Includes */
+
+#include <assert.h>
+
+#include <string.h>
+
+#include "util/llist.h"
+
+#include "kernel/vfs.h"
+
+#include "kernel/heapmm.h"
+#include "kernel/physmm.h"
+#include "kernel/paging.h"
+#include "kernel/shrinker.h"
+
+/* Global Variables */
+
+/** The lookup table, hashed on inode and file offset */
+page_cache_t **page_cache_table;
+
+/** All cached pages, least recently used first */
+llist_t page_cache_lru;
+
+/** The number of cached pages */
+size_t page_cache_count;
+
+/** Protects the lookup table, the LRU list and the page lists of inodes */
+semaphore_t page_cache_lock;
+
+/* Internal type definitions */
+
+#define PAGE_CACHE_BUCKET( InO, OfF ) ( &page_cache_table[ \
+		( ( ( uintptr_t ) (InO) >> 4 ) ^ \
+		  ( ( uint32_t ) ( (OfF) / PHYSMM_PAGE_SIZE ) * 0x9E3779B1u ) ) & \
+		( CONFIG_PAGE_CACHE_TABLESIZE - 1 ) ] )
+
+/* Internal functions */
+
+/**
+ * @brief Find a page in the lookup table
+ *
+ * The caller must hold page_cache_lock.
+ * @param inode The file the page belongs to
+ * @param offset The page aligned offset of the page in the file
+ * @return The page or NULL if it is not cached
+ */
+
+static page_cache_t *vfs_page_cache_find( inode_t *inode, aoff_t offset )
+{
+	page_cache_t *page;
+
+	for ( page = *PAGE_CACHE_BUCKET( inode, offset ); page;
+	      page = page->hash_next )
+		if ( page->inode == inode && page->offset == offset )
+			return page;
+
+	return NULL;
+}
+
+/**
+ * @brief Add a page to the lookup table and the list of its file
+ *
+ * The caller must hold page_cache_lock.
+ */
+
+static void vfs_page_cache_insert( page_cache_t *page )
+{
+	page_cache_t **bkt = PAGE_CACHE_BUCKET( page->inode, page->offset );
+	inode_t *inode = page->inode;
+
+	page->hash_next = *bkt;
+	page->hash_pprev = bkt;
+	if ( *bkt )
+		(*bkt)->hash_pprev = &page->hash_next;
+	*bkt = page;
+
+	page->inode_next = inode->pages;
+	page->inode_pprev = &inode->pages;
+	if ( inode->pages )
+		inode->pages->inode_pprev = &page->inode_next;
+	inode->pages = page;
+
+	llist_add_end( &page_cache_lru, &page->lru_link );
+	page_cache_count++;
+}
+
+/**
+ * @brief Remove a page from the cache and free it
+ *
+ * Processes that mapped the page keep its frame, they hold a reference to it.
+ * The caller must hold page_cache_lock.
+ */
+
+static void vfs_page_cache_destroy( page_cache_t *page )
+{
+	assert( page->usage_count == 0 );
+
+	*page->hash_pprev = page->hash_next;
+	if ( page->hash_next )
+		page->hash_next->hash_pprev = page->hash_pprev;
+
+	*page->inode_pprev = page->inode_next;
+	if ( page->inode_next )
+		page->inode_next->inode_pprev = page->inode_pprev;
+
+	llist_unlink( &page->lru_link );
+	page_cache_count--;
+
+	physmm_free_frame( page->frame );
+
+	heapmm_free( page, sizeof( page_cache_t ) );
+}
+
+/**
+ * @brief Count the cached pages
+ */
+
+static size_t vfs_pcache_shrinker_count(
+			__attribute__((unused)) shrinker_t *shrinker )
+{
+	return page_cache_count;
+}
+
+/**
+ * @brief Check whether a page is cached
+ * @param inode The file the page belongs to
+ * @param offset The page aligned offset of the page in the file
+ * @return Nonzero if the page is cached
+ */
+
+static int vfs_page_cache_present( inode_t *inode, aoff_t offset )
+{
+	int present;
+
+	semaphore_down( &page_cache_lock );
+	present = vfs_page_cache_find( inode, offset ) != NULL;
+	semaphore_up( &page_cache_lock );
+
+	return present;
+}
+
+/**
+ * @brief Free the least recently used pages
+ *
+ * Pages that are in use or mapped by a process are skipped, freeing them
+ * would not release their frame. Does nothing if the cache is locked, as
+ * the holder may be waiting for memory.
+ */
+
+static size_t vfs_pcache_shrinker_scan(
+			__attribute__((unused)) shrinker_t *shrinker,
+			size_t nr )
+{
+	page_cache_t *page, *next;
+	size_t count = 0, seen;
+
+	if ( !semaphore_try_down( &page_cache_lock ) )
+		return 0;
+
+	page = ( page_cache_t * ) llist_get_first( &page_cache_lru );
+
+	for ( seen = page_cache_count; page && seen && count < nr; seen-- ) {
+
+		next = ( page_cache_t * ) page->lru_link.next;
+		if ( next == ( page_cache_t * ) &page_cache_lru )
+			next = NULL;
+
+		if ( !page->usage_count &&
+		     physmm_frame_refs( page->frame ) == 1 ) {
+			vfs_page_cache_destroy( page );
+			count++;
+		}
+
+		page = next;
+	}
+
+	semaphore_up( &page_cache_lock );
+
+	return count;
+}
+
+static shrinker_t vfs_pcache_shrinker = {
+	.name  = "pcache",
+	.pass  = SHRINKER_PASS_CACHE,
+	.count = vfs_pcache_shrinker_count,
+	.scan  = vfs_pcache_shrinker_scan
+};
+
+/* Public Functions */
+
+/**
+ * @brief Set up the page cache lookup table
+ */
+
+void vfs_pcache_initialize( void )
+{
+	/* Allocate the lookup table */
+	page_cache_table = heapmm_alloc( CONFIG_PAGE_CACHE_TABLESIZE *
+					 sizeof( page_cache_t * ) );
+	assert( page_cache_table != NULL );
+
+	memset( page_cache_table, 0, CONFIG_PAGE_CACHE_TABLESIZE *
+				     sizeof( page_cache_t * ) );
+
+	/* Create the LRU list */
+	llist_create( &page_cache_lru );
+
+	page_cache_count = 0;
+
+	semaphore_init( &page_cache_lock );
+	semaphore_up( &page_cache_lock );
+
+	shrinker_register( &vfs_pcache_shrinker );
+}
+
+/**
+ * @brief Add a page to the cache
+ *
+ * If the page was added while waiting for memory, that page is returned.
+ * @param inode The file the page belongs to
+ * @param offset The page aligned offset of the page in the file
+ * @param data The contents of the page
+ * @return The page, release it with vfs_page_cache_release
+ *
+ * @exception ENOMEM Could not allocate memory for the page
+ */
+
+static SFUNC( page_cache_t *, vfs_page_cache_add,
+					inode_t *inode,
+					aoff_t offset,
+					const void *data )
+{
+	page_cache_t *page, *other;
+	physaddr_t frame;
+
+	page = heapmm_alloc( sizeof( page_cache_t ) );
+
+	if ( !page )
+		THROW( ENOMEM, NULL );
+
+	frame = physmm_alloc_frame();
+	if ( frame == PHYSMM_NO_FRAME ) {
+		/* Wait for the kernel caches to release memory */
+		paging_handle_out_of_memory();
+		frame = physmm_alloc_frame();
+	}
+
+	if ( frame == PHYSMM_NO_FRAME ) {
+		heapmm_free( page, sizeof( page_cache_t ) );
+		THROW( ENOMEM, NULL );
+	}
+
+	if ( paging_copy_to_frame( frame, data ) ) {
+		heapmm_free( page, sizeof( page_cache_t ) );
+		physmm_free_frame( frame );
+		THROW( ENOMEM, NULL );
+	}
+
+	memset( page, 0, sizeof( page_cache_t ) );
+
+	page->inode = inode;
+	page->offset = offset;
+	page->frame = frame;
+	page->usage_count = 1;
+
+	semaphore_down( &page_cache_lock );
+
+	/* Waiting for memory may have blocked, check the table again */
+	other = vfs_page_cache_find( inode, offset );
+
+	if ( other ) {
+		other->usage_count++;
+		semaphore_up( &page_cache_lock );
+
+		heapmm_free( page, sizeof( page_cache_t ) );
+		physmm_free_frame( frame );
+
+		RETURN( other );
+	}
+
+	vfs_page_cache_insert( page );
+
+	semaphore_up( &page_cache_lock );
+
+	RETURN( page );
+}
+
+/**
+ * @brief Get a page of a file if it is cached
+ *
+ * The caller must hold the lock on the inode.
+ * @param inode The file to get the page of
+ * @param offset The page aligned offset of the page in the file
+ * @return The page or NULL if it is not cached, release it with
+ *         vfs_page_cache_release
+ */
+
+page_cache_t *vfs_page_cache_lookup( inode_t *inode, aoff_t offset )
+{
+	page_cache_t *page;
+
+	assert( inode != NULL );
+	assert( !( offset & PHYSMM_PAGE_ADDRESS_MASK ) );
+
+	semaphore_down( &page_cache_lock );
+
+	page = vfs_page_cache_find( inode, offset );
+
+	if ( page ) {
+
+		/* Move it to the end of the LRU list */
+		llist_unlink( &page->lru_link );
+		llist_add_end( &page_cache_lru, &page->lru_link );
+
+		page->usage_count++;
+
+	}
+
+	semaphore_up( &page_cache_lock );
+
+	return page;
+}
+
+/**
+ * @brief Get a page of a file, reading it if it is not cached
+ *
+ * The part of the page past the end of the file is filled with zeroes. The
+ * caller must hold the lock on the inode.
+ * @param inode The file to get the page of
+ * @param offset The page aligned offset of the page in the file
+ * @return The page, release it with vfs_page_cache_release
+ *
+ * @exception ENOMEM Could not allocate memory for the page
+ * @exception EIO    An IO error occurred while reading the file
+ */
+
+SFUNC( page_cache_t *, vfs_page_cache_get, inode_t *inode, aoff_t offset )
+{
+	page_cache_t *page;
+	aoff_t count, read_size;
+	void *buffer;
+	errno_t status;
+
+	/* Check the lookup table */
+	page = vfs_page_cache_lookup( inode, offset );
+
+	if ( page )
+		RETURN( page );
+
+	/* Not cached, the frame can not be written directly so read into a
+	 * buffer first */
+	buffer = heapmm_alloc_page();
+
+	if ( !buffer )
+		THROW( ENOMEM, NULL );
+
+	memset( buffer, 0, PHYSMM_PAGE_SIZE );
+
+	/* Read the part of the page that is in the file */
+	count = 0;
+	if ( offset < inode->size ) {
+		count = inode->size - offset;
+		if ( count > PHYSMM_PAGE_SIZE )
+			count = PHYSMM_PAGE_SIZE;
+	}
+
+	status = ESUCCESS;
+
+	if ( count )
+		status = ifs_read( inode, buffer, offset, count, &read_size );
+
+	/* Reading may have blocked, the page is only added if nobody else
+	 * added it in the mean time */
+	if ( !status )
+		status = vfs_page_cache_add( inode, offset, buffer, &page );
+
+	heapmm_free( buffer, PHYSMM_PAGE_SIZE );
+
+	if ( status )
+		THROW( status, NULL );
+
+	RETURN( page );
+}
+
+/**
+ * @brief Read the missing pages of a range of a file into the cache
+ *
+ * Consecutive missing pages are read with a single read of up to
+ * CONFIG_PAGE_CACHE_POPULATE_SIZE bytes. Pages past the end of the file are
+ * not read. The caller must hold the lock on the inode.
+ * @param inode The file to read
+ * @param offset The page aligned offset of the range in the file
+ * @param count The length of the range
+ *
+ * @exception ENOMEM Could not allocate memory for the pages
+ * @exception EIO    An IO error occurred while reading the file
+ */
+
+SVFUNC( vfs_page_cache_populate, inode_t *inode, aoff_t offset, aoff_t count )
+{
+	page_cache_t *page;
+	aoff_t end, run_end, run_size, read_size;
+	void *buffer;
+	errno_t status;
+
+	assert( inode != NULL );
+	assert( !( offset & PHYSMM_PAGE_ADDRESS_MASK ) );
+
+	end = offset + count;
+	if ( end > inode->size )
+		end = inode->size;
+
+	while ( offset < end ) {
+
+		/* Skip pages that are cached already */
+		if ( vfs_page_cache_present( inode, offset ) ) {
+			offset += PHYSMM_PAGE_SIZE;
+			continue;
+		}
+
+		/* Find the missing pages that follow */
+		run_end = offset + PHYSMM_PAGE_SIZE;
+		while ( run_end < end &&
+			run_end - offset < CONFIG_PAGE_CACHE_POPULATE_SIZE &&
+			!vfs_page_cache_present( inode, run_end ) )
+			run_end += PHYSMM_PAGE_SIZE;
+
+		run_size = run_end - offset;
+
+		/* Read them with a single call */
+		buffer = heapmm_alloc( run_size );
+
+		if ( !buffer )
+			THROWV( ENOMEM );
+
+		memset( buffer, 0, run_size );
+
+		count = run_size;
+		if ( count > inode->size - offset )
+			count = inode->size - offset;
+
+		status = ifs_read( inode, buffer, offset, count, &read_size );
+
+		for ( count = 0; !status && count < run_size;
+		      count += PHYSMM_PAGE_SIZE ) {
+			status = vfs_page_cache_add( inode,
+						     offset + count,
+						     buffer + count,
+						     &page );
+			if ( !status )
+				vfs_page_cache_release( page );
+		}
+
+		heapmm_free( buffer, run_size );
+
+		if ( status )
+			THROWV( status );
+
+		offset = run_end;
+
+	}
+
+	RETURNV;
+}
+
+/**
+ * @brief Release a page obtained from vfs_page_cache_get
+ * @param page The page to release
+ */
+
+void vfs_page_cache_release( page_cache_t *page )
+{
+	assert( page != NULL );
+	assert( page->usage_count > 0 );
+
+	semaphore_down( &page_cache_lock );
+	page->usage_count--;
+	semaphore_up( &page_cache_lock );
+}
+
+/**
+ * @brief Read file data through the page cache
+ *
+ * The caller must hold the lock on the inode and must not read past the end
+ * of the file.
+ * @param inode The file to read from
+ * @param buffer The buffer to store the data in
+ * @param file_offset The offset in the file to start reading at
+ * @param count The number of bytes to read
+ * @return The number of bytes read, also set on error
+ */
+
+SFUNC( aoff_t, vfs_page_cache_read,
+				inode_t *inode,
+				void *buffer,
+				aoff_t file_offset,
+				aoff_t count )
+{
+	page_cache_t *page;
+	aoff_t done, in_page, size;
+	errno_t status;
+
+	for ( done = 0; done < count; done += size ) {
+
+		in_page = file_offset & PHYSMM_PAGE_ADDRESS_MASK;
+
+		size = PHYSMM_PAGE_SIZE - in_page;
+		if ( size > count - done )
+			size = count - done;
+
+		status = vfs_page_cache_get( inode, file_offset - in_page, &page );
+
+		if ( status )
+			THROW( status, done );
+
+		status = paging_read_frame( page->frame,
+					    in_page,
+					    buffer + done,
+					    size );
+
+		vfs_page_cache_release( page );
+
+		if ( status )
+			THROW( status, done );
+
+		file_offset += size;
+
+	}
+
+	RETURN( done );
+}
+
+/**
+ * @brief Update the cached pages after data was written to a file
+ *
+ * Pages that are not cached are left alone, they will be read from the file
+ * when they are needed. The caller must hold the lock on the inode.
+ * @param inode The file that was written to
+ * @param buffer The data that was written
+ * @param file_offset The offset in the file the data was written at
+ * @param count The number of bytes that were written
+ */
+
+void vfs_page_cache_write( inode_t *inode,
+			   const void *buffer,
+			   aoff_t file_offset,
+			   aoff_t count )
+{
+	page_cache_t *page;
+	aoff_t done, in_page, size;
+
+	semaphore_down( &page_cache_lock );
+
+	for ( done = 0; done < count; done += size ) {
+
+		in_page = file_offset & PHYSMM_PAGE_ADDRESS_MASK;
+
+		size = PHYSMM_PAGE_SIZE - in_page;
+		if ( size > count - done )
+			size = count - done;
+
+		page = vfs_page_cache_find( inode, file_offset - in_page );
+
+		/* If the page can not be updated it must be dropped */
+		if ( page && paging_write_frame( page->frame,
+						 in_page,
+						 buffer + done,
+						 size ) )
+			vfs_page_cache_destroy( page );
+
+		file_offset += size;
+
+	}
+
+	semaphore_up( &page_cache_lock );
+}
+
+/**
+ * @brief Write a page of mapped file data back to the file
+ *
+ * Only the part of the page inside the file is written, a mapping can not
+ * grow the file. If the frame is not the cached one the cached page is
+ * updated as well. The caller must hold the lock on the inode.
+ * @param inode The file the page belongs to
+ * @param offset The page aligned offset of the page in the file
+ * @param frame The frame holding the data
+ * @param count The number of bytes at the start of the page to write
+ *
+ * @exception ENOMEM Could not allocate memory for a buffer
+ * @exception EIO    An IO error occurred while writing the file
+ */
+
+SVFUNC( vfs_page_cache_writeback, inode_t *inode, aoff_t offset,
+					physaddr_t frame, aoff_t count )
+{
+	page_cache_t *page;
+	aoff_t write_size;
+	void *buffer;
+	errno_t status;
+	int stale;
+
+	assert( inode != NULL );
+	assert( !( offset & PHYSMM_PAGE_ADDRESS_MASK ) );
+	assert( count <= PHYSMM_PAGE_SIZE );
+
+	/* Data past the end of the file is dropped */
+	if ( !count || offset >= inode->size )
+		RETURNV;
+
+	if ( count > inode->size - offset )
+		count = inode->size - offset;
+
+	/* The frame can not be read directly, copy it into a buffer */
+	buffer = heapmm_alloc_page();
+
+	if ( !buffer )
+		THROWV( ENOMEM );
+
+	status = paging_read_frame( frame, 0, buffer, count );
+
+	if ( !status )
+		status = ifs_write( inode, buffer, offset, count, &write_size );
+
+	if ( !status ) {
+
+		semaphore_down( &page_cache_lock );
+		page = vfs_page_cache_find( inode, offset );
+		stale = page && page->frame != frame;
+		semaphore_up( &page_cache_lock );
+
+		if ( stale )
+			vfs_page_cache_write( inode, buffer, offset, count );
+
+	}
+
+	heapmm_free( buffer, PHYSMM_PAGE_SIZE );
+
+	if ( status )
+		THROWV( status );
+
+	RETURNV;
+}
+
+/**
+ * @brief Update the cached pages after a file was resized
+ *
+ * Pages past the new end of the file are dropped and the part of the last
+ * page past the end of the file is cleared. The caller must hold the lock on
+ * the inode.
+ * @param inode The file that was resized
+ * @param size The new size of the file
+ */
+
+void vfs_page_cache_truncate( inode_t *inode, aoff_t size )
+{
+	page_cache_t *page, *next;
+	aoff_t in_page;
+
+	semaphore_down( &page_cache_lock );
+
+	for ( page = inode->pages; page; page = next ) {
+
+		next = page->inode_next;
+
+		if ( page->offset >= size ) {
+
+			vfs_page_cache_destroy( page );
+
+		} else if ( size - page->offset < PHYSMM_PAGE_SIZE ) {
+
+			in_page = size - page->offset;
+
+			if ( paging_write_frame( page->frame,
+						 in_page,
+						 NULL,
+						 PHYSMM_PAGE_SIZE - in_page ) )
+				vfs_page_cache_destroy( page );
+
+		}
+
+	}
+
+	semaphore_up( &page_cache_lock );
+}
+
+/**
+ * @brief Drop all cached pages of a file
+ *
+ * Called before the inode is freed.
+ * @param inode The file to drop the pages of
+ */
+
+void vfs_page_cache_drop( inode_t *inode )
+{
+	semaphore_down( &page_cache_lock );
+
+	while ( inode->pages )
+		vfs_page_cache_destroy( inode->pages );
+
+	semaphore_up( &page_cache_lock );
+}
@@ -0,0 +1,265 @@
+/**
+ * tests/fs/pathres.c
+ *
+ * Part of P-OS kernel.
+ *
+ * Resolves a set of hot paths against a small in-memory tree through the real
+ * path walk and directory cache and counts the heap allocations per lookup.
+ * Once the cache is warm a lookup must not allocate other than to read
+ * symlink targets. This is built against the kernel headers, the few C
+ * library functions it needs from the host are declared below.
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/errno.h>
+#include "kernel/vfs.h"
+#include "kernel/process.h"
+#include "kernel/scheduler.h"
+#include "kernel/heapmm.h"
+#include "kernel/shrinker.h"
+#include "kernel/synch.h"
+#include "kernel/console.h"
+#include "kernel/system.h"
+
+#undef printf
+#undef vprintf
+
+int printf( const char *format, ... );
+int vprintf( const char *format, va_list ap );
+void *malloc( size_t size );
+void free( void *ptr );
+void abort( void ) __attribute__((noreturn));
+
+#define BENCH_ITERATIONS	(1000)
+
+/** The number of allocations made, used to check for allocation free paths */
+static unsigned long heapmm_alloc_count;
+
+typedef struct {
+	ino_t		 parent;
+	const char	*name;
+	umode_t		 mode;
+	const char	*target;
+} bench_node_t;
+
+/* Inode numbers are indices into this table, 1 is the root */
+static bench_node_t bench_tree[] = {
+	{ 0, NULL,		0,		NULL },
+	{ 1, "",		S_IFDIR | 0755,	NULL },
+	{ 1, "usr",		S_IFDIR | 0755,	NULL },
+	{ 2, "lib",		S_IFDIR | 0755,	NULL },
+	{ 3, "gcc",		S_IFDIR | 0755,	NULL },
+	{ 4, "i386-pos",	S_IFDIR | 0755,	NULL },
+	{ 5, "include",		S_IFDIR | 0755,	NULL },
+	{ 6, "stddef.h",	S_IFREG | 0644,	NULL },
+	{ 2, "include",		S_IFDIR | 0755,	NULL },
+	{ 8, "stdio.h",		S_IFREG | 0644,	NULL },
+	{ 2, "bin",		S_IFDIR | 0755,	NULL },
+	{ 10, "gcc",		S_IFREG | 0755,	NULL },
+	{ 10, "cc",		S_IFLNK | 0777,	"gcc" },
+	{ 1, "lib",		S_IFLNK | 0777,	"usr/lib" }
+};
+
+#define BENCH_NODES	(sizeof(bench_tree) / sizeof(bench_tree[0]))
+
+static inode_t		bench_inodes[BENCH_NODES];
+static fs_device_t	bench_device;
+static process_info_t	bench_process;
+static scheduler_task_t	bench_task;
+
+scheduler_task_t *scheduler_current_task = &bench_task;
+
+void *heapmm_alloc( size_t size )
+{
+	heapmm_alloc_count++;
+	return malloc( size );
+}
+
+void heapmm_free( void *ptr, __attribute__((unused)) size_t size )
+{
+	free( ptr );
+}
+
+void shrinker_register( __attribute__((unused)) shrinker_t *shrinker )
+{
+}
+
+/* There is only one task, the caches must never be contended */
+void semaphore_init( semaphore_t *semaphore )
+{
+	*semaphore = 0;
+}
+
+void semaphore_up( semaphore_t *semaphore )
+{
+	(*semaphore)++;
+}
+
+int semaphore_down( semaphore_t *semaphore )
+{
+	assert( *semaphore != 0 );
+	(*semaphore)--;
+	return 0;
+}
+
+int semaphore_try_down( semaphore_t *semaphore )
+{
+	if ( *semaphore == 0 )
+		return 0;
+	(*semaphore)--;
+	return 1;
+}
+
+void con_hprintf( __attribute__((unused)) int hnd,
+                  __attribute__((unused)) int lvl,
+                  const char *fmt, ... )
+{
+	va_list args;
+	va_start( args, fmt );
+	vprintf( fmt, args );
+	va_end( args );
+}
+
+void halt( void )
+{
+	abort();
+}
+
+SFUNC(inode_t *, vfs_get_inode, fs_device_t *device, ino_t inode_id)
+{
+	if (device != &bench_device || inode_id < 1 || inode_id >= BENCH_NODES)
+		THROW(ENOENT, NULL);
+	RETURN(vfs_inode_ref(&bench_inodes[inode_id]));
+}
+
+inode_t *vfs_inode_ref(inode_t *inode)
+{
+	inode->usage_count++;
+	return inode;
+}
+
+void vfs_inode_release(inode_t *inode)
+{
+	assert(inode->usage_count > 0);
+	inode->usage_count--;
+}
+
+inode_t *vfs_effective_inode(inode_t *inode)
+{
+	return inode;
+}
+
+int vfs_have_permissions(__attribute__((unused)) inode_t *inode,
+                         __attribute__((unused)) mode_t req_mode)
+{
+	return 1;
+}
+
+SFUNC(dirent_t *, ifs_find_dirent, inode_t *inode, const char *name)
+{
+	dirent_t *dirent;
+	ino_t id;
+
+	for (id = 2; id < BENCH_NODES; id++) {
+		if (bench_tree[id].parent == inode->id &&
+		    !strcmp(bench_tree[id].name, name)) {
+			/* Like the filesystems, hand out an entry the caller frees. */
+			/* It is not counted, only the VFS allocations are measured */
+			dirent = malloc(sizeof(dirent_t));
+			assert(dirent != NULL);
+			dirent->inode_id = id;
+			RETURN(dirent);
+		}
+	}
+
+	THROW(ENOENT, NULL);
+}
+
+int vfs_readlink(inode_t *inode, char *buffer, size_t size, size_t *read_size)
+{
+	const char *target = bench_tree[inode->id].target;
+
+	assert(target != NULL);
+	strncpy(buffer, target, size);
+	*read_size = strlen(target);
+	return 0;
+}
+
+static void bench_init(void)
+{
+	ino_t id;
+	dir_cache_t *root;
+
+	for (id = 1; id < BENCH_NODES; id++) {
+		bench_inodes[id].id = id;
+		bench_inodes[id].device = &bench_device;
+		bench_inodes[id].mode = bench_tree[id].mode;
+		if (bench_tree[id].target)
+			bench_inodes[id].size = strlen(bench_tree[id].target);
+	}
+
+	vfs_dcache_initialize();
+
+	root = vfs_dir_cache_mkroot(&bench_inodes[1]);
+	bench_process.root_directory = root;
+	bench_process.current_directory = vfs_dir_cache_ref(root);
+	bench_task.process = &bench_process;
+}
+
+/**
+ * Resolve path repeatedly and check the allocations made per lookup
+ * @param expect The inode the path should resolve to, 0 if it does not exist
+ * @param links The number of symlinks followed, each allocates a buffer
+ */
+static void bench_path(const char *path, ino_t expect, unsigned long links)
+{
+	dir_cache_t *dirc;
+	unsigned long allocs;
+	errno_t status;
+	int n;
+
+	printf("Resolving %s...", path);
+
+	/* Warm up the cache */
+	status = vfs_find_dirc(path, &dirc);
+	if (!status)
+		vfs_dir_cache_release(dirc);
+
+	allocs = heapmm_alloc_count;
+
+	for (n = 0; n < BENCH_ITERATIONS; n++) {
+		status = vfs_find_dirc(path, &dirc);
+		if (expect) {
+			assert(status == 0 && dirc->inode->id == expect);
+			vfs_dir_cache_release(dirc);
+		} else
+			assert(status == ENOENT);
+	}
+
+	allocs = heapmm_alloc_count - allocs;
+	assert(allocs == links * BENCH_ITERATIONS);
+
+	printf(" OK\n");
+}
+
+int main(void)
+{
+	printf("P-OS Path lookup allocation test\n");
+
+	bench_init();
+
+	bench_path("/usr/lib/gcc/i386-pos/include/stddef.h", 7, 0);
+	bench_path("usr/include/stdio.h", 9, 0);
+	bench_path("/usr/lib/../include/./stdio.h", 9, 0);
+	bench_path("/usr//bin/", 10, 0);
+	bench_path("/usr/bin/cc", 11, 1);
+	bench_path("/lib/gcc", 4, 1);
+	bench_path("/usr/include/missing.h", 0, 0);
+
+	return 0;
+}
@@ -7,71 +7,174 @@
  *
  * Changelog:
  * 29-03-2014 - Created
+ * 17-10-2026 - Check the buddy allocator instead of printing its results
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "kernel/heapmm.h"
 #include "kernel/physmm.h"
 
-int remaining_blocks = 30;
+#define RAM_START	(0x10000)
+#define RAM_END		(0x800000)
+#define RAM_FRAMES	((RAM_END - RAM_START) / PHYSMM_PAGE_SIZE)
 
-size_t heapmm_request_core ( size_t size )
-{	
-	remaining_blocks--;
-	printf("heapmm requested %i bytes of extra heap, giving 4096. remaining pages:%i \n",size, remaining_blocks);
-	return 4096;
+void *heapmm_alloc(size_t size)
+{
+	return malloc(size);
 }
 
-int main ( void )
+void *heapmm_alloc_nowait(size_t size)
 {
-	physaddr_t alloc1;
-	physaddr_t alloc2;
-	physaddr_t alloc3;
-	physaddr_t alloc4;
-
-	
-	size_t heap_size_initial = 65536;
-	size_t ram_size = 4096 * remaining_blocks;
-	void *heap_start = malloc (4096 * remaining_blocks);
-	printf("P-OS Physical memory manager test\n");
-	printf("Virtual RAM for testcase : %i byte @ 0x%x\n",ram_size,(uint32_t)heap_start);
-	printf("Physical RAM for testcase : %i byte @ 0x%x\n",ram_size,(uint32_t)0x10000);
-	printf("Initial heap size: %i\n", heap_size_initial);
-	printf("Committing initial heap...\n");
-	remaining_blocks-=16;
-	heapmm_init(heap_start, heap_size_initial);
-	printf("Initial heap committed! Remaining heap pages: %i\n", remaining_blocks);
-
-	printf("Initializing physical memory manager...");
+	return malloc(size);
+}
+
+void heapmm_free(void *ptr, __attribute__((unused)) size_t size)
+{
+	free(ptr);
+}
+
+void shrinker_check(void)
+{
+}
+
+static void test_register(void)
+{
+	printf("Registering RAM...");
 	physmm_init();
+	physmm_free_range(RAM_START, RAM_END);
+	/* Overlapping regions from the firmware must not be counted twice */
+	physmm_free_range(RAM_START, RAM_START + 0x4000);
+	assert(physmm_count_free() == RAM_FRAMES * PHYSMM_PAGE_SIZE);
 	printf(" OK\n");
+}
 
-	printf("Registering RAM... \n");
-	for (alloc1 = 0x10000; alloc1 < ram_size; alloc1+=4096){
-		printf("\t Register frame : 0x%x\n", alloc1);
-		physmm_free_frame(alloc1);
-	}
-	printf(" OK\n");
+static void test_frames(void)
+{
+	physaddr_t alloc1, alloc2;
 
-	
-	printf("Allocating page...");
+	printf("Allocating frames...");
+	alloc1 = physmm_alloc_frame();
 	alloc2 = physmm_alloc_frame();
-	printf(" OK: 0x%x\n", (uint32_t) alloc2);
+	assert(alloc1 != PHYSMM_NO_FRAME && alloc2 != PHYSMM_NO_FRAME);
+	assert(alloc1 != alloc2);
+	assert(alloc1 >= RAM_START && alloc1 < RAM_END);
+	assert(physmm_count_free() == (RAM_FRAMES - 2) * PHYSMM_PAGE_SIZE);
+
+	/* The lowest free frame is handed out first */
+	physmm_free_frame(alloc1);
+	assert(physmm_alloc_frame() == alloc1);
 
-	printf("Allocating page...");
-	alloc3 = physmm_alloc_frame();
-	printf(" OK: 0x%x\n", (uint32_t) alloc3);
-	
-	printf("Freeing page 1...");
+	physmm_free_frame(alloc1);
 	physmm_free_frame(alloc2);
-	printf(" OK!\n");
+	assert(physmm_count_free() == RAM_FRAMES * PHYSMM_PAGE_SIZE);
+	printf(" OK\n");
+}
 
-	printf("Allocating page...");
-	alloc2 = physmm_alloc_frame();
-	printf(" OK: 0x%x\n", (uint32_t) alloc2);
+static void test_pages(void)
+{
+	physaddr_t single, block, big;
+
+	printf("Allocating contiguous blocks...");
+	single = physmm_alloc_frame();
+	block = physmm_alloc_pages(2);
+	assert(block != PHYSMM_NO_FRAME);
+	assert((block & 0x3FFF) == 0);
+	assert(single < block || single >= block + 0x4000);
+	assert(physmm_count_free() == (RAM_FRAMES - 5) * PHYSMM_PAGE_SIZE);
+
+	big = physmm_alloc_pages(PHYSMM_MAX_ORDER);
+	assert(big != PHYSMM_NO_FRAME);
+	assert((big & ((PHYSMM_PAGE_SIZE << PHYSMM_MAX_ORDER) - 1)) == 0);
+
+	/* Buddies merge again once everything is released */
+	physmm_free_pages(block, 2);
+	physmm_free_frame(single);
+	physmm_free_pages(big, PHYSMM_MAX_ORDER);
+	assert(physmm_count_free() == RAM_FRAMES * PHYSMM_PAGE_SIZE);
+	big = physmm_alloc_pages(PHYSMM_MAX_ORDER);
+	assert(big != PHYSMM_NO_FRAME);
+	physmm_free_pages(big, PHYSMM_MAX_ORDER);
+	printf(" OK\n");
+}
+
+static void test_exhaust(void)
+{
+	physaddr_t frame;
+	unsigned n;
+
+	printf("Exhausting memory...");
+	for (n = 0; n < RAM_FRAMES; n++)
+		assert(physmm_alloc_frame() != PHYSMM_NO_FRAME);
+	assert(physmm_count_free() == 0);
+	assert(physmm_alloc_frame() == PHYSMM_NO_FRAME);
+	assert(physmm_alloc_pages(1) == PHYSMM_NO_FRAME);
+
+	for (frame = RAM_START; frame < RAM_END; frame += PHYSMM_PAGE_SIZE)
+		physmm_free_frame(frame);
+	assert(physmm_count_free() == RAM_FRAMES * PHYSMM_PAGE_SIZE);
+	printf(" OK\n");
+}
+
+static void test_refs(void)
+{
+	physaddr_t frame;
+
+	printf("Sharing a frame...");
+	frame = physmm_alloc_frame();
+	assert(physmm_frame_refs(frame) == 1);
+	assert(physmm_ref_frame(frame) == 0);
+	assert(physmm_frame_refs(frame) == 2);
+
+	/* Only the last reference releases the frame */
+	physmm_free_frame(frame);
+	assert(physmm_frame_refs(frame) == 1);
+	assert(physmm_count_free() == (RAM_FRAMES - 1) * PHYSMM_PAGE_SIZE);
+	physmm_free_frame(frame);
+	assert(physmm_count_free() == RAM_FRAMES * PHYSMM_PAGE_SIZE);
+	printf(" OK\n");
+}
+
+static void test_double_free(void)
+{
+	physaddr_t frame;
+	pid_t pid;
+	int status;
+
+	printf("Freeing a frame twice...");
+	fflush(stdout);
+	frame = physmm_alloc_frame();
+	physmm_free_frame(frame);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		fclose(stderr);
+		physmm_free_frame(frame);
+		_exit(0);
+	}
+
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+	printf(" OK\n");
+}
+
+int main ( void )
+{
+	printf("P-OS Physical memory manager test\n");
+
+	test_register();
+	test_frames();
+	test_pages();
+	test_exhaust();
+	test_refs();
+	test_double_free();
 
-	free(heap_start);
+	return EXIT_SUCCESS;
 }
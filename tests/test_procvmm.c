@@ -0,0 +1,143 @@
+/**
+ * tests/test_procvmm.c
+ *
+ * Part of P-OS kernel.
+ *
+ * Checks the user memory access checks done before the kernel touches user
+ * buffers. This is built against the kernel headers, the few C library
+ * functions it needs from the host are declared below.
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#include <stdarg.h>
+#include <assert.h>
+#include "kernel/process.h"
+#include "kernel/scheduler.h"
+#include "kernel/heapmm.h"
+#include "kernel/console.h"
+#include "kernel/system.h"
+#include "kernel/vfs.h"
+#include "kernel/shm.h"
+
+#undef printf
+#undef vprintf
+
+int printf( const char *format, ... );
+int vprintf( const char *format, va_list ap );
+void *malloc( size_t size );
+void free( void *ptr );
+void abort( void ) __attribute__((noreturn));
+
+#define RO_START	((void *) 0x10000000)
+#define RW_START	((void *) 0x10004000)
+#define REGION_SIZE	(0x4000)
+
+scheduler_task_t *scheduler_current_task;
+
+void *heapmm_alloc( size_t size )
+{
+	return malloc( size );
+}
+
+void heapmm_free( void *ptr, __attribute__((unused)) size_t size )
+{
+	free( ptr );
+}
+
+void con_hprintf( __attribute__((unused)) int hnd,
+                  __attribute__((unused)) int lvl,
+                  const char *fmt, ... )
+{
+	va_list args;
+	va_start( args, fmt );
+	vprintf( fmt, args );
+	va_end( args );
+}
+
+void halt( void )
+{
+	abort();
+}
+
+/* Only reached when releasing file and shared memory regions */
+void vfs_inode_release( __attribute__((unused)) inode_t *inode )
+{
+	abort();
+}
+
+void shm_do_delete( __attribute__((unused)) shm_info_t *info )
+{
+	abort();
+}
+
+static void test_setup( void )
+{
+	static scheduler_task_t task;
+	static process_info_t process;
+
+	printf("Mapping regions...");
+	process.pid = 2;
+	task.process = &process;
+	scheduler_current_task = &task;
+	process.memory_map = procvmm_alloc_memory_map();
+	assert( process.memory_map != NULL );
+	assert( procvmm_mmap_anon( RO_START, REGION_SIZE, 0, "ro" ) == 0 );
+	assert( procvmm_mmap_anon( RW_START, REGION_SIZE,
+	                           PROCESS_MMAP_FLAG_WRITE, "rw" ) == 0 );
+	printf(" OK\n");
+}
+
+static void test_read( void )
+{
+	char *ro = RO_START;
+
+	printf("Checking reads...");
+	assert( procvmm_check( ro, 16 ) );
+	assert( procvmm_check( ro + REGION_SIZE - 8, 16 ) );
+	assert( procvmm_check( ro, 2 * REGION_SIZE ) );
+	assert( !procvmm_check( ro - 8, 16 ) );
+	assert( !procvmm_check( ro + 2 * REGION_SIZE - 8, 16 ) );
+	printf(" OK\n");
+}
+
+static void test_write( void )
+{
+	char *ro = RO_START;
+	char *rw = RW_START;
+
+	printf("Checking writes...");
+	assert( procvmm_check_write( rw, REGION_SIZE ) );
+	assert( procvmm_check_write( rw + 100, 4 ) );
+
+	/* A read only mapping may not be stored to, not even in part */
+	assert( !procvmm_check_write( ro, 1 ) );
+	assert( !procvmm_check_write( ro + REGION_SIZE - 1, 1 ) );
+	assert( !procvmm_check_write( rw - 8, 16 ) );
+
+	/* The last page of an area that straddles a boundary counts too */
+	assert( !procvmm_check_write( rw + REGION_SIZE - 8, 16 ) );
+	assert( !procvmm_check_write( rw + 8, REGION_SIZE ) );
+	printf(" OK\n");
+}
+
+static void test_wrap( void )
+{
+	printf("Checking wrap around...");
+	assert( !procvmm_check( RW_START, (size_t) -1 ) );
+	assert( !procvmm_check_write( RW_START, (size_t) -1 ) );
+	printf(" OK\n");
+}
+
+int main( void )
+{
+	printf("P-OS Process memory access check test\n");
+
+	test_setup();
+	test_read();
+	test_write();
+	test_wrap();
+
+	return 0;
+}
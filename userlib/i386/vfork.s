@@ -0,0 +1,44 @@
+;Copyright (C) 2017 Peter Bosch
+;
+;This program is free software; you can redistribute it and/or
+;modify it under the terms of the GNU General Public License
+;as published by the Free Software Foundation; either version 2
+;of the License, or (at your option) any later version.
+;
+;This program is distributed in the hope that it will be useful,
+;but WITHOUT ANY WARRANTY; without even the implied warranty of
+;MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;GNU General Public License for more details.
+;
+;You should have received a copy of the GNU General Public License
+;along with this program; if not, write to the Free Software
+;Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+
+;
+; userlib/i386/vfork.s
+;
+; Part of P-OS kernel.
+;
+; Written by Peter Bosch <peterbosc@gmail.com>
+;
+; Changelog:
+; 17-10-2026 - Created
+;
+
+[BITS 32]
+[section .text]
+
+[extern errno]
+
+; The child runs on the parent's stack until it calls exec or exits, so the
+; return address is kept in a register: if it were left on the stack the
+; child could overwrite it before the parent gets to return.
+
+[global vfork]
+vfork:
+	pop	edx		; return address
+	mov	eax, 85		; SYS_VFORK
+	int	129		; syscall
+	mov	[ errno ], ecx	; errno
+	jmp	edx
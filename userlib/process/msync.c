@@ -0,0 +1,40 @@
+/******************************************************************************\
+Copyright (C) 2017 Peter Bosch
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+\******************************************************************************/
+
+/**
+ * @file userlib/msync.c
+ *
+ * Part of posnk kernel
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+int	msync( void *addr, size_t length, int flags )
+{
+	return ( int ) syscall( SYS_MSYNC,
+				( uint32_t ) addr,
+				( uint32_t ) length,
+				( uint32_t ) flags, 0, 0, 0 );
+}
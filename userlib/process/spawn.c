@@ -0,0 +1,167 @@
+/******************************************************************************\
+Copyright (C) 2017 Peter Bosch
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+\******************************************************************************/
+
+/**
+ * @file userlib/spawn.c
+ *
+ * Part of posnk kernel
+ *
+ * Written by Peter Bosch <peterbosc@gmail.com>
+ *
+ * Changelog:
+ * 17-10-2026 - Created
+ */
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
+
+int	posix_spawn_file_actions_init( posix_spawn_file_actions_t *fa )
+{
+	memset( fa, 0, sizeof( posix_spawn_file_actions_t ) );
+	return 0;
+}
+
+int	posix_spawn_file_actions_destroy( posix_spawn_file_actions_t *fa )
+{
+	fa->fa_count = 0;
+	return 0;
+}
+
+static struct posix_spawn_file_action *spawn_add_action(
+					posix_spawn_file_actions_t *fa,
+					int type,
+					int fd )
+{
+	struct posix_spawn_file_action *act;
+
+	if ( fa->fa_count >= SPAWN_MAX_FILE_ACTIONS )
+		return NULL;
+
+	act = &fa->fa_list[ fa->fa_count++ ];
+	memset( act, 0, sizeof( struct posix_spawn_file_action ) );
+	act->fa_type = type;
+	act->fa_fd   = fd;
+
+	return act;
+}
+
+int	posix_spawn_file_actions_addopen( posix_spawn_file_actions_t *fa,
+					int fd,
+					const char *path,
+					int oflag,
+					mode_t mode )
+{
+	struct posix_spawn_file_action *act;
+
+	if ( fd < 0 )
+		return EBADF;
+
+	act = spawn_add_action( fa, SPAWN_FA_OPEN, fd );
+	if ( !act )
+		return ENOMEM;
+
+	act->fa_path  = path;
+	act->fa_oflag = oflag;
+	act->fa_mode  = mode;
+
+	return 0;
+}
+
+int	posix_spawn_file_actions_addclose( posix_spawn_file_actions_t *fa,
+					int fd )
+{
+	if ( fd < 0 )
+		return EBADF;
+
+	if ( !spawn_add_action( fa, SPAWN_FA_CLOSE, fd ) )
+		return ENOMEM;
+
+	return 0;
+}
+
+int	posix_spawn_file_actions_adddup2( posix_spawn_file_actions_t *fa,
+					int fd,
+					int newfd )
+{
+	struct posix_spawn_file_action *act;
+
+	if ( fd < 0 || newfd < 0 )
+		return EBADF;
+
+	act = spawn_add_action( fa, SPAWN_FA_DUP2, fd );
+	if ( !act )
+		return ENOMEM;
+
+	act->fa_newfd = newfd;
+
+	return 0;
+}
+
+int	posix_spawnattr_init( posix_spawnattr_t *attr )
+{
+	memset( attr, 0, sizeof( posix_spawnattr_t ) );
+	return 0;
+}
+
+int	posix_spawnattr_destroy( posix_spawnattr_t *attr )
+{
+	( void ) attr;
+	return 0;
+}
+
+int	posix_spawnattr_setflags( posix_spawnattr_t *attr, short flags )
+{
+	if ( flags & ~POSIX_SPAWN_SETPGROUP )
+		return EINVAL;
+	attr->sa_flags = flags;
+	return 0;
+}
+
+int	posix_spawnattr_setpgroup( posix_spawnattr_t *attr, pid_t pgroup )
+{
+	attr->sa_pgroup = pgroup;
+	return 0;
+}
+
+int	posix_spawn( pid_t *pid,
+		const char *path,
+		const posix_spawn_file_actions_t *fa,
+		const posix_spawnattr_t *attr,
+		char *const argv[],
+		char *const envp[] )
+{
+	int status;
+
+	status = ( int ) syscall( SYS_SPAWN,
+				( uint32_t ) path,
+				( uint32_t ) argv,
+				( uint32_t ) envp,
+				( uint32_t ) fa,
+				( uint32_t ) attr, 0 );
+	if ( status < 0 )
+		return errno;
+
+	if ( pid )
+		*pid = ( pid_t ) status;
+
+	return 0;
+}